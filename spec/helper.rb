@@ -1,7 +1,9 @@
 require File.expand_path('lib/administrator', File.dirname(__FILE__))
 require File.expand_path('lib/database', File.dirname(__FILE__))
 require File.expand_path('lib/mailer', File.dirname(__FILE__))
+require File.expand_path('lib/scrambler_tool', File.dirname(__FILE__))
 require File.expand_path('lib/storage', File.dirname(__FILE__))
+require 'securerandom'
 
 LARGE_ATTACHMENT_FILE_SIZE = 2 * 1024 * 1024
 MULTIPLE_MAILS_COUNT = 5
@@ -13,6 +15,12 @@ def test_message(number = 0)
   "test message #{number}"
 end
 
+# Random lines, so the compression doesn't shrink the mail much below the given size.
+def large_test_message(size)
+  lines = Array.new(size / 81) { SecureRandom.base64(60) }
+  "Subject: large message\n\n" + lines.join("\n") + "\nlarge message end\n"
+end
+
 def deliver_test_message(mailer, number, to)
   mailer.deliver test_message(number), to
 end
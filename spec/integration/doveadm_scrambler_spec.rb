@@ -0,0 +1,265 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+require 'tempfile'
+
+describe 'Doveadm scrambler' do
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @mailer = Mailer.new 'test.com', 'sender@test.com', 'test', @password
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_key 1, true, @password
+  end
+
+  after :all do
+    @mailer.close
+  end
+
+  context 'encrypt' do
+
+    before :each do
+      @database.update_key 1, false
+      deliver_test_messages @mailer, 2, 'test'
+      @database.update_key 1, true
+    end
+
+    after :each do
+      @storage.clear
+    end
+
+    it 'should encrypt the plain mails' do
+      @storage.stored_package_ids.should == [ nil, nil ]
+
+      _, status = @administrator.scrambler @password, { }, 'encrypt'
+      status.should == 0
+      @administrator.purge
+      @storage.stored_package_ids.should == [ 0x00, 0x00 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+      mails[1].should =~ /test message 1/
+    end
+
+  end
+
+  context 'verify' do
+
+    before :each do
+      @mailer.deliver_file File.expand_path('../fixtures/mail-1.eml', File.dirname(__FILE__)), 'test'
+      deliver_test_message @mailer, 0, 'test'
+    end
+
+    after :each do
+      @storage.clear
+    end
+
+    it 'should pass the intact mails' do
+      _, status = @administrator.scrambler @password, { }, 'verify'
+      status.should == 0
+    end
+
+    it 'should report a modified chunk' do
+      @storage.tamper_chunk
+      _, status = @administrator.scrambler @password, { }, 'verify'
+      status.should == 65
+    end
+
+  end
+
+  context 'rekey' do
+
+    before :each do
+      deliver_test_messages @mailer, 2, 'test'
+
+      # the settings are switched first, the previous private key is passed as the old one
+      @old_private_key = @database.fetch_keys.first[:private_key]
+      @key_pair = KeyPair.x25519
+      @database.replace_key 1, true, @password, @key_pair
+
+      @public_key_file = Tempfile.new 'public_key'
+      @public_key_file.write @key_pair.public_pem
+      @public_key_file.close
+    end
+
+    after :each do
+      @public_key_file.unlink
+      @storage.clear
+      @database.replace_key 1, true, @password
+    end
+
+    it 'should read the mails with the old private key before the run' do
+      mails = @administrator.fetch @password, 'plugin/scrambler_old_private_key' => @old_private_key
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+    end
+
+    it 'should verify the mails with the old private key before the run' do
+      _, status = @administrator.scrambler @password, { 'plugin/scrambler_old_private_key' => @old_private_key },
+          'verify'
+      status.should == 0
+    end
+
+    it 'should wrap the mails for the new key' do
+      _, status = @administrator.scrambler @password, { 'plugin/scrambler_old_private_key' => @old_private_key },
+          'rekey', '-k', @public_key_file.path
+      status.should == 0
+      @administrator.purge
+      @storage.stored_package_ids.should == [ 0x01, 0x01 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+      mails[1].should =~ /test message 1/
+    end
+
+  end
+
+  context 'rekey to another X25519 key' do
+
+    before :each do
+      # both keys unwrap any header, only the chunk tags tell them apart
+      @database.replace_key 1, true, @password, KeyPair.x25519
+      deliver_test_messages @mailer, 2, 'test'
+
+      @old_private_key = @database.fetch_keys.first[:private_key]
+      @key_pair = KeyPair.x25519
+      @database.replace_key 1, true, @password, @key_pair
+
+      @public_key_file = Tempfile.new 'public_key'
+      @public_key_file.write @key_pair.public_pem
+      @public_key_file.close
+    end
+
+    after :each do
+      @public_key_file.unlink
+      @storage.clear
+      @database.replace_key 1, true, @password
+    end
+
+    it 'should read the mails with the old private key before the run' do
+      mails = @administrator.fetch @password, 'plugin/scrambler_old_private_key' => @old_private_key
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+      mails[1].should =~ /test message 1/
+    end
+
+    it 'should wrap the mails for the new key' do
+      _, status = @administrator.scrambler @password, { 'plugin/scrambler_old_private_key' => @old_private_key },
+          'rekey', '-k', @public_key_file.path
+      status.should == 0
+      @administrator.purge
+      @storage.stored_package_ids.should == [ 0x01, 0x01 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+      mails[1].should =~ /test message 1/
+    end
+
+    it 'should overwrite the wrapped keys in the mdbox files' do
+      stored_mails = @storage.stored_mails
+      stored_chunks = @storage.stored_chunks
+
+      output, status = @administrator.scrambler @password, { 'plugin/scrambler_old_private_key' => @old_private_key },
+          'rekey', '-k', @public_key_file.path
+      status.should == 0
+      output.lines.last.split.should == [ 'test', '2', '0', '0' ]
+
+      # without a purge, mails that have been saved again would still be stored
+      @storage.stored_mails.length.should == 2
+      @storage.stored_mails.should_not == stored_mails
+      @storage.stored_chunks.should == stored_chunks
+    end
+
+    { 'sdbox' => 'sdbox:~/sdbox', 'maildir' => 'maildir:~/Maildir' }.each do |format, location|
+
+      it "should overwrite the wrapped keys in the #{format} files" do
+        storage = Storage.new 'test', location.split('~/').last
+        settings = { 'mail_location' => location }
+        begin
+          # the new key pair is configured by the before block already, the mails are saved for the old one
+          @database.replace_key 1, true, @password, KeyPair.x25519
+          old_private_key = @database.fetch_keys.first[:private_key]
+          2.times do |index|
+            @administrator.save test_message(index), settings
+          end
+          stored_chunks = storage.stored_chunks
+          @database.replace_key 1, true, @password, @key_pair
+
+          output, status = @administrator.scrambler @password,
+              settings.merge('plugin/scrambler_old_private_key' => old_private_key), 'rekey', '-k', @public_key_file.path
+          status.should == 0
+          output.lines.last.split.should == [ 'test', '2', '0', '0' ]
+          storage.stored_chunks.should == stored_chunks
+
+          mails = @administrator.fetch @password, settings
+          mails.length.should == 2
+          mails[0].should =~ /test message 0/
+          mails[1].should =~ /test message 1/
+        ensure
+          storage.clear
+        end
+      end
+
+    end
+
+    it 'should not fail on the mails, that have been wrapped for the new key already' do
+      2.times do
+        _, status = @administrator.scrambler @password, { 'plugin/scrambler_old_private_key' => @old_private_key },
+            'rekey', '-k', @public_key_file.path
+        status.should == 0
+      end
+
+      mails = @administrator.fetch @password
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+    end
+
+  end
+
+  context 'rekey to a RSA key of another size' do
+
+    before :each do
+      @database.replace_key 1, true, @password, KeyPair.rsa(2048)
+      deliver_test_messages @mailer, 2, 'test'
+
+      @key_pair = KeyPair.rsa(4096)
+      @public_key_file = Tempfile.new 'public_key'
+      @public_key_file.write @key_pair.public_pem
+      @public_key_file.close
+    end
+
+    after :each do
+      @public_key_file.unlink
+      @storage.clear
+      @database.replace_key 1, true, @password
+    end
+
+    it 'should save the mails as the new header and the stored chunks' do
+      stored_chunks = @storage.stored_chunks
+
+      # reads don't fall back to a key of another size, so the settings are switched after the run
+      output, status = @administrator.scrambler @password, { }, 'rekey', '-k', @public_key_file.path
+      status.should == 0
+      output.lines.last.split.should == [ 'test', '0', '2', '0' ]
+      @administrator.purge
+      @storage.stored_package_ids.should == [ 0x02, 0x02 ]
+      @storage.stored_chunks.sort.should == stored_chunks.sort
+
+      @database.replace_key 1, true, @password, @key_pair
+      mails = @administrator.fetch @password
+      mails.length.should == 2
+      mails[0].should =~ /test message 0/
+      mails[1].should =~ /test message 1/
+    end
+
+  end
+
+end
@@ -0,0 +1,81 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+require 'fileutils'
+
+describe 'Mail attachments' do
+
+  ATTACHMENT_MAIL_FILENAME = File.expand_path('../fixtures/mail-1.eml', File.dirname(__FILE__))
+  ATTACHMENT_DIRECTORY = File.expand_path('../../dovecot/attachments', File.dirname(__FILE__))
+  ATTACHMENT_SETTINGS = {
+      'mail_attachment_dir' => ATTACHMENT_DIRECTORY,
+      'mail_attachment_fs' => 'scrambler:sis:posix'
+  }
+  ATTACHMENT_TAIL = 'NjM3NEEwNkUwNTQzNjhCNEE4Mzc1QjFGRjNCRDUyPl0+Pg1zdGFydHhyZWYNMTE2DSUlRU9G'
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storages = [ Storage.new('test'), Storage.new('test2') ]
+    @administrators = [ Administrator.new('test'), Administrator.new('test2') ]
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_user 2, 'test2', @password
+    @database.insert_key 1, true, @password
+    @database.insert_key 2, true, @password, KeyPair.x25519
+  end
+
+  after :all do
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_key 1, true, @password
+  end
+
+  context 'of the same mail saved for two users with single instance storage' do
+
+    before :each do
+      @administrators.each do |administrator|
+        administrator.save File.read(ATTACHMENT_MAIL_FILENAME), ATTACHMENT_SETTINGS
+      end
+    end
+
+    after :each do
+      @storages.each &:clear
+      FileUtils.rm_rf ATTACHMENT_DIRECTORY
+    end
+
+    it 'should decrypt the mail with the attachment for both users' do
+      @administrators.each do |administrator|
+        mails = administrator.fetch @password, ATTACHMENT_SETTINGS
+        mails.length.should == 1
+        mails[0].should include(ATTACHMENT_TAIL)
+      end
+    end
+
+    it 'should store the attachment once and encrypted' do
+      filenames = attachment_filenames
+      filenames.length.should >= 2
+      filenames.map{ |filename| File.stat(filename).ino }.uniq.length.should == 1
+
+      content = File.binread filenames.first
+      content.should_not include('%PDF-1.5')
+      content.should_not include('JVBERi0xLjUN')
+    end
+
+    it 'should wrap the content key for each user' do
+      attachment_filenames.each do |filename|
+        File.exist?("#{filename}.scrambler-key").should == true
+      end
+    end
+
+  end
+
+  def attachment_filenames
+    Dir[ File.join(ATTACHMENT_DIRECTORY, '**', '*') ].select do |filename|
+      File.file?(filename) && !filename.end_with?('.scrambler-key') && !filename.include?('/hashes/')
+    end
+  end
+
+end
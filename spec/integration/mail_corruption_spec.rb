@@ -0,0 +1,66 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+require 'socket'
+
+describe 'Mail corruption' do
+
+  before :all do
+    password = 'testPassword'
+
+    @database = Database.new
+    @mailer = Mailer.new 'test.com', 'sender@test.com', 'test', password
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', password
+    @database.insert_key 1, true, password
+  end
+
+  after :all do
+    @mailer.close
+  end
+
+  context 'of a mail cut off behind a chunk' do
+
+    before :each do
+      @mailer.deliver_file File.expand_path('../fixtures/mail-1.eml', File.dirname(__FILE__)), 'test'
+      @storage.truncate_final_chunk
+    end
+
+    after :each do
+      @storage.clear
+    end
+
+    it 'should fail to decrypt the mail from mapped pages' do
+      @administrator.fetch_fails?('testPassword', 'plugin/scrambler_mmap' => 1).should == true
+    end
+
+    it 'should fail to decrypt the mail from the stream' do
+      @administrator.fetch_fails?('testPassword', 'plugin/scrambler_mmap' => 0).should == true
+    end
+
+  end
+
+  context 'of a mail with a modified chunk' do
+
+    before :each do
+      @mailer.deliver_file File.expand_path('../fixtures/mail-1.eml', File.dirname(__FILE__)), 'test'
+      @storage.tamper_chunk
+    end
+
+    after :each do
+      @storage.clear
+    end
+
+    it 'should fail to decrypt the mail from mapped pages' do
+      @administrator.fetch_fails?('testPassword', 'plugin/scrambler_mmap' => 1).should == true
+    end
+
+    it 'should fail to decrypt the mail from the stream' do
+      @administrator.fetch_fails?('testPassword', 'plugin/scrambler_mmap' => 0).should == true
+    end
+
+  end
+
+end
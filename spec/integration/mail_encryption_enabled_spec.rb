@@ -123,6 +123,31 @@ describe 'Mail encryption enabled' do
 
     end
 
+    context 'with the keys unlocked in the background' do
+
+      UNLOCK_SETTINGS = { 'plugin/scrambler_unlock_threads' => 1 }
+
+      it 'should allow the administrator to access the mail using the valid password' do
+        mails = @administrator.fetch 'testPassword', UNLOCK_SETTINGS
+        mails.length.should == 1
+        mails[0].should =~ /test message one/
+        @administrator.last_stats['key_ops'].should > 0
+      end
+
+      it 'should decrypt every mail with the unlocked keys' do
+        @mailer.deliver 'test message two', 'test'
+        mails = @administrator.fetch 'testPassword', UNLOCK_SETTINGS
+        mails.length.should == 2
+        mails[1].should =~ /test message two/
+      end
+
+      it 'should deny the administrator to access the mail using an invalid password' do
+        @administrator.fetch_fails?('invalid', UNLOCK_SETTINGS).should == true
+        @administrator.last_log.should include('May caused by an invalid password')
+      end
+
+    end
+
   end
 
   context 'of multiple standard mails' do
@@ -187,6 +212,25 @@ describe 'Mail encryption enabled' do
       mails.length.should == 1
     end
 
+    it 'should decrypt a body part like the whole mail' do
+      body = @mailer.receive_body
+      part = @mailer.receive_body 1, '2'
+      part.should_not be_empty
+      body.should include(part)
+    end
+
+    it 'should decrypt partial fetches like the whole mail' do
+      body = @mailer.receive_body
+      [ [ 0, 100 ], [ 8000, 500 ], [ 1_000_000, 10_000 ] ].each do |offset, length|
+        @mailer.receive_body(1, '', [ offset, length ]).should == body.byteslice(offset, length)
+      end
+    end
+
+    it 'should decrypt partial fetches of a body part' do
+      part = @mailer.receive_body 1, '2'
+      @mailer.receive_body(1, '2', [ 300_000, 4096 ]).should == part.byteslice(300_000, 4096)
+    end
+
   end
 
   context 'of a chunk-size mail' do
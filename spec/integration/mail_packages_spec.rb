@@ -0,0 +1,138 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+
+describe 'Mail packages' do
+
+  MAIL_FILENAME = File.expand_path('../fixtures/mail-4.eml', File.dirname(__FILE__))
+  FIXTURE_DIRECTORY = File.expand_path('../fixtures/package-00', File.dirname(__FILE__))
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+  end
+
+  after :each do
+    @storage.clear
+  end
+
+  after :all do
+    @database.clear_keys
+    @database.insert_key 1, true, @password
+  end
+
+  context 'of a RSA 2048 key' do
+
+    before :all do
+      @database.replace_key 1, true, @password, KeyPair.rsa(2048)
+    end
+
+    it 'should store and decrypt the mail with package 00' do
+      @administrator.save File.read(MAIL_FILENAME)
+      @storage.stored_package_ids.should == [ 0x00 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('https://listi.jpberlin.de/mailman/listinfo/moviemento')
+    end
+
+  end
+
+  context 'of a RSA 4096 key' do
+
+    before :all do
+      @database.replace_key 1, true, @password, KeyPair.rsa(4096)
+    end
+
+    it 'should store and decrypt the mail with package 02' do
+      @administrator.save File.read(MAIL_FILENAME)
+      @storage.stored_package_ids.should == [ 0x02 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('https://listi.jpberlin.de/mailman/listinfo/moviemento')
+    end
+
+  end
+
+  context 'of a X25519 key' do
+
+    before :all do
+      @database.replace_key 1, true, @password, KeyPair.x25519
+    end
+
+    it 'should store and decrypt the mail with package 01' do
+      @administrator.save File.read(MAIL_FILENAME)
+      @storage.stored_package_ids.should == [ 0x01 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('https://listi.jpberlin.de/mailman/listinfo/moviemento')
+    end
+
+  end
+
+  context 'of a small mail and the compact package setting' do
+
+    it 'should store and decrypt the mail of a RSA key with package 03' do
+      @database.replace_key 1, true, @password, KeyPair.rsa(2048)
+      @administrator.save test_message, 'plugin/scrambler_compact_package' => 1
+      @storage.stored_package_ids.should == [ 0x03 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should =~ /test message 0/
+    end
+
+    it 'should store and decrypt the mail of a X25519 key with package 04' do
+      @database.replace_key 1, true, @password, KeyPair.x25519
+      @administrator.save test_message, 'plugin/scrambler_compact_package' => 1
+      @storage.stored_package_ids.should == [ 0x04 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should =~ /test message 0/
+    end
+
+    it 'should keep the chunked package for a mail larger than a chunk' do
+      @database.replace_key 1, true, @password, KeyPair.x25519
+      @administrator.save File.read(MAIL_FILENAME), 'plugin/scrambler_compact_package' => 1
+      @storage.stored_package_ids.should == [ 0x01 ]
+
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('https://listi.jpberlin.de/mailman/listinfo/moviemento')
+    end
+
+  end
+
+  context 'of a mail stored with package 00 by an earlier release' do
+
+    before :each do
+      # the disabled key stores the fixture as it is, the key is enabled afterwards to read it
+      @database.clear_keys
+      @database.insert_fixture_key 1, false, FIXTURE_DIRECTORY
+      @administrator.save File.binread(File.join(FIXTURE_DIRECTORY, 'mail-4.eml.encrypted')),
+          'plugin/zlib_save' => ''
+      @database.update_key 1, true
+      @storage.clear_cache
+    end
+
+    it 'should keep the stored bytes' do
+      @storage.stored_mails.should == [ File.binread(File.join(FIXTURE_DIRECTORY, 'mail-4.eml.encrypted')) ]
+    end
+
+    it 'should decrypt the mail' do
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('https://listi.jpberlin.de/mailman/listinfo/moviemento')
+    end
+
+  end
+
+end
@@ -0,0 +1,96 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+
+describe 'Mail prefetch' do
+
+  PREFETCH_SETTINGS = {
+      'mail_prefetch_count' => 4,
+      'plugin/scrambler_prefetch_threads' => 2
+  }
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_key 1, true, @password
+  end
+
+  [ [ 'mdbox', 'mdbox:~/mail' ], [ 'maildir', 'maildir:~/Maildir' ] ].each do |format, location|
+
+    context "of a #{format} mailbox" do
+
+      before :all do
+        @storage = Storage.new 'test', location.split('~/').last
+        @settings = { 'mail_location' => location }
+      end
+
+      before :each do
+        MULTIPLE_MAILS_COUNT.times do |index|
+          @administrator.save test_message(index), @settings
+        end
+      end
+
+      after :each do
+        @storage.clear
+      end
+
+      it 'should fetch the mails with the keys unwrapped by the threads' do
+        mails = @administrator.fetch @password, @settings.merge(PREFETCH_SETTINGS)
+        mails.length.should == MULTIPLE_MAILS_COUNT
+        mails.each_with_index do |mail, index|
+          mail.should =~ /test message #{index}/
+        end
+        @administrator.last_stats['prefetched_headers'].should > 0
+      end
+
+      it 'should fetch the same mails without the threads' do
+        @administrator.fetch(@password, @settings.merge(PREFETCH_SETTINGS)).should ==
+            @administrator.fetch(@password, @settings)
+        @administrator.last_stats['prefetched_headers'].should == 0
+      end
+
+    end
+
+  end
+
+  context 'of mails decrypted as a whole by the threads' do
+
+    before :all do
+      @storage = Storage.new
+    end
+
+    before :each do
+      MULTIPLE_MAILS_COUNT.times do |index|
+        @administrator.save test_message(index)
+      end
+      # beyond the 1 MiB of mails decrypted as a whole, this one is only prefetched up to its header
+      @administrator.save large_test_message(1536 * 1024)
+    end
+
+    after :each do
+      @storage.clear
+    end
+
+    it 'should fetch the small and the large mails' do
+      mails = @administrator.fetch @password, PREFETCH_SETTINGS
+      mails.length.should == MULTIPLE_MAILS_COUNT + 1
+      MULTIPLE_MAILS_COUNT.times do |index|
+        mails[index].should =~ /test message #{index}/
+      end
+      mails.last.should include('large message end')
+      @administrator.last_stats['prefetched_headers'].should > 0
+    end
+
+    it 'should find the mails of a body search' do
+      @administrator.search(@password, PREFETCH_SETTINGS, 'body', 'message 2').should == [ 3 ]
+      @administrator.search(@password, PREFETCH_SETTINGS, 'body', 'large message end').should ==
+          [ MULTIPLE_MAILS_COUNT + 1 ]
+    end
+
+  end
+
+end
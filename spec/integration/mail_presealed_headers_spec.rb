@@ -0,0 +1,69 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+
+describe 'Mail presealed headers' do
+
+  PRESEALED_SETTINGS = {
+      'plugin/scrambler_presealed_headers' => 2,
+      'plugin/scrambler_seal_threads' => 1
+  }
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+  end
+
+  after :each do
+    @storage.clear
+  end
+
+  after :all do
+    @database.clear_keys
+    @database.insert_key 1, true, @password
+  end
+
+  [ [ 'RSA 2048', KeyPair.rsa(2048), { }, [ 0x00, 0x00 ] ],
+    [ 'X25519', KeyPair.x25519, { }, [ 0x01, 0x01 ] ],
+    [ 'RSA 2048 and the compact package', KeyPair.rsa(2048), { 'plugin/scrambler_compact_package' => 1 },
+      [ 0x03, 0x03 ] ],
+    [ 'X25519 and the compact package', KeyPair.x25519, { 'plugin/scrambler_compact_package' => 1 },
+      [ 0x04, 0x04 ] ] ].each do |name, key_pair, settings, package_ids|
+
+    context "of a #{name} key" do
+
+      before :all do
+        @database.replace_key 1, true, @password, key_pair
+      end
+
+      it 'should store and decrypt the mails' do
+        2.times do |index|
+          @administrator.save test_message(index), PRESEALED_SETTINGS.merge(settings)
+          # the header is either taken from the pool or sealed by the save, never both
+          @administrator.last_stats['key_ops'].should == 1
+        end
+        @storage.stored_package_ids.should == package_ids
+
+        mails = @administrator.fetch @password
+        mails.length.should == 2
+        mails[0].should =~ /test message 0/
+        mails[1].should =~ /test message 1/
+      end
+
+      it 'should wrap a new content key for each mail' do
+        2.times do |index|
+          @administrator.save test_message(index), PRESEALED_SETTINGS.merge(settings)
+        end
+        @storage.stored_headers.uniq.length.should == 2
+      end
+
+    end
+
+  end
+
+end
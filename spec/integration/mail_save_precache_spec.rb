@@ -0,0 +1,65 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+
+describe 'Mail save precache' do
+
+  PRECACHE_SETTINGS = {
+      'plugin/scrambler_save_precache' => 1,
+      'mail_always_cache_fields' => 'imap.bodystructure'
+  }
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_key 1, true, @password
+  end
+
+  after :each do
+    @storage.clear
+  end
+
+  context 'of a delivered mail' do
+
+    before :each do
+      @administrator.deliver test_message, PRECACHE_SETTINGS
+    end
+
+    it 'should store the mail encrypted' do
+      @storage.stored_package_ids.should == [ 0x00 ]
+    end
+
+    it 'should fetch the fields cached by the delivery without the private key' do
+      # the delivery has no private key either, the fields are cached from the plain text it has written
+      output = @administrator.fetch_fields nil, { }, 'imap.bodystructure'
+      output.should =~ /"text" "plain"/i
+    end
+
+    it 'should decrypt the mail' do
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should =~ /test message 0/
+    end
+
+  end
+
+  context 'of a delivered mail larger than the precache' do
+
+    before :each do
+      @administrator.deliver large_test_message(1536 * 1024), PRECACHE_SETTINGS
+    end
+
+    it 'should leave the mail to the indexing and decrypt it' do
+      mails = @administrator.fetch @password
+      mails.length.should == 1
+      mails[0].should include('large message end')
+    end
+
+  end
+
+end
@@ -0,0 +1,38 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+
+describe 'Mail seeks' do
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+    @database.insert_key 1, true, @password
+  end
+
+  after :each do
+    @storage.clear
+  end
+
+  # below and above MAIL_MAX_MEMORY_BUFFER, which keeps the decrypted data in memory or in a temporary file
+  [ [ 'in memory', 64 * 1024 ], [ 'in a temporary file', 512 * 1024 ] ].each do |spill, size|
+
+    it "should decrypt a mail seeked backwards repeatedly only twice with the data kept #{spill}" do
+      message = large_test_message size
+      @administrator.save message
+
+      # the body seeks back to the end of the header, the header back to the start of the mail
+      output = @administrator.fetch_fields @password, { }, 'text', 'body', 'hdr'
+      output.scan('large message end').length.should == 2
+      output.should include(message.lines[-2].chomp)
+      @administrator.last_stats['seek_rewinds'].should == 1
+    end
+
+  end
+
+end
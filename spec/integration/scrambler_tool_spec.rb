@@ -0,0 +1,114 @@
+require File.expand_path('../helper', File.dirname(__FILE__))
+require 'fileutils'
+require 'stringio'
+require 'tmpdir'
+require 'zlib'
+
+describe 'Scrambler tool' do
+
+  before :all do
+    @password = 'testPassword'
+
+    @database = Database.new
+    @storage = Storage.new
+    @administrator = Administrator.new 'test'
+
+    @database.clear_users
+    @database.clear_keys
+    @database.insert_user 1, 'test', @password
+  end
+
+  after :all do
+    @database.clear_keys
+    @database.insert_key 1, true, @password
+  end
+
+  [ [ 'RSA 2048', KeyPair.rsa(2048), 0x00 ], [ 'X25519', KeyPair.x25519, 0x01 ] ].each do |name, key_pair, package_id|
+
+    context "with a #{name} key and a stored mdbox file" do
+
+      before :all do
+        @database.replace_key 1, true, @password, key_pair
+        @tool = ScramblerTool.new @database.fetch_keys.first, @password
+      end
+
+      after :all do
+        @tool.close
+      end
+
+      before :each do
+        # the first mail spans several chunks, so one of them can be tampered with
+        @administrator.save large_test_message(64 * 1024)
+        @administrator.save test_message(0)
+        @mdbox_filename = @storage.mdbox_filenames.first
+        @directory = Dir.mktmpdir
+      end
+
+      after :each do
+        @storage.clear
+        FileUtils.rm_rf @directory
+      end
+
+      # the mails are decrypted as stored, which is compressed by the zlib plugin
+      def decrypted_mails
+        Dir[ File.join(@directory, '**', '*') ].select { |path| File.file? path }.sort.map do |path|
+          Zlib::GzipReader.new(StringIO.new(File.binread(path))).read
+        end
+      end
+
+      it 'should print the package of each mail' do
+        output, success = @tool.info '-m', @mdbox_filename
+        success.should == true
+        lines = output.lines
+        lines.length.should == 2
+        lines.each do |line|
+          line.should include("encrypted, package %02x" % package_id)
+        end
+      end
+
+      it 'should verify the chunks of each mail' do
+        output, success = @tool.verify '-m', @mdbox_filename
+        success.should == true
+        output.lines.length.should == 2
+        output.lines.each do |line|
+          line.should include(': ok (')
+        end
+      end
+
+      it 'should fail to verify a tampered mail' do
+        @storage.tamper_chunk
+        output, success = @tool.verify '-m', @mdbox_filename
+        success.should == false
+        output.should include(': failed (')
+      end
+
+      it 'should decrypt each mail into the output directory' do
+        _, success = @tool.decrypt '-m', '-o', @directory, @mdbox_filename
+        success.should == true
+        mails = decrypted_mails
+        mails.length.should == 2
+        mails.select { |mail| mail =~ /test message 0/ }.length.should == 1
+        mails.select { |mail| mail.include? 'large message end' }.length.should == 1
+      end
+
+      it 'should encrypt a decrypted mail again' do
+        @tool.decrypt '-m', '-o', @directory, @mdbox_filename
+        plain_filename = Dir[ File.join(@directory, '**', '*') ].select { |path| File.file? path }.sort.first
+        encrypted_filename = File.join @directory, 'encrypted'
+        decrypted_filename = File.join @directory, 'decrypted'
+
+        _, success = @tool.encrypt '-o', encrypted_filename, plain_filename
+        success.should == true
+        output, _ = @tool.info encrypted_filename
+        output.should include("encrypted, package %02x" % package_id)
+
+        _, success = @tool.decrypt '-o', decrypted_filename, encrypted_filename
+        success.should == true
+        File.binread(decrypted_filename).should == File.binread(plain_filename)
+      end
+
+    end
+
+  end
+
+end
@@ -1,25 +1,71 @@
+require 'open3'
 
 class Administrator
 
   BASE_PATH = File.expand_path '../..', File.dirname(__FILE__)
   DOVECOT_PATH = File.expand_path 'dovecot', BASE_PATH
   DOVEADM_PATH = File.expand_path 'target/bin/doveadm', DOVECOT_PATH
+  LDA_PATH = File.expand_path 'target/libexec/dovecot/dovecot-lda', DOVECOT_PATH
   CONF_PATH = File.expand_path 'configuration/dovecot.conf', DOVECOT_PATH
   PASSWORD_FILE_PATH = File.expand_path 'sudo.password', BASE_PATH
 
+  # the log of the last doveadm command, written to stderr
+  attr_reader :last_log
+
   def initialize(username)
     @username = username
   end
 
+  # Returns the counters of the scrambler stats, that the last doveadm command logged, e.g. stats['key_ops'].
+  def last_stats
+    line = (@last_log || '').lines.reverse.find { |log_line| log_line.include? 'scrambler stats: ' }
+    return { } unless line
+    Hash[line.scan(/(\w+)=(\d+)/).map { |name, value| [ name, value.to_i ] }]
+  end
+
   def home_mail_path
     File.expand_path "home/#{@username}/mail", DOVECOT_PATH
   end
 
-  def fetch(password = nil)
-    output = doveadm password, 'fetch', '-u', @username, 'text', 'mailbox', 'inbox'
+  def fetch(password = nil, settings = { })
+    output = doveadm password, *setting_options(settings), 'fetch', '-u', @username, 'text', 'mailbox', 'inbox'
     parse_doveadm_fetch_text_output output
   end
 
+  # Fetches the given fields of the mails one after another, each of them reads the mail stream from its start.
+  def fetch_fields(password, settings, *fields)
+    doveadm password, *setting_options(settings), 'fetch', '-u', @username, fields.join(' '), 'mailbox', 'inbox'
+  end
+
+  # Returns the uids of the mails in the inbox, that match the search query.
+  def search(password, settings, *query)
+    output = doveadm password, *setting_options(settings), 'search', '-u', @username, 'mailbox', 'inbox', *query
+    output.lines.map { |line| line.split.last.to_i }
+  end
+
+  def fetch_fails?(password = nil, settings = { })
+    _, status = run_doveadm password, [ *setting_options(settings), 'fetch', '-u', @username, 'text', 'mailbox', 'inbox' ]
+    status != 0
+  end
+
+  def save(message, settings = { })
+    _, status = run_doveadm nil, [ *setting_options(settings), 'save', '-u', @username, '-m', 'inbox' ], message
+    raise 'save failed' unless status == 0
+  end
+
+  # Delivers the message to the inbox with dovecot-lda, which runs as a delivery like lmtp does.
+  def deliver(message, settings = { })
+    output, status = Open3.capture2e LDA_PATH, '-c', CONF_PATH, *setting_options(settings), '-d', @username,
+      stdin_data: message
+    @last_log = output
+    raise 'delivery failed' unless status.success?
+  end
+
+  # Runs a doveadm scrambler command for the user and returns its output and exit status.
+  def scrambler(password, settings, command, *arguments)
+    run_doveadm password, [ *setting_options(settings), 'scrambler', command, '-u', @username, *arguments ]
+  end
+
   def fetch_header(password = nil)
     output = doveadm password, 'fetch', '-u', @username, 'hdr', 'mailbox', 'inbox'
     parse_doveadm_fetch_header_output output
@@ -37,32 +83,66 @@ class Administrator
     system "mv /tmp/test #{home_mail_path}"
   end
 
+  # Removes the expunged mails from the mdbox files.
+  def purge
+    doveadm nil, 'purge', '-u', @username
+  end
+
   def doveadm(password, *arguments)
+    output, status = run_doveadm password, arguments
+    raise 'invalid password' if status == 75
+    output
+  end
+
+  def clear
+    system 'rm -rf /tmp/test'
+  end
+
+  private
+
+  def run_doveadm(password, arguments, input = '')
     passwordReader, passwordWriter = IO.pipe
     outputReader, outputWriter = IO.pipe
-
-    command = "#{DOVEADM_PATH} -c #{CONF_PATH} -D "
-    command += "-o plugin/scrambler_plain_password_fd=#{passwordReader.fileno} " if password
-    command += arguments.join ' '
-    pid = spawn command, passwordReader => passwordReader, :out => outputWriter
+    errorReader, errorWriter = IO.pipe
+    inputReader, inputWriter = IO.pipe
+
+    command = [ DOVEADM_PATH, '-c', CONF_PATH, '-D' ]
+    command += [ '-o', "plugin/scrambler_plain_password_fd=#{passwordReader.fileno}" ] if password
+    command += arguments
+    pid = spawn *command, passwordReader => passwordReader, :in => inputReader, :out => outputWriter,
+      :err => errorWriter
     outputWriter.close
+    errorWriter.close
+    inputReader.close
+
+    # mails can be larger than a pipe buffer, so the input is written while the output is read
+    writer = Thread.new do
+      inputWriter.write input
+      inputWriter.close
+    end
 
     passwordWriter.write "#{password}\n"
     passwordWriter.write "#{password}\n"
     passwordWriter.close
 
+    # the debug log doesn't fit into a pipe buffer either
+    logger = Thread.new { errorReader.read }
+
+    output = outputReader.read
+    writer.join
+    @last_log = logger.value
+    $stderr.write @last_log
     Process.wait pid
-    raise 'invalid password' if $?.exitstatus.to_i == 75
 
-    outputReader.read
+    [ output, $?.exitstatus.to_i ]
   end
 
-  def clear
-    system 'rm -rf /tmp/test'
+  def setting_options(settings)
+    settings.map do |name, value|
+      [ '-o', "#{name}=#{value}" ]
+    end.flatten
   end
 
-  private
-
   def parse_doveadm_fetch_text_output(output)
     parts = output.split "\f\n"
     parts.map do |part|
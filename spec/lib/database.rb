@@ -1,6 +1,7 @@
 require 'sqlite3'
 require 'openssl'
 require 'bcrypt'
+require File.expand_path('key_pair', File.dirname(__FILE__))
 
 class Database
 
@@ -14,10 +15,34 @@ class Database
         [ id, name, password ])
   end
 
-  def insert_key(id, enabled, password = nil)
+  def insert_key(id, enabled, password = nil, key_pair = nil)
+    public_pem, private_pem = key_pair ?
+        [ escape_pem(key_pair.public_pem), private_key(key_pair, password) ] :
+        [ default_public_key, default_private_key(password) ]
     @database.execute(
         'INSERT INTO keys (id, enabled, public_key, private_key, private_key_salt, private_key_iterations) VALUES (?, ?, ?, ?, ?, ?)',
-        [ id, (enabled ? 1 : 0), default_public_key, default_private_key(password), default_private_key_salt, default_private_key_iterations ])
+        [ id, (enabled ? 1 : 0), public_pem, private_pem, default_private_key_salt, default_private_key_iterations ])
+  end
+
+  # Inserts the key of a fixture directory, whose private key is encrypted with the default password.
+  def insert_fixture_key(id, enabled, directory)
+    @database.execute(
+        'INSERT INTO keys (id, enabled, public_key, private_key, private_key_salt, private_key_iterations) VALUES (?, ?, ?, ?, ?, ?)',
+        [ id, (enabled ? 1 : 0),
+          escape_pem(File.read(File.join(directory, 'public.pem'))),
+          escape_pem(File.read(File.join(directory, 'private.pem'))),
+          File.read(File.join(directory, 'private_key_salt')).strip,
+          default_private_key_iterations ])
+  end
+
+  def replace_key(id, enabled, password = nil, key_pair = nil)
+    @database.execute 'DELETE FROM keys WHERE id = ?', [ id ]
+    insert_key id, enabled, password, key_pair
+  end
+
+  # The private key in the form of the userdb fields, encrypted with the hashed password like the inserted keys.
+  def private_key(key_pair, password = nil)
+    escape_pem key_pair.encrypted_private_pem(hashed_password(password))
   end
 
   def update_key(id, enabled)
@@ -87,9 +112,12 @@ class Database
   end
 
   def default_private_key(password = nil)
+    escape_pem default_key_pair.to_pem(OpenSSL::Cipher.new('aes-256-cbc'), hashed_password(password))
+  end
+
+  def hashed_password(password = nil)
     settings = '$2a$%02u$%22s' % [ default_private_key_iterations, default_private_key_salt ]
-    hashed_password = BCrypt::Engine.hash_secret (password || default_private_key_password), settings
-    escape_pem default_key_pair.to_pem(OpenSSL::Cipher.new('aes-256-cbc'), hashed_password)
+    BCrypt::Engine.hash_secret (password || default_private_key_password), settings
   end
 
   def default_private_key_password
@@ -0,0 +1,34 @@
+require 'open3'
+
+# Key pairs of the types the plugin supports, created with the openssl command line tool, as the openssl binding of
+# older rubies can't create X25519 keys.
+class KeyPair
+
+  def self.rsa(bits = 2048)
+    new 'RSA', '-pkeyopt', "rsa_keygen_bits:#{bits}"
+  end
+
+  def self.x25519
+    new 'X25519'
+  end
+
+  attr_reader :public_pem
+
+  def initialize(algorithm, *options)
+    @private_pem = openssl nil, 'genpkey', '-algorithm', algorithm, *options
+    @public_pem = openssl @private_pem, 'pkey', '-pubout'
+  end
+
+  def encrypted_private_pem(passphrase)
+    openssl @private_pem, 'pkey', '-aes-256-cbc', '-passout', "pass:#{passphrase}"
+  end
+
+  private
+
+  def openssl(input, *arguments)
+    output, _, status = Open3.capture3 'openssl', *arguments, stdin_data: input.to_s
+    raise "openssl #{arguments.first} failed" unless status.success?
+    output
+  end
+
+end
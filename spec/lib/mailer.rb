@@ -36,6 +36,10 @@ class Mailer
     @imap.receive_part
   end
 
+  def receive_body(number = 1, section = '', partial = nil)
+    @imap.receive_body number, section, partial
+  end
+
   def search(options = { })
     @imap.search options
   end
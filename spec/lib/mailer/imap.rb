@@ -37,6 +37,12 @@ class Mailer::IMAP
     end
   end
 
+  def receive_body(number, section, partial)
+    within 'inbox' do |session|
+      session.fetch_body number, section, partial
+    end
+  end
+
   def search(options = { })
     within 'inbox' do |session|
       session.search options
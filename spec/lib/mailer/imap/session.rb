@@ -84,6 +84,16 @@ class Mailer::IMAP::Session
     end.compact
   end
 
+  # Fetches a body section, or the given offset and length of it, as the literal of the response.
+  def fetch_body(number, section = '', partial = nil)
+    write_line 'command_12', "fetch #{number} body.peek[#{section}]#{partial ? "<#{partial.join('.')}>" : ''}"
+    line = read_line '*', "#{number}"
+    raise 'broken stream' unless line =~ /\{(\d+)\}\s*$/
+    body = @socket.read $1.to_i
+    read_tagged_line('command_12') =~ /^command_12\sOK/i or raise 'fetch failed'
+    body
+  end
+
   def sort(field, reverse)
     write_line 'command_06', "sort (#{reverse ? 'reverse ' : ''}#{field}) us-ascii all"
     response = read_line '*', 'SORT'
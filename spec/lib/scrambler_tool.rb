@@ -0,0 +1,58 @@
+require 'open3'
+require 'tempfile'
+
+# Runs the scrambler-tool with the keys of a user, as they are stored in the database.
+class ScramblerTool
+
+  TOOL_PATH = File.expand_path '../../dovecot/target/bin/scrambler-tool', File.dirname(__FILE__)
+
+  def initialize(key, password)
+    @password = password
+    @salt = key[:private_key_salt]
+    @iterations = key[:private_key_iterations]
+    @public_key_file = key_file 'public', key[:public_key]
+    @private_key_file = key_file 'private', key[:private_key]
+  end
+
+  def encrypt(*arguments)
+    run 'encrypt', '-k', @public_key_file.path, *arguments
+  end
+
+  def decrypt(*arguments)
+    run 'decrypt', *private_key_options, *arguments
+  end
+
+  def verify(*arguments)
+    run 'verify', *private_key_options, *arguments
+  end
+
+  def info(*arguments)
+    run 'info', *arguments
+  end
+
+  def close
+    @public_key_file.close!
+    @private_key_file.close!
+  end
+
+  private
+
+  def private_key_options
+    [ '-K', @private_key_file.path, '-s', @salt, '-i', @iterations.to_s ]
+  end
+
+  # Returns the output and whether the tool succeeded.
+  def run(command, *arguments)
+    output, status = Open3.capture2({ 'SCRAMBLER_PASSWORD' => @password }, TOOL_PATH, command, *arguments)
+    [ output, status.success? ]
+  end
+
+  # The keys are stored in the userdb format, with underscores instead of line breaks.
+  def key_file(name, pem)
+    file = Tempfile.new name
+    file.write pem.gsub('_', "\n")
+    file.flush
+    file
+  end
+
+end
@@ -3,9 +3,16 @@ require 'fileutils'
 class Storage
 
   DIRECTORY = File.expand_path '../../dovecot/home', File.dirname(__FILE__)
+  DBOX_MESSAGE_HEADER = /\x01\x02N ([0-9a-fA-F]{16})[^\n]*\n/n
+  MAGIC = "\xee\xff\xcc".b
+  MAGIC_SIZE = MAGIC.bytesize + 1
+  CHUNK_SIZE = 8192
+  CHUNK_TAG_SIZE = 32
+  ENCRYPTED_CHUNK_SIZE = 2 + CHUNK_SIZE + CHUNK_TAG_SIZE
 
-  def initialize(user = 'test')
-    @directory = File.join DIRECTORY, user, 'mail'
+  # The location is the directory of the mail_location below the home directory.
+  def initialize(user = 'test', location = 'mail')
+    @directory = File.join DIRECTORY, user, location
   end
 
   def find_mail_delivered_to(user)
@@ -23,8 +30,124 @@ class Storage
     @mails = nil
   end
 
+  # The storage files of an mdbox, each holds one or more mails.
+  def mdbox_filenames
+    Dir[ File.join(@directory, 'storage', 'm.*') ].sort
+  end
+
+  # The mails as they are stored in the mdbox, sdbox or maildir files.
+  def stored_mails
+    dbox_filenames = Dir[ File.join(@directory, 'storage', 'm.*') ] + Dir[ File.join(@directory, '**', 'u.*') ]
+    maildir_mails = Dir[ File.join(@directory, '{cur,new}', '*') ].sort.map do |filename|
+      File.binread filename
+    end
+
+    dbox_filenames.sort.map do |filename|
+      content = File.binread filename
+      result = [ ]
+
+      offset = 0
+      while match = DBOX_MESSAGE_HEADER.match(content, offset)
+        size = match[1].to_i 16
+        result << content.byteslice(match.end(0), size)
+        offset = match.end(0) + size
+      end
+
+      result
+    end.flatten + maildir_mails
+  end
+
+  # The chunks of the stored mails behind the header of their package, which differs per key the mail is wrapped for.
+  def stored_chunks
+    stored_mails.map do |mail|
+      mail.byteslice header_size(mail) .. -1
+    end
+  end
+
+  # The headers of the stored mails up to their first chunk, which hold the wrapped content keys.
+  def stored_headers
+    stored_mails.map do |mail|
+      mail.byteslice 0, header_size(mail)
+    end
+  end
+
+  # The package bytes of the stored mails, nil for plain mails.
+  def stored_package_ids
+    stored_mails.map do |mail|
+      mail.byteslice(0, MAGIC.bytesize) == MAGIC ? mail.getbyte(MAGIC.bytesize) : nil
+    end
+  end
+
+  def clear_cache
+    Dir[ File.join(@directory, '**', 'dovecot.index.cache') ].each do |cache_filename|
+      FileUtils.rm_f cache_filename
+    end
+  end
+
+  # Cuts the final chunk off the first stored mail, so that it ends behind a complete chunk.
+  def truncate_final_chunk
+    update_stored_mail do |mail|
+      mail.byteslice 0, final_chunk_offset(mail)
+    end
+  end
+
+  # Flips a ciphertext byte in the chunk before the final one of the first stored mail.
+  def tamper_chunk
+    update_stored_mail do |mail|
+      offset = final_chunk_offset(mail) - ENCRYPTED_CHUNK_SIZE + 2 + 100
+      mail.byteslice(0, offset) + (mail.getbyte(offset) ^ 0x01).chr + mail.byteslice(offset + 1 .. -1)
+    end
+  end
+
+
   private
 
+  # Magic, key size field, iv, wrapped key and encrypted mac key of the package.
+  def header_size(mail)
+    key_size = mail.byteslice(MAGIC_SIZE, 2).unpack('n').first
+    case mail.getbyte(MAGIC.bytesize)
+    when 0x00 then MAGIC_SIZE + 16 + 256 + 32
+    when 0x01 then MAGIC_SIZE + 16 + 48
+    when 0x02 then MAGIC_SIZE + 2 + 16 + key_size + 32
+    when 0x03 then MAGIC_SIZE + 2 + 12 + key_size
+    when 0x04 then MAGIC_SIZE + 12 + 48
+    else raise 'unknown package'
+    end
+  end
+
+  def update_stored_mail
+    filename = Dir[ File.join(@directory, 'storage', 'm.*') ].sort.first
+    content = File.binread filename
+
+    match = DBOX_MESSAGE_HEADER.match content
+    size = match[1].to_i 16
+    mail = yield content.byteslice(match.end(0), size)
+
+    header = match[0].sub match[1], ('%016x' % mail.bytesize)
+    File.binwrite filename,
+        content.byteslice(0, match.begin(0)) + header + mail + content.byteslice(match.end(0) + size .. -1)
+
+    # the cache would still hold the sizes of the complete mail
+    clear_cache
+    @mails = nil
+  end
+
+  # The final chunk is the one, whose header has the msb set and the size of the rest of the mail, and which follows
+  # a full chunk. Needs a mail of at least two chunks.
+  def final_chunk_offset(mail)
+    (0 .. CHUNK_SIZE).each do |size|
+      offset = mail.bytesize - (2 + size + CHUNK_TAG_SIZE)
+      next if offset < ENCRYPTED_CHUNK_SIZE
+      return offset if chunk_header(mail, offset) == (0x8000 | size) &&
+          chunk_header(mail, offset - ENCRYPTED_CHUNK_SIZE) == CHUNK_SIZE
+    end
+    raise 'no final chunk found'
+  end
+
+  def chunk_header(mail, offset)
+    mail.byteslice(offset, 2).unpack('S').first
+  end
+
   def mails
     @mails ||= begin
       result = [ ]
@@ -0,0 +1,458 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dovecot/lib.h"
+#include "dovecot/buffer.h"
+#include "dovecot/istream.h"
+#include "dovecot/ostream.h"
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-istream.h"
+#include "scrambler-ostream.h"
+
+// Defines
+
+#define DEFAULT_FIXTURE_DIR "spec/fixtures"
+#define DEFAULT_MINIMAL_MSECS (500)
+#define DEFAULT_RSA_KEY_BITS (2048)
+#define FIXTURE_COUNT (4)
+#define MEGABYTE (1024.0 * 1024.0)
+
+// Structs
+
+struct scrambler_bench {
+    EVP_PKEY *key;
+    unsigned int minimal_msecs;
+};
+
+struct scrambler_bench_result {
+    double encrypt_mbps;
+    double decrypt_mbps;
+    double seek_mbps;
+    double header_mbps;
+    double allocations;
+};
+
+typedef int scrambler_bench_func_t(
+    struct scrambler_bench *bench,
+    const buffer_t *plain,
+    const buffer_t *encrypted,
+    buffer_t *output);
+
+// Constants
+
+static const size_t scrambler_bench_synthetic_sizes[] = {
+    1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024, 100 * 1024 * 1024
+};
+
+// Functions
+
+#ifdef __GLIBC__
+// All allocations of the process, including dovecot pools and OpenSSL, are counted by interposing the allocator.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+static bool scrambler_bench_count_allocations = FALSE;
+static unsigned long long scrambler_bench_allocation_count = 0;
+
+void *malloc(size_t size) {
+    if (scrambler_bench_count_allocations)
+        scrambler_bench_allocation_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (scrambler_bench_count_allocations)
+        scrambler_bench_allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    if (scrambler_bench_count_allocations)
+        scrambler_bench_allocation_count++;
+    return __libc_realloc(pointer, size);
+}
+#define ALLOCATIONS_COUNTED TRUE
+#else
+static bool scrambler_bench_count_allocations = FALSE;
+static unsigned long long scrambler_bench_allocation_count = 0;
+#define ALLOCATIONS_COUNTED FALSE
+#endif
+
+static long long scrambler_bench_now_usecs(void) {
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        i_fatal("clock_gettime() failed: %m");
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static EVP_PKEY *scrambler_bench_generate_key(int type, unsigned int rsa_key_bits) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(type, NULL);
+    EVP_PKEY *key = NULL;
+
+    if (context == NULL ||
+        EVP_PKEY_keygen_init(context) != 1 ||
+        (type == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_keygen_bits(context, rsa_key_bits) != 1) ||
+        EVP_PKEY_keygen(context, &key) != 1) {
+        i_error_openssl("scrambler_bench_generate_key");
+        i_fatal("failed to generate the benchmark key");
+    }
+
+    EVP_PKEY_CTX_free(context);
+    return key;
+}
+
+static void scrambler_bench_read_file(buffer_t *buffer, const char *path) {
+    struct istream *input = i_stream_create_file(path, IO_BLOCK_SIZE);
+    const unsigned char *data;
+    size_t size;
+
+    while (i_stream_read_data(input, &data, &size, 0) > 0) {
+        buffer_append(buffer, data, size);
+        i_stream_skip(input, size);
+    }
+    if (input->stream_errno != 0)
+        i_fatal("read(%s) failed: %s", path, strerror(input->stream_errno));
+
+    i_stream_unref(&input);
+}
+
+// Builds a message with some headers and a body of printable lines, so it looks like a mail to the zlib plugin.
+static void scrambler_bench_synthesize(buffer_t *buffer, size_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/";
+    unsigned int seed = 0x5eed;
+
+    buffer_append(buffer, "From: bench@example.org\r\nTo: bench@example.org\r\nSubject: benchmark\r\n\r\n", 70);
+    while (buffer->used < size) {
+        char line[78];
+
+        for (unsigned int index = 0; index < sizeof(line) - 2; index++) {
+            seed = seed * 1103515245 + 12345;
+            line[index] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        line[sizeof(line) - 2] = '\r';
+        line[sizeof(line) - 1] = '\n';
+        buffer_append(buffer, line, MIN(sizeof(line), size - buffer->used));
+    }
+}
+
+static int scrambler_bench_encrypt(
+    struct scrambler_bench *bench,
+    const buffer_t *plain,
+    const buffer_t *encrypted ATTR_UNUSED,
+    buffer_t *output
+) {
+    struct ostream *buffer_output, *encrypt_output;
+    int result = 0;
+
+    buffer_set_used_size(output, 0);
+    buffer_output = o_stream_create_buffer(output);
+    encrypt_output = scrambler_ostream_create(buffer_output, bench->key, NULL);
+
+    if (o_stream_send(encrypt_output, plain->data, plain->used) != (ssize_t)plain->used ||
+        o_stream_flush(encrypt_output) < 0)
+        result = -1;
+
+    o_stream_unref(&encrypt_output);
+    o_stream_unref(&buffer_output);
+    return result;
+}
+
+static int scrambler_bench_read_all(struct istream *input, uoff_t *size_r) {
+    const unsigned char *data;
+    size_t size;
+
+    *size_r = 0;
+    while (i_stream_read_data(input, &data, &size, 0) > 0) {
+        *size_r += size;
+        i_stream_skip(input, size);
+    }
+    return input->stream_errno != 0 ? -1 : 0;
+}
+
+static int scrambler_bench_decrypt(
+    struct scrambler_bench *bench,
+    const buffer_t *plain,
+    const buffer_t *encrypted,
+    buffer_t *output ATTR_UNUSED
+) {
+    struct istream *input = i_stream_create_from_data(encrypted->data, encrypted->used);
+    struct istream *decrypt_input = scrambler_istream_create(input, bench->key, NULL);
+    uoff_t size;
+    int result;
+
+    result = scrambler_bench_read_all(decrypt_input, &size);
+    if (size != plain->used)
+        result = -1;
+
+    i_stream_unref(&decrypt_input);
+    i_stream_unref(&input);
+    return result;
+}
+
+// Reads the mail, seeks back to the middle and reads the second half again. The stored mail is a seekable memory
+// stream, so the seek jumps straight to the chunk of the middle (seek_chunk) and only the second half is decrypted
+// again.
+static int scrambler_bench_seek(
+    struct scrambler_bench *bench,
+    const buffer_t *plain,
+    const buffer_t *encrypted,
+    buffer_t *output ATTR_UNUSED
+) {
+    struct istream *input = i_stream_create_from_data(encrypted->data, encrypted->used);
+    struct istream *decrypt_input = scrambler_istream_create(input, bench->key, NULL);
+    uoff_t size, second_size;
+    int result;
+
+    result = scrambler_bench_read_all(decrypt_input, &size);
+    if (result == 0) {
+        i_stream_seek(decrypt_input, plain->used / 2);
+        result = scrambler_bench_read_all(decrypt_input, &second_size);
+        if (second_size != plain->used - plain->used / 2)
+            result = -1;
+    }
+
+    i_stream_unref(&decrypt_input);
+    i_stream_unref(&input);
+    return result;
+}
+
+static bool scrambler_bench_has_header_end(const unsigned char *data, size_t size) {
+    for (size_t index = 1; index < size; index++) {
+        if (data[index] == '\n' && (data[index - 1] == '\n' || (index > 1 && data[index - 1] == '\r' &&
+            data[index - 2] == '\n')))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Reads until the end of the header block, like a header fetch does.
+static int scrambler_bench_header(
+    struct scrambler_bench *bench,
+    const buffer_t *plain ATTR_UNUSED,
+    const buffer_t *encrypted,
+    buffer_t *output ATTR_UNUSED
+) {
+    struct istream *input = i_stream_create_from_data(encrypted->data, encrypted->used);
+    struct istream *decrypt_input = scrambler_istream_create(input, bench->key, NULL);
+    const unsigned char *data;
+    size_t size = 0;
+    int result = -1;
+
+    while (i_stream_read_data(decrypt_input, &data, &size, size) > 0) {
+        if (scrambler_bench_has_header_end(data, size)) {
+            result = 0;
+            break;
+        }
+    }
+    if (decrypt_input->stream_errno == 0 && decrypt_input->eof)
+        result = 0;
+
+    i_stream_unref(&decrypt_input);
+    i_stream_unref(&input);
+    return result;
+}
+
+// Runs the function until the minimal time has passed and returns the processed megabytes per second.
+static double scrambler_bench_measure(
+    struct scrambler_bench *bench,
+    scrambler_bench_func_t *function,
+    const buffer_t *plain,
+    const buffer_t *encrypted,
+    buffer_t *output,
+    const char *name
+) {
+    long long start_usecs = scrambler_bench_now_usecs(), elapsed_usecs;
+    unsigned int iterations = 0;
+
+    do {
+        T_BEGIN {
+            if (function(bench, plain, encrypted, output) < 0)
+                i_fatal("%s benchmark failed", name);
+        } T_END;
+        iterations++;
+        elapsed_usecs = scrambler_bench_now_usecs() - start_usecs;
+    } while (elapsed_usecs < (long long)bench->minimal_msecs * 1000);
+
+    return (double)plain->used * iterations / MEGABYTE / ((double)MAX(elapsed_usecs, 1) / 1000000);
+}
+
+static double scrambler_bench_count(
+    struct scrambler_bench *bench,
+    const buffer_t *plain,
+    const buffer_t *encrypted,
+    buffer_t *output
+) {
+    scrambler_bench_allocation_count = 0;
+    scrambler_bench_count_allocations = TRUE;
+    T_BEGIN {
+        if (scrambler_bench_encrypt(bench, plain, encrypted, output) < 0 ||
+            scrambler_bench_decrypt(bench, plain, encrypted, output) < 0)
+            i_fatal("allocation benchmark failed");
+    } T_END;
+    scrambler_bench_count_allocations = FALSE;
+
+    return (double)scrambler_bench_allocation_count;
+}
+
+static void scrambler_bench_message(struct scrambler_bench *bench, const char *name, const buffer_t *plain) {
+    struct scrambler_bench_result result;
+    buffer_t *encrypted = buffer_create_dynamic(default_pool, plain->used + plain->used / 64 + 1024);
+    buffer_t *output = buffer_create_dynamic(default_pool, plain->used + plain->used / 64 + 1024);
+
+    if (scrambler_bench_encrypt(bench, plain, NULL, encrypted) < 0)
+        i_fatal("%s: encryption failed", name);
+
+    result.encrypt_mbps = scrambler_bench_measure(bench, scrambler_bench_encrypt, plain, encrypted, output, "encrypt");
+    result.decrypt_mbps = scrambler_bench_measure(bench, scrambler_bench_decrypt, plain, encrypted, output, "decrypt");
+    result.seek_mbps = scrambler_bench_measure(bench, scrambler_bench_seek, plain, encrypted, output, "seek");
+    result.header_mbps = scrambler_bench_measure(bench, scrambler_bench_header, plain, encrypted, output, "header");
+    result.allocations = scrambler_bench_count(bench, plain, encrypted, output);
+
+    printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f", name, (unsigned long long)plain->used,
+        result.encrypt_mbps, result.decrypt_mbps, result.seek_mbps, result.header_mbps);
+    if (ALLOCATIONS_COUNTED)
+        printf(" %8.0f\n", result.allocations);
+    else
+        printf(" %8s\n", "n/a");
+
+    buffer_free(&output);
+    buffer_free(&encrypted);
+}
+
+static void scrambler_bench_key_wrap(struct scrambler_bench *bench) {
+    const struct scrambler_package *package = scrambler_package_for_key(bench->key);
+    const char *name = package->key_type == EVP_PKEY_RSA ? "rsa" : "x25519";
+    unsigned char key[16] = { 0 }, unwrapped_key[EVP_MAX_KEY_LENGTH];
+    unsigned char wrapped_key[package->wrapped_key_size(bench->key)];
+    size_t wrapped_key_size, unwrapped_key_size;
+    long long start_usecs, elapsed_usecs;
+    unsigned int wraps = 0, unwraps = 0;
+
+    start_usecs = scrambler_bench_now_usecs();
+    do {
+        wrapped_key_size = sizeof(wrapped_key);
+        if (scrambler_wrap_key(wrapped_key, &wrapped_key_size, key, sizeof(key), bench->key) < 0)
+            i_fatal("wrap benchmark failed");
+        wraps++;
+        elapsed_usecs = scrambler_bench_now_usecs() - start_usecs;
+    } while (elapsed_usecs < (long long)bench->minimal_msecs * 1000);
+    printf("%s wrap:   %10.1f ops/s\n", name, wraps / ((double)MAX(elapsed_usecs, 1) / 1000000));
+
+    start_usecs = scrambler_bench_now_usecs();
+    do {
+        unwrapped_key_size = sizeof(unwrapped_key);
+        if (scrambler_unwrap_key(unwrapped_key, &unwrapped_key_size, wrapped_key, wrapped_key_size, bench->key) < 0)
+            i_fatal("unwrap benchmark failed");
+        unwraps++;
+        elapsed_usecs = scrambler_bench_now_usecs() - start_usecs;
+    } while (elapsed_usecs < (long long)bench->minimal_msecs * 1000);
+    printf("%s unwrap: %10.1f ops/s\n", name, unwraps / ((double)MAX(elapsed_usecs, 1) / 1000000));
+}
+
+static void scrambler_bench_usage(void) {
+    fprintf(stderr, "usage: scrambler-bench [-r <rsa key bits> | -x] [-t <msecs per measurement>] "
+        "[-l <largest synthetic size>] [<fixture dir>]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct scrambler_bench bench;
+    const char *fixture_dir = DEFAULT_FIXTURE_DIR;
+    uoff_t largest_size = (uoff_t)-1;
+    buffer_t *plain;
+    unsigned int rsa_key_bits = DEFAULT_RSA_KEY_BITS;
+    int option, key_type = EVP_PKEY_RSA;
+
+    lib_init();
+    i_set_failure_prefix("scrambler-bench: ");
+    scrambler_initialize();
+
+    memset(&bench, 0, sizeof(bench));
+    bench.minimal_msecs = DEFAULT_MINIMAL_MSECS;
+
+    while ((option = getopt(argc, argv, "t:l:r:x")) != -1) {
+        switch (option) {
+        case 'r':
+            if (str_to_uint(optarg, &rsa_key_bits) < 0)
+                scrambler_bench_usage();
+            break;
+        case 'x':
+#ifdef HAVE_X25519
+            key_type = EVP_PKEY_X25519;
+            break;
+#else
+            i_fatal("X25519 is not supported by this OpenSSL version");
+#endif
+        case 't':
+            if (str_to_uint(optarg, &bench.minimal_msecs) < 0)
+                scrambler_bench_usage();
+            break;
+        case 'l':
+            if (str_to_uoff(optarg, &largest_size) < 0)
+                scrambler_bench_usage();
+            break;
+        default:
+            scrambler_bench_usage();
+        }
+    }
+    if (optind < argc)
+        fixture_dir = argv[optind];
+
+    bench.key = scrambler_bench_generate_key(key_type, rsa_key_bits);
+
+    printf("%-12s %10s %10s %10s %10s %10s %8s\n", "message", "bytes", "enc MB/s", "dec MB/s", "seek MB/s",
+        "hdr MB/s", "allocs");
+
+    plain = buffer_create_dynamic(default_pool, 1024 * 1024);
+    for (unsigned int index = 1; index <= FIXTURE_COUNT; index++) {
+        const char *name = t_strdup_printf("mail-%u.eml", index);
+
+        buffer_set_used_size(plain, 0);
+        scrambler_bench_read_file(plain, t_strconcat(fixture_dir, "/", name, NULL));
+        scrambler_bench_message(&bench, name, plain);
+    }
+
+    for (unsigned int index = 0; index < N_ELEMENTS(scrambler_bench_synthetic_sizes); index++) {
+        size_t size = scrambler_bench_synthetic_sizes[index];
+
+        if (size > largest_size)
+            break;
+
+        buffer_set_used_size(plain, 0);
+        scrambler_bench_synthesize(plain, size);
+        scrambler_bench_message(&bench, t_strdup_printf("synth-%llu", (unsigned long long)size), plain);
+    }
+    buffer_free(&plain);
+
+    scrambler_bench_key_wrap(&bench);
+
+    EVP_PKEY_free(bench.key);
+    lib_deinit();
+
+    return EXIT_SUCCESS;
+}
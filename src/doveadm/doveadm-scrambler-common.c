@@ -0,0 +1,376 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dovecot/lib.h"
+#include "dovecot/array.h"
+#include "dovecot/istream.h"
+#include "dovecot/time-util.h"
+#include "dovecot/mail-storage.h"
+#include "dovecot/mail-search-build.h"
+#include "dovecot/mailbox-list-iter.h"
+#include "dovecot/doveadm-mail.h"
+#include "dovecot/doveadm-mailbox-list-iter.h"
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "scrambler-common.h"
+
+#include "doveadm-scrambler-common.h"
+
+// Defines
+
+#define DEFAULT_BATCH_SIZE (100)
+#define REPORT_INTERVAL_MSECS (10 * 1000)
+#define MAXIMAL_PROGRESS_TAG_LENGTH (64)
+
+// Functions
+
+static const char *doveadm_scrambler_progress_path(struct doveadm_scrambler_cmd_context *ctx, struct mailbox *box) {
+    const char *path;
+
+    if (ctx->progress_file_name == NULL)
+        return NULL;
+
+    if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+        return NULL;
+
+    return t_strconcat(path, "/", ctx->progress_file_name, NULL);
+}
+
+// The progress file holds the uid validity of the mailbox, the last uid of the last committed batch and an
+// optional tag, that ties the progress to the command arguments (e.g. the new key of a rekey run).
+static uint32_t doveadm_scrambler_progress_read(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mailbox *box,
+    uint32_t uid_validity
+) {
+    const char *path = doveadm_scrambler_progress_path(ctx, box);
+    unsigned int file_uid_validity, file_uid;
+    char buffer[64 + MAXIMAL_PROGRESS_TAG_LENGTH];
+    char file_tag[MAXIMAL_PROGRESS_TAG_LENGTH + 1];
+    ssize_t size;
+    int fd;
+
+    if (path == NULL)
+        return 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            i_error("open(%s) failed: %s", path, strerror(errno));
+        return 0;
+    }
+
+    size = read(fd, buffer, sizeof(buffer) - 1);
+    if (size < 0)
+        i_error("read(%s) failed: %s", path, strerror(errno));
+    close(fd);
+
+    if (size <= 0)
+        return 0;
+    buffer[size] = '\0';
+
+    file_tag[0] = '\0';
+    if (sscanf(buffer, "%u %u %64s", &file_uid_validity, &file_uid, file_tag) < 2 ||
+        file_uid_validity != uid_validity)
+        return 0;
+
+    if (strcmp(file_tag, ctx->progress_tag == NULL ? "" : ctx->progress_tag) != 0)
+        return 0;
+
+    return file_uid;
+}
+
+static void doveadm_scrambler_progress_write(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mailbox *box,
+    uint32_t uid_validity,
+    uint32_t uid
+) {
+    const char *path = doveadm_scrambler_progress_path(ctx, box);
+    const char *temp_path, *content;
+    int fd;
+
+    if (path == NULL)
+        return;
+
+    temp_path = t_strconcat(path, ".tmp", NULL);
+    if (ctx->progress_tag == NULL)
+        content = t_strdup_printf("%u %u\n", uid_validity, uid);
+    else
+        content = t_strdup_printf("%u %u %s\n", uid_validity, uid, ctx->progress_tag);
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        i_error("open(%s) failed: %s", temp_path, strerror(errno));
+        return;
+    }
+    if (write(fd, content, strlen(content)) < 0)
+        i_error("write(%s) failed: %s", temp_path, strerror(errno));
+    if (close(fd) < 0)
+        i_error("close(%s) failed: %s", temp_path, strerror(errno));
+    else if (rename(temp_path, path) < 0)
+        i_error("rename(%s, %s) failed: %s", temp_path, path, strerror(errno));
+}
+
+void doveadm_scrambler_cmd_report(struct doveadm_scrambler_cmd_context *ctx, bool force) {
+    struct timeval now;
+    long long elapsed_msecs;
+
+    if (gettimeofday(&now, NULL) < 0)
+        i_fatal("gettimeofday() failed: %m");
+
+    if (!force && timeval_diff_msecs(&now, &ctx->report_time) < REPORT_INTERVAL_MSECS)
+        return;
+    ctx->report_time = now;
+
+    elapsed_msecs = MAX(timeval_diff_msecs(&now, &ctx->start_time), 1);
+    i_info("scrambler %s: %u mails (%llu mails/s), %llu bytes (%llu bytes/s)", ctx->name,
+        ctx->mail_count, (unsigned long long)ctx->mail_count * 1000 / elapsed_msecs,
+        (unsigned long long)ctx->byte_count, (unsigned long long)ctx->byte_count * 1000 / elapsed_msecs);
+}
+
+static void doveadm_scrambler_throttle(struct doveadm_scrambler_cmd_context *ctx) {
+    struct timeval now;
+    long long elapsed_usecs, expected_usecs;
+
+    if (ctx->max_bytes_per_second == 0)
+        return;
+
+    if (gettimeofday(&now, NULL) < 0)
+        i_fatal("gettimeofday() failed: %m");
+
+    elapsed_usecs = timeval_diff_usecs(&now, &ctx->start_time);
+    expected_usecs = ctx->byte_count * 1000000 / ctx->max_bytes_per_second;
+    if (expected_usecs > elapsed_usecs)
+        usleep(expected_usecs - elapsed_usecs);
+}
+
+// Saves the given input as a copy of the mail, which passes it through the scrambler ostream with the current
+// public key of the user, and expunges the original.
+int doveadm_scrambler_save_mail(
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail,
+    struct istream *input
+) {
+    struct mail_save_context *save_ctx;
+    const char *guid;
+    time_t received_date;
+    int result = 0;
+
+    if (mail_get_received_date(mail, &received_date) < 0 ||
+        mail_get_special(mail, MAIL_FETCH_GUID, &guid) < 0)
+        return -1;
+
+    save_ctx = mailbox_save_alloc(transaction);
+    mailbox_save_copy_flags(save_ctx, mail);
+    mailbox_save_set_received_date(save_ctx, received_date, 0);
+    if (*guid != '\0')
+        mailbox_save_set_guid(save_ctx, guid);
+
+    if (mailbox_save_begin(&save_ctx, input) < 0)
+        return -1;
+
+    do {
+        if (mailbox_save_continue(save_ctx) < 0) {
+            result = -1;
+            break;
+        }
+    } while (i_stream_read(input) > 0);
+
+    if (result < 0 || input->stream_errno != 0) {
+        if (input->stream_errno != 0)
+            i_error("read(%s) failed: %s", i_stream_get_name(input), strerror(input->stream_errno));
+        mailbox_save_cancel(&save_ctx);
+        return -1;
+    }
+
+    if (mailbox_save_finish(&save_ctx) < 0)
+        return -1;
+
+    mail_expunge(mail);
+    return 0;
+}
+
+static int doveadm_scrambler_run_batch(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mailbox *box,
+    const uint32_t *uids,
+    unsigned int uid_count
+) {
+    struct mailbox_transaction_context *transaction;
+    struct mail *mail;
+    int result = 0;
+
+    transaction = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+    mail = mail_alloc(transaction, 0, NULL);
+
+    for (unsigned int index = 0; index < uid_count; index++) {
+        if (!mail_set_uid(mail, uids[index]))
+            continue;
+
+        if (ctx->process_mail(ctx, transaction, mail) < 0) {
+            i_error("scrambler %s: %s: failed to process uid %u: %s", ctx->name, mailbox_get_vname(box),
+                uids[index], mailbox_get_last_error(box, NULL));
+            doveadm_mail_failed_mailbox(&ctx->ctx, box);
+            result = -1;
+        }
+
+        doveadm_scrambler_throttle(ctx);
+        doveadm_scrambler_cmd_report(ctx, FALSE);
+    }
+
+    mail_free(&mail);
+
+    if (ctx->finish_batch != NULL && ctx->finish_batch(ctx) < 0) {
+        doveadm_mail_failed_mailbox(&ctx->ctx, box);
+        mailbox_transaction_rollback(&transaction);
+        return -1;
+    }
+
+    if (mailbox_transaction_commit(&transaction) < 0) {
+        i_error("scrambler %s: %s: failed to commit transaction: %s", ctx->name, mailbox_get_vname(box),
+            mailbox_get_last_error(box, NULL));
+        doveadm_mail_failed_mailbox(&ctx->ctx, box);
+        return -1;
+    }
+    return result;
+}
+
+static int doveadm_scrambler_run_box(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mail_user *user,
+    const struct mailbox_info *info
+) {
+    struct mailbox *box;
+    struct mailbox_transaction_context *transaction;
+    struct mail_search_context *search_ctx;
+    struct mailbox_status status;
+    struct mail *mail;
+    ARRAY_TYPE(uint32_t) uids;
+    const uint32_t *uid_list;
+    unsigned int uid_count;
+    uint32_t last_uid;
+    int result = 0;
+
+    box = doveadm_mailbox_find(user, info->vname);
+    if (mailbox_sync(box, 0) < 0) {
+        i_error("scrambler %s: %s: failed to sync mailbox: %s", ctx->name, info->vname,
+            mailbox_get_last_error(box, NULL));
+        doveadm_mail_failed_mailbox(&ctx->ctx, box);
+        mailbox_free(&box);
+        return -1;
+    }
+
+    mailbox_get_open_status(box, STATUS_UIDVALIDITY, &status);
+    last_uid = doveadm_scrambler_progress_read(ctx, box, status.uidvalidity);
+
+    // collect the uids first, as the mails are processed in several transactions
+    i_array_init(&uids, 256);
+    transaction = mailbox_transaction_begin(box, 0);
+    search_ctx = mailbox_search_init(transaction, ctx->ctx.search_args, NULL, 0, NULL);
+    while (mailbox_search_next(search_ctx, &mail)) {
+        if (mail->uid > last_uid)
+            array_append(&uids, &mail->uid, 1);
+    }
+    if (mailbox_search_deinit(&search_ctx) < 0) {
+        i_error("scrambler %s: %s: search failed: %s", ctx->name, info->vname, mailbox_get_last_error(box, NULL));
+        doveadm_mail_failed_mailbox(&ctx->ctx, box);
+        result = -1;
+    }
+    mailbox_transaction_rollback(&transaction);
+
+    uid_list = array_get(&uids, &uid_count);
+    for (unsigned int index = 0; index < uid_count && result == 0; index += ctx->batch_size) {
+        unsigned int batch_count = MIN(ctx->batch_size, uid_count - index);
+
+        result = doveadm_scrambler_run_batch(ctx, box, uid_list + index, batch_count);
+        if (result == 0)
+            doveadm_scrambler_progress_write(ctx, box, status.uidvalidity, uid_list[index + batch_count - 1]);
+    }
+
+    array_free(&uids);
+    mailbox_free(&box);
+    return result;
+}
+
+int doveadm_scrambler_cmd_run_mailboxes(struct doveadm_scrambler_cmd_context *ctx, struct mail_user *user) {
+    struct doveadm_mailbox_list_iter *iter;
+    const struct mailbox_info *info;
+    int result = 0;
+
+    iter = doveadm_mailbox_list_iter_init(&ctx->ctx, user, ctx->ctx.search_args,
+        MAILBOX_LIST_ITER_NO_AUTO_BOXES | MAILBOX_LIST_ITER_RETURN_NO_FLAGS);
+    while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+        T_BEGIN {
+            if (doveadm_scrambler_run_box(ctx, user, info) < 0)
+                result = -1;
+        } T_END;
+    }
+    if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
+        result = -1;
+
+    return result;
+}
+
+bool doveadm_scrambler_cmd_parse_arg(struct doveadm_scrambler_cmd_context *ctx, int c) {
+    switch (c) {
+    case 'b':
+        if (str_to_uint(optarg, &ctx->batch_size) < 0 || ctx->batch_size == 0)
+            i_fatal("invalid batch size: %s", optarg);
+        break;
+    case 't':
+        if (str_to_uoff(optarg, &ctx->max_bytes_per_second) < 0)
+            i_fatal("invalid throttle: %s", optarg);
+        break;
+    default:
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void doveadm_scrambler_cmd_init(struct doveadm_scrambler_cmd_context *ctx, const char *const args[]) {
+    if (args[0] == NULL) {
+        ctx->ctx.search_args = mail_search_build_init();
+        mail_search_build_add_all(ctx->ctx.search_args);
+    } else {
+        ctx->ctx.search_args = doveadm_mail_build_search_args(args);
+    }
+
+    if (gettimeofday(&ctx->start_time, NULL) < 0)
+        i_fatal("gettimeofday() failed: %m");
+    ctx->report_time = ctx->start_time;
+}
+
+struct doveadm_scrambler_cmd_context *doveadm_scrambler_cmd_alloc_size(
+    size_t size,
+    const char *name,
+    const char *progress_file_name,
+    doveadm_scrambler_mail_func_t *process_mail
+) {
+    struct doveadm_scrambler_cmd_context *ctx;
+
+    ctx = (struct doveadm_scrambler_cmd_context *)doveadm_mail_cmd_alloc_size(size);
+    ctx->name = name;
+    ctx->progress_file_name = progress_file_name;
+    ctx->process_mail = process_mail;
+    ctx->batch_size = DEFAULT_BATCH_SIZE;
+    return ctx;
+}
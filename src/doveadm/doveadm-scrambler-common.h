@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DOVEADM_SCRAMBLER_COMMON_H
+#define DOVEADM_SCRAMBLER_COMMON_H
+
+#include "dovecot/doveadm-mail.h"
+
+// Defines
+
+#define doveadm_scrambler_cmd_alloc(type, name, progress_file_name, process_mail) \
+    ((type *)doveadm_scrambler_cmd_alloc_size(sizeof(type), name, progress_file_name, process_mail))
+
+// Structs
+
+struct doveadm_scrambler_cmd_context;
+
+// Returns 1 if the mail has been processed, 0 if it has been skipped and -1 on errors.
+typedef int doveadm_scrambler_mail_func_t(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail);
+
+// Called before the transaction of a batch is committed. Returns 0 on success and -1 on errors.
+typedef int doveadm_scrambler_batch_func_t(struct doveadm_scrambler_cmd_context *ctx);
+
+struct doveadm_scrambler_cmd_context {
+    struct doveadm_mail_cmd_context ctx;
+
+    const char *name;
+    const char *progress_file_name;
+    const char *progress_tag;
+    doveadm_scrambler_mail_func_t *process_mail;
+    doveadm_scrambler_batch_func_t *finish_batch;
+
+    unsigned int batch_size;
+    uoff_t max_bytes_per_second;
+
+    struct timeval start_time;
+    struct timeval report_time;
+    unsigned int mail_count;
+    uoff_t byte_count;
+};
+
+// Functions
+
+struct doveadm_scrambler_cmd_context *doveadm_scrambler_cmd_alloc_size(
+    size_t size,
+    const char *name,
+    const char *progress_file_name,
+    doveadm_scrambler_mail_func_t *process_mail);
+
+bool doveadm_scrambler_cmd_parse_arg(struct doveadm_scrambler_cmd_context *ctx, int c);
+
+void doveadm_scrambler_cmd_init(struct doveadm_scrambler_cmd_context *ctx, const char *const args[]);
+
+int doveadm_scrambler_cmd_run_mailboxes(struct doveadm_scrambler_cmd_context *ctx, struct mail_user *user);
+
+void doveadm_scrambler_cmd_report(struct doveadm_scrambler_cmd_context *ctx, bool force);
+
+int doveadm_scrambler_save_mail(
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail,
+    struct istream *input);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dovecot/lib.h"
+#include "dovecot/istream.h"
+#include "dovecot/mail-storage.h"
+#include "dovecot/doveadm-mail.h"
+#include "dovecot/doveadm-print.h"
+
+#include "scrambler-plugin.h"
+#include "scrambler-istream.h"
+
+#include "doveadm-scrambler-common.h"
+#include "doveadm-scrambler-encrypt.h"
+
+// Defines
+
+#define PROGRESS_FILE_NAME "dovecot.scrambler-encrypt"
+
+// Functions
+
+// Saves the plain mail again, which passes it through the scrambler ostream, and expunges the original.
+static int doveadm_scrambler_encrypt_mail(
+    struct doveadm_scrambler_cmd_context *ctx,
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail
+) {
+    struct istream *input;
+    int result;
+
+    if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+        return -1;
+
+    result = scrambler_istream_is_encrypted(input);
+    if (result != 0)
+        return result < 0 ? -1 : 0;
+
+    if (doveadm_scrambler_save_mail(transaction, mail, input) < 0)
+        return -1;
+
+    ctx->mail_count++;
+    ctx->byte_count += input->v_offset;
+    return 1;
+}
+
+static int doveadm_scrambler_encrypt_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user) {
+    struct doveadm_scrambler_cmd_context *ctx = (struct doveadm_scrambler_cmd_context *)_ctx;
+    struct scrambler_user *suser = scrambler_user_get(user);
+    unsigned int start_mail_count = ctx->mail_count;
+    uoff_t start_byte_count = ctx->byte_count;
+    int result;
+
+    if (suser == NULL || !suser->enabled || suser->public_key == NULL) {
+        i_info("scrambler encrypt: encryption is not enabled for user %s, skipping", user->username);
+        return 0;
+    }
+
+    result = doveadm_scrambler_cmd_run_mailboxes(ctx, user);
+
+    doveadm_print(user->username);
+    doveadm_print_num(ctx->mail_count - start_mail_count);
+    doveadm_print_num(ctx->byte_count - start_byte_count);
+
+    doveadm_scrambler_cmd_report(ctx, TRUE);
+    return result;
+}
+
+static bool doveadm_scrambler_encrypt_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c) {
+    return doveadm_scrambler_cmd_parse_arg((struct doveadm_scrambler_cmd_context *)_ctx, c);
+}
+
+static void doveadm_scrambler_encrypt_init(struct doveadm_mail_cmd_context *_ctx, const char *const args[]) {
+    doveadm_scrambler_cmd_init((struct doveadm_scrambler_cmd_context *)_ctx, args);
+
+    doveadm_print_header_simple("username");
+    doveadm_print_header_simple("mails");
+    doveadm_print_header_simple("bytes");
+}
+
+static struct doveadm_mail_cmd_context *doveadm_scrambler_encrypt_alloc(void) {
+    struct doveadm_scrambler_cmd_context *ctx;
+
+    ctx = doveadm_scrambler_cmd_alloc(struct doveadm_scrambler_cmd_context, "encrypt", PROGRESS_FILE_NAME,
+        doveadm_scrambler_encrypt_mail);
+    ctx->ctx.getopt_args = "b:t:";
+    ctx->ctx.v.parse_arg = doveadm_scrambler_encrypt_parse_arg;
+    ctx->ctx.v.init = doveadm_scrambler_encrypt_init;
+    ctx->ctx.v.run = doveadm_scrambler_encrypt_run;
+    doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+    return &ctx->ctx;
+}
+
+// Constants
+
+struct doveadm_mail_cmd doveadm_scrambler_cmd_encrypt = {
+    doveadm_scrambler_encrypt_alloc, "scrambler encrypt", "[-b <batch size>] [-t <bytes/s>] [<search query>]"
+};
@@ -0,0 +1,40 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dovecot/lib.h"
+#include "dovecot/doveadm-mail.h"
+
+#include "doveadm-scrambler-plugin.h"
+#include "doveadm-scrambler-encrypt.h"
+#include "doveadm-scrambler-rekey.h"
+#include "doveadm-scrambler-verify.h"
+
+const char *doveadm_scrambler_plugin_version = DOVECOT_ABI_VERSION;
+
+// Functions
+
+void doveadm_scrambler_plugin_init(struct module *module ATTR_UNUSED) {
+    doveadm_mail_register_cmd(&doveadm_scrambler_cmd_encrypt);
+    doveadm_mail_register_cmd(&doveadm_scrambler_cmd_rekey);
+    doveadm_mail_register_cmd(&doveadm_scrambler_cmd_verify);
+}
+
+void doveadm_scrambler_plugin_deinit(void) {
+}
@@ -0,0 +1,539 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+// F_OFD_SETLK
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include "dovecot/lib.h"
+#include "dovecot/str.h"
+#include "dovecot/hex-binary.h"
+#include "dovecot/istream.h"
+#include "dovecot/istream-private.h"
+#include "dovecot/ostream.h"
+#include "dovecot/mail-storage.h"
+#include "dovecot/doveadm-mail.h"
+#include "dovecot/doveadm-print.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-plugin.h"
+#include "scrambler-istream.h"
+#include "scrambler-ostream.h"
+
+#include "doveadm-scrambler-common.h"
+#include "doveadm-scrambler-rekey.h"
+
+// Defines
+
+#define PROGRESS_FILE_NAME "dovecot.scrambler-rekey"
+#define PROGRESS_TAG_SIZE (16)
+// file name prefix of mdbox files, which hold many mails and are shared with saves and doveadm purge
+#define MDBOX_FILE_PREFIX "m."
+// an open file description lock isn't dropped by the close() of another descriptor of the file in this process, like
+// the ones of the storage. The process wide lock is, so mdbox files are only rewritten in place with the former
+#ifdef F_OFD_SETLK
+#define FILE_LOCK_COMMAND F_OFD_SETLK
+#else
+#define FILE_LOCK_COMMAND F_SETLK
+#endif
+
+// Structs
+
+struct doveadm_scrambler_rekey_cmd_context {
+    struct doveadm_scrambler_cmd_context ctx;
+
+    const char *public_key_path;
+    EVP_PKEY *public_key;
+
+    struct scrambler_user *suser;
+
+    // the storage file of the last in place rewrite, synced at the end of each batch
+    const char *file_path;
+    int file_fd;
+
+    unsigned int in_place_count;
+    unsigned int saved_count;
+    unsigned int skipped_count;
+};
+
+// Functions
+
+static const char *doveadm_scrambler_rekey_read_file(const char *path) {
+    string_t *content = t_str_new(1024);
+    char buffer[1024];
+    ssize_t size;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        i_fatal("open(%s) failed: %m", path);
+
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+        str_append_n(content, buffer, size);
+    if (size < 0)
+        i_fatal("read(%s) failed: %m", path);
+
+    close(fd);
+    return str_c(content);
+}
+
+// Identifies the new key in the progress file, so a later rotation to another key starts from the beginning.
+static const char *doveadm_scrambler_rekey_fingerprint(EVP_PKEY *public_key) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    unsigned char *der = NULL;
+    int der_size;
+
+    der_size = i2d_PUBKEY(public_key, &der);
+    if (der_size <= 0)
+        i_fatal("scrambler rekey: failed to encode the public key");
+
+    if (EVP_Digest(der, der_size, digest, &digest_size, scrambler_sha256(), NULL) != 1)
+        i_fatal("scrambler rekey: failed to hash the public key");
+    OPENSSL_free(der);
+
+    return binary_to_hex(digest, PROGRESS_TAG_SIZE);
+}
+
+static int doveadm_scrambler_rekey_close_file(struct doveadm_scrambler_rekey_cmd_context *ctx) {
+    int result = 0;
+
+    if (ctx->file_fd == -1)
+        return 0;
+
+    if (fdatasync(ctx->file_fd) < 0) {
+        i_error("fdatasync(%s) failed: %m", ctx->file_path);
+        result = -1;
+    }
+    if (close(ctx->file_fd) < 0) {
+        i_error("close(%s) failed: %m", ctx->file_path);
+        result = -1;
+    }
+
+    ctx->file_fd = -1;
+    ctx->file_path = NULL;
+    return result;
+}
+
+static int doveadm_scrambler_rekey_finish_batch(struct doveadm_scrambler_cmd_context *_ctx) {
+    return doveadm_scrambler_rekey_close_file((struct doveadm_scrambler_rekey_cmd_context *)_ctx);
+}
+
+// Opens the storage file of the raw stream for the in place rewrite. It gets the write lock dovecot takes on dbox
+// files before it changes them (dbox_file_try_lock()), so the rewrite doesn't race with saves appending to an mdbox
+// file, doveadm purge or another rekey run. Returns 1 if the file is open, 0 if it is locked or no longer the file of
+// the stream and -1 on errors.
+static int doveadm_scrambler_rekey_open_file(
+    struct doveadm_scrambler_rekey_cmd_context *ctx,
+    struct istream *raw_input,
+    const char *path
+) {
+    struct stat stream_stat, file_stat;
+    struct flock lock;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        i_error("open(%s) failed: %m", path);
+        return -1;
+    }
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, FILE_LOCK_COMMAND, &lock) < 0) {
+        bool locked = errno == EACCES || errno == EAGAIN;
+        if (!locked)
+            i_error("fcntl(%s, write-lock) failed: %m", path);
+        (void)close(fd);
+        return locked ? 0 : -1;
+    }
+
+    // doveadm purge replaces mdbox files, the path may name another file by now
+    if (fstat(fd, &file_stat) < 0 || fstat(i_stream_get_fd(raw_input), &stream_stat) < 0 ||
+        file_stat.st_dev != stream_stat.st_dev || file_stat.st_ino != stream_stat.st_ino) {
+        (void)close(fd);
+        return 0;
+    }
+
+    ctx->file_fd = fd;
+    ctx->file_path = p_strdup(ctx->ctx.ctx.pool, path);
+    return 1;
+}
+
+// Overwrites the wrapped key in the storage file, if the raw stream is backed by a file and the bytes at the
+// calculated position are the old wrapped key. Returns 1 if the key has been replaced, 0 if the storage does not
+// allow it and -1 on errors.
+static int doveadm_scrambler_rekey_in_place(
+    struct doveadm_scrambler_rekey_cmd_context *ctx,
+    struct istream *raw_input,
+    size_t offset,
+    const unsigned char *old_wrapped_key,
+    const unsigned char *new_wrapped_key,
+    size_t wrapped_key_size
+) {
+    const char *path = i_stream_get_name(raw_input);
+    unsigned char buffer[wrapped_key_size];
+    off_t file_offset;
+    int result;
+
+    if (i_stream_get_fd(raw_input) == -1 || path[0] != '/')
+        return 0;
+
+#ifndef F_OFD_SETLK
+    if (strncmp(strrchr(path, '/') + 1, MDBOX_FILE_PREFIX, strlen(MDBOX_FILE_PREFIX)) == 0)
+        return 0;
+#endif
+
+    if (ctx->file_path == NULL || strcmp(ctx->file_path, path) != 0) {
+        if (doveadm_scrambler_rekey_close_file(ctx) < 0)
+            return -1;
+        result = doveadm_scrambler_rekey_open_file(ctx, raw_input, path);
+        if (result <= 0)
+            return result;
+    }
+
+    file_offset = raw_input->real_stream->abs_start_offset + offset;
+    if (pread(ctx->file_fd, buffer, wrapped_key_size, file_offset) != (ssize_t)wrapped_key_size ||
+        memcmp(buffer, old_wrapped_key, wrapped_key_size) != 0)
+        return 0;
+
+    if (pwrite(ctx->file_fd, new_wrapped_key, wrapped_key_size, file_offset) != (ssize_t)wrapped_key_size) {
+        i_error("pwrite(%s) failed: %m", path);
+        return -1;
+    }
+    return 1;
+}
+
+// Saves the mail again with the new public key. With a new header, the stored chunks are copied behind it as they are,
+// see scrambler_ostream_set_stored(). The storage still reads the plain text of the mail for its index, but nothing is
+// encrypted. Without one, which is only needed for a switch to another key type, the mail is encrypted again.
+static int doveadm_scrambler_rekey_save_mail(
+    struct doveadm_scrambler_rekey_cmd_context *ctx,
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail,
+    struct istream *input,
+    const unsigned char *header, size_t header_size,
+    struct istream *chunks
+) {
+    EVP_PKEY *public_key = ctx->suser->public_key;
+    int result;
+
+    i_stream_seek(input, 0);
+
+    ctx->suser->public_key = ctx->public_key;
+    ctx->suser->rewrap_header = header;
+    ctx->suser->rewrap_header_size = header_size;
+    ctx->suser->rewrap_chunks = chunks;
+    result = doveadm_scrambler_save_mail(transaction, mail, input);
+    ctx->suser->public_key = public_key;
+    ctx->suser->rewrap_header = NULL;
+    ctx->suser->rewrap_header_size = 0;
+    ctx->suser->rewrap_chunks = NULL;
+
+    if (result == 0)
+        ctx->ctx.byte_count += input->v_offset;
+    return result;
+}
+
+// Saves the mail again with the header for the new wrapped key in front of the stored chunks. data holds the stored
+// header, which has been read from the raw stream. Returns 0 if the mail has been saved and -1 on errors.
+static int doveadm_scrambler_rekey_rewrap_mail(
+    struct doveadm_scrambler_rekey_cmd_context *ctx,
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail,
+    struct istream *input,
+    struct istream *raw_input,
+    const unsigned char *data,
+    const struct scrambler_package *package,
+    EVP_PKEY *private_key,
+    const struct scrambler_package *new_package,
+    const unsigned char *new_wrapped_key
+) {
+    size_t header_size = scrambler_package_header_size(package, private_key);
+    size_t new_header_size = MAGIC_SIZE + scrambler_package_header_size(new_package, ctx->public_key);
+    unsigned char new_header[new_header_size];
+    struct istream *chunks;
+    int result;
+
+    memcpy(new_header, scrambler_header, sizeof(scrambler_header));
+    new_header[sizeof(scrambler_header)] = new_package->id;
+    scrambler_package_rewrap_header(package, data + MAGIC_SIZE, package->wrapped_key_size(private_key), new_package,
+        new_wrapped_key, new_package->wrapped_key_size(ctx->public_key), new_header + MAGIC_SIZE);
+
+    // a stream of its own, the save reads the mail through the raw stream as well
+    i_stream_seek(raw_input, MAGIC_SIZE + header_size);
+    chunks = i_stream_create_limit(raw_input, (uoff_t)-1);
+    result = doveadm_scrambler_rekey_save_mail(ctx, transaction, mail, input, new_header, new_header_size, chunks);
+    i_stream_unref(&chunks);
+    return result;
+}
+
+// Unwraps the message key of the header in data with the private key. A key of the same type unwraps any header, so
+// the key is confirmed with the tag of the first chunk, before the mail is written for the new key. Returns FALSE, if
+// the mail is not wrapped for the key.
+static bool doveadm_scrambler_rekey_unwrap_key(
+    const struct scrambler_package *package,
+    const unsigned char *data,
+    size_t size,
+    EVP_PKEY *private_key,
+    unsigned char *key,
+    size_t *key_size_r
+) {
+    size_t wrapped_key_offset = scrambler_package_wrapped_key_offset(package);
+    size_t wrapped_key_size, header_size;
+    const char *error;
+
+    if (!scrambler_package_accepts_key(package, private_key))
+        return FALSE;
+
+    wrapped_key_size = package->wrapped_key_size(private_key);
+    header_size = scrambler_package_header_size(package, private_key);
+    if (size < MAGIC_SIZE + header_size)
+        return FALSE;
+    if (package->key_size_field_size > 0 &&
+        scrambler_package_recorded_key_size(package, data + MAGIC_SIZE) != wrapped_key_size)
+        return FALSE;
+
+    *key_size_r = EVP_MAX_KEY_LENGTH;
+    if (package->unwrap_key(key, key_size_r, data + wrapped_key_offset, wrapped_key_size, private_key) < 0 ||
+        *key_size_r != (size_t)EVP_CIPHER_key_length(package->cipher()) ||
+        scrambler_package_confirm_key(package, data + MAGIC_SIZE, private_key, key, *key_size_r,
+            data + MAGIC_SIZE + header_size, size - MAGIC_SIZE - header_size, &error) < 0) {
+        ERR_clear_error();
+        safe_memset(key, 0, EVP_MAX_KEY_LENGTH);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int doveadm_scrambler_rekey_mail(
+    struct doveadm_scrambler_cmd_context *_ctx,
+    struct mailbox_transaction_context *transaction,
+    struct mail *mail
+) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx = (struct doveadm_scrambler_rekey_cmd_context *)_ctx;
+    struct istream *input, *raw_input;
+    const unsigned char *data;
+    const struct scrambler_package *package, *new_package;
+    EVP_PKEY *private_key, *old_private_key;
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    size_t key_size;
+    size_t old_wrapped_key_size, new_wrapped_key_size, wrapped_key_offset, header_end, header_min_end, size;
+    int result;
+
+    if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+        return -1;
+
+    result = scrambler_istream_is_encrypted(input);
+    if (result <= 0) {
+        if (result == 0)
+            ctx->skipped_count++;
+        return result;
+    }
+
+    raw_input = scrambler_istream_get_raw(input);
+    package = scrambler_package_get(i_stream_get_data(raw_input, &size)[sizeof(scrambler_header)]);
+    if (package == NULL) {
+        i_error("scrambler rekey: uid %u: unknown encryption package", mail->uid);
+        return -1;
+    }
+
+    // during a migration to another key type, the mails of the old type are unwrapped with the old private key
+    private_key = scrambler_user_get_private_key(ctx->suser, package);
+    if (private_key == NULL) {
+        i_warning("scrambler rekey: uid %u: no private key for package %02x, skipping", mail->uid, package->id);
+        ctx->skipped_count++;
+        return 0;
+    }
+    // after a rotation to a key of the same type, the settings may hold the new key pair already, while the mails
+    // that haven't been rekeyed yet are wrapped for the old one
+    old_private_key = ctx->suser->old_private_key;
+    if (old_private_key == private_key || !scrambler_package_accepts_key(package, old_private_key))
+        old_private_key = NULL;
+
+    wrapped_key_offset = scrambler_package_wrapped_key_offset(package);
+    header_end = header_min_end = wrapped_key_offset + package->wrapped_key_size(private_key);
+    if (old_private_key != NULL) {
+        header_end = MAX(header_end, wrapped_key_offset + package->wrapped_key_size(old_private_key));
+        header_min_end = MIN(header_min_end, wrapped_key_offset + package->wrapped_key_size(old_private_key));
+    }
+    // the header and the first chunk, which confirms the unwrapped key
+    i_stream_set_max_buffer_size(raw_input,
+        MAX(i_stream_get_max_buffer_size(raw_input), header_end + ENCRYPTED_CHUNK_SIZE));
+    if (i_stream_read_data(raw_input, &data, &size, header_end + ENCRYPTED_CHUNK_SIZE - 1) <= 0 &&
+        size < header_min_end) {
+        i_error("scrambler rekey: uid %u: failed to read the header", mail->uid);
+        return -1;
+    }
+
+    // mails that have been saved again by an interrupted run are wrapped for the new key already
+    if (!doveadm_scrambler_rekey_unwrap_key(package, data, size, private_key, key, &key_size)) {
+        if (old_private_key == NULL ||
+            !doveadm_scrambler_rekey_unwrap_key(package, data, size, old_private_key, key, &key_size)) {
+            i_warning("scrambler rekey: uid %u: not wrapped for the current or the old private key or the first chunk "
+                "is corrupted, skipping", mail->uid);
+            ctx->skipped_count++;
+            return 0;
+        }
+        private_key = old_private_key;
+    }
+    old_wrapped_key_size = package->wrapped_key_size(private_key);
+
+    if (EVP_PKEY_eq(private_key, ctx->public_key) == 1) {
+        safe_memset(key, 0, sizeof(key));
+        ctx->skipped_count++;
+        return 0;
+    }
+
+    // compact mails stay compact, so they can be rekeyed in place as well
+    new_package = package->single_chunk ? scrambler_package_compact_for_key(ctx->public_key) :
+        scrambler_package_for_key(ctx->public_key);
+    new_wrapped_key_size = new_package->wrapped_key_size(ctx->public_key);
+    unsigned char new_wrapped_key[new_wrapped_key_size];
+    result = new_package->wrap_key(new_wrapped_key, &new_wrapped_key_size, key, key_size, ctx->public_key);
+    safe_memset(key, 0, sizeof(key));
+    if (result < 0) {
+        i_error_openssl("doveadm_scrambler_rekey_mail");
+        return -1;
+    }
+
+    // a switch to another key type changes the package byte and the layout of the header
+    if (new_package == package && new_wrapped_key_size == old_wrapped_key_size) {
+        result = doveadm_scrambler_rekey_in_place(ctx, raw_input, wrapped_key_offset,
+            data + wrapped_key_offset, new_wrapped_key, new_wrapped_key_size);
+        if (result < 0)
+            return -1;
+        if (result > 0) {
+            ctx->in_place_count++;
+            ctx->ctx.mail_count++;
+            ctx->ctx.byte_count += new_wrapped_key_size;
+            return 1;
+        }
+    }
+
+    if (scrambler_package_chunks_compatible(package, new_package))
+        result = doveadm_scrambler_rekey_rewrap_mail(ctx, transaction, mail, input, raw_input, data, package,
+            private_key, new_package, new_wrapped_key);
+    else
+        result = doveadm_scrambler_rekey_save_mail(ctx, transaction, mail, input, NULL, 0, NULL);
+    if (result < 0)
+        return -1;
+
+    ctx->saved_count++;
+    ctx->ctx.mail_count++;
+    return 1;
+}
+
+static int doveadm_scrambler_rekey_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx = (struct doveadm_scrambler_rekey_cmd_context *)_ctx;
+    unsigned int start_in_place_count = ctx->in_place_count;
+    unsigned int start_saved_count = ctx->saved_count;
+    unsigned int start_skipped_count = ctx->skipped_count;
+    int result;
+
+    ctx->suser = scrambler_user_get(user);
+    if (ctx->suser == NULL || !ctx->suser->enabled || scrambler_user_unlock(ctx->suser) == NULL) {
+        i_error("scrambler rekey: the private key of user %s is not available", user->username);
+        doveadm_mail_failed_error(_ctx, MAIL_ERROR_PERM);
+        return -1;
+    }
+
+    result = doveadm_scrambler_cmd_run_mailboxes(&ctx->ctx, user);
+    if (doveadm_scrambler_rekey_close_file(ctx) < 0)
+        result = -1;
+    ctx->suser = NULL;
+
+    doveadm_print(user->username);
+    doveadm_print_num(ctx->in_place_count - start_in_place_count);
+    doveadm_print_num(ctx->saved_count - start_saved_count);
+    doveadm_print_num(ctx->skipped_count - start_skipped_count);
+
+    doveadm_scrambler_cmd_report(&ctx->ctx, TRUE);
+    return result;
+}
+
+static bool doveadm_scrambler_rekey_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx = (struct doveadm_scrambler_rekey_cmd_context *)_ctx;
+
+    switch (c) {
+    case 'k':
+        ctx->public_key_path = optarg;
+        break;
+    default:
+        return doveadm_scrambler_cmd_parse_arg(&ctx->ctx, c);
+    }
+    return TRUE;
+}
+
+static void doveadm_scrambler_rekey_init(struct doveadm_mail_cmd_context *_ctx, const char *const args[]) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx = (struct doveadm_scrambler_rekey_cmd_context *)_ctx;
+
+    if (ctx->public_key_path == NULL)
+        doveadm_mail_help_name("scrambler rekey");
+
+    ctx->public_key = scrambler_pem_read_public_key(doveadm_scrambler_rekey_read_file(ctx->public_key_path));
+    if (ctx->public_key == NULL)
+        i_fatal("scrambler rekey: failed to read the public key from %s", ctx->public_key_path);
+    ctx->ctx.progress_tag = p_strdup(_ctx->pool, doveadm_scrambler_rekey_fingerprint(ctx->public_key));
+
+    doveadm_scrambler_cmd_init(&ctx->ctx, args);
+
+    doveadm_print_header_simple("username");
+    doveadm_print_header_simple("in place");
+    doveadm_print_header_simple("saved");
+    doveadm_print_header_simple("skipped");
+}
+
+static void doveadm_scrambler_rekey_deinit(struct doveadm_mail_cmd_context *_ctx) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx = (struct doveadm_scrambler_rekey_cmd_context *)_ctx;
+
+    if (ctx->public_key != NULL)
+        EVP_PKEY_free(ctx->public_key);
+}
+
+static struct doveadm_mail_cmd_context *doveadm_scrambler_rekey_alloc(void) {
+    struct doveadm_scrambler_rekey_cmd_context *ctx;
+
+    ctx = doveadm_scrambler_cmd_alloc(struct doveadm_scrambler_rekey_cmd_context, "rekey", PROGRESS_FILE_NAME,
+        doveadm_scrambler_rekey_mail);
+    ctx->ctx.finish_batch = doveadm_scrambler_rekey_finish_batch;
+    ctx->file_fd = -1;
+    ctx->ctx.ctx.getopt_args = "b:k:t:";
+    ctx->ctx.ctx.v.parse_arg = doveadm_scrambler_rekey_parse_arg;
+    ctx->ctx.ctx.v.init = doveadm_scrambler_rekey_init;
+    ctx->ctx.ctx.v.deinit = doveadm_scrambler_rekey_deinit;
+    ctx->ctx.ctx.v.run = doveadm_scrambler_rekey_run;
+    doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+    return &ctx->ctx.ctx;
+}
+
+// Constants
+
+struct doveadm_mail_cmd doveadm_scrambler_cmd_rekey = {
+    doveadm_scrambler_rekey_alloc, "scrambler rekey",
+    "-k <public key file> [-b <batch size>] [-t <bytes/s>] [<search query>]"
+};
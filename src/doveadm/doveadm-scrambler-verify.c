@@ -0,0 +1,262 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dovecot/lib.h"
+#include "dovecot/buffer.h"
+#include "dovecot/istream.h"
+#include "dovecot/mail-storage.h"
+#include "dovecot/doveadm-mail.h"
+#include "dovecot/doveadm-print.h"
+#include <sysexits.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-plugin.h"
+#include "scrambler-istream.h"
+#include "scrambler-verify.h"
+#include "scrambler-workers.h"
+
+#include "doveadm-scrambler-common.h"
+#include "doveadm-scrambler-verify.h"
+
+// Defines
+
+#define QUEUED_JOBS_PER_WORKER (4)
+// The mails are read as a whole, so the queue is bound by their size as well. A larger mail is still queued alone.
+#define MAX_QUEUED_BYTES (64 * 1024 * 1024)
+
+// Structs
+
+struct doveadm_scrambler_verify_cmd_context {
+    struct doveadm_scrambler_cmd_context ctx;
+
+    unsigned int worker_count;
+    struct scrambler_workers *workers;
+
+    struct mail_user *user;
+    struct scrambler_user *suser;
+
+    uoff_t queued_bytes;
+
+    unsigned int verified_count;
+    unsigned int failed_count;
+    unsigned int skipped_count;
+};
+
+struct doveadm_scrambler_verify_job {
+    struct doveadm_scrambler_verify_cmd_context *ctx;
+
+    char *username;
+    char *mailbox;
+    uint32_t uid;
+
+    buffer_t *data;
+    EVP_PKEY *private_key;
+    EVP_PKEY *old_private_key;
+
+    int result;
+    const char *error;
+    unsigned int chunk_index;
+};
+
+// Functions
+
+static void doveadm_scrambler_verify_job_run(void *context) {
+    struct doveadm_scrambler_verify_job *job = context;
+
+    job->result = scrambler_verify(job->data->data, job->data->used, job->private_key, job->old_private_key,
+        &job->error, &job->chunk_index);
+}
+
+static void doveadm_scrambler_verify_job_finish(void *context) {
+    struct doveadm_scrambler_verify_job *job = context;
+    struct doveadm_scrambler_verify_cmd_context *ctx = job->ctx;
+
+    if (job->result < 0) {
+        i_error("scrambler verify: %s: uid %u: %s (chunk %u)", job->mailbox, job->uid, job->error, job->chunk_index);
+
+        doveadm_print(job->username);
+        doveadm_print(job->mailbox);
+        doveadm_print_num(job->uid);
+        doveadm_print(t_strdup_printf("%s (chunk %u)", job->error, job->chunk_index));
+
+        ctx->failed_count++;
+        if (ctx->ctx.ctx.exit_code == 0)
+            ctx->ctx.ctx.exit_code = EX_DATAERR;
+    } else {
+        ctx->verified_count++;
+    }
+
+    ctx->queued_bytes -= job->data->used;
+    buffer_free(&job->data);
+    i_free(job->username);
+    i_free(job->mailbox);
+    i_free(job);
+}
+
+// Reads the stored mail in the main thread and hands it over to a worker, as the streams can't be used from other
+// threads.
+static int doveadm_scrambler_verify_mail(
+    struct doveadm_scrambler_cmd_context *_ctx,
+    struct mailbox_transaction_context *transaction ATTR_UNUSED,
+    struct mail *mail
+) {
+    struct doveadm_scrambler_verify_cmd_context *ctx = (struct doveadm_scrambler_verify_cmd_context *)_ctx;
+    struct doveadm_scrambler_verify_job *job;
+    struct istream *input, *raw_input;
+    const unsigned char *data;
+    uoff_t stream_size;
+    size_t size;
+    ssize_t result;
+
+    if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+        return -1;
+
+    result = scrambler_istream_is_encrypted(input);
+    if (result <= 0) {
+        if (result == 0)
+            ctx->skipped_count++;
+        return result;
+    }
+
+    raw_input = scrambler_istream_get_raw(input);
+    if (i_stream_get_size(raw_input, TRUE, &stream_size) <= 0)
+        stream_size = 2 * ENCRYPTED_CHUNK_SIZE;
+
+    while (ctx->queued_bytes > 0 && ctx->queued_bytes + stream_size > MAX_QUEUED_BYTES)
+        scrambler_workers_wait_any(ctx->workers);
+
+    job = i_new(struct doveadm_scrambler_verify_job, 1);
+    job->ctx = ctx;
+    job->username = i_strdup(ctx->user->username);
+    job->mailbox = i_strdup(mailbox_get_vname(mail->box));
+    job->uid = mail->uid;
+    job->data = buffer_create_dynamic(default_pool, stream_size);
+
+    while ((result = i_stream_read_data(raw_input, &data, &size, 0)) > 0) {
+        buffer_append(job->data, data, size);
+        i_stream_skip(raw_input, size);
+    }
+
+    if (raw_input->stream_errno != 0) {
+        i_error("read(%s) failed: %s", i_stream_get_name(raw_input), strerror(raw_input->stream_errno));
+        buffer_free(&job->data);
+        i_free(job->username);
+        i_free(job->mailbox);
+        i_free(job);
+        return -1;
+    }
+
+    // the mails still wrapped for the old key are confirmed by scrambler_verify(), like the rekey does
+    job->private_key = ctx->suser->private_key;
+    job->old_private_key = ctx->suser->old_private_key;
+
+    ctx->queued_bytes += job->data->used;
+    ctx->ctx.mail_count++;
+    ctx->ctx.byte_count += job->data->used;
+
+    scrambler_workers_submit(ctx->workers, doveadm_scrambler_verify_job_run, doveadm_scrambler_verify_job_finish, job);
+    return 1;
+}
+
+static int doveadm_scrambler_verify_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user) {
+    struct doveadm_scrambler_verify_cmd_context *ctx = (struct doveadm_scrambler_verify_cmd_context *)_ctx;
+    unsigned int start_verified_count = ctx->verified_count;
+    unsigned int start_failed_count = ctx->failed_count;
+    unsigned int start_skipped_count = ctx->skipped_count;
+    int result;
+
+    ctx->user = user;
+    ctx->suser = scrambler_user_get(user);
+    if (ctx->suser == NULL || !ctx->suser->enabled || scrambler_user_unlock(ctx->suser) == NULL) {
+        i_error("scrambler verify: the private key of user %s is not available", user->username);
+        doveadm_mail_failed_error(_ctx, MAIL_ERROR_PERM);
+        return -1;
+    }
+
+    result = doveadm_scrambler_cmd_run_mailboxes(&ctx->ctx, user);
+
+    // the jobs use the private key of the user, which is freed with the user
+    scrambler_workers_wait(ctx->workers);
+    ctx->user = NULL;
+    ctx->suser = NULL;
+
+    i_info("scrambler verify: %s: %u mails verified, %u failed, %u plain", user->username,
+        ctx->verified_count - start_verified_count, ctx->failed_count - start_failed_count,
+        ctx->skipped_count - start_skipped_count);
+
+    doveadm_scrambler_cmd_report(&ctx->ctx, TRUE);
+    return result;
+}
+
+static bool doveadm_scrambler_verify_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c) {
+    struct doveadm_scrambler_verify_cmd_context *ctx = (struct doveadm_scrambler_verify_cmd_context *)_ctx;
+
+    switch (c) {
+    case 'j':
+        if (str_to_uint(optarg, &ctx->worker_count) < 0)
+            i_fatal("invalid worker count: %s", optarg);
+        break;
+    default:
+        return doveadm_scrambler_cmd_parse_arg(&ctx->ctx, c);
+    }
+    return TRUE;
+}
+
+static void doveadm_scrambler_verify_init(struct doveadm_mail_cmd_context *_ctx, const char *const args[]) {
+    struct doveadm_scrambler_verify_cmd_context *ctx = (struct doveadm_scrambler_verify_cmd_context *)_ctx;
+
+    doveadm_scrambler_cmd_init(&ctx->ctx, args);
+
+    ctx->workers = scrambler_workers_create(ctx->worker_count, ctx->worker_count * QUEUED_JOBS_PER_WORKER);
+
+    doveadm_print_header_simple("username");
+    doveadm_print_header_simple("mailbox");
+    doveadm_print_header_simple("uid");
+    doveadm_print_header_simple("error");
+}
+
+static void doveadm_scrambler_verify_deinit(struct doveadm_mail_cmd_context *_ctx) {
+    struct doveadm_scrambler_verify_cmd_context *ctx = (struct doveadm_scrambler_verify_cmd_context *)_ctx;
+
+    if (ctx->workers != NULL)
+        scrambler_workers_destroy(&ctx->workers);
+}
+
+static struct doveadm_mail_cmd_context *doveadm_scrambler_verify_alloc(void) {
+    struct doveadm_scrambler_verify_cmd_context *ctx;
+
+    ctx = doveadm_scrambler_cmd_alloc(struct doveadm_scrambler_verify_cmd_context, "verify", NULL,
+        doveadm_scrambler_verify_mail);
+    ctx->worker_count = scrambler_workers_default_count();
+    ctx->ctx.ctx.getopt_args = "b:j:t:";
+    ctx->ctx.ctx.v.parse_arg = doveadm_scrambler_verify_parse_arg;
+    ctx->ctx.ctx.v.init = doveadm_scrambler_verify_init;
+    ctx->ctx.ctx.v.deinit = doveadm_scrambler_verify_deinit;
+    ctx->ctx.ctx.v.run = doveadm_scrambler_verify_run;
+    doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+    return &ctx->ctx.ctx;
+}
+
+// Constants
+
+struct doveadm_mail_cmd doveadm_scrambler_cmd_verify = {
+    doveadm_scrambler_verify_alloc, "scrambler verify", "[-j <workers>] [-t <bytes/s>] [<search query>]"
+};
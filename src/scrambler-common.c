@@ -26,25 +26,198 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/objects.h>
 #include <openssl/pem.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/params.h>
+#endif
 #include <xcrypt.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "scrambler-common.h"
+#include "scrambler-package.h"
 
 // Constants
 
 const char scrambler_header[] = { 0xee, 0xff, 0xcc };
 
+// Statics
+
+#ifdef HAVE_OPENSSL_3
+// fetched once and kept for the lifetime of the process
+static EVP_CIPHER *scrambler_aes_128_ctr_cipher = NULL;
+static EVP_CIPHER *scrambler_aes_128_gcm_cipher = NULL;
+static EVP_MD *scrambler_sha256_digest = NULL;
+static EVP_MAC *scrambler_hmac_mac = NULL;
+static EVP_KDF *scrambler_hkdf_kdf = NULL;
+#endif
+
 // Functions
 
+#ifdef HAVE_OPENSSL_3
+static void scrambler_fetch_algorithms(void) {
+    if (scrambler_aes_128_ctr_cipher != NULL)
+        return;
+
+    scrambler_aes_128_ctr_cipher = EVP_CIPHER_fetch(NULL, "AES-128-CTR", NULL);
+    scrambler_aes_128_gcm_cipher = EVP_CIPHER_fetch(NULL, "AES-128-GCM", NULL);
+    scrambler_sha256_digest = EVP_MD_fetch(NULL, "SHA256", NULL);
+    scrambler_hmac_mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    scrambler_hkdf_kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+
+    if (scrambler_aes_128_ctr_cipher == NULL || scrambler_aes_128_gcm_cipher == NULL ||
+        scrambler_sha256_digest == NULL || scrambler_hmac_mac == NULL || scrambler_hkdf_kdf == NULL) {
+        i_error_openssl("scrambler_initialize");
+        i_fatal("scrambler_initialize: fetching the algorithms failed");
+    }
+}
+#endif
+
 void scrambler_initialize(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
     OpenSSL_add_all_algorithms();
     ERR_load_crypto_strings();
+#endif
+#ifdef HAVE_OPENSSL_3
+    scrambler_fetch_algorithms();
+#endif
     i_info("scrambler plugin initialized");
 }
 
+#ifdef HAVE_OPENSSL_3
+const EVP_CIPHER *scrambler_aes_128_ctr(void) {
+    return scrambler_aes_128_ctr_cipher;
+}
+
+const EVP_CIPHER *scrambler_aes_128_gcm(void) {
+    return scrambler_aes_128_gcm_cipher;
+}
+
+const EVP_MD *scrambler_sha256(void) {
+    return scrambler_sha256_digest;
+}
+
+EVP_MAC *scrambler_hmac(void) {
+    return scrambler_hmac_mac;
+}
+
+EVP_KDF *scrambler_hkdf(void) {
+    return scrambler_hkdf_kdf;
+}
+
+scrambler_mac_context_t *scrambler_mac_context_new(void) {
+    return EVP_MAC_CTX_new(scrambler_hmac_mac);
+}
+
+int scrambler_mac_context_reset(scrambler_mac_context_t *context) {
+    static const unsigned char zero_key[MAC_KEY_SIZE];
+
+    // EVP_MAC has no reset, so the key is overwritten
+    return scrambler_mac_init(context, zero_key, sizeof(zero_key), scrambler_sha256_digest);
+}
+
+void scrambler_mac_context_free(scrambler_mac_context_t *context) {
+    EVP_MAC_CTX_free(context);
+}
+
+int scrambler_mac_init(
+    scrambler_mac_context_t *context,
+    const unsigned char *key, size_t key_size,
+    const EVP_MD *digest
+) {
+    OSSL_PARAM parameters[2];
+
+    if (key == NULL)
+        return EVP_MAC_init(context, NULL, 0, NULL) == 1 ? 0 : -1;
+
+    parameters[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)EVP_MD_get0_name(digest), 0);
+    parameters[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init(context, key, key_size, parameters) == 1 ? 0 : -1;
+}
+
+int scrambler_mac_update(scrambler_mac_context_t *context, const unsigned char *data, size_t size) {
+    return EVP_MAC_update(context, data, size) == 1 ? 0 : -1;
+}
+
+int scrambler_mac_final(scrambler_mac_context_t *context, unsigned char *tag, size_t tag_size) {
+    size_t final_size;
+
+    if (EVP_MAC_final(context, tag, &final_size, tag_size) != 1 || final_size != tag_size)
+        return -1;
+    return 0;
+}
+#else
+const EVP_CIPHER *scrambler_aes_128_ctr(void) {
+    return EVP_aes_128_ctr();
+}
+
+const EVP_CIPHER *scrambler_aes_128_gcm(void) {
+    return EVP_aes_128_gcm();
+}
+
+const EVP_MD *scrambler_sha256(void) {
+    return EVP_sha256();
+}
+
+scrambler_mac_context_t *scrambler_mac_context_new(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // not allocated with i_new(), as worker threads must not call into dovecot
+    HMAC_CTX *context = malloc(sizeof(HMAC_CTX));
+
+    if (context != NULL)
+        HMAC_CTX_init(context);
+    return context;
+#else
+    return HMAC_CTX_new();
+#endif
+}
+
+int scrambler_mac_context_reset(scrambler_mac_context_t *context) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    HMAC_CTX_cleanup(context);
+    HMAC_CTX_init(context);
+    return 0;
+#else
+    return HMAC_CTX_reset(context) == 1 ? 0 : -1;
+#endif
+}
+
+void scrambler_mac_context_free(scrambler_mac_context_t *context) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    HMAC_CTX_cleanup(context);
+    free(context);
+#else
+    HMAC_CTX_free(context);
+#endif
+}
+
+int scrambler_mac_init(
+    scrambler_mac_context_t *context,
+    const unsigned char *key, size_t key_size,
+    const EVP_MD *digest
+) {
+    if (key == NULL)
+        return HMAC_Init_ex(context, NULL, 0, NULL, NULL) == 1 ? 0 : -1;
+    return HMAC_Init_ex(context, key, key_size, digest, NULL) == 1 ? 0 : -1;
+}
+
+int scrambler_mac_update(scrambler_mac_context_t *context, const unsigned char *data, size_t size) {
+    return HMAC_Update(context, data, size) == 1 ? 0 : -1;
+}
+
+int scrambler_mac_final(scrambler_mac_context_t *context, unsigned char *tag, size_t tag_size) {
+    unsigned int final_size;
+
+    if (HMAC_Final(context, tag, &final_size) != 1 || final_size != tag_size)
+        return -1;
+    return 0;
+}
+#endif
+
 const char *scrambler_read_line_fd(pool_t pool, int fd) {
     string_t *buffer = str_new(pool, MAXIMAL_PASSWORD_LENGTH);
     char *result = str_c_modifiable(buffer);
@@ -72,61 +245,35 @@ const char *scrambler_read_line_fd(pool_t pool, int fd) {
     return result;
 }
 
-const char *scrambler_hash_password(
-    const char *password,
-    const char *salt,
-    unsigned int iterations
-) {
+int scrambler_hash_settings(char *settings, const char *salt, unsigned int iterations) {
     size_t salt_size = strlen(salt);
-    char settings[30];
 
     if (iterations < 4 || iterations > 31) {
         i_error("scrambler_hash_password: iterations must be between 4 and 31 (inclusive), current value is %u",
                 iterations);
-        return NULL;
+        return -1;
     }
 
     if (salt_size != 22) {
         i_error("scrambler_hash_password: salt must have a size of 22, current size is %u", (unsigned int)salt_size);
-        return NULL;
+        return -1;
     }
 
     sprintf(settings, "$2a$%02u$%22s", iterations, salt);
-
-    return crypt(password, settings);
-}
-
-const EVP_CIPHER *scrambler_cipher(enum packages package) {
-    switch (package) {
-    case PACKAGE_RSA_2048_AES_128_CTR_HMAC:
-        return EVP_aes_128_ctr();
-    }
-    return NULL;
+    return 0;
 }
 
-void scrambler_generate_mac(
-    unsigned char *tag, unsigned int *tag_size,
-    const unsigned char *sources[], size_t source_sizes[],
-    const unsigned char *key, size_t key_size
+const char *scrambler_hash_password(
+    const char *password,
+    const char *salt,
+    unsigned int iterations
 ) {
-    HMAC_CTX context;
-    HMAC_CTX_init(&context);
-    HMAC_Init_ex(&context, key, key_size, EVP_sha256(), NULL);
-
-    unsigned int index = 0;
-    const unsigned char *source = sources[index];
-    size_t source_size = source_sizes[index];
-    while (source != NULL) {
-        HMAC_Update(&context, source, source_size);
-
-        index++;
-        source = sources[index];
-        source_size = source_sizes[index];
-    }
+    char settings[HASH_SETTINGS_SIZE];
 
-    HMAC_Final(&context, tag, tag_size);
+    if (scrambler_hash_settings(settings, salt, iterations) < 0)
+        return NULL;
 
-    HMAC_CTX_cleanup(&context);
+    return crypt(password, settings);
 }
 
 void scrambler_unescape_pem(char *pem) {
@@ -138,6 +285,16 @@ void scrambler_unescape_pem(char *pem) {
     }
 }
 
+// PEM files can hold any key type OpenSSL knows, but only the ones with a package can be used.
+static EVP_PKEY *scrambler_pem_check_key_type(EVP_PKEY *key, const char *function_name) {
+    if (key == NULL || scrambler_package_for_key(key) != NULL)
+        return key;
+
+    i_error("%s: unsupported key type %s", function_name, OBJ_nid2sn(EVP_PKEY_base_id(key)));
+    EVP_PKEY_free(key);
+    return NULL;
+}
+
 EVP_PKEY *scrambler_pem_read_public_key(const char *source) {
     BIO *public_key_pem_bio = BIO_new_mem_buf((char *)source, -1);
     EVP_PKEY *result = PEM_read_bio_PUBKEY(public_key_pem_bio, NULL, NULL, NULL);
@@ -145,7 +302,7 @@ EVP_PKEY *scrambler_pem_read_public_key(const char *source) {
 
     if (result == NULL)
         i_error_openssl("scrambler_pem_read_public_key");
-    return result;
+    return scrambler_pem_check_key_type(result, "scrambler_pem_read_public_key");
 }
 
 EVP_PKEY *scrambler_pem_read_encrypted_private_key(const char *source, const char *password) {
@@ -155,7 +312,7 @@ EVP_PKEY *scrambler_pem_read_encrypted_private_key(const char *source, const cha
 
     if (result == NULL)
         i_error_openssl("scrambler_pem_read_encrypted_private_key");
-    return result;
+    return scrambler_pem_check_key_type(result, "scrambler_pem_read_encrypted_private_key");
 }
 
 void i_error_openssl(const char *function_name) {
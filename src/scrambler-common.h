@@ -22,16 +22,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SCRAMBLER_COMMON_H
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 // Defines
 
 #define MAGIC_SIZE (sizeof(scrambler_header) + 1)
-#define ENCRYPTED_HEADER_SIZE (304)
 #define CHUNK_SIZE (8192)
 #define CHUNK_TAG_SIZE (32)
 #define ENCRYPTED_CHUNK_SIZE ((int)sizeof(unsigned short) + CHUNK_SIZE + CHUNK_TAG_SIZE)
+#define GCM_TAG_SIZE (16)
 #define MAC_KEY_SIZE (32)
 #define MAXIMAL_PASSWORD_LENGTH (256)
+#define HASH_SETTINGS_SIZE (30)
+#define X25519_KEY_SIZE (32)
+#define KEY_SIZE_FIELD_SIZE (2)
+#define MINIMAL_RSA_KEY_SIZE (128)
+#define MAXIMAL_RSA_KEY_SIZE (1024)
+// Decrypted mails and attachments larger than this are spilled to an encrypted temporary file, once they are read
+// again.
+#define MAIL_MAX_MEMORY_BUFFER (1024*128)
+
+// X25519 needs the raw key functions, which have been added in OpenSSL 1.1.1
+#if defined(EVP_PKEY_X25519) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_X25519
+#endif
+
+// OpenSSL 3 fetches the implementation of an algorithm on every use of the EVP_aes_128_ctr() style getters and has
+// deprecated the HMAC functions, the algorithms are fetched once and the mac goes through EVP_MAC
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define HAVE_OPENSSL_3
+#else
+#define EVP_PKEY_eq EVP_PKEY_cmp
+#endif
 
 #define ASSERT_SUCCESS(command, expected_result, function_name, error_text, error_result) \
     if ((expected_result) != (command)) { \
@@ -56,10 +78,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+// Structs
+
+#ifdef HAVE_OPENSSL_3
+typedef EVP_MAC_CTX scrambler_mac_context_t;
+#else
+typedef HMAC_CTX scrambler_mac_context_t;
+#endif
+
 // Enums
 
 enum packages {
-    PACKAGE_RSA_2048_AES_128_CTR_HMAC = 0x00
+    // the size of the wrapped key is the one of the private key, written for 2048 bit keys only to stay readable by
+    // older versions
+    PACKAGE_RSA_2048_AES_128_CTR_HMAC = 0x00,
+    // the content key is wrapped with an ephemeral X25519 key agreement and the mac key is derived from it
+    PACKAGE_X25519_AES_128_CTR_HMAC = 0x01,
+    // like the RSA 2048 package, but the size of the wrapped key follows the package byte (2 bytes, big endian), so
+    // any RSA key size can be used and the header can be parsed without the key
+    PACKAGE_RSA_AES_128_CTR_HMAC = 0x02,
+    // compact packages for mails that fit into a single chunk: AES-GCM with a 12 byte iv, no mac key in the header
+    // and the GCM tag instead of the HMAC. The RSA package records the size of the wrapped key like 0x02
+    PACKAGE_RSA_AES_128_GCM_SINGLE = 0x03,
+    PACKAGE_X25519_AES_128_GCM_SINGLE = 0x04
 };
 
 // Constants
@@ -69,20 +110,43 @@ const char scrambler_header[3];
 
 void scrambler_initialize(void);
 
+// Algorithms fetched by scrambler_initialize().
+const EVP_CIPHER *scrambler_aes_128_ctr(void);
+const EVP_CIPHER *scrambler_aes_128_gcm(void);
+const EVP_MD *scrambler_sha256(void);
+#ifdef HAVE_OPENSSL_3
+EVP_MAC *scrambler_hmac(void);
+EVP_KDF *scrambler_hkdf(void);
+#endif
+
+// Mac contexts don't log, so they can be used from worker threads. scrambler_mac_context_reset() wipes the key.
+scrambler_mac_context_t *scrambler_mac_context_new(void);
+int scrambler_mac_context_reset(scrambler_mac_context_t *context);
+void scrambler_mac_context_free(scrambler_mac_context_t *context);
+
+// Without key, the context is initialized again with the key and digest of the previous call, which skips the key
+// setup.
+int scrambler_mac_init(
+    scrambler_mac_context_t *context,
+    const unsigned char *key, size_t key_size,
+    const EVP_MD *digest);
+
+int scrambler_mac_update(scrambler_mac_context_t *context, const unsigned char *data, size_t size);
+
+// Fails if the tag doesn't have the given size.
+int scrambler_mac_final(scrambler_mac_context_t *context, unsigned char *tag, size_t tag_size);
+
 const char *scrambler_read_line_fd(pool_t pool, int file_descriptor);
 
+// Writes the bcrypt settings for salt and iterations, HASH_SETTINGS_SIZE bytes, to settings. Logs and returns -1, if
+// they are invalid.
+int scrambler_hash_settings(char *settings, const char *salt, unsigned int iterations);
+
 const char *scrambler_hash_password(
     const char *password,
     const char *salt,
     unsigned int iterations);
 
-const EVP_CIPHER *scrambler_cipher(enum packages package);
-
-void scrambler_generate_mac(
-  unsigned char *tag, unsigned int *tag_size,
-  const unsigned char *sources[], size_t source_sizes[],
-  const unsigned char *key, size_t key_size);
-
 void scrambler_unescape_pem(char *source);
 
 EVP_PKEY *scrambler_pem_read_public_key(const char *source);
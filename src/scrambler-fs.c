@@ -0,0 +1,562 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <dovecot/buffer.h>
+#include <dovecot/istream.h>
+#include <dovecot/ostream.h>
+#include <dovecot/iostream-temp.h>
+#include <dovecot/fs-api-private.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "scrambler-common.h"
+#include "scrambler-istream.h"
+#include "scrambler-ostream.h"
+#include "scrambler-plugin.h"
+#include "scrambler-fs.h"
+
+// Defines
+
+// The content key of an attachment, wrapped for the user, is stored next to it in a file with this suffix.
+#define KEY_FILE_SUFFIX ".scrambler-key"
+// Magic, package and the largest header of a package.
+#define KEY_FILE_MAX_SIZE (MAGIC_SIZE + KEY_SIZE_FIELD_SIZE + EVP_MAX_IV_LENGTH + MAXIMAL_RSA_KEY_SIZE + MAC_KEY_SIZE)
+
+// Structs
+
+struct scrambler_fs {
+    struct fs fs;
+    // the wrapped driver, e.g. sis
+    struct fs *super;
+    // the key files bypass the wrapped driver, sis would take them for attachments otherwise
+    struct fs *key_fs;
+    // NULL, if the plugin isn't loaded for the user, then the attachments are passed through. The storages and their
+    // attachment fs are destroyed before the user
+    struct scrambler_user *suser;
+};
+
+struct scrambler_fs_file {
+    struct fs_file file;
+    struct scrambler_fs *fs;
+    struct fs_file *super;
+
+    // the plain text, until the write is finished and the content key can be derived from it
+    struct ostream *temp_output;
+    struct ostream *super_output;
+};
+
+struct scrambler_fs_iter {
+    struct fs_iter iter;
+    struct fs_iter *super;
+};
+
+// Functions
+
+static bool scrambler_fs_encrypts(const struct scrambler_fs *sfs) {
+    return sfs->suser != NULL && sfs->suser->enabled && sfs->suser->public_key != NULL &&
+        scrambler_package_for_key(sfs->suser->public_key) != NULL;
+}
+
+static const char *scrambler_fs_key_path(struct scrambler_fs_file *file) {
+    return t_strconcat(file->file.path, KEY_FILE_SUFFIX, NULL);
+}
+
+static struct fs *scrambler_fs_alloc(void) {
+    struct scrambler_fs *sfs = i_new(struct scrambler_fs, 1);
+
+    sfs->fs = fs_class_scrambler;
+    return &sfs->fs;
+}
+
+static int scrambler_fs_init(struct fs *_fs, const char *args, const struct fs_settings *set) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+    const char *parent_name, *parent_args, *error;
+
+    if (*args == '\0') {
+        fs_set_error(_fs, "scrambler_fs_init: parent filesystem not given");
+        return -1;
+    }
+
+    parent_args = strchr(args, ':');
+    if (parent_args == NULL) {
+        parent_name = args;
+        parent_args = "";
+    } else {
+        parent_name = t_strdup_until(args, parent_args);
+        parent_args++;
+    }
+
+    if (fs_init(parent_name, parent_args, set, &sfs->super, &error) < 0) {
+        fs_set_error(_fs, "scrambler_fs_init: %s: %s", parent_name, error);
+        return -1;
+    }
+    if (fs_init("posix", "", set, &sfs->key_fs, &error) < 0) {
+        fs_set_error(_fs, "scrambler_fs_init: posix: %s", error);
+        return -1;
+    }
+
+    if (set->username != NULL)
+        sfs->suser = scrambler_user_lookup(set->username);
+    return 0;
+}
+
+static void scrambler_fs_deinit(struct fs *_fs) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+
+    if (sfs->super != NULL)
+        fs_deinit(&sfs->super);
+    if (sfs->key_fs != NULL)
+        fs_deinit(&sfs->key_fs);
+    i_free(sfs);
+}
+
+static enum fs_properties scrambler_fs_get_properties(struct fs *_fs) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+
+    return fs_get_properties(sfs->super);
+}
+
+static struct fs_file *scrambler_fs_file_init(
+    struct fs *_fs,
+    const char *path,
+    enum fs_open_mode mode,
+    enum fs_open_flags flags
+) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+    struct scrambler_fs_file *file = i_new(struct scrambler_fs_file, 1);
+
+    file->file.fs = _fs;
+    file->file.path = i_strdup(path);
+    file->fs = sfs;
+    file->super = fs_file_init(sfs->super, path, mode | flags);
+    return &file->file;
+}
+
+static void scrambler_fs_file_deinit(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    i_assert(file->temp_output == NULL && file->super_output == NULL);
+
+    fs_file_deinit(&file->super);
+    i_free(file->file.path);
+    i_free(file);
+}
+
+static void scrambler_fs_file_close(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    fs_file_close(file->super);
+}
+
+static const char *scrambler_fs_get_path(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_file_path(file->super);
+}
+
+static void scrambler_fs_set_async_callback(
+    struct fs_file *_file,
+    fs_file_async_callback_t *callback,
+    void *context
+) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    fs_file_set_async_callback(file->super, callback, context);
+}
+
+static int scrambler_fs_wait_async(struct fs *_fs) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+
+    return fs_wait_async(sfs->super);
+}
+
+static void scrambler_fs_set_metadata(struct fs_file *_file, const char *key, const char *value) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    fs_set_metadata(file->super, key, value);
+}
+
+static int scrambler_fs_get_metadata(struct fs_file *_file, const ARRAY_TYPE(fs_metadata) **metadata_r) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_get_metadata(file->super, metadata_r);
+}
+
+static bool scrambler_fs_prefetch(struct fs_file *_file, uoff_t length) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_prefetch(file->super, length);
+}
+
+// Appends the header of the container to the buffer and returns 1, 0 if the attachment is stored in plain text or -1.
+static int scrambler_fs_read_key_file(struct scrambler_fs_file *file, buffer_t *header) {
+    struct fs_file *key_file;
+    unsigned char data[KEY_FILE_MAX_SIZE + 1];
+    ssize_t size;
+    int result = 1, saved_errno = 0;
+
+    key_file = fs_file_init(file->fs->key_fs, scrambler_fs_key_path(file), FS_OPEN_MODE_READONLY);
+    size = fs_read(key_file, data, sizeof(data));
+    if (size < 0) {
+        saved_errno = errno;
+        if (errno == ENOENT) {
+            // written before the attachments were encrypted
+            result = 0;
+        } else {
+            fs_set_error(&file->fs->fs, "scrambler_fs_read_key_file: %s", fs_file_last_error(key_file));
+            result = -1;
+        }
+    } else if ((size_t)size <= MAGIC_SIZE || (size_t)size > KEY_FILE_MAX_SIZE ||
+        memcmp(data, scrambler_header, sizeof(scrambler_header)) != 0) {
+        fs_set_critical(&file->fs->fs, "scrambler_fs_read_key_file: %s is malformed", fs_file_path(key_file));
+        saved_errno = EIO;
+        result = -1;
+    } else {
+        buffer_append(header, data, size);
+    }
+
+    fs_file_deinit(&key_file);
+    errno = saved_errno;
+    return result;
+}
+
+// The header from the key file and the chunks of the attachment are read as one container by the scrambler istream.
+// Without the plugin loaded for the user, only plain attachments can be read.
+static struct istream *scrambler_fs_read_stream(struct fs_file *_file, size_t max_buffer_size) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+    struct scrambler_user *suser = file->fs->suser;
+    struct istream *inputs[3], *input, *decrypted_input;
+    buffer_t *header;
+    int result;
+
+    header = buffer_create_dynamic(default_pool, KEY_FILE_MAX_SIZE);
+    result = scrambler_fs_read_key_file(file, header);
+    if (result <= 0) {
+        buffer_free(&header);
+        if (result < 0)
+            return i_stream_create_error_str(errno, "%s", fs_last_error(_file->fs));
+        return fs_read_stream(file->super, max_buffer_size);
+    }
+
+    // the chunks would be passed as the attachment otherwise
+    if (suser == NULL) {
+        buffer_free(&header);
+        fs_set_critical(_file->fs, "scrambler_fs_read_stream: %s is encrypted, but the plugin isn't loaded for "
+            "the user", fs_file_path(_file));
+        return i_stream_create_error_str(EIO, "%s", fs_last_error(_file->fs));
+    }
+
+    inputs[0] = i_stream_create_copy_from_data(header->data, header->used);
+    inputs[1] = fs_read_stream(file->super, max_buffer_size);
+    inputs[2] = NULL;
+    buffer_free(&header);
+
+    input = i_stream_create_concat(inputs);
+    i_stream_unref(&inputs[0]);
+    i_stream_unref(&inputs[1]);
+
+    decrypted_input = scrambler_user_istream_create(suser, input);
+    i_stream_unref(&input);
+    scrambler_istream_set_spill(decrypted_input, MAIL_MAX_MEMORY_BUFFER, _file->fs->temp_path_prefix);
+    return decrypted_input;
+}
+
+static void scrambler_fs_write_stream(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    i_assert(_file->output == NULL);
+
+    if (!scrambler_fs_encrypts(file->fs)) {
+        file->super_output = fs_write_stream(file->super);
+        _file->output = file->super_output;
+        return;
+    }
+
+    // dovecot keeps the extracted attachment in a temporary file of the same directory for its hash already
+    file->temp_output = iostream_temp_create_named(_file->fs->temp_path_prefix, 0, fs_file_path(_file));
+    _file->output = file->temp_output;
+}
+
+static int scrambler_fs_digest(struct istream *input, unsigned char *digest, unsigned int *digest_size) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    const unsigned char *data;
+    size_t size;
+    int result = -1;
+
+    if (context == NULL || EVP_DigestInit_ex(context, scrambler_sha256(), NULL) != 1)
+        goto finish;
+
+    while (i_stream_read(input) > 0 || i_stream_get_data_size(input) > 0) {
+        data = i_stream_get_data(input, &size);
+        if (EVP_DigestUpdate(context, data, size) != 1)
+            goto finish;
+        i_stream_skip(input, size);
+    }
+
+    if (input->stream_errno == 0 && EVP_DigestFinal_ex(context, digest, digest_size) == 1)
+        result = 0;
+
+finish:
+    EVP_MD_CTX_free(context);
+    return result;
+}
+
+// Encrypts the attachment with a content key derived from its SHA-256, so every copy of it gets the same chunks and
+// sis can link them. Only the key files differ, they hold the content key wrapped for the user.
+static int scrambler_fs_write_encrypted(struct scrambler_fs_file *file, struct istream *input) {
+    struct scrambler_user *suser = file->fs->suser;
+    struct fs *_fs = &file->fs->fs;
+    struct fs_file *key_file;
+    struct ostream *output;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    buffer_t *header;
+    int result = 0;
+
+    if (scrambler_fs_digest(input, digest, &digest_size) < 0) {
+        fs_set_error(_fs, "scrambler_fs_write_encrypted: hashing %s failed: %s", file->file.path,
+            input->stream_errno != 0 ? i_stream_get_error(input) : "digest failed");
+        return -1;
+    }
+    i_stream_seek(input, 0);
+
+    header = buffer_create_dynamic(default_pool, KEY_FILE_MAX_SIZE);
+    file->super_output = fs_write_stream(file->super);
+    output = scrambler_ostream_create(file->super_output, suser->public_key, &suser->stats);
+    scrambler_ostream_set_convergent(output, digest, digest_size, header);
+    OPENSSL_cleanse(digest, sizeof(digest));
+
+    if (o_stream_send_istream(output, input) < 0 || input->stream_errno != 0 || o_stream_flush(output) < 0) {
+        fs_set_error(_fs, "scrambler_fs_write_encrypted: encrypting %s failed: %s", file->file.path,
+            input->stream_errno != 0 ? i_stream_get_error(input) : o_stream_get_error(output));
+        result = -1;
+    }
+    o_stream_unref(&output);
+
+    if (result < 0) {
+        fs_write_stream_abort(file->super, &file->super_output);
+        buffer_free(&header);
+        return -1;
+    }
+    if (fs_write_stream_finish(file->super, &file->super_output) < 0) {
+        fs_set_error(_fs, "%s", fs_file_last_error(file->super));
+        buffer_free(&header);
+        return -1;
+    }
+
+    // written after the attachment, so a key file never points to a missing attachment
+    key_file = fs_file_init(file->fs->key_fs, scrambler_fs_key_path(file), FS_OPEN_MODE_REPLACE);
+    if (fs_write(key_file, header->data, header->used) < 0) {
+        fs_set_error(_fs, "scrambler_fs_write_encrypted: %s", fs_file_last_error(key_file));
+        result = -1;
+    }
+    fs_file_deinit(&key_file);
+    buffer_free(&header);
+
+    if (result < 0)
+        (void)fs_delete(file->super);
+    return result;
+}
+
+static int scrambler_fs_write_stream_finish(struct fs_file *_file, bool success) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+    struct istream *input;
+    int result;
+
+    if (file->temp_output == NULL) {
+        _file->output = NULL;
+        if (!success) {
+            fs_write_stream_abort(file->super, &file->super_output);
+            return -1;
+        }
+        return fs_write_stream_finish(file->super, &file->super_output);
+    }
+
+    _file->output = NULL;
+    if (!success) {
+        o_stream_destroy(&file->temp_output);
+        return -1;
+    }
+
+    input = iostream_temp_finish(&file->temp_output, IO_BLOCK_SIZE);
+    result = scrambler_fs_write_encrypted(file, input);
+    i_stream_unref(&input);
+    return result;
+}
+
+static int scrambler_fs_lock(struct fs_file *_file, unsigned int secs, struct fs_lock **lock_r) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_lock(file->super, secs, lock_r);
+}
+
+static void scrambler_fs_unlock(struct fs_lock *lock ATTR_UNUSED) {
+    // the locks belong to the wrapped driver, which unlocks them
+    i_unreached();
+}
+
+static int scrambler_fs_exists(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_exists(file->super);
+}
+
+// The size is the one of the chunks, not of the plain text.
+static int scrambler_fs_stat(struct fs_file *_file, struct stat *st_r) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+
+    return fs_stat(file->super, st_r);
+}
+
+// Applies the operation of the attachments to their key files. Attachments without a key file are plain.
+static int scrambler_fs_key_file_operation(
+    struct scrambler_fs_file *src,
+    struct scrambler_fs_file *dest,
+    int (*operation)(struct fs_file *src, struct fs_file *dest)
+) {
+    struct fs_file *src_key_file, *dest_key_file;
+    int result = 0;
+
+    src_key_file = fs_file_init(src->fs->key_fs, scrambler_fs_key_path(src), FS_OPEN_MODE_READONLY);
+    dest_key_file = fs_file_init(dest->fs->key_fs, scrambler_fs_key_path(dest), FS_OPEN_MODE_REPLACE);
+    if (operation(src_key_file, dest_key_file) < 0 && errno != ENOENT) {
+        fs_set_error(&dest->fs->fs, "scrambler_fs_key_file_operation: %s", fs_file_last_error(dest_key_file));
+        result = -1;
+    }
+    fs_file_deinit(&src_key_file);
+    fs_file_deinit(&dest_key_file);
+    return result;
+}
+
+static int scrambler_fs_copy(struct fs_file *_src, struct fs_file *_dest) {
+    struct scrambler_fs_file *src = (struct scrambler_fs_file *)_src;
+    struct scrambler_fs_file *dest = (struct scrambler_fs_file *)_dest;
+
+    // an asynchronous copy is continued
+    if (_src == NULL)
+        return fs_copy_finish_async(dest->super);
+
+    if (fs_copy(src->super, dest->super) < 0)
+        return -1;
+    return scrambler_fs_key_file_operation(src, dest, fs_copy);
+}
+
+static int scrambler_fs_rename(struct fs_file *_src, struct fs_file *_dest) {
+    struct scrambler_fs_file *src = (struct scrambler_fs_file *)_src;
+    struct scrambler_fs_file *dest = (struct scrambler_fs_file *)_dest;
+
+    if (fs_rename(src->super, dest->super) < 0)
+        return -1;
+    return scrambler_fs_key_file_operation(src, dest, fs_rename);
+}
+
+static int scrambler_fs_delete(struct fs_file *_file) {
+    struct scrambler_fs_file *file = (struct scrambler_fs_file *)_file;
+    struct fs_file *key_file;
+    int result = 0;
+
+    if (fs_delete(file->super) < 0)
+        return -1;
+
+    key_file = fs_file_init(file->fs->key_fs, scrambler_fs_key_path(file), FS_OPEN_MODE_READONLY);
+    if (fs_delete(key_file) < 0 && errno != ENOENT) {
+        fs_set_error(_file->fs, "scrambler_fs_delete: %s", fs_file_last_error(key_file));
+        result = -1;
+    }
+    fs_file_deinit(&key_file);
+    return result;
+}
+
+static struct fs_iter *scrambler_fs_iter_init(struct fs *_fs, const char *path, enum fs_iter_flags flags) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+    struct scrambler_fs_iter *iter = i_new(struct scrambler_fs_iter, 1);
+
+    iter->iter.fs = _fs;
+    iter->iter.flags = flags;
+    iter->super = fs_iter_init(sfs->super, path, flags);
+    return &iter->iter;
+}
+
+// Hides the key files.
+static const char *scrambler_fs_iter_next(struct fs_iter *_iter) {
+    struct scrambler_fs_iter *iter = (struct scrambler_fs_iter *)_iter;
+    size_t suffix_length = strlen(KEY_FILE_SUFFIX), length;
+    const char *name;
+
+    while ((name = fs_iter_next(iter->super)) != NULL) {
+        length = strlen(name);
+        if (length < suffix_length || strcmp(name + length - suffix_length, KEY_FILE_SUFFIX) != 0)
+            break;
+    }
+    return name;
+}
+
+static int scrambler_fs_iter_deinit(struct fs_iter *_iter) {
+    struct scrambler_fs_iter *iter = (struct scrambler_fs_iter *)_iter;
+    int result;
+
+    result = fs_iter_deinit(&iter->super);
+    i_free(iter);
+    return result;
+}
+
+static bool scrambler_fs_switch_ioloop(struct fs *_fs) {
+    struct scrambler_fs *sfs = (struct scrambler_fs *)_fs;
+
+    return fs_switch_ioloop(sfs->super);
+}
+
+// Constants
+
+const struct fs fs_class_scrambler = {
+    .name = "scrambler",
+    .v = {
+        .alloc = scrambler_fs_alloc,
+        .init = scrambler_fs_init,
+        .deinit = scrambler_fs_deinit,
+        .get_properties = scrambler_fs_get_properties,
+        .file_init = scrambler_fs_file_init,
+        .file_deinit = scrambler_fs_file_deinit,
+        .file_close = scrambler_fs_file_close,
+        .get_path = scrambler_fs_get_path,
+        .set_async_callback = scrambler_fs_set_async_callback,
+        .wait_async = scrambler_fs_wait_async,
+        .set_metadata = scrambler_fs_set_metadata,
+        .get_metadata = scrambler_fs_get_metadata,
+        .prefetch = scrambler_fs_prefetch,
+        .read = fs_read_via_stream,
+        .read_stream = scrambler_fs_read_stream,
+        .write = fs_write_via_stream,
+        .write_stream = scrambler_fs_write_stream,
+        .write_stream_finish = scrambler_fs_write_stream_finish,
+        .lock = scrambler_fs_lock,
+        .unlock = scrambler_fs_unlock,
+        .exists = scrambler_fs_exists,
+        .stat = scrambler_fs_stat,
+        .copy = scrambler_fs_copy,
+        .rename = scrambler_fs_rename,
+        .delete_file = scrambler_fs_delete,
+        .iter_init = scrambler_fs_iter_init,
+        .iter_next = scrambler_fs_iter_next,
+        .iter_deinit = scrambler_fs_iter_deinit,
+        .switch_ioloop = scrambler_fs_switch_ioloop
+    }
+};
@@ -0,0 +1,248 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <dovecot/llist.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-workers.h"
+#include "scrambler-header-pool.h"
+
+// Enums
+
+enum scrambler_header_state {
+    header_empty,
+    header_sealing,
+    header_ready
+};
+
+// Structs
+
+struct scrambler_sealed_header {
+    struct scrambler_header_pool *pool;
+
+    // guarded by the mutex of the pool, context and header belong to the worker while the header is sealed
+    enum scrambler_header_state state;
+    struct scrambler_package_context context;
+    unsigned char *header;
+};
+
+struct scrambler_header_pool {
+    struct scrambler_header_pool *prev, *next;
+
+    struct scrambler_workers *workers;
+    EVP_PKEY *public_key;
+    const struct scrambler_package *package;
+    size_t header_size;
+
+    struct scrambler_sealed_header *headers;
+    unsigned int size;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t sealed_cond;
+    unsigned int sealing_count;
+    // set on destroy, the queued jobs skip their header then
+    bool cancelled;
+};
+
+// Statics
+
+static struct scrambler_header_pool *scrambler_header_pools = NULL;
+static unsigned int scrambler_header_pool_count = 0;
+
+// Functions
+
+static void scrambler_header_pool_seal_run(void *context) {
+    struct scrambler_sealed_header *sealed = context;
+    struct scrambler_header_pool *pool = sealed->pool;
+    bool cancelled, success;
+
+    pthread_mutex_lock(&pool->mutex);
+    cancelled = pool->cancelled;
+    if (cancelled) {
+        sealed->state = header_empty;
+        pool->sealing_count--;
+        pthread_cond_signal(&pool->sealed_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (cancelled)
+        return;
+
+    // the stats of a stream are only touched by its own thread, the stream counts the taken header itself
+    scrambler_package_context_init(&sealed->context, pool->package, NULL);
+    success = pool->package->seal_header(&sealed->context, sealed->header, pool->public_key) == 0;
+    if (!success) {
+        // the stream seals the header itself then, which logs the error
+        scrambler_package_context_deinit(&sealed->context);
+        ERR_clear_error();
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    sealed->state = success ? header_ready : header_empty;
+    pool->sealing_count--;
+    pthread_cond_signal(&pool->sealed_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Submits all empty headers.
+static void scrambler_header_pool_refill(struct scrambler_header_pool *pool) {
+    for (unsigned int index = 0; index < pool->size; index++) {
+        struct scrambler_sealed_header *sealed = &pool->headers[index];
+
+        pthread_mutex_lock(&pool->mutex);
+        if (sealed->state != header_empty) {
+            pthread_mutex_unlock(&pool->mutex);
+            continue;
+        }
+        sealed->state = header_sealing;
+        pool->sealing_count++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        scrambler_workers_submit(pool->workers, scrambler_header_pool_seal_run, NULL, sealed);
+    }
+}
+
+static struct scrambler_header_pool *scrambler_header_pool_create(
+    struct scrambler_workers *workers,
+    const struct scrambler_package *package,
+    EVP_PKEY *public_key,
+    unsigned int size
+) {
+    struct scrambler_header_pool *pool = i_new(struct scrambler_header_pool, 1);
+
+    pool->workers = workers;
+    // the key of the user that created the pool is freed with the user
+    EVP_PKEY_up_ref(public_key);
+    pool->public_key = public_key;
+    pool->package = package;
+    i_assert(scrambler_package_accepts_key(package, public_key));
+    pool->header_size = scrambler_package_header_size(pool->package, public_key);
+
+    pool->size = size;
+    pool->headers = i_new(struct scrambler_sealed_header, size);
+    for (unsigned int index = 0; index < size; index++) {
+        pool->headers[index].pool = pool;
+        pool->headers[index].header = i_malloc(pool->header_size);
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->sealed_cond, NULL);
+
+    scrambler_header_pool_refill(pool);
+    return pool;
+}
+
+struct scrambler_header_pool *scrambler_header_pool_get(
+    struct scrambler_workers *workers,
+    const struct scrambler_package *package,
+    EVP_PKEY *public_key,
+    unsigned int size,
+    unsigned int max_pools
+) {
+    struct scrambler_header_pool *pool;
+
+    for (pool = scrambler_header_pools; pool != NULL; pool = pool->next) {
+        if (pool->package == package && EVP_PKEY_eq(pool->public_key, public_key) == 1)
+            return pool;
+    }
+
+    if (scrambler_header_pool_count >= max_pools)
+        return NULL;
+
+    pool = scrambler_header_pool_create(workers, package, public_key, size);
+    DLLIST_PREPEND(&scrambler_header_pools, pool);
+    scrambler_header_pool_count++;
+    return pool;
+}
+
+bool scrambler_header_pool_take(
+    struct scrambler_header_pool *pool,
+    struct scrambler_package_context *context,
+    unsigned char *header
+) {
+    struct scrambler_sealed_header *sealed = NULL;
+
+    i_assert(context->package == pool->package && context->cipher_context == NULL);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (unsigned int index = 0; index < pool->size; index++) {
+        if (pool->headers[index].state == header_ready) {
+            sealed = &pool->headers[index];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (sealed == NULL)
+        return FALSE;
+
+    // ready headers are only touched by this thread
+    memcpy(header, sealed->header, pool->header_size);
+    safe_memset(sealed->header, 0, pool->header_size);
+    sealed->context.stats = context->stats;
+    *context = sealed->context;
+    memset(&sealed->context, 0, sizeof(sealed->context));
+
+    pthread_mutex_lock(&pool->mutex);
+    sealed->state = header_empty;
+    pthread_mutex_unlock(&pool->mutex);
+
+    scrambler_header_pool_refill(pool);
+    return TRUE;
+}
+
+static void scrambler_header_pool_destroy(struct scrambler_header_pool **_pool) {
+    struct scrambler_header_pool *pool = *_pool;
+
+    *_pool = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->cancelled = TRUE;
+    while (pool->sealing_count > 0)
+        pthread_cond_wait(&pool->sealed_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned int index = 0; index < pool->size; index++) {
+        if (pool->headers[index].state == header_ready)
+            scrambler_package_context_deinit(&pool->headers[index].context);
+        i_free(pool->headers[index].header);
+    }
+
+    pthread_cond_destroy(&pool->sealed_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    EVP_PKEY_free(pool->public_key);
+    i_free(pool->headers);
+    i_free(pool);
+}
+
+void scrambler_header_pool_destroy_all(void) {
+    struct scrambler_header_pool *pool;
+
+    while (scrambler_header_pools != NULL) {
+        pool = scrambler_header_pools;
+        DLLIST_REMOVE(&scrambler_header_pools, pool);
+        scrambler_header_pool_destroy(&pool);
+    }
+    scrambler_header_pool_count = 0;
+}
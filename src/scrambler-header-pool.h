@@ -0,0 +1,60 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_HEADER_POOL_H
+#define SCRAMBLER_HEADER_POOL_H
+
+#include <openssl/evp.h>
+
+#include "scrambler-package.h"
+#include "scrambler-workers.h"
+
+// Structs
+
+// Headers for new mails of one public key and package, sealed ahead of time on the workers. Each holds a wrapped random
+// content key and the package context, that is set up for it. The pools belong to the process, so the users of a
+// public key share one, and a user that comes back to a process (e.g. the next delivery in lmtp) finds its headers
+// ready.
+struct scrambler_header_pool;
+
+// Functions
+
+// Returns the pool of the package and public key, which the package has to accept. The first call for them creates the
+// pool, which starts sealing size headers right away, as long as the process has less than max_pools. Returns NULL
+// otherwise. The pools are kept until scrambler_header_pool_destroy_all().
+struct scrambler_header_pool *scrambler_header_pool_get(
+    struct scrambler_workers *workers,
+    const struct scrambler_package *package,
+    EVP_PKEY *public_key,
+    unsigned int size,
+    unsigned int max_pools);
+
+// Moves a sealed header into header, which needs room for scrambler_package_header_size() bytes, and its state into
+// the context, which has to be initialized for the package of the pool. Returns FALSE, if no header is ready,
+// in that case the caller has to seal one itself. The taken header is replaced in the background.
+bool scrambler_header_pool_take(
+    struct scrambler_header_pool *pool,
+    struct scrambler_package_context *context,
+    unsigned char *header);
+
+// Cancels the headers that are still queued, waits only for the ones that are being sealed and wipes all pools.
+void scrambler_header_pool_destroy_all(void);
+
+#endif
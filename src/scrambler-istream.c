@@ -21,12 +21,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <dovecot/lib.h>
 #include <dovecot/istream.h>
 #include <dovecot/istream-private.h>
-#include <openssl/aes.h>
 #include <openssl/err.h>
-#include <openssl/pem.h>
-#include <openssl/rsa.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-spill.h"
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
+#include "scrambler-workers.h"
 #include "scrambler-istream.h"
 
 // Enums
@@ -39,21 +45,87 @@ enum scrambler_istream_mode {
 
 // Structs
 
+// Header of a mail, that is opened by a worker thread before the stream reads it.
+struct scrambler_istream_prefetch {
+    // copy of the header behind the magic
+    unsigned char *header;
+    size_t header_size;
+    EVP_PKEY *private_key;
+    // only set for mails, that are decrypted as a whole and may be wrapped for the old private key of the same size
+    EVP_PKEY *old_private_key;
+
+    // only set for mails, that are decrypted as a whole: the stored mail and room for its plain text
+    unsigned char *stored;
+    size_t stored_size;
+    unsigned char *decrypted;
+
+    // results, written by the worker thread before done is set
+    struct scrambler_package_context context;
+    struct scrambler_stats stats;
+    size_t decrypted_size;
+    // 0, -1 or one of the chunk errors
+    int result;
+    const char *error;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    bool done;
+};
+
 struct scrambler_istream {
 	struct istream_private istream;
 
     enum scrambler_istream_mode mode;
 
     EVP_PKEY *private_key;
-    EVP_CIPHER_CTX *cipher_context;
-    const EVP_CIPHER *cipher;
+    // kept while mails of a previous key type are migrated
+    EVP_PKEY *old_private_key;
+    // copy of the header, until a chunk confirms the key it has been opened with. A key of the same type unwraps any
+    // header without an error, only the tag of the first chunk tells whether the mail is wrapped for the old key
+    unsigned char *unconfirmed_header;
+    // asked for the keys on the first encrypted mail, while they are still unlocked in the background
+    scrambler_istream_key_callback_t *key_callback;
+    void *key_context;
     unsigned int encrypted_header_size;
+    // set by scrambler_istream_prefetch() until the header is read
+    struct scrambler_istream_prefetch *prefetch;
+    // mail decrypted as a whole by the prefetch, the stream is served from it
+    unsigned char *decrypted;
+    size_t decrypted_size;
 
-    unsigned char mac_key[MAC_KEY_SIZE];
-
-    unsigned int chunk_index;
+    struct scrambler_package_context context;
     bool last_chunk_read;
 
+    // header or chunk, that is split over reads of the parent, so the parent never has to buffer a whole one
+    unsigned char *partial;
+    size_t partial_size;
+    size_t partial_buffer_size;
+
+    // bytes read from the parent ahead of the chunk that is decrypted, two chunks unless set otherwise
+    size_t read_ahead_size;
+
+    // with mmap enabled, mails in plain files are decrypted straight from the mapped pages instead of going
+    // through the buffer of the parent
+    bool mmap_enabled;
+    void *map;
+    size_t map_size;
+    const unsigned char *mapped_mail;
+    size_t mapped_mail_size;
+    // position of the next chunk in the mapped mail
+    size_t mapped_offset;
+
+    // decrypted data for seeks backwards, created on the first one, which decrypts the mail again from the start
+    char *spill_temp_path_prefix;
+    size_t spill_max_memory_size;
+    struct scrambler_spill *spill;
+
+    struct scrambler_stats stats;
+    struct scrambler_stats *target_stats;
+
+    struct scrambler_trace *trace;
+    char *trace_label;
+    unsigned long long read_usecs;
+
 #ifdef DEBUG_STREAMS
     unsigned int in_byte_count;
     unsigned int out_byte_count;
@@ -90,6 +162,63 @@ static ssize_t scrambler_istream_read_parent(
     return size;
 }
 
+// Maps the stored mail, if the parent reads straight from a plain file. Returns FALSE, if the mail can't be
+// mapped, it's read through the parent then.
+static bool scrambler_istream_map(struct scrambler_istream *sstream) {
+    struct istream *parent = sstream->istream.parent;
+    int fd = i_stream_get_fd(parent);
+    uoff_t mail_size, mail_offset, map_offset;
+    struct stat stat;
+    long page_size;
+    void *map;
+
+    // streams that change the data, like the ones of compressed files, aren't readable_fd
+    if (fd < 0 || !parent->readable_fd || fstat(fd, &stat) < 0 || !S_ISREG(stat.st_mode))
+        return FALSE;
+    if (i_stream_get_size(parent, TRUE, &mail_size) <= 0)
+        return FALSE;
+
+    // the stream of the mail starts at the absolute offset of the parent when it was created, e.g. within a mdbox
+    mail_offset = sstream->istream.abs_start_offset;
+    mail_size -= sstream->istream.parent_start_offset;
+    if (mail_size == 0 || mail_offset + mail_size > (uoff_t)stat.st_size)
+        return FALSE;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    map_offset = mail_offset - mail_offset % page_size;
+
+    map = mmap(NULL, mail_offset - map_offset + mail_size, PROT_READ, MAP_SHARED, fd, map_offset);
+    if (map == MAP_FAILED)
+        return FALSE;
+
+    // the chunks are read once from start to end
+    (void)madvise(map, mail_offset - map_offset + mail_size, MADV_SEQUENTIAL);
+    (void)madvise(map, mail_offset - map_offset + mail_size, MADV_WILLNEED);
+
+    sstream->map = map;
+    sstream->map_size = mail_offset - map_offset + mail_size;
+    sstream->mapped_mail = (const unsigned char *)map + (mail_offset - map_offset);
+    sstream->mapped_mail_size = mail_size;
+    return TRUE;
+}
+
+static void scrambler_istream_unmap(struct scrambler_istream *sstream) {
+    if (sstream->map == NULL)
+        return;
+
+    if (munmap(sstream->map, sstream->map_size) < 0)
+        i_error("scrambler_istream_unmap: munmap() failed: %m");
+    sstream->map = NULL;
+    sstream->mapped_mail = NULL;
+}
+
+static void scrambler_istream_get_keys(struct scrambler_istream *sstream) {
+    if (sstream->private_key == NULL && sstream->key_callback != NULL) {
+        sstream->key_callback(sstream->key_context, &sstream->private_key, &sstream->old_private_key);
+        sstream->key_callback = NULL;
+    }
+}
+
 static ssize_t scrambler_istream_read_detect_magic(
     struct scrambler_istream *sstream,
     const unsigned char *source
@@ -100,6 +229,7 @@ static ssize_t scrambler_istream_read_detect_magic(
         i_debug("istream read encrypted mail");
 #endif
         sstream->mode = decrypt;
+        scrambler_istream_get_keys(sstream);
         if (sstream->private_key == NULL) {
             i_error("tried to decrypt a mail without the private key");
             sstream->istream.istream.stream_errno = EACCES;
@@ -107,19 +237,31 @@ static ssize_t scrambler_istream_read_detect_magic(
             return -1;
         } else {
             source += sizeof(scrambler_header);
-            enum packages package = *source;
-            sstream->cipher = scrambler_cipher(package);
-            if (sstream->cipher == NULL) {
-                i_error("could not detect encryption package signature (%02x)", package);
+            const struct scrambler_package *package = scrambler_package_get(*source);
+            if (package == NULL) {
+                i_error("could not detect encryption package signature (%02x)", *source);
                 sstream->istream.istream.stream_errno = EACCES;
                 sstream->istream.istream.eof = TRUE;
                 return -1;
             }
 
-            sstream->encrypted_header_size =
-                EVP_CIPHER_iv_length(sstream->cipher) +
-                EVP_PKEY_size(sstream->private_key) +
-                MAC_KEY_SIZE;
+            if (!scrambler_package_accepts_key(package, sstream->private_key)) {
+                if (!scrambler_package_accepts_key(package, sstream->old_private_key)) {
+                    i_error("tried to decrypt a mail of package %02x without a matching private key", package->id);
+                    sstream->istream.istream.stream_errno = EACCES;
+                    sstream->istream.istream.eof = TRUE;
+                    return -1;
+                }
+                sstream->private_key = sstream->old_private_key;
+            }
+
+            scrambler_package_context_init(&sstream->context, package, &sstream->stats);
+            sstream->encrypted_header_size = scrambler_package_header_size(package, sstream->private_key);
+            i_stream_set_max_buffer_size(sstream->istream.parent,
+                MAGIC_SIZE + sstream->encrypted_header_size + sstream->read_ahead_size);
+
+            if (sstream->mmap_enabled && (sstream->map != NULL || scrambler_istream_map(sstream)))
+                sstream->mapped_offset = MAGIC_SIZE;
 
             return MAGIC_SIZE;
         }
@@ -138,7 +280,10 @@ static ssize_t scrambler_istream_read_detect(struct scrambler_istream *sstream)
     ssize_t result;
     size_t source_size;
 
-    i_stream_set_max_buffer_size(sstream->istream.parent, ENCRYPTED_HEADER_SIZE + (2 * ENCRYPTED_CHUNK_SIZE));
+    // enough for the magic. For encrypted mails, it's grown by the header size once the package is known, so chunks
+    // can be decrypted straight from the buffer of the parent. Smaller buffers work as well, but split chunks are
+    // copied once more.
+    i_stream_set_max_buffer_size(sstream->istream.parent, sstream->read_ahead_size);
 
     result = scrambler_istream_read_parent(sstream, MAGIC_SIZE, 0);
     if (result <= 0)
@@ -156,153 +301,441 @@ static ssize_t scrambler_istream_read_detect(struct scrambler_istream *sstream)
     return result;
 }
 
-static ssize_t scrambler_istream_read_decrypt_header(
+static void scrambler_istream_prefetch_run(void *context) {
+    struct scrambler_istream_prefetch *prefetch = context;
+    const unsigned char *source, *source_end;
+    size_t decrypted_size;
+    ssize_t result;
+    bool final = FALSE;
+
+    if (prefetch->old_private_key == NULL) {
+        prefetch->result = prefetch->context.package->open_header(&prefetch->context, prefetch->header,
+            prefetch->private_key, &prefetch->error);
+    } else {
+        // the stream doesn't read the mail, so the worker falls back to the old key itself
+        source = prefetch->stored + MAGIC_SIZE + prefetch->header_size;
+        source_end = prefetch->stored + prefetch->stored_size;
+        prefetch->result = scrambler_package_open_confirmed_header(&prefetch->context, prefetch->header,
+            prefetch->private_key, source, source_end - source, &prefetch->error);
+        if (prefetch->result == SCRAMBLER_CHUNK_TAG_MISMATCH) {
+            scrambler_package_context_deinit(&prefetch->context);
+            prefetch->result = scrambler_package_open_confirmed_header(&prefetch->context, prefetch->header,
+                prefetch->old_private_key, source, source_end - source, &prefetch->error);
+        }
+    }
+
+    if (prefetch->result == 0 && prefetch->stored != NULL) {
+        source = prefetch->stored + MAGIC_SIZE + prefetch->header_size;
+        source_end = prefetch->stored + prefetch->stored_size;
+        while (!final) {
+            result = prefetch->context.package->open_chunk(&prefetch->context, source, source_end - source,
+                prefetch->decrypted + prefetch->decrypted_size, &decrypted_size, &final, &prefetch->error);
+            if (result < 0) {
+                prefetch->result = result;
+                break;
+            }
+            source += result;
+            prefetch->decrypted_size += decrypted_size;
+        }
+    }
+    // the errors are logged by the stream
+    ERR_clear_error();
+
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->done = TRUE;
+    pthread_cond_signal(&prefetch->done_cond);
+    pthread_mutex_unlock(&prefetch->mutex);
+}
+
+static void scrambler_istream_prefetch_wait_done(struct scrambler_istream_prefetch *prefetch) {
+    pthread_mutex_lock(&prefetch->mutex);
+    while (!prefetch->done)
+        pthread_cond_wait(&prefetch->done_cond, &prefetch->mutex);
+    pthread_mutex_unlock(&prefetch->mutex);
+}
+
+// Waits for the worker and takes the prefetch from the stream.
+static struct scrambler_istream_prefetch *scrambler_istream_prefetch_wait(struct scrambler_istream *sstream) {
+    struct scrambler_istream_prefetch *prefetch = sstream->prefetch;
+
+    sstream->prefetch = NULL;
+    scrambler_istream_prefetch_wait_done(prefetch);
+    return prefetch;
+}
+
+static void scrambler_istream_prefetch_free(struct scrambler_istream_prefetch **_prefetch) {
+    struct scrambler_istream_prefetch *prefetch = *_prefetch;
+
+    *_prefetch = NULL;
+
+    scrambler_package_context_deinit(&prefetch->context);
+    pthread_cond_destroy(&prefetch->done_cond);
+    pthread_mutex_destroy(&prefetch->mutex);
+    i_free(prefetch->header);
+    i_free(prefetch->stored);
+    i_free(prefetch->decrypted);
+    i_free(prefetch);
+}
+
+// Returns TRUE, if the worker opened the given header and its context has been taken over.
+static bool scrambler_istream_prefetch_finish(struct scrambler_istream *sstream, const unsigned char *header) {
+    struct scrambler_istream_prefetch *prefetch = scrambler_istream_prefetch_wait(sstream);
+    bool taken = FALSE;
+
+    if (prefetch->result == 0 &&
+        prefetch->context.package == sstream->context.package &&
+        prefetch->private_key == sstream->private_key &&
+        prefetch->header_size == sstream->encrypted_header_size &&
+        memcmp(prefetch->header, header, prefetch->header_size) == 0) {
+        scrambler_package_context_deinit(&sstream->context);
+        sstream->context = prefetch->context;
+        sstream->context.stats = &sstream->stats;
+        memset(&prefetch->context, 0, sizeof(prefetch->context));
+        taken = TRUE;
+    }
+
+    scrambler_istream_prefetch_free(&prefetch);
+    return taken;
+}
+
+// Serves the stream from the mail, that has been decrypted as a whole by the worker. The stored mail isn't read by
+// the stream anymore.
+static int scrambler_istream_prefetch_finish_decrypted(struct scrambler_istream *sstream) {
+    struct istream_private *stream = &sstream->istream;
+    struct scrambler_istream_prefetch *prefetch = scrambler_istream_prefetch_wait(sstream);
+
+    if (prefetch->result < 0) {
+        i_error("scrambler_istream_prefetch_finish_decrypted: %s", prefetch->error);
+        stream->istream.stream_errno = prefetch->result == SCRAMBLER_CHUNK_TAG_MISMATCH ? EACCES : EIO;
+        stream->istream.eof = TRUE;
+        scrambler_istream_prefetch_free(&prefetch);
+        return -1;
+    }
+
+    sstream->decrypted = prefetch->decrypted;
+    sstream->decrypted_size = prefetch->decrypted_size;
+    prefetch->decrypted = NULL;
+
+    scrambler_stats_add(&sstream->stats, &prefetch->stats);
+    sstream->stats.key_operations++;
+    sstream->stats.prefetched_headers++;
+    sstream->mode = decrypt;
+    sstream->last_chunk_read = TRUE;
+
+    scrambler_istream_prefetch_free(&prefetch);
+    return 0;
+}
+
+// After a rotation to a key of the same type, the settings hold the new key pair and the mails that haven't been
+// rekeyed yet are still wrapped for scrambler_old_private_key. Only applies if the old key has the same header size,
+// as the header has been read for the size of the given key.
+static bool scrambler_istream_old_key_applies(
     struct scrambler_istream *sstream,
-    const unsigned char **source
+    const struct scrambler_package *package,
+    EVP_PKEY *private_key
 ) {
-    sstream->cipher_context = EVP_CIPHER_CTX_new();
+    return sstream->old_private_key != NULL && sstream->old_private_key != private_key &&
+        scrambler_package_accepts_key(package, sstream->old_private_key) &&
+        scrambler_package_header_size(package, sstream->old_private_key) ==
+            scrambler_package_header_size(package, private_key);
+}
 
-    size_t iv_size = EVP_CIPHER_iv_length(sstream->cipher);
-    unsigned char iv[iv_size];
-    memcpy(iv, *source, iv_size);
-    *source += iv_size;
-#ifdef DEBUG_STREAMS
-    sstream->in_byte_count += iv_size;
-#endif
+static bool scrambler_istream_open_header_with_old_key(struct scrambler_istream *sstream, const unsigned char *source) {
+    const struct scrambler_package *package = sstream->context.package;
+    const char *error;
 
-    size_t encrypted_key_size = EVP_PKEY_size(sstream->private_key);
-    ASSERT_OPENSSL_SUCCESS(
-        EVP_OpenInit(sstream->cipher_context, sstream->cipher, *source, encrypted_key_size, iv, sstream->private_key), 1,
-        "scrambler_istream_read_decrypt_header", "initialization of public key decryption failed", -1);
-    *source += encrypted_key_size;
-#ifdef DEBUG_STREAMS
-    sstream->in_byte_count += encrypted_key_size;
-#endif
+    if (!scrambler_istream_old_key_applies(sstream, package, sstream->private_key))
+        return FALSE;
+
+    // the error of the current key is the one that is logged
+    scrambler_package_context_deinit(&sstream->context);
+    if (package->open_header(&sstream->context, source, sstream->old_private_key, &error) < 0)
+        return FALSE;
+    ERR_clear_error();
+    sstream->private_key = sstream->old_private_key;
+    return TRUE;
+}
+
+// The tag of the first chunk, that has been read since the header has been opened, didn't match. If the key is
+// unconfirmed still, the header is opened again with the old key and positioned at the same chunk.
+static bool scrambler_istream_reopen_with_old_key(struct scrambler_istream *sstream) {
+    const struct scrambler_package *package = sstream->context.package;
+    unsigned int chunk_index = sstream->context.chunk_index;
+    const char *error;
+    bool reopened;
+
+    if (sstream->unconfirmed_header == NULL)
+        return FALSE;
+
+    scrambler_package_context_deinit(&sstream->context);
+    reopened = package->open_header(&sstream->context, sstream->unconfirmed_header, sstream->old_private_key,
+        &error) == 0 && (chunk_index == 0 || package->seek_chunk(&sstream->context, chunk_index) == 0);
+    i_free(sstream->unconfirmed_header);
+    if (!reopened) {
+        // the tag mismatch of the current key is the error that is logged
+        ERR_clear_error();
+        return FALSE;
+    }
+
+    sstream->private_key = sstream->old_private_key;
+    sstream->stats.key_operations++;
+    return TRUE;
+}
 
-    // decrypt mac key
-    int decrypted_mac_key_size;
-    ASSERT_OPENSSL_SUCCESS(
-        EVP_OpenUpdate(sstream->cipher_context, sstream->mac_key, &decrypted_mac_key_size, *source, MAC_KEY_SIZE), 1,
-        "scrambler_istream_read_decrypt_header", "mac key decryption failed", -1)
-    i_assert(decrypted_mac_key_size == MAC_KEY_SIZE);
-    *source += MAC_KEY_SIZE;
+static ssize_t scrambler_istream_read_decrypt_header(
+    struct scrambler_istream *sstream,
+    const unsigned char **source
+) {
+    unsigned long long start_usecs = scrambler_stats_now_usecs();
+    const char *error;
+
+    if (sstream->prefetch != NULL && scrambler_istream_prefetch_finish(sstream, *source)) {
+        sstream->stats.prefetched_headers++;
+    } else if (sstream->context.package->open_header(&sstream->context, *source, sstream->private_key, &error) < 0 &&
+        !scrambler_istream_open_header_with_old_key(sstream, *source)) {
+        i_error("scrambler_istream_read_decrypt_header: %s", error);
+        i_error_openssl("scrambler_istream_read_decrypt_header");
+        // the next read starts over with the header
+        scrambler_package_context_deinit(&sstream->context);
+        return -1;
+    }
+    if (scrambler_istream_old_key_applies(sstream, sstream->context.package, sstream->private_key)) {
+        sstream->unconfirmed_header = i_malloc(sstream->encrypted_header_size);
+        memcpy(sstream->unconfirmed_header, *source, sstream->encrypted_header_size);
+    }
+    *source += sstream->encrypted_header_size;
 #ifdef DEBUG_STREAMS
-    sstream->in_byte_count += MAC_KEY_SIZE;
+    sstream->in_byte_count += sstream->encrypted_header_size;
 #endif
 
+    sstream->stats.key_operations++;
+    sstream->stats.header_usecs += scrambler_stats_now_usecs() - start_usecs;
     return 0;
 }
 
 static ssize_t scrambler_istream_read_decrypt_chunk(
     struct scrambler_istream *sstream,
+    scrambler_package_open_chunk_t *open_chunk,
     unsigned char **destination,
     const unsigned char **source,
-    const unsigned char *source_end
+    const unsigned char *source_end,
+    bool *final_r
 ) {
-    int decrypted_size = 0;
-    int total_decrypted_size = 0;
-
-    const unsigned char *header = *source;
-    unsigned short encrypted_size = *(unsigned short *)header;
-    bool final = (encrypted_size & 0x8000) != 0;
-    encrypted_size &= 0x7fff; // clear msb
-    *source += sizeof(unsigned short);
-#ifdef DEBUG_STREAMS
-    sstream->in_byte_count += sizeof(unsigned short);
-#endif
+    const char *error;
+    size_t decrypted_size;
+    ssize_t result;
+    bool final;
 
-    if (*source + encrypted_size + CHUNK_TAG_SIZE > source_end) {
-        i_error("failed to verify chunk size");
-        sstream->istream.istream.stream_errno = EIO;
+    result = open_chunk(&sstream->context, *source, source_end - *source, *destination, &decrypted_size, &final,
+        &error);
+    if (result == SCRAMBLER_CHUNK_TAG_MISMATCH && scrambler_istream_reopen_with_old_key(sstream)) {
+        result = open_chunk(&sstream->context, *source, source_end - *source, *destination, &decrypted_size, &final,
+            &error);
+    }
+    if (result < 0) {
+        i_error("%s", error);
+        i_error_openssl("scrambler_istream_read_decrypt_chunk");
+        sstream->istream.istream.stream_errno = result == SCRAMBLER_CHUNK_TAG_MISMATCH ? EACCES : EIO;
         sstream->istream.istream.eof = TRUE;
         return -1;
     }
-
-    const unsigned char *encrypted = *source;
-    *source += encrypted_size;
+    *source += result;
+    i_free(sstream->unconfirmed_header);
 #ifdef DEBUG_STREAMS
-    sstream->in_byte_count += encrypted_size;
+    sstream->in_byte_count += result;
+    i_debug_hex("chunk", *destination, decrypted_size);
 #endif
+    *destination += decrypted_size;
 
-    const unsigned char *tag = *source;
-    *source += CHUNK_TAG_SIZE;
-#ifdef DEBUG_STREAMS
-    sstream->in_byte_count += CHUNK_TAG_SIZE;
-#endif
+    if (final_r != NULL)
+        *final_r = final;
+    return 0;
+}
 
-    // verify the mac
-    unsigned int generated_tag_size;
-    unsigned char generated_tag[CHUNK_TAG_SIZE];
-    const unsigned char *blocks[] = {
-        (unsigned char *)&sstream->chunk_index,
-        (unsigned char *)header,
-        encrypted,
-        NULL
-    };
-    size_t block_sizes[] = {
-        sizeof(unsigned int),
-        sizeof(unsigned short),
-        encrypted_size,
-        0
-    };
-
-    scrambler_generate_mac(generated_tag, &generated_tag_size, blocks, block_sizes, sstream->mac_key, MAC_KEY_SIZE);
-    i_assert(generated_tag_size == CHUNK_TAG_SIZE);
-
-    if (CRYPTO_memcmp(tag, generated_tag, generated_tag_size)) {
-        i_error("failed to verify chunk tag");
-        sstream->istream.istream.stream_errno = EACCES;
-        sstream->istream.istream.eof = TRUE;
+// Size of the next header or chunk at source, 0 if more bytes are needed to tell.
+static size_t scrambler_istream_unit_size(
+    struct scrambler_istream *sstream,
+    const unsigned char *source,
+    size_t source_size
+) {
+    if (sstream->context.cipher_context == NULL)
+        return sstream->encrypted_header_size;
+    return sstream->context.package->stored_chunk_size(source, source_size);
+}
+
+// Opens the header or decrypts the chunk at unit, which is complete.
+static ssize_t scrambler_istream_read_decrypt_unit(
+    struct scrambler_istream *sstream,
+    const unsigned char *unit,
+    size_t unit_size,
+    unsigned char **destination,
+    bool *final_r
+) {
+    if (sstream->context.cipher_context == NULL) {
+        if (scrambler_istream_read_decrypt_header(sstream, &unit) < 0) {
+            sstream->istream.istream.stream_errno = EIO;
+            sstream->istream.istream.eof = TRUE;
+            return -1;
+        }
+        return 0;
+    }
+
+    return scrambler_istream_read_decrypt_chunk(sstream, sstream->context.package->open_chunk, destination, &unit,
+        unit + unit_size, final_r);
+}
+
+// Decrypts the complete units, that the parent has buffered, as long as there is room for another chunk. The start
+// of a split unit is moved to the partial buffer. Returns the number of parent bytes used or -1.
+static ssize_t scrambler_istream_read_decrypt_buffered(
+    struct scrambler_istream *sstream,
+    const unsigned char *source,
+    const unsigned char *source_end,
+    unsigned char **destination,
+    const unsigned char *destination_end,
+    bool *final_r
+) {
+    const unsigned char *source_start = source;
+    size_t unit_size, copy_size;
+
+    while (!*final_r && destination_end - *destination >= CHUNK_SIZE) {
+        if (sstream->partial_size == 0) {
+            unit_size = scrambler_istream_unit_size(sstream, source, source_end - source);
+            if (unit_size == 0 && source == source_end)
+                break;
+            if (unit_size != 0 && unit_size <= (size_t)(source_end - source)) {
+                // zero copy, the whole unit is in the buffer of the parent
+                if (scrambler_istream_read_decrypt_unit(sstream, source, unit_size, destination, final_r) < 0)
+                    return -1;
+                source += unit_size;
+                continue;
+            }
+        }
+
+        // collect the unit, the first bytes tell its size
+        unit_size = scrambler_istream_unit_size(sstream, sstream->partial, sstream->partial_size);
+        while (unit_size == 0 && source < source_end) {
+            sstream->partial[sstream->partial_size++] = *source++;
+            unit_size = scrambler_istream_unit_size(sstream, sstream->partial, sstream->partial_size);
+        }
+        if (unit_size == 0)
+            break;
+
+        i_assert(unit_size <= sstream->partial_buffer_size);
+        copy_size = MIN(unit_size - sstream->partial_size, (size_t)(source_end - source));
+        memcpy(sstream->partial + sstream->partial_size, source, copy_size);
+        sstream->partial_size += copy_size;
+        source += copy_size;
+        if (sstream->partial_size < unit_size)
+            break;
+
+        sstream->partial_size = 0;
+        if (scrambler_istream_read_decrypt_unit(sstream, sstream->partial, unit_size, destination, final_r) < 0)
+            return -1;
+    }
+
+    return source - source_start;
+}
+
+// Decrypts from the parent as it delivers the data. Returns 0, if a non-blocking parent has no more data for now, the
+// state is kept for the next read.
+static ssize_t scrambler_istream_read_decrypt(struct scrambler_istream *sstream) {
+    struct istream_private *stream = &sstream->istream;
+    const unsigned char *source;
+    unsigned char *destination, *destination_end;
+    size_t source_size;
+    ssize_t result;
+    bool final = FALSE;
+
+    if (sstream->last_chunk_read) {
+        stream->istream.stream_errno = stream->parent->stream_errno;
+        stream->istream.eof = TRUE;
         return -1;
     }
 
-    // decrypt
-    ASSERT_OPENSSL_SUCCESS(
-        EVP_OpenUpdate(sstream->cipher_context, *destination, &decrypted_size, encrypted, encrypted_size), 1,
-        "scrambler_istream_read_decrypt_chunk", "stream decryption failed", -1)
-    i_assert(decrypted_size == (int)encrypted_size);
-    total_decrypted_size += decrypted_size;
-    *destination += decrypted_size;
+    if (sstream->partial == NULL) {
+        sstream->partial_buffer_size = MAX((size_t)ENCRYPTED_CHUNK_SIZE, sstream->encrypted_header_size);
+        sstream->partial = i_malloc(sstream->partial_buffer_size);
+    }
+
+    i_stream_alloc(stream, CHUNK_SIZE);
+    destination = stream->w_buffer + stream->pos;
+    destination_end = stream->w_buffer + stream->buffer_size;
+
+    for (;;) {
+        source = i_stream_get_data(stream->parent, &source_size);
+        result = scrambler_istream_read_decrypt_buffered(sstream, source, source + source_size, &destination,
+            destination_end, &final);
+        if (result < 0)
+            return -1;
+        i_stream_skip(stream->parent, result);
+
+        if (final || destination != stream->w_buffer + stream->pos)
+            break;
 
-    if (final) {
-        ASSERT_OPENSSL_SUCCESS(
-            EVP_OpenFinal(sstream->cipher_context, *destination, &decrypted_size), 1,
-            "scrambler_istream_read_decrypt_chunk", "stream finalization failed", -1)
-        total_decrypted_size += decrypted_size;
-        *destination += decrypted_size;
+        // everything buffered has been used, so the parent has room for more
+        result = i_stream_read(stream->parent);
+        if (result == 0)
+            return 0;
+        if (result < 0) {
+            if (stream->parent->stream_errno != 0) {
+                stream->istream.stream_errno = stream->parent->stream_errno;
+            } else {
+                i_error("scrambler_istream_read_decrypt: %s",
+                    sstream->context.cipher_context == NULL ? "truncated header" :
+                    sstream->partial_size > 0 ? "truncated chunk" : "missing final chunk");
+                stream->istream.stream_errno = EIO;
+            }
+            stream->istream.eof = TRUE;
+            return -1;
+        }
     }
 
-    sstream->chunk_index++;
+    sstream->last_chunk_read = final;
+
+    result = destination - (stream->w_buffer + stream->pos);
+    stream->pos += result;
+
+    if (result == 0) {
+        // empty final chunk
+        stream->istream.eof = TRUE;
+        return -1;
+    }
 
 #ifdef DEBUG_STREAMS
-    i_debug_hex("chunk", *destination - total_decrypted_size, total_decrypted_size);
+    sstream->out_byte_count += result;
+    i_debug("scrambler istream read (%d)", (int)result);
 #endif
 
-    return 0;
+    return result;
 }
 
-static ssize_t scrambler_istream_read_decrypt(struct scrambler_istream *sstream) {
+// Like scrambler_istream_read_decrypt(), but the chunks are read from the mapped mail. Decrypts as many chunks as fit
+// into the buffer.
+static ssize_t scrambler_istream_read_decrypt_mapped(struct scrambler_istream *sstream) {
     struct istream_private *stream = &sstream->istream;
-    const unsigned char *parent_data, *source, *source_end;
+    const unsigned char *source, *source_end;
     unsigned char *destination, *destination_end;
     ssize_t result;
-    size_t source_size, minimal_size;
-
-    minimal_size = sstream->cipher_context == NULL ? sstream->encrypted_header_size : 0;
-    minimal_size += ENCRYPTED_CHUNK_SIZE;
 
-    result = scrambler_istream_read_parent(sstream, minimal_size, CHUNK_SIZE + stream->pos);
-    if (result <= 0 && result != -1)
-        return result;
+    if (sstream->last_chunk_read) {
+        stream->istream.eof = TRUE;
+        return -1;
+    }
 
-    parent_data = i_stream_get_data(stream->parent, &source_size);
-    source = parent_data;
-    source_end = source + source_size;
+    i_stream_alloc(stream, CHUNK_SIZE);
+    source = sstream->mapped_mail + sstream->mapped_offset;
+    source_end = sstream->mapped_mail + sstream->mapped_mail_size;
     destination = stream->w_buffer + stream->pos;
     destination_end = stream->w_buffer + stream->buffer_size;
 
-    // handle header and chiper initialization
-    if (sstream->cipher_context == NULL) {
+    if (sstream->context.cipher_context == NULL) {
+        if ((size_t)(source_end - source) < sstream->encrypted_header_size) {
+            i_error("scrambler_istream_read_decrypt_mapped: truncated header");
+            stream->istream.stream_errno = EIO;
+            stream->istream.eof = TRUE;
+            return -1;
+        }
+
         result = scrambler_istream_read_decrypt_header(sstream, &source);
         if (result < 0) {
             stream->istream.stream_errno = EIO;
@@ -310,59 +743,37 @@ static ssize_t scrambler_istream_read_decrypt(struct scrambler_istream *sstream)
         }
     }
 
-    while ( (source_end - source) >= ENCRYPTED_CHUNK_SIZE ) {
-        if (destination_end - destination < CHUNK_SIZE) {
-            i_error("output buffer too small");
-            sstream->istream.istream.stream_errno = EIO;
-            sstream->istream.istream.eof = TRUE;
-            return -1;
-        }
-
-        result = scrambler_istream_read_decrypt_chunk(sstream, &destination, &source, source_end);
+    scrambler_package_open_chunk_t *open_chunk = sstream->context.package->open_chunk;
+    bool final = FALSE;
+    while (!final && source < source_end && destination_end - destination >= CHUNK_SIZE) {
+        result = scrambler_istream_read_decrypt_chunk(sstream, open_chunk, &destination, &source, source_end, &final);
         if (result < 0)
             return result;
     }
 
-    if (stream->parent->eof) {
-        if (sstream->last_chunk_read) {
-            stream->istream.stream_errno = stream->parent->stream_errno;
-            stream->istream.eof = stream->parent->eof;
-            return -1;
-        } else {
-            stream->istream.stream_errno = 0;
-            stream->istream.eof = FALSE;
-
-            if (destination_end - destination < CHUNK_SIZE) {
-                i_error("output buffer too small (for final chunk)");
-                sstream->istream.istream.stream_errno = EIO;
-                sstream->istream.istream.eof = TRUE;
-                return -1;
-            }
-
-            result = scrambler_istream_read_decrypt_chunk(sstream, &destination, &source, source_end);
-            if (result < 0) {
-                stream->istream.stream_errno = EIO;
-                return result;
-            }
-
-            sstream->last_chunk_read = TRUE;
-        }
+    // like the parent reaching its end in scrambler_istream_read_decrypt(), a mail cut off behind a chunk must not
+    // pass as complete. The chunks decrypted before are returned first. Bytes behind the final chunk are ignored the
+    // same way
+    if (!final && source == source_end && destination == stream->w_buffer + stream->pos) {
+        i_error("scrambler_istream_read_decrypt_mapped: missing final chunk");
+        stream->istream.stream_errno = EIO;
+        stream->istream.eof = TRUE;
+        return -1;
     }
-
-    i_stream_skip(stream->parent, source - parent_data);
+    sstream->last_chunk_read = final;
+    sstream->mapped_offset = source - sstream->mapped_mail;
 
     result = (destination - stream->w_buffer) - stream->pos;
     stream->pos = destination - stream->w_buffer;
 
     if (result == 0) {
-        stream->istream.stream_errno = stream->parent->stream_errno;
-        stream->istream.eof = stream->parent->eof;
+        stream->istream.eof = sstream->last_chunk_read;
         return -1;
     }
 
 #ifdef DEBUG_STREAMS
     sstream->out_byte_count += result;
-    i_debug("scrambler istream read (%d)", (int)result);
+    i_debug("scrambler istream read mapped (%d)", (int)result);
 #endif
 
     return result;
@@ -393,17 +804,88 @@ static ssize_t scrambler_istream_read_plain(struct scrambler_istream *sstream) {
     return copy_size;
 }
 
-static ssize_t scrambler_istream_read(struct istream_private *stream) {
-    struct scrambler_istream *sstream = (struct scrambler_istream *)stream;
+static ssize_t scrambler_istream_read_decrypted(struct scrambler_istream *sstream) {
+    struct istream_private *stream = &sstream->istream;
+    uoff_t offset = stream->istream.v_offset + (stream->pos - stream->skip);
+    size_t size;
+
+    if (offset >= sstream->decrypted_size) {
+        stream->istream.eof = TRUE;
+        return -1;
+    }
+
+    i_stream_alloc(stream, CHUNK_SIZE);
+    size = MIN(stream->buffer_size - stream->pos, (size_t)(sstream->decrypted_size - offset));
+    memcpy(stream->w_buffer + stream->pos, sstream->decrypted + offset, size);
+    stream->pos += size;
+
+#ifdef DEBUG_STREAMS
+    sstream->out_byte_count += size;
+#endif
+
+    return size;
+}
+
+static ssize_t scrambler_istream_read_spill(struct scrambler_istream *sstream, uoff_t offset) {
+    struct istream_private *stream = &sstream->istream;
+    ssize_t result;
+
+    i_stream_alloc(stream, CHUNK_SIZE);
+    result = scrambler_spill_read(sstream->spill, offset, stream->w_buffer + stream->pos,
+        stream->buffer_size - stream->pos);
+    if (result < 0) {
+        stream->istream.stream_errno = EIO;
+        stream->istream.eof = TRUE;
+        return -1;
+    }
+
+    stream->pos += result;
+    return result;
+}
+
+// Adds newly decrypted data to the spill. Without the spill, seeks backwards decrypt the mail from the start again.
+static void scrambler_istream_spill_append(struct scrambler_istream *sstream, ssize_t size) {
+    struct istream_private *stream = &sstream->istream;
+
+    if (scrambler_spill_append(sstream->spill, stream->w_buffer + stream->pos - size, size) < 0) {
+        scrambler_spill_destroy(&sstream->spill);
+        i_free(sstream->spill_temp_path_prefix);
+    }
+}
+
+static ssize_t scrambler_istream_read_mode(struct scrambler_istream *sstream) {
+    struct istream_private *stream = &sstream->istream;
+    ssize_t result;
+
+    if (sstream->prefetch != NULL && sstream->prefetch->stored != NULL &&
+        scrambler_istream_prefetch_finish_decrypted(sstream) < 0)
+        return -1;
+    if (sstream->decrypted != NULL)
+        return scrambler_istream_read_decrypted(sstream);
+
+    if (sstream->spill != NULL) {
+        uoff_t offset = stream->istream.v_offset + (stream->pos - stream->skip);
+
+        if (offset < scrambler_spill_get_size(sstream->spill))
+            return scrambler_istream_read_spill(sstream, offset);
+    }
 
     if (sstream->mode == detect) {
-        ssize_t result = scrambler_istream_read_detect(sstream);
+        result = scrambler_istream_read_detect(sstream);
         if (result < 0)
             return result;
     }
 
-    if (sstream->mode == decrypt)
-        return scrambler_istream_read_decrypt(sstream);
+    if (sstream->mode == decrypt) {
+        if (sstream->mapped_mail != NULL)
+            result = scrambler_istream_read_decrypt_mapped(sstream);
+        else
+            result = scrambler_istream_read_decrypt(sstream);
+
+        if (result > 0 && sstream->spill != NULL)
+            scrambler_istream_spill_append(sstream, result);
+        return result;
+    }
 
     if (sstream->mode == plain)
         return scrambler_istream_read_plain(sstream);
@@ -411,6 +893,72 @@ static ssize_t scrambler_istream_read(struct istream_private *stream) {
     return -1;
 }
 
+static ssize_t scrambler_istream_read(struct istream_private *stream) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)stream;
+    unsigned long long start_usecs;
+    ssize_t result;
+
+    if (sstream->trace == NULL)
+        return scrambler_istream_read_mode(sstream);
+
+    start_usecs = scrambler_stats_now_usecs();
+    result = scrambler_istream_read_mode(sstream);
+    sstream->read_usecs += scrambler_stats_now_usecs() - start_usecs;
+
+    return result;
+}
+
+// Jumps to the chunk at v_offset, instead of decrypting all chunks before it. The stored offset of a chunk follows from
+// its index, as all chunks except the final one are full. So dovecot's seeks to cached MIME parts (BODY[n]) only
+// decrypt the chunks of the part. Returns FALSE, if the stream has to read up to v_offset instead.
+static bool scrambler_istream_seek_chunk(struct scrambler_istream *sstream, uoff_t v_offset) {
+    struct istream_private *stream = &sstream->istream;
+    scrambler_package_seek_chunk_t *seek_chunk;
+    uoff_t chunk_index = v_offset / CHUNK_SIZE;
+    uoff_t stored_size, chunks_size, chunk_offset;
+
+    // the data after the spill has to be appended in order
+    if (sstream->mode != decrypt || sstream->context.cipher_context == NULL || sstream->spill != NULL)
+        return FALSE;
+    seek_chunk = sstream->context.package->seek_chunk;
+    if (seek_chunk == NULL)
+        return FALSE;
+
+    // the buffered data or the next chunk is read anyway
+    if (v_offset >= stream->istream.v_offset && chunk_index <= sstream->context.chunk_index)
+        return FALSE;
+
+    if (sstream->mapped_mail != NULL) {
+        stored_size = sstream->mapped_mail_size;
+    } else if (!stream->parent->seekable || i_stream_get_size(stream->parent, TRUE, &stored_size) <= 0) {
+        return FALSE;
+    }
+    if (stored_size <= MAGIC_SIZE + sstream->encrypted_header_size)
+        return FALSE;
+
+    // beyond the end, the final chunk reports it
+    chunks_size = stored_size - MAGIC_SIZE - sstream->encrypted_header_size;
+    chunk_index = MIN(chunk_index, (chunks_size - 1) / ENCRYPTED_CHUNK_SIZE);
+    if (seek_chunk(&sstream->context, chunk_index) < 0)
+        return FALSE;
+
+    chunk_offset = MAGIC_SIZE + sstream->encrypted_header_size + chunk_index * ENCRYPTED_CHUNK_SIZE;
+    if (sstream->mapped_mail != NULL) {
+        sstream->mapped_offset = chunk_offset;
+    } else {
+        stream->parent_expected_offset = stream->parent_start_offset + chunk_offset;
+        i_stream_seek(stream->parent, chunk_offset);
+    }
+
+    sstream->last_chunk_read = FALSE;
+    sstream->partial_size = 0;
+    sstream->stats.chunk_seeks++;
+
+    stream->skip = stream->pos = 0;
+    stream->istream.v_offset = chunk_index * CHUNK_SIZE;
+    return TRUE;
+}
+
 static void scrambler_istream_seek(struct istream_private *stream, uoff_t v_offset, bool mark) {
     struct scrambler_istream *sstream = (struct scrambler_istream *)stream;
 
@@ -418,17 +966,30 @@ static void scrambler_istream_seek(struct istream_private *stream, uoff_t v_offs
     i_debug("scrambler istream seek %d / %d / %d", (int)stream->istream.v_offset, (int)v_offset, (int)mark);
 #endif
 
-    if (v_offset < stream->istream.v_offset) {
-        // seeking backwards - go back to beginning and seek forward from there.
-        if (sstream->cipher_context != NULL) {
-            EVP_CIPHER_CTX_free(sstream->cipher_context);
-            sstream->cipher_context = NULL;
+    if (sstream->decrypted != NULL) {
+        stream->skip = stream->pos = 0;
+        stream->istream.v_offset = MIN(v_offset, (uoff_t)sstream->decrypted_size);
+    } else if (sstream->spill != NULL) {
+        // everything up to the decryption position is in the spill, beyond that it's read forward
+        stream->skip = stream->pos = 0;
+        stream->istream.v_offset = MIN(v_offset, scrambler_spill_get_size(sstream->spill));
+    } else if (scrambler_istream_seek_chunk(sstream, v_offset)) {
+        // the rest of the chunk is skipped below
+    } else if (v_offset < stream->istream.v_offset) {
+        // seeking backwards - go back to beginning and seek forward from there. The data is spilled this time, so
+        // further seeks don't need to decrypt again.
+        if (sstream->mode == decrypt && sstream->spill_temp_path_prefix != NULL) {
+            sstream->spill = scrambler_spill_create(sstream->spill_max_memory_size,
+                sstream->spill_temp_path_prefix);
         }
+        scrambler_package_context_deinit(&sstream->context);
+        i_free(sstream->unconfirmed_header);
 
         sstream->mode = detect;
 
-        sstream->chunk_index = 0;
         sstream->last_chunk_read = FALSE;
+        sstream->partial_size = 0;
+        sstream->stats.seek_rewinds++;
 #ifdef DEBUG_STREAMS
         sstream->in_byte_count = 0;
         sstream->out_byte_count = 0;
@@ -456,21 +1017,263 @@ static int scrambler_istream_stat(struct istream_private *stream, bool exact) {
 static void scrambler_istream_close(struct iostream_private *stream, bool close_parent) {
     struct scrambler_istream *sstream = (struct scrambler_istream *)stream;
 
-    if (sstream->cipher_context != NULL) {
-        EVP_CIPHER_CTX_free(sstream->cipher_context);
-        sstream->cipher_context = NULL;
+    if (sstream->prefetch != NULL) {
+        struct scrambler_istream_prefetch *prefetch = scrambler_istream_prefetch_wait(sstream);
+        scrambler_istream_prefetch_free(&prefetch);
     }
+    i_free(sstream->decrypted);
+    scrambler_package_context_deinit(&sstream->context);
+    i_free(sstream->unconfirmed_header);
+    i_free(sstream->partial);
+    scrambler_istream_unmap(sstream);
+    if (sstream->spill != NULL)
+        scrambler_spill_destroy(&sstream->spill);
+    i_free(sstream->spill_temp_path_prefix);
 
 #ifdef DEBUG_STREAMS
     i_debug("scrambler istream close - %u bytes in / %u bytes out / %u bytes overhead",
         sstream->in_byte_count, sstream->out_byte_count, sstream->in_byte_count - sstream->out_byte_count);
 #endif
 
+    if (sstream->trace != NULL) {
+        if (sstream->stats.chunks_verified > 0)
+            scrambler_trace_read_finished(sstream->trace, sstream->trace_label, sstream->read_usecs, &sstream->stats);
+        sstream->trace = NULL;
+        i_free(sstream->trace_label);
+    }
+
+    if (sstream->target_stats != NULL) {
+        scrambler_stats_add(sstream->target_stats, &sstream->stats);
+        sstream->target_stats = NULL;
+    }
+
     if (close_parent)
         i_stream_close(sstream->istream.parent);
 }
 
-struct istream *scrambler_istream_create(struct istream *input, EVP_PKEY *private_key) {
+// Returns the stream below the scrambler istream in the chain of the given stream, which provides the stored
+// data, or the given stream itself, if there is no scrambler istream in the chain.
+struct istream *scrambler_istream_get_raw(struct istream *input) {
+    for (struct istream *stream = input; stream != NULL; stream = stream->real_stream->parent) {
+        if (stream->real_stream->read == scrambler_istream_read)
+            return stream->real_stream->parent;
+    }
+    return input;
+}
+
+// Peeks at the stored data without decrypting anything. Returns 1 if the data is encrypted, 0 if it's plain
+// and -1 if it could not be read. The raw stream is rewound, as the scrambler istream might have consumed the
+// header already, it repositions its parent on its next read.
+int scrambler_istream_is_encrypted(struct istream *input) {
+    struct istream *raw_input = scrambler_istream_get_raw(input);
+    const unsigned char *data;
+    size_t size;
+
+    i_stream_seek(raw_input, 0);
+    if (i_stream_read_data(raw_input, &data, &size, MAGIC_SIZE - 1) <= 0 && size < MAGIC_SIZE)
+        return raw_input->stream_errno != 0 ? -1 : 0;
+
+    return 0 == memcmp(scrambler_header, data, sizeof(scrambler_header)) ? 1 : 0;
+}
+
+// Moves the whole stored mail from the parent into the prefetch. On failure, the parent is rewound, so the stream
+// reads the mail itself.
+static bool scrambler_istream_prefetch_read_stored(
+    struct scrambler_istream_prefetch *prefetch,
+    struct istream *parent,
+    size_t stored_size
+) {
+    const unsigned char *data;
+    size_t size;
+
+    prefetch->stored = i_malloc(stored_size);
+    while (prefetch->stored_size < stored_size && i_stream_read_data(parent, &data, &size, 0) > 0) {
+        size = MIN(size, stored_size - prefetch->stored_size);
+        memcpy(prefetch->stored + prefetch->stored_size, data, size);
+        prefetch->stored_size += size;
+        i_stream_skip(parent, size);
+    }
+
+    if (prefetch->stored_size < stored_size || parent->stream_errno != 0) {
+        i_stream_seek(parent, 0);
+        i_free(prefetch->stored);
+        prefetch->stored_size = 0;
+        return FALSE;
+    }
+
+    // open_chunk needs room for a whole chunk
+    prefetch->decrypted = i_malloc(stored_size + CHUNK_SIZE);
+    return TRUE;
+}
+
+void scrambler_istream_prefetch(struct istream *input, struct scrambler_workers *workers, size_t max_decrypt_size) {
+    struct scrambler_istream *sstream = NULL;
+    struct scrambler_istream_prefetch *prefetch;
+    const struct scrambler_package *package;
+    const unsigned char *data;
+    EVP_PKEY *private_key;
+    size_t size, header_size;
+    uoff_t stored_size;
+
+    for (struct istream *stream = input; stream != NULL; stream = stream->real_stream->parent) {
+        if (stream->real_stream->read == scrambler_istream_read) {
+            sstream = (struct scrambler_istream *)stream->real_stream;
+            break;
+        }
+    }
+    if (sstream == NULL || sstream->mode != detect || sstream->prefetch != NULL)
+        return;
+
+    // only peeks at the parent, the first read of the stream detects the mail as usual
+    if (i_stream_read_data(sstream->istream.parent, &data, &size, MAGIC_SIZE - 1) <= 0 && size < MAGIC_SIZE)
+        return;
+    if (memcmp(scrambler_header, data, sizeof(scrambler_header)) != 0)
+        return;
+    package = scrambler_package_get(data[sizeof(scrambler_header)]);
+    if (package == NULL)
+        return;
+
+    scrambler_istream_get_keys(sstream);
+    if (scrambler_package_accepts_key(package, sstream->private_key))
+        private_key = sstream->private_key;
+    else if (scrambler_package_accepts_key(package, sstream->old_private_key))
+        private_key = sstream->old_private_key;
+    else
+        return;
+
+    header_size = scrambler_package_header_size(package, private_key);
+    if (i_stream_read_data(sstream->istream.parent, &data, &size, MAGIC_SIZE + header_size - 1) <= 0 &&
+        size < MAGIC_SIZE + header_size)
+        return;
+
+    prefetch = i_new(struct scrambler_istream_prefetch, 1);
+    prefetch->header = i_malloc(header_size);
+    memcpy(prefetch->header, data + MAGIC_SIZE, header_size);
+    prefetch->header_size = header_size;
+    prefetch->private_key = private_key;
+    // the stats of the stream are only touched by its own thread
+    scrambler_package_context_init(&prefetch->context, package, &prefetch->stats);
+    pthread_mutex_init(&prefetch->mutex, NULL);
+    pthread_cond_init(&prefetch->done_cond, NULL);
+
+    if (max_decrypt_size > 0 && sstream->istream.parent->v_offset == 0 &&
+        i_stream_get_size(sstream->istream.parent, TRUE, &stored_size) > 0 &&
+        stored_size > MAGIC_SIZE + header_size && stored_size <= max_decrypt_size)
+        (void)scrambler_istream_prefetch_read_stored(prefetch, sstream->istream.parent, stored_size);
+    if (prefetch->stored != NULL && private_key == sstream->private_key &&
+        scrambler_istream_old_key_applies(sstream, package, private_key))
+        prefetch->old_private_key = sstream->old_private_key;
+
+    sstream->prefetch = prefetch;
+    scrambler_workers_submit(workers, scrambler_istream_prefetch_run, NULL, prefetch);
+}
+
+struct scrambler_istream_prefetch *scrambler_istream_detach_prefetch(struct istream *input) {
+    struct scrambler_istream_prefetch *prefetch;
+
+    for (struct istream *stream = input; stream != NULL; stream = stream->real_stream->parent) {
+        if (stream->real_stream->read == scrambler_istream_read) {
+            struct scrambler_istream *sstream = (struct scrambler_istream *)stream->real_stream;
+
+            prefetch = sstream->prefetch;
+            sstream->prefetch = NULL;
+            return prefetch;
+        }
+    }
+    return NULL;
+}
+
+void scrambler_istream_attach_prefetch(struct istream *input, struct scrambler_istream_prefetch **_prefetch) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    if (sstream->mode != detect || sstream->prefetch != NULL || sstream->decrypted != NULL) {
+        scrambler_istream_prefetch_discard(_prefetch);
+        return;
+    }
+    sstream->prefetch = *_prefetch;
+    *_prefetch = NULL;
+}
+
+void scrambler_istream_prefetch_discard(struct scrambler_istream_prefetch **prefetch) {
+    scrambler_istream_prefetch_wait_done(*prefetch);
+    scrambler_istream_prefetch_free(prefetch);
+}
+
+void scrambler_istream_set_trace(struct istream *input, struct scrambler_trace *trace, const char *label) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    sstream->trace = trace;
+    i_free(sstream->trace_label);
+    sstream->trace_label = i_strdup(label);
+}
+
+void scrambler_istream_set_old_private_key(struct istream *input, EVP_PKEY *old_private_key) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    sstream->old_private_key = old_private_key;
+}
+
+void scrambler_istream_set_key_callback(
+    struct istream *input,
+    scrambler_istream_key_callback_t *callback,
+    void *context
+) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    sstream->key_callback = callback;
+    sstream->key_context = context;
+}
+
+void scrambler_istream_set_mmap(struct istream *input, bool mmap_enabled) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    sstream->mmap_enabled = mmap_enabled;
+}
+
+void scrambler_istream_set_read_ahead(struct istream *input, size_t read_ahead_size) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+    i_assert(sstream->mode == detect);
+
+    sstream->read_ahead_size = I_MAX(read_ahead_size, 2 * ENCRYPTED_CHUNK_SIZE);
+}
+
+void scrambler_istream_set_spill(struct istream *input, size_t max_memory_size, const char *temp_path_prefix) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+
+    sstream->spill_max_memory_size = max_memory_size;
+    i_free(sstream->spill_temp_path_prefix);
+    sstream->spill_temp_path_prefix = i_strdup(temp_path_prefix);
+}
+
+void scrambler_istream_set_decrypted(struct istream *input, const void *data, size_t size) {
+    struct scrambler_istream *sstream = (struct scrambler_istream *)input->real_stream;
+
+    i_assert(input->real_stream->read == scrambler_istream_read);
+    i_assert(sstream->mode == detect && sstream->prefetch == NULL);
+
+    // the stored mail isn't read at all, so no key is needed either
+    sstream->decrypted = i_malloc(I_MAX(size, 1));
+    memcpy(sstream->decrypted, data, size);
+    sstream->decrypted_size = size;
+    sstream->mode = decrypt;
+    sstream->last_chunk_read = TRUE;
+}
+
+struct istream *scrambler_istream_create(struct istream *input, EVP_PKEY *private_key, struct scrambler_stats *stats) {
     struct scrambler_istream *sstream = i_new(struct scrambler_istream, 1);
 
 #ifdef DEBUG_STREAMS
@@ -480,10 +1283,10 @@ struct istream *scrambler_istream_create(struct istream *input, EVP_PKEY *privat
     sstream->mode = detect;
 
     sstream->private_key = private_key;
-    sstream->cipher_context = NULL;
 
-    sstream->chunk_index = 0;
     sstream->last_chunk_read = FALSE;
+    sstream->read_ahead_size = 2 * ENCRYPTED_CHUNK_SIZE;
+    sstream->target_stats = stats;
 #ifdef DEBUG_STREAMS
     sstream->in_byte_count = 0;
     sstream->out_byte_count = 0;
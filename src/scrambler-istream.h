@@ -23,6 +23,70 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <openssl/evp.h>
 
-struct istream *scrambler_istream_create(struct istream *input, EVP_PKEY *private_key);
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
+#include "scrambler-workers.h"
+
+// Structs
+
+// Started by scrambler_istream_prefetch(), private to the stream.
+struct scrambler_istream_prefetch;
+
+// Returns the keys, once they are unlocked. Both are NULL, if unlocking failed.
+typedef void scrambler_istream_key_callback_t(void *context, EVP_PKEY **private_key_r, EVP_PKEY **old_private_key_r);
+
+// Functions
+
+struct istream *scrambler_istream_create(struct istream *input, EVP_PKEY *private_key, struct scrambler_stats *stats);
+
+// Records the time spent in reading the stream in the trace and logs it with the label, if it's slow.
+void scrambler_istream_set_trace(struct istream *input, struct scrambler_trace *trace, const char *label);
+
+// Used for mails whose package doesn't match the type of the private key, e.g. RSA mails after the switch to X25519.
+void scrambler_istream_set_old_private_key(struct istream *input, EVP_PKEY *old_private_key);
+
+// Used instead of the private key given on creation, if that is NULL. It's only called once the stream hits an
+// encrypted mail, so plain mails don't wait for the keys.
+void scrambler_istream_set_key_callback(
+    struct istream *input,
+    scrambler_istream_key_callback_t *callback,
+    void *context);
+
+// Encrypted mails, that are stored in plain files, are mapped and decrypted from the page cache. Has to be set before
+// the first read.
+void scrambler_istream_set_mmap(struct istream *input, bool mmap_enabled);
+
+// Reads encrypted mails from the parent in pieces of the given size instead of two chunks, e.g. from slow disks, where
+// fewer and larger reads pay off. Smaller sizes are raised to two chunks. Has to be set before the first read.
+void scrambler_istream_set_read_ahead(struct istream *input, size_t read_ahead_size);
+
+// Keeps the decrypted data once the stream seeks backwards, so later seeks don't decrypt the mail again. Up to
+// max_memory_size bytes are kept in memory, larger mails are spilled to an encrypted temporary file.
+void scrambler_istream_set_spill(struct istream *input, size_t max_memory_size, const char *temp_path_prefix);
+
+// Reads the header of an encrypted mail ahead of time and unwraps its content key on one of the workers. Mails up to
+// max_decrypt_size bytes are read as a whole and decrypted by the worker as well, 0 only prefetches the header. The
+// first read of the stream waits for it. Does nothing, if the given stream chain has no scrambler istream, it has been
+// read already or the header can't be read.
+void scrambler_istream_prefetch(struct istream *input, struct scrambler_workers *workers, size_t max_decrypt_size);
+
+// Takes the running prefetch from the given stream chain, so it outlives the stream, e.g. while the mail waits for its
+// read. Returns NULL, if there is none.
+struct scrambler_istream_prefetch *scrambler_istream_detach_prefetch(struct istream *input);
+
+// Hands a detached prefetch of the same mail to a new stream. Has to be set before the first read, otherwise the
+// prefetch is discarded.
+void scrambler_istream_attach_prefetch(struct istream *input, struct scrambler_istream_prefetch **prefetch);
+
+// Waits for a detached prefetch, that isn't needed anymore, and frees it.
+void scrambler_istream_prefetch_discard(struct scrambler_istream_prefetch **prefetch);
+
+// Serves the stream from the given plain text instead of decrypting the stored mail, e.g. from the copy taken while the
+// mail was saved. Has to be set before the first read.
+void scrambler_istream_set_decrypted(struct istream *input, const void *data, size_t size);
+
+struct istream *scrambler_istream_get_raw(struct istream *input);
+
+int scrambler_istream_is_encrypted(struct istream *input);
 
 #endif
@@ -19,17 +19,19 @@ You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <dovecot/lib.h>
+#include <dovecot/buffer.h>
+#include <dovecot/istream.h>
 #include <dovecot/ostream.h>
 #include <dovecot/ostream-private.h>
-#include <openssl/aes.h>
-#include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/pem.h>
-#include <openssl/rand.h>
-#include <openssl/rsa.h>
 
 #include "scrambler-common.h"
+#include "scrambler-header-pool.h"
+#include "scrambler-package.h"
+#include "scrambler-pool.h"
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
 #include "scrambler-ostream.h"
 
 // Structs
@@ -37,20 +39,41 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 struct scrambler_ostream {
 	struct ostream_private ostream;
 
-	enum packages package;
-
     EVP_PKEY *public_key;
-    EVP_CIPHER_CTX *cipher_context;
-    const EVP_CIPHER *cipher;
-
-		unsigned char mac_key[MAC_KEY_SIZE];
-
-		unsigned int chunk_index;
-    unsigned char chunk_buffer[CHUNK_SIZE];
+    // may be NULL, then the header is sealed by the stream
+    struct scrambler_header_pool *header_pool;
+    // single chunk package for mails that end within the first chunk, may be NULL
+    const struct scrambler_package *compact_package;
+    struct scrambler_header_pool *compact_header_pool;
+    struct scrambler_package_context context;
+    // the header is sent with the first chunk, so saves that are aborted before don't wrap a key and the package can
+    // still be switched to the compact one
+    bool header_sent;
+    // may be NULL, reset once it overflows
+    struct scrambler_ostream_tee *tee;
+    // set for convergent encryption, the header goes into the buffer instead of the parent
+    unsigned char convergent_secret[EVP_MAX_MD_SIZE];
+    size_t convergent_secret_size;
+    buffer_t *header_output;
+    // set to rewrap a stored mail, header and stored chunks are written instead of the data written to the stream
+    unsigned char *stored_header;
+    size_t stored_header_size;
+    struct istream *stored_chunks;
+
+    // from the pool, CHUNK_SIZE bytes
+    unsigned char *chunk_buffer;
     unsigned int chunk_buffer_size;
 
 		bool flushed;
 
+    struct scrambler_stats stats;
+    struct scrambler_stats *target_stats;
+
+    struct scrambler_trace *trace;
+    char *trace_label;
+    unsigned long long write_usecs;
+    unsigned int send_count;
+
 #ifdef DEBUG_STREAMS
 		unsigned int in_byte_count;
 		unsigned int out_byte_count;
@@ -60,59 +83,47 @@ struct scrambler_ostream {
 // Functions
 
 static ssize_t scrambler_ostream_send_header(struct scrambler_ostream *sstream) {
-    // send header and package information
-    o_stream_send(sstream->ostream.parent, scrambler_header, sizeof(scrambler_header));
-    o_stream_send(sstream->ostream.parent, (unsigned char *)&sstream->package, 1);
-#ifdef DEBUG_STREAMS
-		sstream->out_byte_count += sizeof(scrambler_header) + 1;
-#endif
-
-    sstream->cipher = scrambler_cipher(sstream->package);
-    sstream->cipher_context = EVP_CIPHER_CTX_new();
-
-    EVP_PKEY *public_keys[] = { sstream->public_key };
-
-    int iv_size = EVP_CIPHER_iv_length(sstream->cipher);
-    unsigned char iv[iv_size];
-
-    int encrypted_key_size = EVP_PKEY_size(sstream->public_key);
-    unsigned char encrypted_key[encrypted_key_size];
-    unsigned char *encrypted_keys[] = { encrypted_key };
-
-    ASSERT_OPENSSL_SUCCESS(
-        EVP_SealInit(sstream->cipher_context, sstream->cipher,
-            encrypted_keys, &encrypted_key_size, iv, public_keys, 1), 1,
-        "scrambler_ostream_send_header", "initialization of public key encryption failed", -1);
-		i_assert(encrypted_key_size == EVP_PKEY_size(sstream->public_key));
-
-    o_stream_send(sstream->ostream.parent, iv, iv_size);
-    o_stream_send(sstream->ostream.parent, encrypted_key, encrypted_key_size);
-#ifdef DEBUG_STREAMS
-		sstream->out_byte_count += iv_size + encrypted_key_size;
-#endif
-
-		// generate a mac key
-    if (1 != RAND_bytes(sstream->mac_key, MAC_KEY_SIZE))
+    const struct scrambler_package *package = sstream->context.package;
+    struct scrambler_header_pool *header_pool =
+        package == sstream->compact_package ? sstream->compact_header_pool : sstream->header_pool;
+    size_t header_size = MAGIC_SIZE + scrambler_package_header_size(package, sstream->public_key);
+    unsigned char header[header_size];
+    unsigned long long start_usecs = scrambler_stats_now_usecs();
+
+    // header and package information, followed by the header of the package
+    memcpy(header, scrambler_header, sizeof(scrambler_header));
+    header[sizeof(scrambler_header)] = package->id;
+
+    if (sstream->convergent_secret_size > 0) {
+        if (scrambler_package_seal_convergent_header(&sstream->context, header + MAGIC_SIZE, sstream->public_key,
+                sstream->convergent_secret, sstream->convergent_secret_size) != 0) {
+            i_error("scrambler_ostream_send_header: initialization of convergent encryption failed");
+            i_error_openssl("scrambler_ostream_send_header");
+            sstream->ostream.ostream.stream_errno = EIO;
+            return -1;
+        }
+    } else if (header_pool != NULL &&
+        scrambler_header_pool_take(header_pool, &sstream->context, header + MAGIC_SIZE)) {
+        sstream->stats.presealed_headers++;
+    } else if (package->seal_header(&sstream->context, header + MAGIC_SIZE, sstream->public_key) != 0) {
+        i_error("scrambler_ostream_send_header: initialization of public key encryption failed");
+        i_error_openssl("scrambler_ostream_send_header");
+        sstream->ostream.ostream.stream_errno = EIO;
         return -1;
+    }
 
-		// encrypt the mac key
-		unsigned char encrypted_mac_key[MAC_KEY_SIZE];
-		int encrypted_mac_key_size;
-		ASSERT_OPENSSL_SUCCESS(
-				EVP_SealUpdate(sstream->cipher_context,
-						encrypted_mac_key, &encrypted_mac_key_size, sstream->mac_key, MAC_KEY_SIZE), 1,
-				"scrambler_ostream_send_header", "mac key encryption failed", -1)
-		i_assert(encrypted_mac_key_size == MAC_KEY_SIZE);
-    o_stream_send(sstream->ostream.parent, encrypted_mac_key, encrypted_mac_key_size);
+    if (sstream->header_output != NULL)
+        buffer_append(sstream->header_output, header, header_size);
+    else
+        o_stream_send(sstream->ostream.parent, header, header_size);
+    safe_memset(header, 0, header_size);
+    sstream->header_sent = TRUE;
 #ifdef DEBUG_STREAMS
-		sstream->out_byte_count += encrypted_mac_key_size;
+		sstream->out_byte_count += header_size;
 #endif
 
-		// i_debug("write header / size = %d / parent_size = %d",
-		// 		0, (int)(iv_size + encrypted_key_size + encrypted_mac_key_size));
-
-    // i_debug_hex("mac key", sstream->mac_key, MAC_KEY_SIZE);
-
+    sstream->stats.key_operations++;
+    sstream->stats.header_usecs += scrambler_stats_now_usecs() - start_usecs;
     return 0;
 }
 
@@ -122,66 +133,71 @@ static ssize_t scrambler_ostream_send_chunk(
     size_t chunk_size,
 		bool final
 ) {
-    int encrypted_size = 0;
-		unsigned short total_encrypted_size = 0;
-		unsigned char encrypted[chunk_size + EVP_CIPHER_block_size(sstream->cipher) - 1];
+		unsigned char encrypted[ENCRYPTED_CHUNK_SIZE];
+    ssize_t encrypted_size;
+
+    if (!sstream->header_sent && scrambler_ostream_send_header(sstream) < 0)
+        return -1;
 
 #ifdef DEBUG_STREAMS
-		// i_debug("chunk %s", chunk);
 		i_debug_hex("chunk", chunk, chunk_size);
 #endif
 
-		ASSERT_OPENSSL_SUCCESS(
-				EVP_SealUpdate(sstream->cipher_context, encrypted, &encrypted_size, chunk, chunk_size), 1,
-				"scrambler_ostream_send_chunk", "stream encryption failed", -1)
-		i_assert((size_t)encrypted_size == chunk_size);
-		total_encrypted_size += encrypted_size;
-
-		if (final) {
-				encrypted_size = 0;
-				ASSERT_OPENSSL_SUCCESS(
-						EVP_SealFinal(sstream->cipher_context, encrypted + total_encrypted_size, &encrypted_size), 1,
-						"scrambler_ostream_send_chunk", "stream finalization failed", -1)
-				total_encrypted_size += encrypted_size;
-		}
+    encrypted_size = sstream->context.package->seal_chunk(&sstream->context, chunk, chunk_size, final, encrypted);
+    ASSERT_OPENSSL_SUCCESS(encrypted_size >= 0, TRUE,
+        "scrambler_ostream_send_chunk", "stream encryption failed", -1)
 
-		unsigned short header = total_encrypted_size;
-		if (final)
-				header |= 0x8000; // set msb
-		else
-				header &= 0x7fff; // clear msb
-
-		unsigned int tag_size;
-		unsigned char tag[CHUNK_TAG_SIZE];
-		const unsigned char *blocks[] = {
-				(unsigned char *)&sstream->chunk_index,
-				(unsigned char *)&header,
-				encrypted,
-				NULL
-		};
-		size_t block_sizes[] = {
-			sizeof(unsigned int),
-			sizeof(unsigned short),
-			total_encrypted_size,
-			0
-		};
-
-		scrambler_generate_mac(tag, &tag_size, blocks, block_sizes, sstream->mac_key, MAC_KEY_SIZE);
-		i_assert(tag_size == CHUNK_TAG_SIZE);
-
-		o_stream_send(sstream->ostream.parent, &header, sizeof(unsigned short));
-		o_stream_send(sstream->ostream.parent, encrypted, total_encrypted_size);
-    o_stream_send(sstream->ostream.parent, tag, tag_size);
+		o_stream_send(sstream->ostream.parent, encrypted, encrypted_size);
 #ifdef DEBUG_STREAMS
-		sstream->out_byte_count += sizeof(unsigned short) + total_encrypted_size + tag_size;
+		sstream->out_byte_count += encrypted_size;
 #endif
 
-		sstream->chunk_index++;
-
     return chunk_size;
 }
 
-static ssize_t scrambler_ostream_sendv(
+// Writes the header of the rewrapped mail and copies the stored chunks behind it.
+static int scrambler_ostream_send_stored(struct scrambler_ostream *sstream) {
+    struct istream *chunks = sstream->stored_chunks;
+    const unsigned char *data;
+    size_t size;
+
+    o_stream_send(sstream->ostream.parent, sstream->stored_header, sstream->stored_header_size);
+    sstream->header_sent = TRUE;
+
+    while (i_stream_read_data(chunks, &data, &size, 0) > 0) {
+        o_stream_send(sstream->ostream.parent, data, size);
+        i_stream_skip(chunks, size);
+    }
+
+    if (chunks->stream_errno != 0) {
+        i_error("scrambler_ostream_send_stored: read(%s) failed: %s", i_stream_get_name(chunks),
+            strerror(chunks->stream_errno));
+        sstream->ostream.ostream.stream_errno = chunks->stream_errno;
+        return -1;
+    }
+    return 0;
+}
+
+static void scrambler_ostream_tee(
+    struct scrambler_ostream *sstream,
+    const struct const_iovec *iov,
+    unsigned int iov_count
+) {
+    struct scrambler_ostream_tee *tee = sstream->tee;
+    unsigned int index;
+
+    for (index = 0; index < iov_count; index++) {
+        if (tee->data->used + iov[index].iov_len > tee->max_size) {
+            buffer_set_used_size(tee->data, 0);
+            tee->overflow = TRUE;
+            sstream->tee = NULL;
+            return;
+        }
+        buffer_append(tee->data, iov[index].iov_base, iov[index].iov_len);
+    }
+}
+
+static ssize_t scrambler_ostream_sendv_chunks(
     struct ostream_private *stream,
     const struct const_iovec *iov,
     unsigned int iov_count
@@ -190,6 +206,17 @@ static ssize_t scrambler_ostream_sendv(
 		ssize_t result = 0;
     ssize_t encrypt_result = 0;
 
+    if (sstream->stored_chunks != NULL) {
+        // the stored chunks hold the same data already
+        for (unsigned int index = 0; index < iov_count; index++)
+            result += iov[index].iov_len;
+        stream->ostream.offset += result;
+        return result;
+    }
+
+    if (sstream->tee != NULL)
+        scrambler_ostream_tee(sstream, iov, iov_count);
+
     // encrypt and send data
 		unsigned int index;
     const unsigned char *source, *source_end;
@@ -234,14 +261,46 @@ static ssize_t scrambler_ostream_sendv(
 		return result;
 }
 
-static int scrambler_ostream_flush(struct ostream_private *stream) {
+static ssize_t scrambler_ostream_sendv(
+    struct ostream_private *stream,
+    const struct const_iovec *iov,
+    unsigned int iov_count
+) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)stream;
+    unsigned long long start_usecs;
+    ssize_t result;
+
+    if (sstream->trace == NULL)
+        return scrambler_ostream_sendv_chunks(stream, iov, iov_count);
+
+    start_usecs = scrambler_stats_now_usecs();
+    result = scrambler_ostream_sendv_chunks(stream, iov, iov_count);
+    sstream->write_usecs += scrambler_stats_now_usecs() - start_usecs;
+    sstream->send_count++;
+
+    return result;
+}
+
+static int scrambler_ostream_flush_final(struct ostream_private *stream) {
     struct scrambler_ostream *sstream = (struct scrambler_ostream *)stream;
     ssize_t result;
 
     if (sstream->flushed)
         return 0;
 
-		if (sstream->cipher_context != NULL) {
+    if (sstream->stored_chunks != NULL) {
+        if (!sstream->header_sent && scrambler_ostream_send_stored(sstream) < 0)
+            return -1;
+    } else if (!sstream->header_sent) {
+        // nothing has been sealed yet, so the mail fits into a single chunk. Empty mails are written as a header and
+        // an empty final chunk
+        if (sstream->compact_package != NULL)
+            scrambler_package_context_init(&sstream->context, sstream->compact_package, &sstream->stats);
+        if (scrambler_ostream_send_header(sstream) < 0)
+            return -1;
+    }
+
+		if (sstream->context.cipher_context != NULL) {
 				ssize_t result = scrambler_ostream_send_chunk(sstream, sstream->chunk_buffer, sstream->chunk_buffer_size, TRUE);
 				if (result < 0) {
 					i_error("error sending last chunk on close");
@@ -250,8 +309,7 @@ static int scrambler_ostream_flush(struct ostream_private *stream) {
 				sstream->chunk_buffer_size = 0;
 				sstream->ostream.ostream.offset += result;
 
-				EVP_CIPHER_CTX_free(sstream->cipher_context);
-				sstream->cipher_context = NULL;
+				scrambler_package_context_deinit(&sstream->context);
 		}
 
     result = o_stream_flush(stream->parent);
@@ -267,11 +325,26 @@ static int scrambler_ostream_flush(struct ostream_private *stream) {
 		return result;
 }
 
+static int scrambler_ostream_flush(struct ostream_private *stream) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)stream;
+    unsigned long long start_usecs;
+    int result;
+
+    if (sstream->trace == NULL)
+        return scrambler_ostream_flush_final(stream);
+
+    start_usecs = scrambler_stats_now_usecs();
+    result = scrambler_ostream_flush_final(stream);
+    sstream->write_usecs += scrambler_stats_now_usecs() - start_usecs;
+
+    return result;
+}
+
 static void scrambler_ostream_close(struct iostream_private *stream, bool close_parent) {
     struct scrambler_ostream *sstream = (struct scrambler_ostream *)stream;
 
 		/*
-		if (sstream->cipher_context != NULL) {
+		if (sstream->context.cipher_context != NULL) {
 				ssize_t result = scrambler_ostream_send_chunk(sstream, sstream->chunk_buffer, sstream->chunk_buffer_size, TRUE);
 				if (result < 0) {
 						i_error("error sending last chunk on close");
@@ -279,52 +352,143 @@ static void scrambler_ostream_close(struct iostream_private *stream, bool close_
 				}
 				sstream->chunk_buffer_size = 0;
 				sstream->ostream.ostream.offset += result;
-
-        EVP_CIPHER_CTX_free(sstream->cipher_context);
-        sstream->cipher_context = NULL;
     }
 		*/
 
+    // streams that are closed without the final flush
+    scrambler_package_context_deinit(&sstream->context);
+    safe_memset(sstream->convergent_secret, 0, sizeof(sstream->convergent_secret));
+    sstream->header_output = NULL;
+    i_free(sstream->stored_header);
+    if (sstream->stored_chunks != NULL)
+        i_stream_unref(&sstream->stored_chunks);
+    scrambler_pool_put_chunk_buffer(sstream->chunk_buffer);
+    sstream->chunk_buffer = NULL;
+
 #ifdef DEBUG_STREAMS
 		i_debug("scrambler ostream close - %u bytes in / %u bytes out / %u bytes overhead",
 				sstream->in_byte_count, sstream->out_byte_count, sstream->out_byte_count - sstream->in_byte_count);
 #endif
 
+    if (sstream->trace != NULL) {
+        scrambler_trace_write_finished(sstream->trace, sstream->trace_label, sstream->write_usecs,
+            sstream->send_count, &sstream->stats);
+        sstream->trace = NULL;
+        i_free(sstream->trace_label);
+    }
+
+    if (sstream->target_stats != NULL) {
+        scrambler_stats_add(sstream->target_stats, &sstream->stats);
+        sstream->target_stats = NULL;
+    }
+
 		if (close_parent)
 	    	o_stream_close(sstream->ostream.parent);
 }
 
-struct ostream *scrambler_ostream_create(struct ostream *output, EVP_PKEY *public_key) {
+void scrambler_ostream_set_trace(struct ostream *output, struct scrambler_trace *trace, const char *label) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+
+    sstream->trace = trace;
+    i_free(sstream->trace_label);
+    sstream->trace_label = i_strdup(label);
+}
+
+void scrambler_ostream_set_header_pool(struct ostream *output, struct scrambler_header_pool *header_pool) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+    i_assert(!sstream->header_sent);
+
+    sstream->header_pool = header_pool;
+}
+
+void scrambler_ostream_set_tee(struct ostream *output, struct scrambler_ostream_tee *tee) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+    i_assert(output->offset == 0);
+
+    sstream->tee = tee;
+}
+
+void scrambler_ostream_set_compact(struct ostream *output, struct scrambler_header_pool *header_pool) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+    i_assert(!sstream->header_sent);
+
+    sstream->compact_package = scrambler_package_compact_for_key(sstream->public_key);
+    sstream->compact_header_pool = header_pool;
+}
+
+void scrambler_ostream_set_convergent(
+    struct ostream *output,
+    const unsigned char *secret, size_t secret_size,
+    buffer_t *header_output
+) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+    i_assert(!sstream->header_sent);
+    i_assert(secret_size > 0 && secret_size <= sizeof(sstream->convergent_secret));
+
+    memcpy(sstream->convergent_secret, secret, secret_size);
+    sstream->convergent_secret_size = secret_size;
+    sstream->header_output = header_output;
+    // random headers from the pools and the compact package don't fit
+    sstream->header_pool = NULL;
+    sstream->compact_package = NULL;
+    sstream->compact_header_pool = NULL;
+}
+
+void scrambler_ostream_set_stored(
+    struct ostream *output,
+    const unsigned char *header, size_t header_size,
+    struct istream *chunks
+) {
+    struct scrambler_ostream *sstream = (struct scrambler_ostream *)output->real_stream;
+
+    i_assert(output->real_stream->sendv == scrambler_ostream_sendv);
+    i_assert(output->offset == 0);
+
+    sstream->stored_header = i_malloc(header_size);
+    memcpy(sstream->stored_header, header, header_size);
+    sstream->stored_header_size = header_size;
+    i_stream_ref(chunks);
+    sstream->stored_chunks = chunks;
+}
+
+struct ostream *scrambler_ostream_create(
+    struct ostream *output,
+    EVP_PKEY *public_key,
+    struct scrambler_stats *stats
+) {
     struct scrambler_ostream *sstream = i_new(struct scrambler_ostream, 1);
-    struct ostream *result;
 
 #ifdef DEBUG_STREAMS
 		i_debug("scrambler ostream create");
 #endif
 
-    sstream->package = PACKAGE_RSA_2048_AES_128_CTR_HMAC;
-
     sstream->public_key = public_key;
-    sstream->cipher_context = EVP_CIPHER_CTX_new();
+    scrambler_package_context_init(&sstream->context, scrambler_package_for_key(public_key), &sstream->stats);
 
-		sstream->chunk_index = 0;
+    sstream->chunk_buffer = scrambler_pool_get_chunk_buffer();
+    if (sstream->chunk_buffer == NULL)
+        i_fatal_status(FATAL_OUTOFMEM, "scrambler_ostream_create: chunk buffer allocation failed");
     sstream->chunk_buffer_size = 0;
 #ifdef DEBUG_STREAMS
 		sstream->in_byte_count = 0;
 		sstream->out_byte_count = 0;
 #endif
     sstream->flushed = FALSE;
+    sstream->target_stats = stats;
 
     sstream->ostream.iostream.close = scrambler_ostream_close;
     sstream->ostream.sendv = scrambler_ostream_sendv;
     sstream->ostream.flush = scrambler_ostream_flush;
 
-    result = o_stream_create(&sstream->ostream, output, o_stream_get_fd(output));
-
-    if (scrambler_ostream_send_header(sstream) < 0) {
-        i_error("error creating ostream");
-        return NULL;
-    }
-
-    return result;
+    return o_stream_create(&sstream->ostream, output, o_stream_get_fd(output));
 }
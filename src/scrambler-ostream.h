@@ -24,6 +24,56 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
-struct ostream *scrambler_ostream_create(struct ostream *parent_ostream, EVP_PKEY *public_key);
+#include "scrambler-header-pool.h"
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
+
+// Structs
+
+// Copy of the plain text written to the stream, see scrambler_ostream_set_tee().
+struct scrambler_ostream_tee {
+    buffer_t *data;
+    size_t max_size;
+    // set once more than max_size bytes have been written, the data is emptied then
+    bool overflow;
+};
+
+// Functions
+
+// Records the time spent in writing the stream in the trace and logs it with the label, if it's slow.
+void scrambler_ostream_set_trace(struct ostream *output, struct scrambler_trace *trace, const char *label);
+
+// Takes the header from the pool instead of sealing it on the first write, if one is ready. Has to be set before the
+// first write.
+void scrambler_ostream_set_header_pool(struct ostream *output, struct scrambler_header_pool *header_pool);
+
+// Writes mails, that fit into a single chunk, with the compact package of the key. The header pool holds headers of
+// that package and may be NULL. Has to be set before the first write.
+void scrambler_ostream_set_compact(struct ostream *output, struct scrambler_header_pool *header_pool);
+
+// Copies the plain text written to the stream into the tee, until it exceeds the maximum size of the tee. The tee has
+// to outlive the writes to the stream.
+void scrambler_ostream_set_tee(struct ostream *output, struct scrambler_ostream_tee *tee);
+
+// Encrypts with content key, iv and mac key derived from the secret, so the same secret gives the same chunks. The
+// header with the wrapped content key is appended to header_output instead of being written to the parent, which only
+// receives the chunks then. Has to be set before the first write.
+void scrambler_ostream_set_convergent(
+    struct ostream *output,
+    const unsigned char *secret, size_t secret_size,
+    buffer_t *header_output);
+
+// Rewraps a stored mail for another key: the header, which starts with the magic, and the stored chunks behind it are
+// written instead of the data written to the stream, which is discarded. The chunks have to be encrypted with the
+// content key of the header, see scrambler_package_rewrap_header(). Has to be set before the first write.
+void scrambler_ostream_set_stored(
+    struct ostream *output,
+    const unsigned char *header, size_t header_size,
+    struct istream *chunks);
+
+struct ostream *scrambler_ostream_create(
+    struct ostream *parent_ostream,
+    EVP_PKEY *public_key,
+    struct scrambler_stats *stats);
 
 #endif
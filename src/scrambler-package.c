@@ -0,0 +1,1105 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <openssl/aes.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#include <openssl/kdf.h>
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "scrambler-common.h"
+#include "scrambler-stats.h"
+#include "scrambler-package.h"
+#include "scrambler-pool.h"
+
+// Functions
+
+static size_t scrambler_package_rsa_wrapped_key_size(EVP_PKEY *key) {
+    return EVP_PKEY_size(key);
+}
+
+// With implicit rejection, which OpenSSL 3.2 enables by default, a wrong private key yields a random key instead of
+// an error. The padding check is kept, so mails of another key fail to unwrap, the chunk tags are checked anyway.
+static int scrambler_package_rsa_disable_implicit_rejection(EVP_PKEY_CTX *context ATTR_UNUSED) {
+#ifdef OSSL_ASYM_CIPHER_PARAM_IMPLICIT_REJECTION
+    unsigned int implicit_rejection = 0;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_uint(OSSL_ASYM_CIPHER_PARAM_IMPLICIT_REJECTION, &implicit_rejection),
+        OSSL_PARAM_construct_end()
+    };
+
+    return EVP_PKEY_CTX_set_params(context, params);
+#else
+    return 1;
+#endif
+}
+
+static int scrambler_package_rsa_unwrap_key(
+    unsigned char *key, size_t *key_size,
+    const unsigned char *wrapped_key, size_t wrapped_key_size,
+    EVP_PKEY *private_key
+) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new(private_key, NULL);
+    // OpenSSL wants room for a whole RSA block, even though the key is much shorter
+    unsigned char decrypted[MAXIMAL_RSA_KEY_SIZE];
+    size_t decrypted_size = sizeof(decrypted);
+    int result = -1;
+
+    // same padding as EVP_OpenInit, which has been used by earlier versions
+    if (context != NULL &&
+        EVP_PKEY_decrypt_init(context) == 1 &&
+        EVP_PKEY_CTX_set_rsa_padding(context, RSA_PKCS1_PADDING) == 1 &&
+        scrambler_package_rsa_disable_implicit_rejection(context) == 1 &&
+        EVP_PKEY_decrypt(context, decrypted, &decrypted_size, wrapped_key, wrapped_key_size) == 1 &&
+        decrypted_size <= *key_size) {
+        memcpy(key, decrypted, decrypted_size);
+        *key_size = decrypted_size;
+        result = 0;
+    }
+
+    OPENSSL_cleanse(decrypted, sizeof(decrypted));
+    EVP_PKEY_CTX_free(context);
+    return result;
+}
+
+static int scrambler_package_rsa_wrap_key(
+    unsigned char *wrapped_key, size_t *wrapped_key_size,
+    const unsigned char *key, size_t key_size,
+    EVP_PKEY *public_key
+) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new(public_key, NULL);
+    int result = -1;
+
+    // same padding as EVP_SealInit
+    if (context != NULL &&
+        EVP_PKEY_encrypt_init(context) == 1 &&
+        EVP_PKEY_CTX_set_rsa_padding(context, RSA_PKCS1_PADDING) == 1 &&
+        EVP_PKEY_encrypt(context, wrapped_key, wrapped_key_size, key, key_size) == 1)
+        result = 0;
+
+    EVP_PKEY_CTX_free(context);
+    return result;
+}
+
+#ifdef HAVE_X25519
+static int scrambler_package_hkdf(
+    unsigned char *output, size_t output_size,
+    const unsigned char *secret, size_t secret_size,
+    const unsigned char *salt, size_t salt_size,
+    const char *info
+) {
+#ifdef HAVE_OPENSSL_3
+    EVP_KDF_CTX *context = EVP_KDF_CTX_new(scrambler_hkdf());
+    OSSL_PARAM parameters[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char *)EVP_MD_get0_name(scrambler_sha256()), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void *)salt, salt_size),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void *)secret, secret_size),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void *)info, strlen(info)),
+        OSSL_PARAM_construct_end()
+    };
+    int result = -1;
+
+    if (context != NULL && EVP_KDF_derive(context, output, output_size, parameters) == 1)
+        result = 0;
+
+    EVP_KDF_CTX_free(context);
+    return result;
+#else
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    int result = -1;
+
+    if (context != NULL &&
+        EVP_PKEY_derive_init(context) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(context, scrambler_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(context, salt, salt_size) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(context, secret, secret_size) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(context, (const unsigned char *)info, strlen(info)) == 1 &&
+        EVP_PKEY_derive(context, output, &output_size) == 1)
+        result = 0;
+
+    EVP_PKEY_CTX_free(context);
+    return result;
+#endif
+}
+
+// Derives the key encryption key from the key agreement of the own and the peer key. Both public keys go into the
+// salt, so the wrapped key is bound to the recipient.
+static int scrambler_package_x25519_derive_kek(
+    unsigned char *kek, size_t kek_size,
+    EVP_PKEY *own_key, EVP_PKEY *peer_key,
+    const unsigned char *ephemeral_public_key,
+    EVP_PKEY *recipient_key
+) {
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new(own_key, NULL);
+    unsigned char secret[X25519_KEY_SIZE], salt[2 * X25519_KEY_SIZE];
+    size_t secret_size = sizeof(secret), public_key_size = X25519_KEY_SIZE;
+    int result = -1;
+
+    memcpy(salt, ephemeral_public_key, X25519_KEY_SIZE);
+    if (context != NULL &&
+        EVP_PKEY_derive_init(context) == 1 &&
+        EVP_PKEY_derive_set_peer(context, peer_key) == 1 &&
+        EVP_PKEY_derive(context, secret, &secret_size) == 1 &&
+        EVP_PKEY_get_raw_public_key(recipient_key, salt + X25519_KEY_SIZE, &public_key_size) == 1 &&
+        scrambler_package_hkdf(kek, kek_size, secret, secret_size, salt, sizeof(salt),
+            "scrambler x25519 key wrap") == 0)
+        result = 0;
+
+    EVP_PKEY_CTX_free(context);
+    OPENSSL_cleanse(secret, sizeof(secret));
+    return result;
+}
+
+static size_t scrambler_package_x25519_wrapped_key_size(EVP_PKEY *key ATTR_UNUSED) {
+    // ephemeral public key and the content key
+    return X25519_KEY_SIZE + EVP_CIPHER_key_length(scrambler_aes_128_ctr());
+}
+
+static int scrambler_package_x25519_wrap_key(
+    unsigned char *wrapped_key, size_t *wrapped_key_size,
+    const unsigned char *key, size_t key_size,
+    EVP_PKEY *public_key
+) {
+    EVP_PKEY_CTX *context;
+    EVP_PKEY *ephemeral_key = NULL;
+    unsigned char kek[EVP_MAX_KEY_LENGTH];
+    size_t public_key_size = X25519_KEY_SIZE;
+    int result = -1;
+
+    if (key_size > sizeof(kek) || *wrapped_key_size < X25519_KEY_SIZE + key_size)
+        return -1;
+
+    context = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    if (context != NULL &&
+        EVP_PKEY_keygen_init(context) == 1 &&
+        EVP_PKEY_keygen(context, &ephemeral_key) == 1 &&
+        EVP_PKEY_get_raw_public_key(ephemeral_key, wrapped_key, &public_key_size) == 1 &&
+        scrambler_package_x25519_derive_kek(kek, key_size, ephemeral_key, public_key, wrapped_key,
+            public_key) == 0) {
+        // the kek is used only once, tampering shows up as a chunk tag mismatch, because the mac key is derived
+        // from the content key
+        for (size_t index = 0; index < key_size; index++)
+            wrapped_key[X25519_KEY_SIZE + index] = key[index] ^ kek[index];
+        *wrapped_key_size = X25519_KEY_SIZE + key_size;
+        result = 0;
+    }
+
+    EVP_PKEY_free(ephemeral_key);
+    EVP_PKEY_CTX_free(context);
+    OPENSSL_cleanse(kek, sizeof(kek));
+    return result;
+}
+
+static int scrambler_package_x25519_unwrap_key(
+    unsigned char *key, size_t *key_size,
+    const unsigned char *wrapped_key, size_t wrapped_key_size,
+    EVP_PKEY *private_key
+) {
+    EVP_PKEY *ephemeral_key;
+    unsigned char kek[EVP_MAX_KEY_LENGTH];
+    size_t unwrapped_key_size = wrapped_key_size - X25519_KEY_SIZE;
+    int result = -1;
+
+    if (wrapped_key_size <= X25519_KEY_SIZE || unwrapped_key_size > MIN(*key_size, sizeof(kek)))
+        return -1;
+
+    ephemeral_key = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, wrapped_key, X25519_KEY_SIZE);
+    if (ephemeral_key != NULL &&
+        scrambler_package_x25519_derive_kek(kek, unwrapped_key_size, private_key, ephemeral_key, wrapped_key,
+            private_key) == 0) {
+        for (size_t index = 0; index < unwrapped_key_size; index++)
+            key[index] = wrapped_key[X25519_KEY_SIZE + index] ^ kek[index];
+        *key_size = unwrapped_key_size;
+        result = 0;
+    }
+
+    EVP_PKEY_free(ephemeral_key);
+    OPENSSL_cleanse(kek, sizeof(kek));
+    return result;
+}
+#endif
+
+// Fills output with random bytes or, while a convergent header is sealed, with the HMAC of the label keyed with the
+// secret. So the same secret always gives the same content key, iv and mac key.
+static int scrambler_package_key_material(
+    struct scrambler_package_context *context,
+    unsigned char *output, size_t output_size,
+    const char *label
+) {
+    scrambler_mac_context_t *mac_context;
+    unsigned char derived[MAC_KEY_SIZE];
+    int result = -1;
+
+    if (context->convergent_secret == NULL)
+        return RAND_bytes(output, output_size) == 1 ? 0 : -1;
+    if (output_size > sizeof(derived))
+        return -1;
+
+    mac_context = scrambler_pool_get_mac_context();
+    if (mac_context != NULL &&
+        scrambler_mac_init(mac_context, context->convergent_secret, context->convergent_secret_size,
+            scrambler_sha256()) == 0 &&
+        scrambler_mac_update(mac_context, (const unsigned char *)label, strlen(label)) == 0 &&
+        scrambler_mac_final(mac_context, derived, sizeof(derived)) == 0) {
+        memcpy(output, derived, output_size);
+        result = 0;
+    }
+
+    scrambler_pool_put_mac_context(mac_context);
+    OPENSSL_cleanse(derived, sizeof(derived));
+    return result;
+}
+
+// Writes key size field, iv and the wrapped content key and initializes the cipher with a new content key, which is
+// returned for the mac key setup.
+static int scrambler_package_seal_key(
+    struct scrambler_package_context *context,
+    unsigned char **header,
+    EVP_PKEY *public_key,
+    unsigned char *key, size_t *key_size_r,
+    const unsigned char **iv_r
+) {
+    const struct scrambler_package *package = context->package;
+    const EVP_CIPHER *cipher = package->cipher();
+    size_t key_size = EVP_CIPHER_key_length(cipher);
+    size_t wrapped_key_size = package->wrapped_key_size(public_key);
+    unsigned char *iv;
+
+    if (package->key_size_field_size > 0) {
+        if (wrapped_key_size < MINIMAL_RSA_KEY_SIZE || wrapped_key_size > MAXIMAL_RSA_KEY_SIZE)
+            return -1;
+        (*header)[0] = wrapped_key_size >> 8;
+        (*header)[1] = wrapped_key_size & 0xff;
+        *header += package->key_size_field_size;
+    }
+
+    iv = *header;
+    *header += EVP_CIPHER_iv_length(cipher);
+
+    if (context->cipher_context == NULL)
+        context->cipher_context = scrambler_pool_get_cipher_context();
+
+    if (context->cipher_context == NULL ||
+        scrambler_package_key_material(context, iv, EVP_CIPHER_iv_length(cipher), "scrambler convergent iv") < 0 ||
+        scrambler_package_key_material(context, key, key_size, "scrambler convergent key") < 0 ||
+        package->wrap_key(*header, &wrapped_key_size, key, key_size, public_key) < 0 ||
+        EVP_EncryptInit_ex(context->cipher_context, cipher, NULL, key, iv) != 1)
+        return -1;
+
+    memcpy(context->iv, iv, EVP_CIPHER_iv_length(cipher));
+    *header += wrapped_key_size;
+    *key_size_r = key_size;
+    *iv_r = iv;
+    return 0;
+}
+
+// Counterpart of scrambler_package_seal_key().
+static int scrambler_package_open_key(
+    struct scrambler_package_context *context,
+    const unsigned char **header,
+    EVP_PKEY *private_key,
+    unsigned char *key, size_t *key_size,
+    const unsigned char **iv_r,
+    const char **error_r
+) {
+    const struct scrambler_package *package = context->package;
+    const EVP_CIPHER *cipher = package->cipher();
+    size_t wrapped_key_size = package->wrapped_key_size(private_key);
+    const unsigned char *iv;
+
+    if (package->key_size_field_size > 0) {
+        if (scrambler_package_recorded_key_size(package, *header) != wrapped_key_size) {
+            *error_r = "wrapped for another key size";
+            return -1;
+        }
+        *header += package->key_size_field_size;
+    }
+
+    iv = *header;
+    *header += EVP_CIPHER_iv_length(cipher);
+
+    if (context->content_key != NULL) {
+        // unwrapped by the caller already
+        *key_size = MIN(*key_size, context->content_key_size);
+        memcpy(key, context->content_key, *key_size);
+    } else if (package->unwrap_key(key, key_size, *header, wrapped_key_size, private_key) < 0) {
+        *key_size = 0;
+    }
+    if (*key_size != (size_t)EVP_CIPHER_key_length(cipher)) {
+        *error_r = "content key unwrapping failed";
+        return -1;
+    }
+    *header += wrapped_key_size;
+
+    if (context->cipher_context == NULL)
+        context->cipher_context = scrambler_pool_get_cipher_context();
+
+    if (context->cipher_context == NULL ||
+        EVP_DecryptInit_ex(context->cipher_context, cipher, NULL, key, iv) != 1) {
+        *error_r = "cipher initialization failed";
+        return -1;
+    }
+
+    memcpy(context->iv, iv, EVP_CIPHER_iv_length(cipher));
+    *iv_r = iv;
+    return 0;
+}
+
+// Header with a random mac key, which is encrypted as the start of the key stream.
+static int scrambler_package_stored_mac_key_seal_header(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key
+) {
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    const unsigned char *iv;
+    size_t key_size;
+    int encrypted_mac_key_size = 0, result = -1;
+
+    if (scrambler_package_seal_key(context, &header, public_key, key, &key_size, &iv) == 0 &&
+        scrambler_package_key_material(context, context->mac_key, MAC_KEY_SIZE, "scrambler convergent mac key") == 0 &&
+        EVP_EncryptUpdate(context->cipher_context, header, &encrypted_mac_key_size,
+            context->mac_key, MAC_KEY_SIZE) == 1 &&
+        encrypted_mac_key_size == MAC_KEY_SIZE)
+        result = 0;
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+static int scrambler_package_stored_mac_key_open_header(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const char **error_r
+) {
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    size_t key_size = sizeof(key);
+    const unsigned char *iv;
+    int decrypted_mac_key_size = 0, result = -1;
+
+    if (scrambler_package_open_key(context, &header, private_key, key, &key_size, &iv, error_r) == 0) {
+        if (EVP_DecryptUpdate(context->cipher_context, context->mac_key, &decrypted_mac_key_size,
+                header, MAC_KEY_SIZE) == 1 &&
+            decrypted_mac_key_size == MAC_KEY_SIZE)
+            result = 0;
+        else
+            *error_r = "mac key decryption failed";
+    }
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+#ifdef HAVE_X25519
+// Header without a mac key, it is derived from the content key. So a tampered wrapped key can't pass the chunk tags.
+static int scrambler_package_derived_mac_key_seal_header(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key
+) {
+    const EVP_CIPHER *cipher = context->package->cipher();
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    const unsigned char *iv;
+    size_t key_size;
+    int result = -1;
+
+    if (scrambler_package_seal_key(context, &header, public_key, key, &key_size, &iv) == 0 &&
+        scrambler_package_hkdf(context->mac_key, MAC_KEY_SIZE, key, key_size, iv, EVP_CIPHER_iv_length(cipher),
+            "scrambler mac key") == 0)
+        result = 0;
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+static int scrambler_package_derived_mac_key_open_header(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const char **error_r
+) {
+    const EVP_CIPHER *cipher = context->package->cipher();
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    size_t key_size = sizeof(key);
+    const unsigned char *iv;
+    int result = -1;
+
+    if (scrambler_package_open_key(context, &header, private_key, key, &key_size, &iv, error_r) == 0) {
+        if (scrambler_package_hkdf(context->mac_key, MAC_KEY_SIZE, key, key_size, iv,
+                EVP_CIPHER_iv_length(cipher), "scrambler mac key") == 0)
+            result = 0;
+        else
+            *error_r = "mac key derivation failed";
+    }
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+#endif
+
+// Tags a chunk with HMAC-SHA256 over chunk index, chunk header and ciphertext. The MAC context is keyed once per
+// mail, the later chunks only reset it, which doesn't look up the digest.
+static inline int scrambler_package_chunk_tag(
+    struct scrambler_package_context *context,
+    unsigned char *tag,
+    const unsigned char *header,
+    const unsigned char *encrypted, size_t encrypted_size
+) {
+    if (context->mac_context == NULL) {
+        context->mac_context = scrambler_pool_get_mac_context();
+        if (context->mac_context == NULL ||
+            scrambler_mac_init(context->mac_context, context->mac_key, MAC_KEY_SIZE, scrambler_sha256()) < 0)
+            return -1;
+    } else if (scrambler_mac_init(context->mac_context, NULL, 0, NULL) < 0) {
+        return -1;
+    }
+
+    if (scrambler_mac_update(context->mac_context, (unsigned char *)&context->chunk_index,
+            sizeof(unsigned int)) < 0 ||
+        scrambler_mac_update(context->mac_context, header, sizeof(unsigned short)) < 0 ||
+        scrambler_mac_update(context->mac_context, encrypted, encrypted_size) < 0 ||
+        scrambler_mac_final(context->mac_context, tag, CHUNK_TAG_SIZE) < 0)
+        return -1;
+
+    return 0;
+}
+
+static ssize_t scrambler_package_ctr_hmac_seal_chunk(
+    struct scrambler_package_context *context,
+    const unsigned char *chunk, size_t chunk_size,
+    bool final,
+    unsigned char *destination
+) {
+    unsigned char *encrypted = destination + sizeof(unsigned short);
+    unsigned long long start_usecs = 0, cipher_usecs = 0;
+    int encrypted_size = 0, final_size = 0;
+    unsigned short header;
+
+    if (context->stats != NULL)
+        start_usecs = scrambler_stats_now_usecs();
+
+    if (EVP_EncryptUpdate(context->cipher_context, encrypted, &encrypted_size, chunk, chunk_size) != 1 ||
+        (final && EVP_EncryptFinal_ex(context->cipher_context, encrypted + encrypted_size, &final_size) != 1))
+        return -1;
+    encrypted_size += final_size;
+    i_assert((size_t)encrypted_size == chunk_size);
+
+    if (context->stats != NULL)
+        cipher_usecs = scrambler_stats_now_usecs();
+
+    header = encrypted_size;
+    if (final)
+        header |= 0x8000; // set msb
+    memcpy(destination, &header, sizeof(unsigned short));
+
+    if (scrambler_package_chunk_tag(context, encrypted + encrypted_size, destination, encrypted, encrypted_size) < 0)
+        return -1;
+    context->chunk_index++;
+
+    if (context->stats != NULL) {
+        context->stats->cipher_usecs += cipher_usecs - start_usecs;
+        context->stats->mac_usecs += scrambler_stats_now_usecs() - cipher_usecs;
+        context->stats->encrypted_bytes += chunk_size;
+        context->stats->chunks_encrypted++;
+    }
+
+    return sizeof(unsigned short) + encrypted_size + CHUNK_TAG_SIZE;
+}
+
+static ssize_t scrambler_package_ctr_hmac_open_chunk(
+    struct scrambler_package_context *context,
+    const unsigned char *source, size_t source_size,
+    unsigned char *destination, size_t *decrypted_size_r,
+    bool *final_r,
+    const char **error_r
+) {
+    unsigned char generated_tag[CHUNK_TAG_SIZE];
+    unsigned long long start_usecs = 0, mac_usecs = 0;
+    unsigned short encrypted_size;
+    int decrypted_size = 0, final_size = 0;
+
+    if (source_size < sizeof(unsigned short)) {
+        *error_r = "truncated chunk header";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+    memcpy(&encrypted_size, source, sizeof(unsigned short));
+    *final_r = (encrypted_size & 0x8000) != 0;
+    encrypted_size &= 0x7fff; // clear msb
+
+    if (encrypted_size > CHUNK_SIZE ||
+        source_size - sizeof(unsigned short) < (size_t)encrypted_size + CHUNK_TAG_SIZE) {
+        *error_r = "failed to verify chunk size";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+
+    const unsigned char *encrypted = source + sizeof(unsigned short);
+    const unsigned char *tag = encrypted + encrypted_size;
+
+    if (context->stats != NULL)
+        start_usecs = scrambler_stats_now_usecs();
+
+    if (scrambler_package_chunk_tag(context, generated_tag, source, encrypted, encrypted_size) < 0) {
+        *error_r = "failed to generate chunk tag";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+
+    if (context->stats != NULL) {
+        mac_usecs = scrambler_stats_now_usecs();
+        context->stats->mac_usecs += mac_usecs - start_usecs;
+        context->stats->chunks_verified++;
+    }
+
+    if (CRYPTO_memcmp(tag, generated_tag, CHUNK_TAG_SIZE) != 0) {
+        *error_r = "failed to verify chunk tag";
+        return SCRAMBLER_CHUNK_TAG_MISMATCH;
+    }
+
+    if (destination != NULL) {
+        if (EVP_DecryptUpdate(context->cipher_context, destination, &decrypted_size, encrypted,
+                encrypted_size) != 1 ||
+            (*final_r && EVP_DecryptFinal_ex(context->cipher_context, destination + decrypted_size,
+                &final_size) != 1)) {
+            *error_r = "stream decryption failed";
+            return SCRAMBLER_CHUNK_MALFORMED;
+        }
+        *decrypted_size_r = decrypted_size + final_size;
+
+        if (context->stats != NULL) {
+            context->stats->cipher_usecs += scrambler_stats_now_usecs() - mac_usecs;
+            context->stats->decrypted_bytes += *decrypted_size_r;
+        }
+    }
+
+    context->chunk_index++;
+    return sizeof(unsigned short) + encrypted_size + CHUNK_TAG_SIZE;
+}
+
+static size_t scrambler_package_ctr_hmac_stored_chunk_size(const unsigned char *source, size_t source_size) {
+    unsigned short encrypted_size;
+
+    if (source_size < sizeof(unsigned short))
+        return 0;
+    memcpy(&encrypted_size, source, sizeof(unsigned short));
+    encrypted_size &= 0x7fff; // clear msb
+
+    // the chunk header is enough to reject an oversized chunk
+    if (encrypted_size > CHUNK_SIZE)
+        return sizeof(unsigned short);
+    return sizeof(unsigned short) + encrypted_size + CHUNK_TAG_SIZE;
+}
+
+// The key stream of a chunk starts behind the encrypted mac key, if the package stores one, and the chunks before it.
+// Both are multiples of the block size, so the counter is the iv plus the number of blocks before the chunk.
+static int scrambler_package_ctr_hmac_seek_chunk(struct scrambler_package_context *context, unsigned int chunk_index) {
+    const EVP_CIPHER *cipher = context->package->cipher();
+    unsigned long long blocks = ((unsigned long long)chunk_index * CHUNK_SIZE +
+        context->package->encrypted_mac_key_size) / AES_BLOCK_SIZE;
+    unsigned char counter[EVP_MAX_IV_LENGTH];
+    unsigned int carry = 0;
+    int index;
+
+    i_assert(CHUNK_SIZE % AES_BLOCK_SIZE == 0 && context->package->encrypted_mac_key_size % AES_BLOCK_SIZE == 0);
+
+    // big endian 128 bit addition, like the increment of the counter mode
+    memcpy(counter, context->iv, EVP_CIPHER_iv_length(cipher));
+    for (index = EVP_CIPHER_iv_length(cipher) - 1; index >= 0; index--) {
+        carry += counter[index] + (blocks & 0xff);
+        counter[index] = carry & 0xff;
+        carry >>= 8;
+        blocks >>= 8;
+    }
+
+    if (context->cipher_context == NULL ||
+        EVP_DecryptInit_ex(context->cipher_context, NULL, NULL, NULL, counter) != 1)
+        return -1;
+
+    context->chunk_index = chunk_index;
+    return 0;
+}
+
+// Header of the single chunk packages. The GCM tag authenticates the chunk with the content key, so there is no mac
+// key.
+static int scrambler_package_gcm_seal_header(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key
+) {
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    const unsigned char *iv;
+    size_t key_size;
+    int result;
+
+    result = scrambler_package_seal_key(context, &header, public_key, key, &key_size, &iv);
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+static int scrambler_package_gcm_open_header(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const char **error_r
+) {
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    size_t key_size = sizeof(key);
+    const unsigned char *iv;
+    int result;
+
+    result = scrambler_package_open_key(context, &header, private_key, key, &key_size, &iv, error_r);
+    OPENSSL_cleanse(key, sizeof(key));
+    return result;
+}
+
+// The chunk header goes into the tag as additional data, so the final flag and the size are authenticated as well.
+static ssize_t scrambler_package_gcm_seal_chunk(
+    struct scrambler_package_context *context,
+    const unsigned char *chunk, size_t chunk_size,
+    bool final,
+    unsigned char *destination
+) {
+    unsigned char *encrypted = destination + sizeof(unsigned short);
+    unsigned long long start_usecs = 0;
+    int encrypted_size = 0, final_size = 0;
+    unsigned short header;
+
+    // larger mails are written with the chunked package of the key
+    if (!final || context->chunk_index > 0 || chunk_size > CHUNK_SIZE)
+        return -1;
+
+    if (context->stats != NULL)
+        start_usecs = scrambler_stats_now_usecs();
+
+    header = chunk_size | 0x8000; // set msb
+    memcpy(destination, &header, sizeof(unsigned short));
+
+    if (EVP_EncryptUpdate(context->cipher_context, NULL, &encrypted_size, destination,
+            sizeof(unsigned short)) != 1 ||
+        EVP_EncryptUpdate(context->cipher_context, encrypted, &encrypted_size, chunk, chunk_size) != 1 ||
+        EVP_EncryptFinal_ex(context->cipher_context, encrypted + encrypted_size, &final_size) != 1 ||
+        EVP_CIPHER_CTX_ctrl(context->cipher_context, EVP_CTRL_GCM_GET_TAG, GCM_TAG_SIZE,
+            encrypted + chunk_size) != 1)
+        return -1;
+    i_assert((size_t)(encrypted_size + final_size) == chunk_size);
+    context->chunk_index++;
+
+    if (context->stats != NULL) {
+        context->stats->cipher_usecs += scrambler_stats_now_usecs() - start_usecs;
+        context->stats->encrypted_bytes += chunk_size;
+        context->stats->chunks_encrypted++;
+    }
+
+    return sizeof(unsigned short) + chunk_size + GCM_TAG_SIZE;
+}
+
+static ssize_t scrambler_package_gcm_open_chunk(
+    struct scrambler_package_context *context,
+    const unsigned char *source, size_t source_size,
+    unsigned char *destination, size_t *decrypted_size_r,
+    bool *final_r,
+    const char **error_r
+) {
+    // GCM decrypts while it computes the tag, without destination the plain text is dropped
+    unsigned char discarded[CHUNK_SIZE];
+    unsigned char *decrypted = destination != NULL ? destination : discarded;
+    unsigned long long start_usecs = 0;
+    unsigned short encrypted_size;
+    int decrypted_size = 0, final_size = 0;
+
+    if (source_size < sizeof(unsigned short)) {
+        *error_r = "truncated chunk header";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+    memcpy(&encrypted_size, source, sizeof(unsigned short));
+    *final_r = (encrypted_size & 0x8000) != 0;
+    encrypted_size &= 0x7fff; // clear msb
+
+    if (!*final_r || context->chunk_index > 0 || encrypted_size > CHUNK_SIZE ||
+        source_size - sizeof(unsigned short) < (size_t)encrypted_size + GCM_TAG_SIZE) {
+        *error_r = "failed to verify chunk size";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+
+    const unsigned char *encrypted = source + sizeof(unsigned short);
+    const unsigned char *tag = encrypted + encrypted_size;
+
+    if (context->stats != NULL)
+        start_usecs = scrambler_stats_now_usecs();
+
+    if (EVP_CIPHER_CTX_ctrl(context->cipher_context, EVP_CTRL_GCM_SET_TAG, GCM_TAG_SIZE, (void *)tag) != 1 ||
+        EVP_DecryptUpdate(context->cipher_context, NULL, &decrypted_size, source, sizeof(unsigned short)) != 1 ||
+        EVP_DecryptUpdate(context->cipher_context, decrypted, &decrypted_size, encrypted, encrypted_size) != 1) {
+        *error_r = "stream decryption failed";
+        return SCRAMBLER_CHUNK_MALFORMED;
+    }
+    if (EVP_DecryptFinal_ex(context->cipher_context, decrypted + decrypted_size, &final_size) != 1) {
+        OPENSSL_cleanse(decrypted, encrypted_size);
+        *error_r = "failed to verify chunk tag";
+        return SCRAMBLER_CHUNK_TAG_MISMATCH;
+    }
+    if (destination == NULL)
+        OPENSSL_cleanse(discarded, encrypted_size);
+    else
+        *decrypted_size_r = decrypted_size + final_size;
+
+    if (context->stats != NULL) {
+        context->stats->cipher_usecs += scrambler_stats_now_usecs() - start_usecs;
+        context->stats->chunks_verified++;
+        if (destination != NULL)
+            context->stats->decrypted_bytes += *decrypted_size_r;
+    }
+
+    context->chunk_index++;
+    return sizeof(unsigned short) + encrypted_size + GCM_TAG_SIZE;
+}
+
+static size_t scrambler_package_gcm_stored_chunk_size(const unsigned char *source, size_t source_size) {
+    unsigned short encrypted_size;
+
+    if (source_size < sizeof(unsigned short))
+        return 0;
+    memcpy(&encrypted_size, source, sizeof(unsigned short));
+    encrypted_size &= 0x7fff; // clear msb
+
+    if (encrypted_size > CHUNK_SIZE)
+        return sizeof(unsigned short);
+    return sizeof(unsigned short) + encrypted_size + GCM_TAG_SIZE;
+}
+
+// Constants
+
+static const struct scrambler_package scrambler_packages[] = {
+    {
+        .id = PACKAGE_RSA_2048_AES_128_CTR_HMAC,
+        .name = "rsa-2048-aes-128-ctr-hmac",
+        .key_type = EVP_PKEY_RSA,
+        .key_size_field_size = 0,
+        .encrypted_mac_key_size = MAC_KEY_SIZE,
+        .chunk_tag_size = CHUNK_TAG_SIZE,
+        .cipher = scrambler_aes_128_ctr,
+        .wrapped_key_size = scrambler_package_rsa_wrapped_key_size,
+        .wrap_key = scrambler_package_rsa_wrap_key,
+        .unwrap_key = scrambler_package_rsa_unwrap_key,
+        .seal_header = scrambler_package_stored_mac_key_seal_header,
+        .open_header = scrambler_package_stored_mac_key_open_header,
+        .seal_chunk = scrambler_package_ctr_hmac_seal_chunk,
+        .open_chunk = scrambler_package_ctr_hmac_open_chunk,
+        .stored_chunk_size = scrambler_package_ctr_hmac_stored_chunk_size,
+        .seek_chunk = scrambler_package_ctr_hmac_seek_chunk
+    },
+#ifdef HAVE_X25519
+    {
+        .id = PACKAGE_X25519_AES_128_CTR_HMAC,
+        .name = "x25519-aes-128-ctr-hmac",
+        .key_type = EVP_PKEY_X25519,
+        .key_size_field_size = 0,
+        .encrypted_mac_key_size = 0,
+        .chunk_tag_size = CHUNK_TAG_SIZE,
+        .cipher = scrambler_aes_128_ctr,
+        .wrapped_key_size = scrambler_package_x25519_wrapped_key_size,
+        .wrap_key = scrambler_package_x25519_wrap_key,
+        .unwrap_key = scrambler_package_x25519_unwrap_key,
+        .seal_header = scrambler_package_derived_mac_key_seal_header,
+        .open_header = scrambler_package_derived_mac_key_open_header,
+        .seal_chunk = scrambler_package_ctr_hmac_seal_chunk,
+        .open_chunk = scrambler_package_ctr_hmac_open_chunk,
+        .stored_chunk_size = scrambler_package_ctr_hmac_stored_chunk_size,
+        .seek_chunk = scrambler_package_ctr_hmac_seek_chunk
+    },
+#endif
+    {
+        .id = PACKAGE_RSA_AES_128_CTR_HMAC,
+        .name = "rsa-aes-128-ctr-hmac",
+        .key_type = EVP_PKEY_RSA,
+        .key_size_field_size = KEY_SIZE_FIELD_SIZE,
+        .encrypted_mac_key_size = MAC_KEY_SIZE,
+        .chunk_tag_size = CHUNK_TAG_SIZE,
+        .cipher = scrambler_aes_128_ctr,
+        .wrapped_key_size = scrambler_package_rsa_wrapped_key_size,
+        .wrap_key = scrambler_package_rsa_wrap_key,
+        .unwrap_key = scrambler_package_rsa_unwrap_key,
+        .seal_header = scrambler_package_stored_mac_key_seal_header,
+        .open_header = scrambler_package_stored_mac_key_open_header,
+        .seal_chunk = scrambler_package_ctr_hmac_seal_chunk,
+        .open_chunk = scrambler_package_ctr_hmac_open_chunk,
+        .stored_chunk_size = scrambler_package_ctr_hmac_stored_chunk_size,
+        .seek_chunk = scrambler_package_ctr_hmac_seek_chunk
+    },
+    {
+        .id = PACKAGE_RSA_AES_128_GCM_SINGLE,
+        .name = "rsa-aes-128-gcm-single",
+        .key_type = EVP_PKEY_RSA,
+        .key_size_field_size = KEY_SIZE_FIELD_SIZE,
+        .encrypted_mac_key_size = 0,
+        .chunk_tag_size = GCM_TAG_SIZE,
+        .single_chunk = TRUE,
+        .cipher = scrambler_aes_128_gcm,
+        .wrapped_key_size = scrambler_package_rsa_wrapped_key_size,
+        .wrap_key = scrambler_package_rsa_wrap_key,
+        .unwrap_key = scrambler_package_rsa_unwrap_key,
+        .seal_header = scrambler_package_gcm_seal_header,
+        .open_header = scrambler_package_gcm_open_header,
+        .seal_chunk = scrambler_package_gcm_seal_chunk,
+        .open_chunk = scrambler_package_gcm_open_chunk,
+        .stored_chunk_size = scrambler_package_gcm_stored_chunk_size,
+        .seek_chunk = NULL
+    },
+#ifdef HAVE_X25519
+    {
+        .id = PACKAGE_X25519_AES_128_GCM_SINGLE,
+        .name = "x25519-aes-128-gcm-single",
+        .key_type = EVP_PKEY_X25519,
+        .key_size_field_size = 0,
+        .encrypted_mac_key_size = 0,
+        .chunk_tag_size = GCM_TAG_SIZE,
+        .single_chunk = TRUE,
+        .cipher = scrambler_aes_128_gcm,
+        .wrapped_key_size = scrambler_package_x25519_wrapped_key_size,
+        .wrap_key = scrambler_package_x25519_wrap_key,
+        .unwrap_key = scrambler_package_x25519_unwrap_key,
+        .seal_header = scrambler_package_gcm_seal_header,
+        .open_header = scrambler_package_gcm_open_header,
+        .seal_chunk = scrambler_package_gcm_seal_chunk,
+        .open_chunk = scrambler_package_gcm_open_chunk,
+        .stored_chunk_size = scrambler_package_gcm_stored_chunk_size,
+        .seek_chunk = NULL
+    },
+#endif
+};
+
+// Functions
+
+const struct scrambler_package *scrambler_package_get(enum packages id) {
+    for (unsigned int index = 0; index < N_ELEMENTS(scrambler_packages); index++) {
+        if (scrambler_packages[index].id == id)
+            return &scrambler_packages[index];
+    }
+    return NULL;
+}
+
+const struct scrambler_package *scrambler_package_for_key(EVP_PKEY *key) {
+    switch (EVP_PKEY_base_id(key)) {
+    case EVP_PKEY_RSA:
+        // 2048 bit keys keep the old package, so older versions can read the mails
+        if (EVP_PKEY_bits(key) == 2048)
+            return scrambler_package_get(PACKAGE_RSA_2048_AES_128_CTR_HMAC);
+        return scrambler_package_get(PACKAGE_RSA_AES_128_CTR_HMAC);
+#ifdef HAVE_X25519
+    case EVP_PKEY_X25519:
+        return scrambler_package_get(PACKAGE_X25519_AES_128_CTR_HMAC);
+#endif
+    }
+    return NULL;
+}
+
+const struct scrambler_package *scrambler_package_compact_for_key(EVP_PKEY *key) {
+    switch (EVP_PKEY_base_id(key)) {
+    case EVP_PKEY_RSA:
+        return scrambler_package_get(PACKAGE_RSA_AES_128_GCM_SINGLE);
+#ifdef HAVE_X25519
+    case EVP_PKEY_X25519:
+        return scrambler_package_get(PACKAGE_X25519_AES_128_GCM_SINGLE);
+#endif
+    }
+    return NULL;
+}
+
+bool scrambler_package_accepts_key(const struct scrambler_package *package, EVP_PKEY *key) {
+    return package != NULL && key != NULL && EVP_PKEY_base_id(key) == package->key_type;
+}
+
+size_t scrambler_package_header_size(const struct scrambler_package *package, EVP_PKEY *key) {
+    return scrambler_package_wrapped_key_offset(package) - MAGIC_SIZE +
+        package->wrapped_key_size(key) + package->encrypted_mac_key_size;
+}
+
+size_t scrambler_package_wrapped_key_offset(const struct scrambler_package *package) {
+    return MAGIC_SIZE + package->key_size_field_size + EVP_CIPHER_iv_length(package->cipher());
+}
+
+size_t scrambler_package_recorded_key_size(const struct scrambler_package *package, const unsigned char *header) {
+    if (package->key_size_field_size == 0)
+        return 0;
+
+    return ((size_t)header[0] << 8) | header[1];
+}
+
+bool scrambler_package_chunks_compatible(
+    const struct scrambler_package *package,
+    const struct scrambler_package *other
+) {
+    return package->key_type == other->key_type && package->cipher == other->cipher &&
+        package->encrypted_mac_key_size == other->encrypted_mac_key_size &&
+        package->single_chunk == other->single_chunk && package->open_header == other->open_header &&
+        package->open_chunk == other->open_chunk;
+}
+
+void scrambler_package_rewrap_header(
+    const struct scrambler_package *package,
+    const unsigned char *header,
+    size_t wrapped_key_size,
+    const struct scrambler_package *new_package,
+    const unsigned char *new_wrapped_key, size_t new_wrapped_key_size,
+    unsigned char *new_header
+) {
+    size_t iv_size = EVP_CIPHER_iv_length(package->cipher());
+
+    i_assert(scrambler_package_chunks_compatible(package, new_package));
+
+    header += package->key_size_field_size;
+    if (new_package->key_size_field_size > 0) {
+        new_header[0] = new_wrapped_key_size >> 8;
+        new_header[1] = new_wrapped_key_size & 0xff;
+        new_header += new_package->key_size_field_size;
+    }
+
+    memcpy(new_header, header, iv_size);
+    memcpy(new_header + iv_size, new_wrapped_key, new_wrapped_key_size);
+    memcpy(new_header + iv_size + new_wrapped_key_size, header + iv_size + wrapped_key_size,
+        package->encrypted_mac_key_size);
+}
+
+void scrambler_package_context_init(
+    struct scrambler_package_context *context,
+    const struct scrambler_package *package,
+    struct scrambler_stats *stats
+) {
+    memset(context, 0, sizeof(*context));
+    context->package = package;
+    context->stats = stats;
+}
+
+int scrambler_package_seal_convergent_header(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key,
+    const unsigned char *secret, size_t secret_size
+) {
+    int result;
+
+    context->convergent_secret = secret;
+    context->convergent_secret_size = secret_size;
+    result = context->package->seal_header(context, header, public_key);
+    context->convergent_secret = NULL;
+    context->convergent_secret_size = 0;
+    return result;
+}
+
+// Checks the tag of the first chunk with the opened context and positions the context at the first chunk again.
+static int scrambler_package_check_first_chunk(
+    struct scrambler_package_context *context,
+    const unsigned char *chunk, size_t chunk_size,
+    const char **error_r
+) {
+    struct scrambler_stats *stats = context->stats;
+    ssize_t result;
+    bool final;
+
+    // the chunk is counted, when it is opened again
+    context->stats = NULL;
+    result = context->package->open_chunk(context, chunk, chunk_size, NULL, NULL, &final, error_r);
+    context->stats = stats;
+    if (result < 0)
+        return result;
+
+    // the single chunk packages start over with the iv, the key is kept
+    if (context->package->seek_chunk != NULL ? context->package->seek_chunk(context, 0) < 0 :
+        EVP_DecryptInit_ex(context->cipher_context, NULL, NULL, NULL, context->iv) != 1) {
+        *error_r = "cipher initialization failed";
+        return -1;
+    }
+    context->chunk_index = 0;
+    return 0;
+}
+
+int scrambler_package_open_confirmed_header(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const unsigned char *chunk, size_t chunk_size,
+    const char **error_r
+) {
+    if (context->package->open_header(context, header, private_key, error_r) < 0)
+        return -1;
+    return scrambler_package_check_first_chunk(context, chunk, chunk_size, error_r);
+}
+
+int scrambler_package_confirm_key(
+    const struct scrambler_package *package,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const unsigned char *key, size_t key_size,
+    const unsigned char *chunk, size_t chunk_size,
+    const char **error_r
+) {
+    struct scrambler_package_context context;
+    int result;
+
+    scrambler_package_context_init(&context, package, NULL);
+    context.content_key = key;
+    context.content_key_size = key_size;
+    result = scrambler_package_open_confirmed_header(&context, header, private_key, chunk, chunk_size, error_r);
+    context.content_key = NULL;
+    context.content_key_size = 0;
+    scrambler_package_context_deinit(&context);
+    return result;
+}
+
+void scrambler_package_context_deinit(struct scrambler_package_context *context) {
+    scrambler_pool_put_cipher_context(context->cipher_context);
+    context->cipher_context = NULL;
+    scrambler_pool_put_mac_context(context->mac_context);
+    context->mac_context = NULL;
+    OPENSSL_cleanse(context->mac_key, sizeof(context->mac_key));
+    context->chunk_index = 0;
+}
+
+int scrambler_unwrap_key(
+    unsigned char *key, size_t *key_size,
+    const unsigned char *wrapped_key, size_t wrapped_key_size,
+    EVP_PKEY *private_key
+) {
+    const struct scrambler_package *package = scrambler_package_for_key(private_key);
+
+    if (package == NULL)
+        return -1;
+    return package->unwrap_key(key, key_size, wrapped_key, wrapped_key_size, private_key);
+}
+
+int scrambler_wrap_key(
+    unsigned char *wrapped_key, size_t *wrapped_key_size,
+    const unsigned char *key, size_t key_size,
+    EVP_PKEY *public_key
+) {
+    const struct scrambler_package *package = scrambler_package_for_key(public_key);
+
+    if (package == NULL)
+        return -1;
+    return package->wrap_key(wrapped_key, wrapped_key_size, key, key_size, public_key);
+}
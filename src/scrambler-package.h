@@ -0,0 +1,223 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_PACKAGE_H
+#define SCRAMBLER_PACKAGE_H
+
+#include <openssl/evp.h>
+
+#include "scrambler-common.h"
+#include "scrambler-stats.h"
+
+// Defines
+
+// Chunk errors, malformed data is reported as EIO, failed authentication as EACCES by the streams.
+#define SCRAMBLER_CHUNK_MALFORMED (-1)
+#define SCRAMBLER_CHUNK_TAG_MISMATCH (-2)
+
+// Structs
+
+struct scrambler_package;
+
+// State of one message while its chunks are sealed or opened.
+struct scrambler_package_context {
+    const struct scrambler_package *package;
+    EVP_CIPHER_CTX *cipher_context;
+    // initial counter of the key stream
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    unsigned char mac_key[MAC_KEY_SIZE];
+    // keyed with the mac key on the first chunk, the following chunks reuse the key setup
+    scrambler_mac_context_t *mac_context;
+    unsigned int chunk_index;
+    // only set while scrambler_package_seal_convergent_header() runs
+    const unsigned char *convergent_secret;
+    size_t convergent_secret_size;
+    // only set while scrambler_package_confirm_key() runs, the header is opened with it instead of unwrapping
+    const unsigned char *content_key;
+    size_t content_key_size;
+
+    // may be NULL
+    struct scrambler_stats *stats;
+};
+
+// Writes the header behind the magic for a new random content key into header, which has a size of
+// scrambler_package_header_size(), and initializes the context for sealing.
+typedef int scrambler_package_seal_header_t(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key);
+
+// Parses the header behind the magic, which has a size of scrambler_package_header_size(), and initializes the
+// context for opening. Doesn't log, so it can be used from worker threads.
+typedef int scrambler_package_open_header_t(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const char **error_r);
+
+// Encrypts the chunk and writes chunk header, ciphertext and tag to destination, which needs room for
+// ENCRYPTED_CHUNK_SIZE bytes. Returns the number of bytes written or -1.
+typedef ssize_t scrambler_package_seal_chunk_t(
+    struct scrambler_package_context *context,
+    const unsigned char *chunk, size_t chunk_size,
+    bool final,
+    unsigned char *destination);
+
+// Checks the tag of the chunk at source and decrypts it into destination, which needs room for CHUNK_SIZE bytes.
+// Without destination, only the tag is checked. Returns the size of the chunk in the source or one of the chunk
+// errors.
+typedef ssize_t scrambler_package_open_chunk_t(
+    struct scrambler_package_context *context,
+    const unsigned char *source, size_t source_size,
+    unsigned char *destination, size_t *decrypted_size_r,
+    bool *final_r,
+    const char **error_r);
+
+// Returns the stored size of the chunk at source, as far as it can be told from the first bytes, or 0 if there are too
+// few bytes to tell. Malformed chunks are left to open_chunk, which only needs the returned size to reject them.
+typedef size_t scrambler_package_stored_chunk_size_t(const unsigned char *source, size_t source_size);
+
+// Positions the opened context at the start of the chunk with the index, so it's opened next. All chunks except the
+// final one hold CHUNK_SIZE bytes, so the position in the key stream follows from the index.
+typedef int scrambler_package_seek_chunk_t(struct scrambler_package_context *context, unsigned int chunk_index);
+
+// Describes the key wrapping, the header layout and the chunk format of a package. The header behind the magic
+// is: key size field, iv, wrapped key, encrypted mac key. Fields of size 0 are left out.
+struct scrambler_package {
+    enum packages id;
+    const char *name;
+
+    // type of the keys the content keys are wrapped for
+    int key_type;
+    size_t key_size_field_size;
+    size_t encrypted_mac_key_size;
+    size_t chunk_tag_size;
+    // the whole mail is a single, final chunk
+    bool single_chunk;
+
+    const EVP_CIPHER *(*cipher)(void);
+
+    size_t (*wrapped_key_size)(EVP_PKEY *key);
+    int (*wrap_key)(
+        unsigned char *wrapped_key, size_t *wrapped_key_size,
+        const unsigned char *key, size_t key_size,
+        EVP_PKEY *public_key);
+    int (*unwrap_key)(
+        unsigned char *key, size_t *key_size,
+        const unsigned char *wrapped_key, size_t wrapped_key_size,
+        EVP_PKEY *private_key);
+
+    scrambler_package_seal_header_t *seal_header;
+    scrambler_package_open_header_t *open_header;
+    scrambler_package_seal_chunk_t *seal_chunk;
+    scrambler_package_open_chunk_t *open_chunk;
+    scrambler_package_stored_chunk_size_t *stored_chunk_size;
+    scrambler_package_seek_chunk_t *seek_chunk;
+};
+
+// Functions
+
+// Returns NULL, if the package is unknown or not supported by this build.
+const struct scrambler_package *scrambler_package_get(enum packages id);
+
+// The package new mails are written with for the public key or NULL, if there is none for the key type.
+const struct scrambler_package *scrambler_package_for_key(EVP_PKEY *key);
+
+// The single chunk package for the public key, that mails up to CHUNK_SIZE bytes can be written with, or NULL.
+const struct scrambler_package *scrambler_package_compact_for_key(EVP_PKEY *key);
+
+bool scrambler_package_accepts_key(const struct scrambler_package *package, EVP_PKEY *key);
+
+// Size of the header after the magic.
+size_t scrambler_package_header_size(const struct scrambler_package *package, EVP_PKEY *key);
+
+// Offset of the wrapped content key from the start of the container.
+size_t scrambler_package_wrapped_key_offset(const struct scrambler_package *package);
+
+// Returns the wrapped key size recorded in the header behind the magic, 0 if the package doesn't record it.
+size_t scrambler_package_recorded_key_size(const struct scrambler_package *package, const unsigned char *header);
+
+// Returns TRUE, if both packages derive the key stream and the tags of the chunks the same way from content key and
+// iv, so a mail can be rewrapped from one to the other by replacing the header only.
+bool scrambler_package_chunks_compatible(
+    const struct scrambler_package *package,
+    const struct scrambler_package *other);
+
+// Writes the header behind the magic for the new wrapped key into new_header, which has a size of
+// scrambler_package_header_size() of the new package and key. iv and encrypted mac key are taken over from the header
+// of the compatible package, which holds a wrapped key of the given size.
+void scrambler_package_rewrap_header(
+    const struct scrambler_package *package,
+    const unsigned char *header,
+    size_t wrapped_key_size,
+    const struct scrambler_package *new_package,
+    const unsigned char *new_wrapped_key, size_t new_wrapped_key_size,
+    unsigned char *new_header);
+
+void scrambler_package_context_init(
+    struct scrambler_package_context *context,
+    const struct scrambler_package *package,
+    struct scrambler_stats *stats);
+
+// Like the seal_header of the package, but content key, iv and mac key are derived from the secret instead of being
+// random. The same secret gives the same chunks, only the wrapped key differs between public keys.
+int scrambler_package_seal_convergent_header(
+    struct scrambler_package_context *context,
+    unsigned char *header,
+    EVP_PKEY *public_key,
+    const unsigned char *secret, size_t secret_size);
+
+// Like the open_header of the package, but the tag of the first chunk at chunk, which follows the header, is checked as
+// well. Unwrapping alone doesn't tell a wrong private key from the right one: an X25519 key unwraps any header into a
+// random content key. The context is positioned at the first chunk afterwards. Returns 0, -1 or
+// SCRAMBLER_CHUNK_TAG_MISMATCH, if the key is not the one of the mail. Doesn't log.
+int scrambler_package_open_confirmed_header(
+    struct scrambler_package_context *context,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const unsigned char *chunk, size_t chunk_size,
+    const char **error_r);
+
+// Like scrambler_package_open_confirmed_header() for a content key, that has been unwrapped from the header already.
+int scrambler_package_confirm_key(
+    const struct scrambler_package *package,
+    const unsigned char *header,
+    EVP_PKEY *private_key,
+    const unsigned char *key, size_t key_size,
+    const unsigned char *chunk, size_t chunk_size,
+    const char **error_r);
+
+// Returns cipher and mac context to the pool and clears the keys. The context can be initialized again afterwards.
+void scrambler_package_context_deinit(struct scrambler_package_context *context);
+
+// Wraps or unwraps a content key with the package of the key type. key_size holds the size of the key buffer on
+// input and the size of the unwrapped key on output. Both functions don't log, the errors are left in the OpenSSL
+// error queue, so they can be used from worker threads.
+int scrambler_unwrap_key(
+  unsigned char *key, size_t *key_size,
+  const unsigned char *wrapped_key, size_t wrapped_key_size,
+  EVP_PKEY *private_key);
+
+int scrambler_wrap_key(
+  unsigned char *wrapped_key, size_t *wrapped_key_size,
+  const unsigned char *key, size_t key_size,
+  EVP_PKEY *public_key);
+
+#endif
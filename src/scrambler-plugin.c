@@ -21,7 +21,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dovecot/lib.h"
 #include "dovecot/array.h"
 #include "dovecot/buffer.h"
+#include "dovecot/fs-api-private.h"
 #include "dovecot/hash.h"
+#include "dovecot/llist.h"
 #include "dovecot/istream.h"
 #include "dovecot/ostream.h"
 #include "dovecot/ostream-private.h"
@@ -32,17 +34,40 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dovecot/index-storage.h"
 #include "dovecot/index-mail.h"
 #include "dovecot/strescape.h"
+#include "dovecot/seq-range-array.h"
+#include "dovecot/mail-search.h"
 #include <stdio.h>
 
 #include "scrambler-plugin.h"
 #include "scrambler-common.h"
+#include "scrambler-fs.h"
+#include "scrambler-header-pool.h"
 #include "scrambler-ostream.h"
 #include "scrambler-istream.h"
+#include "scrambler-pool.h"
+#include "scrambler-unlock.h"
+#include "scrambler-workers.h"
 
 // Defines
 
-// After buffer grows larger than this, create a temporary file to /tmp where to read the mail.
-#define MAIL_MAX_MEMORY_BUFFER (1024*128)
+// Prefetches beyond this wait for the oldest ones.
+#define PREFETCH_MAX_QUEUED_JOBS (64)
+// Indexing processes and body searches decrypt prefetched mails up to this size as a whole on the prefetch threads.
+#define PREFETCH_MAX_DECRYPT_SIZE (1024*1024)
+
+// Sealing a header is a single public key operation, one thread keeps up with the saves of a process by default.
+#define SEAL_DEFAULT_THREAD_COUNT (1)
+#define SEAL_MAX_QUEUED_JOBS (64)
+// Public keys beyond this seal their headers during the save, so a long running process doesn't keep a pool for
+// every user it has seen.
+#define SEAL_MAX_HEADER_POOLS (64)
+
+// Deliveries keep the plain text of mails up to this size for the precache after the commit.
+#define SAVE_PRECACHE_MAX_SIZE (1024*1024)
+
+// Logins beyond this wait for a free slot in the queue of the unlock threads.
+#define UNLOCK_MAX_QUEUED_JOBS (1024)
+#define SCRAMBLER_UNLOCK_FAILED_ERROR "Failed to load and decrypt the private key. May caused by an invalid password."
 
 #define SCRAMBLER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, scrambler_storage_module)
@@ -51,17 +76,45 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SCRAMBLER_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, scrambler_user_module)
 
+const char *scrambler_plugin_version = DOVECOT_ABI_VERSION;
+
 // Structs
 
-struct scrambler_user {
-		union mail_user_module_context module_ctx;
+// A mail saved by a transaction, data is NULL if the plain text hasn't been kept.
+struct scrambler_saved_mail {
+    struct mailbox_transaction_context *transaction;
+    buffer_t *data;
+};
+ARRAY_DEFINE_TYPE(scrambler_saved_mail, struct scrambler_saved_mail);
+
+struct scrambler_mail {
+    union mail_module_context module_ctx;
 
-    bool enabled;
-    EVP_PKEY *public_key;
-    EVP_PKEY *private_key;
+    // prefetch of the content key, that keeps running until the stream of the mail is opened for its read
+    struct scrambler_istream_prefetch *prefetch;
+    // set while the stream is opened by scrambler_mail_prefetch() for the prefetch only
+    bool prefetch_opened;
 };
 
-const char *scrambler_plugin_version = DOVECOT_ABI_VERSION;
+struct scrambler_mailbox {
+    union mailbox_module_context module_ctx;
+
+    // the following are only used, if the user has scrambler_save_precache enabled
+    bool save_precache;
+    // plain text of the mail that is currently saved
+    struct scrambler_ostream_tee *tee;
+    // of all open transactions, in the order of the saves
+    ARRAY_TYPE(scrambler_saved_mail) saved_mails;
+    // set while a saved mail is precached, its stream is served from it
+    const buffer_t *precache_data;
+
+    // number of running searches, that read the bodies of the mails
+    unsigned int body_searches;
+
+    // with a trailing slash, only set if the user has scrambler_alt_read_ahead_kb configured and the mailbox list has
+    // an alternate storage
+    const char *alt_root;
+};
 
 // Statics
 
@@ -69,6 +122,25 @@ static MODULE_CONTEXT_DEFINE_INIT(scrambler_storage_module, &mail_storage_module
 static MODULE_CONTEXT_DEFINE_INIT(scrambler_mail_module, &mail_module_register);
 static MODULE_CONTEXT_DEFINE_INIT(scrambler_user_module, &mail_user_module_register);
 
+static struct scrambler_stats scrambler_process_stats;
+static unsigned int scrambler_process_user_count = 0;
+static bool scrambler_process_log_stats = FALSE;
+// process settings, read once by scrambler_process_settings_init(). they size pools shared by all users of the
+// process, so they come from the plugin section and not per user
+static bool scrambler_process_settings_read = FALSE;
+static unsigned int scrambler_unlock_thread_count = 0;
+static unsigned int scrambler_prefetch_thread_count = 0;
+static unsigned int scrambler_presealed_header_count = 0;
+static unsigned int scrambler_seal_thread_count = 0;
+// created with the first user, that needs them
+static struct scrambler_workers *scrambler_unlock_workers = NULL;
+static struct scrambler_workers *scrambler_prefetch_workers = NULL;
+static struct scrambler_workers *scrambler_seal_workers = NULL;
+// the mail, whose stream is opened by the prefetch
+static struct mail *scrambler_prefetch_mail = NULL;
+
+static struct scrambler_user *scrambler_users = NULL;
+
 // Functions
 
 static const char *scrambler_get_string_setting(struct mail_user *user, const char *name) {
@@ -99,6 +171,43 @@ static EVP_PKEY *scrambler_get_pem_key_setting(struct mail_user *user, const cha
     return scrambler_pem_read_public_key(value);
 }
 
+static void scrambler_mail_user_deinit(struct mail_user *user) {
+    struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(user);
+
+    DLLIST_REMOVE(&scrambler_users, suser);
+
+    // the workers still use the unlock, so it has to finish before the user goes away. the header pools belong to
+    // the process and stay for the next user of the key
+    (void)scrambler_user_unlock(suser);
+
+    if (suser->log_stats && !scrambler_stats_is_empty(&suser->stats))
+        i_info("scrambler stats: %s", scrambler_stats_format(&suser->stats));
+    if (suser->trace != NULL)
+        i_info("scrambler trace: %s", scrambler_trace_format(suser->trace));
+
+    scrambler_stats_add(&scrambler_process_stats, &suser->stats);
+    scrambler_process_user_count++;
+    if (suser->log_stats)
+        scrambler_process_log_stats = TRUE;
+
+    suser->module_ctx.super.deinit(user);
+}
+
+// Reads the settings of the process wide pools. Plugins get no settings before the first user, so they are taken from
+// its plugin settings, which hold the plugin section of the config.
+static void scrambler_process_settings_init(struct mail_user *user) {
+    if (scrambler_process_settings_read)
+        return;
+    scrambler_process_settings_read = TRUE;
+
+    scrambler_unlock_thread_count = scrambler_get_integer_setting(user, "scrambler_unlock_threads");
+    scrambler_prefetch_thread_count = scrambler_get_integer_setting(user, "scrambler_prefetch_threads");
+    scrambler_presealed_header_count = scrambler_get_integer_setting(user, "scrambler_presealed_headers");
+    scrambler_seal_thread_count = scrambler_get_integer_setting(user, "scrambler_seal_threads");
+    if (scrambler_seal_thread_count == 0)
+        scrambler_seal_thread_count = SEAL_DEFAULT_THREAD_COUNT;
+}
+
 static void scrambler_mail_user_created(struct mail_user *user) {
     struct mail_user_vfuncs *v = user->vlast;
     struct scrambler_user *suser;
@@ -106,13 +215,64 @@ static void scrambler_mail_user_created(struct mail_user *user) {
     suser = p_new(user->pool, struct scrambler_user, 1);
     suser->module_ctx.super = *v;
     user->vlast = &suser->module_ctx.super;
+    v->deinit = scrambler_mail_user_deinit;
+
+    scrambler_process_settings_init(user);
+
+    const char *log_stats = scrambler_get_string_setting(user, "scrambler_log_stats");
+    suser->log_stats = log_stats == NULL || atoi(log_stats) != 0;
+
+    suser->mmap = !!scrambler_get_integer_setting(user, "scrambler_mmap");
+
+    if (scrambler_prefetch_thread_count > 0) {
+        if (scrambler_prefetch_workers == NULL)
+            scrambler_prefetch_workers = scrambler_workers_create(scrambler_prefetch_thread_count,
+                PREFETCH_MAX_QUEUED_JOBS);
+        suser->prefetch = TRUE;
+        // the fts indexing reads every mail in full, one after another
+        if (user->service != NULL &&
+            (strcmp(user->service, "indexer-worker") == 0 || strcmp(user->service, "doveadm") == 0))
+            suser->prefetch_max_decrypt_size = PREFETCH_MAX_DECRYPT_SIZE;
+    }
+
+    unsigned int trace_threshold_msecs = scrambler_get_integer_setting(user, "scrambler_trace_threshold_msecs");
+    if (trace_threshold_msecs > 0) {
+        suser->trace = p_new(user->pool, struct scrambler_trace, 1);
+        suser->trace->threshold_msecs = trace_threshold_msecs;
+    }
 
     suser->enabled = !!scrambler_get_integer_setting(user, "scrambler_enabled");
     suser->public_key = scrambler_get_pem_key_setting(user, "scrambler_public_key");
 
+    // only deliveries, the other saves (imap APPEND, doveadm) are rare enough for the indexer
+    if (scrambler_get_integer_setting(user, "scrambler_save_precache") && user->service != NULL &&
+        (strcmp(user->service, "lmtp") == 0 || strcmp(user->service, "lda") == 0))
+        suser->save_precache = TRUE;
+
+    suser->alt_read_ahead_size = (size_t)scrambler_get_integer_setting(user, "scrambler_alt_read_ahead_kb") * 1024;
+
+    suser->compact = !!scrambler_get_integer_setting(user, "scrambler_compact_package") &&
+        suser->public_key != NULL && scrambler_package_compact_for_key(suser->public_key) != NULL;
+
+    if (suser->enabled && scrambler_presealed_header_count > 0 && suser->public_key != NULL &&
+        scrambler_package_for_key(suser->public_key) != NULL) {
+        if (scrambler_seal_workers == NULL)
+            scrambler_seal_workers = scrambler_workers_create(scrambler_seal_thread_count, SEAL_MAX_QUEUED_JOBS);
+        suser->header_pool = scrambler_header_pool_get(scrambler_seal_workers,
+            scrambler_package_for_key(suser->public_key), suser->public_key, scrambler_presealed_header_count,
+            SEAL_MAX_HEADER_POOLS);
+        if (suser->compact) {
+            suser->compact_header_pool = scrambler_header_pool_get(scrambler_seal_workers,
+                scrambler_package_compact_for_key(suser->public_key), suser->public_key,
+                scrambler_presealed_header_count, SEAL_MAX_HEADER_POOLS);
+        }
+    }
+
     const char *plain_password = scrambler_get_string_setting(user, "scrambler_plain_password");
     unsigned int plain_password_fd = scrambler_get_integer_setting(user, "scrambler_plain_password_fd");
   	const char *private_key = scrambler_get_pem_string_setting(user, "scrambler_private_key");
+    // encrypted with the same password, so both keys can be used while the mails are migrated
+    const char *old_private_key = scrambler_get_pem_string_setting(user, "scrambler_old_private_key");
     const char *private_key_salt = scrambler_get_string_setting(user, "scrambler_private_key_salt");
     unsigned int private_key_iterations = scrambler_get_integer_setting(user, "scrambler_private_key_iterations");
 
@@ -120,32 +280,133 @@ static void scrambler_mail_user_created(struct mail_user *user) {
         plain_password = scrambler_read_line_fd(user->pool, plain_password_fd);
     }
 
-    if (plain_password != NULL && private_key != NULL && private_key_salt != NULL) {
+    if (plain_password != NULL && private_key != NULL && private_key_salt != NULL &&
+        scrambler_unlock_thread_count > 0) {
+        if (scrambler_unlock_workers == NULL)
+            scrambler_unlock_workers = scrambler_workers_create(scrambler_unlock_thread_count, UNLOCK_MAX_QUEUED_JOBS);
+        suser->unlock = scrambler_unlock_start(scrambler_unlock_workers, plain_password, private_key_salt,
+            private_key_iterations, private_key, old_private_key);
+        if (suser->unlock == NULL) {
+            user->error = p_strdup(user->pool, SCRAMBLER_UNLOCK_FAILED_ERROR);
+        }
+    } else if (plain_password != NULL && private_key != NULL && private_key_salt != NULL) {
+        unsigned long long start_usecs = scrambler_stats_now_usecs();
         const char *hashed_password = scrambler_hash_password(plain_password, private_key_salt, private_key_iterations);
+        unsigned long long kdf_usecs = scrambler_stats_now_usecs();
         suser->private_key = scrambler_pem_read_encrypted_private_key(private_key, hashed_password);
+        if (suser->private_key != NULL && old_private_key != NULL)
+            suser->old_private_key = scrambler_pem_read_encrypted_private_key(old_private_key, hashed_password);
+        suser->stats.kdf_usecs += kdf_usecs - start_usecs;
+        suser->stats.key_load_usecs += scrambler_stats_now_usecs() - kdf_usecs;
         if (suser->private_key == NULL) {
+            user->error = p_strdup(user->pool, SCRAMBLER_UNLOCK_FAILED_ERROR);
+        } else if (old_private_key != NULL && suser->old_private_key == NULL) {
             user->error = p_strdup_printf(user->pool,
-                "Failed to load and decrypt the private key. May caused by an invalid password.");
+                "Failed to load and decrypt the old private key.");
         }
     } else {
         suser->private_key = NULL;
     }
 
+    suser->username = user->username;
+    DLLIST_PREPEND(&scrambler_users, suser);
+
     MODULE_CONTEXT_SET(user, scrambler_user_module, suser);
 }
 
+struct scrambler_user *scrambler_user_get(struct mail_user *user) {
+    return SCRAMBLER_USER_CONTEXT(user);
+}
+
+struct scrambler_user *scrambler_user_lookup(const char *username) {
+    struct scrambler_user *suser;
+
+    for (suser = scrambler_users; suser != NULL; suser = suser->next) {
+        if (strcmp(suser->username, username) == 0)
+            return suser;
+    }
+    return NULL;
+}
+
+EVP_PKEY *scrambler_user_unlock(struct scrambler_user *suser) {
+    const char *error;
+
+    if (suser->unlock != NULL) {
+        if (scrambler_unlock_finish(&suser->unlock, &suser->private_key, &suser->old_private_key, &suser->stats,
+                &error) < 0) {
+            i_error("scrambler_user_unlock: %s. May caused by an invalid password.", error);
+            suser->unlock_failed = TRUE;
+        }
+    }
+    return suser->private_key;
+}
+
+// Doesn't wait for the unlock threads, a failure is noticed once they are done.
+static bool scrambler_user_unlock_failed(struct scrambler_user *suser) {
+    if (suser->unlock != NULL && scrambler_unlock_is_done(suser->unlock))
+        (void)scrambler_user_unlock(suser);
+    return suser->unlock_failed;
+}
+
+static void scrambler_user_unlock_callback(
+    void *context,
+    EVP_PKEY **private_key_r,
+    EVP_PKEY **old_private_key_r
+) {
+    struct scrambler_user *suser = context;
+
+    *private_key_r = scrambler_user_unlock(suser);
+    *old_private_key_r = suser->old_private_key;
+}
+
+struct istream *scrambler_user_istream_create(struct scrambler_user *suser, struct istream *input) {
+    struct istream *sinput = scrambler_istream_create(input, suser->private_key, &suser->stats);
+
+    if (suser->old_private_key != NULL)
+        scrambler_istream_set_old_private_key(sinput, suser->old_private_key);
+    if (suser->unlock != NULL)
+        scrambler_istream_set_key_callback(sinput, scrambler_user_unlock_callback, suser);
+    if (suser->mmap)
+        scrambler_istream_set_mmap(sinput, TRUE);
+    return sinput;
+}
+
+EVP_PKEY *scrambler_user_get_private_key(struct scrambler_user *suser, const struct scrambler_package *package) {
+    (void)scrambler_user_unlock(suser);
+    if (scrambler_package_accepts_key(package, suser->private_key))
+        return suser->private_key;
+    if (scrambler_package_accepts_key(package, suser->old_private_key))
+        return suser->old_private_key;
+    return NULL;
+}
+
+static void scrambler_mailbox_free_tee(struct scrambler_ostream_tee **_tee) {
+    struct scrambler_ostream_tee *tee = *_tee;
+
+    if (tee == NULL)
+        return;
+    *_tee = NULL;
+    if (tee->data != NULL)
+        buffer_free(&tee->data);
+    i_free(tee);
+}
+
 static int scrambler_mail_save_begin(struct mail_save_context *context, struct istream *input) {
     struct mailbox *box = context->transaction->box;
     struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(box->storage->user);
-    union mailbox_module_context *mbox = SCRAMBLER_CONTEXT(box);
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
     struct ostream *output;
 
     if (suser->enabled && suser->public_key == NULL) {
         i_error("scrambler_mail_save_begin: encryption is enabled, but no public key is available");
         return -1;
     }
+    if (scrambler_user_unlock_failed(suser)) {
+        mail_storage_set_error(box->storage, MAIL_ERROR_PERM, SCRAMBLER_UNLOCK_FAILED_ERROR);
+        return -1;
+    }
 
-		if (mbox->super.save_begin(context, input) < 0)
+		if (smailbox->module_ctx.super.save_begin(context, input) < 0)
 				return -1;
 
     if (suser->enabled) {
@@ -154,14 +415,33 @@ static int scrambler_mail_save_begin(struct mail_save_context *context, struct i
 				// be added to the other end of the ostream chain, not to the
 				// beginning (the usual way).
 				if (context->data.output->real_stream->parent == NULL) {
-						output = scrambler_ostream_create(context->data.output, suser->public_key);
+						output = scrambler_ostream_create(context->data.output, suser->public_key, &suser->stats);
 						o_stream_unref(&context->data.output);
 						context->data.output = output;
 				} else {
-						output = scrambler_ostream_create(context->data.output->real_stream->parent, suser->public_key);
+						output = scrambler_ostream_create(context->data.output->real_stream->parent, suser->public_key,
+								&suser->stats);
 						o_stream_unref(&context->data.output->real_stream->parent);
 						context->data.output->real_stream->parent = output;
 				}
+
+        if (suser->header_pool != NULL && output != NULL)
+            scrambler_ostream_set_header_pool(output, suser->header_pool);
+        if (suser->compact && output != NULL)
+            scrambler_ostream_set_compact(output, suser->compact_header_pool);
+        if (suser->trace != NULL && output != NULL)
+            scrambler_ostream_set_trace(output, suser->trace, t_strdup_printf("%s (new mail)", box->vname));
+        if (suser->rewrap_chunks != NULL && output != NULL) {
+            scrambler_ostream_set_stored(output, suser->rewrap_header, suser->rewrap_header_size,
+                suser->rewrap_chunks);
+        }
+        if (smailbox->save_precache && output != NULL) {
+            scrambler_mailbox_free_tee(&smailbox->tee);
+            smailbox->tee = i_new(struct scrambler_ostream_tee, 1);
+            smailbox->tee->data = buffer_create_dynamic(default_pool, 4096);
+            smailbox->tee->max_size = SAVE_PRECACHE_MAX_SIZE;
+            scrambler_ostream_set_tee(output, smailbox->tee);
+        }
 #ifdef DEBUG_STREAMS
         i_debug("scrambler write encrypted mail");
     } else {
@@ -172,49 +452,372 @@ static int scrambler_mail_save_begin(struct mail_save_context *context, struct i
     return 0;
 }
 
+// Keeps the plain text of the saved mail for the precache after the commit.
+static int scrambler_mail_save_finish(struct mail_save_context *context) {
+    struct mailbox *box = context->transaction->box;
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
+    struct scrambler_ostream_tee *tee = smailbox->tee;
+    struct scrambler_saved_mail *saved_mail;
+
+    // the storage flushes the last data through the stream on finish, so the tee is taken afterwards
+    if (smailbox->module_ctx.super.save_finish(context) < 0) {
+        scrambler_mailbox_free_tee(&smailbox->tee);
+        return -1;
+    }
+
+    saved_mail = array_append_space(&smailbox->saved_mails);
+    saved_mail->transaction = context->transaction;
+    if (tee != NULL && !tee->overflow) {
+        saved_mail->data = tee->data;
+        tee->data = NULL;
+    }
+    scrambler_mailbox_free_tee(&smailbox->tee);
+    return 0;
+}
+
+static void scrambler_mail_save_cancel(struct mail_save_context *context) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(context->transaction->box);
+
+    smailbox->module_ctx.super.save_cancel(context);
+    scrambler_mailbox_free_tee(&smailbox->tee);
+}
+
+// Moves the saved mails of the transaction to saved_mails_r.
+static void scrambler_mailbox_take_saved_mails(
+    struct scrambler_mailbox *smailbox,
+    struct mailbox_transaction_context *transaction,
+    ARRAY_TYPE(scrambler_saved_mail) *saved_mails_r
+) {
+    const struct scrambler_saved_mail *saved_mail;
+    unsigned int index = 0;
+
+    while (index < array_count(&smailbox->saved_mails)) {
+        saved_mail = array_idx(&smailbox->saved_mails, index);
+        if (saved_mail->transaction == transaction) {
+            array_append(saved_mails_r, saved_mail, 1);
+            array_delete(&smailbox->saved_mails, index, 1);
+        } else {
+            index++;
+        }
+    }
+}
+
+static void scrambler_mailbox_free_saved_mails(ARRAY_TYPE(scrambler_saved_mail) *saved_mails) {
+    struct scrambler_saved_mail *saved_mail;
+
+    array_foreach_modifiable(saved_mails, saved_mail) {
+        if (saved_mail->data != NULL)
+            buffer_free(&saved_mail->data);
+    }
+}
+
+// Fills the fts index and the cache fields of the mails saved by the committed transaction from their plain text, as
+// the indexer-worker would do later. Otherwise it had to unwrap the key and decrypt each of them again.
+static void scrambler_mailbox_precache(
+    struct mailbox *box,
+    const struct mail_transaction_commit_changes *changes,
+    const ARRAY_TYPE(scrambler_saved_mail) *saved_mails
+) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
+    const struct scrambler_saved_mail *saved;
+    struct mailbox_metadata metadata;
+    struct mailbox_transaction_context *transaction;
+    struct seq_range_iter iter;
+    struct mail *mail;
+    unsigned int count, index;
+    uint32_t uid;
+
+    // copies without a save (hard links) don't show up in the saved mails, so the uids can't be matched
+    saved = array_get(saved_mails, &count);
+    if (seq_range_count(&changes->saved_uids) != count)
+        return;
+
+    // the new mails are only visible after a sync, if it fails they are left to the indexer
+    if (mailbox_sync(box, 0) < 0 ||
+        mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS, &metadata) < 0)
+        return;
+
+    transaction = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
+    mail = mail_alloc(transaction, metadata.precache_fields, NULL);
+    seq_range_array_iter_init(&iter, &changes->saved_uids);
+    for (index = 0; seq_range_array_iter_nth(&iter, index, &uid); index++) {
+        if (saved[index].data == NULL || !mail_set_uid(mail, uid))
+            continue;
+
+        smailbox->precache_data = saved[index].data;
+        if (mail_precache(mail) < 0) {
+            i_error("scrambler_mailbox_precache: %s uid %u: %s", box->vname, uid,
+                mailbox_get_last_error(box, NULL));
+        }
+        smailbox->precache_data = NULL;
+    }
+    mail_free(&mail);
+
+    if (mailbox_transaction_commit(&transaction) < 0)
+        i_error("scrambler_mailbox_precache: %s: %s", box->vname, mailbox_get_last_error(box, NULL));
+}
+
+static int scrambler_transaction_commit(
+    struct mailbox_transaction_context *transaction,
+    struct mail_transaction_commit_changes *changes_r
+) {
+    struct mailbox *box = transaction->box;
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
+    ARRAY_TYPE(scrambler_saved_mail) saved_mails;
+    int result;
+
+    // the transaction is freed by the commit
+    t_array_init(&saved_mails, 8);
+    scrambler_mailbox_take_saved_mails(smailbox, transaction, &saved_mails);
+
+    result = smailbox->module_ctx.super.transaction_commit(transaction, changes_r);
+    if (result == 0 && array_count(&saved_mails) > 0)
+        scrambler_mailbox_precache(box, changes_r, &saved_mails);
+
+    scrambler_mailbox_free_saved_mails(&saved_mails);
+    return result;
+}
+
+static void scrambler_transaction_rollback(struct mailbox_transaction_context *transaction) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(transaction->box);
+    ARRAY_TYPE(scrambler_saved_mail) saved_mails;
+
+    t_array_init(&saved_mails, 8);
+    scrambler_mailbox_take_saved_mails(smailbox, transaction, &saved_mails);
+    scrambler_mailbox_free_saved_mails(&saved_mails);
+
+    smailbox->module_ctx.super.transaction_rollback(transaction);
+}
+
+static bool scrambler_search_args_read_body(const struct mail_search_arg *arg) {
+    for (; arg != NULL; arg = arg->next) {
+        switch (arg->type) {
+        case SEARCH_BODY:
+        case SEARCH_TEXT:
+            return TRUE;
+        case SEARCH_OR:
+        case SEARCH_SUB:
+        case SEARCH_INTHREAD:
+            if (scrambler_search_args_read_body(arg->value.subargs))
+                return TRUE;
+            break;
+        default:
+            break;
+        }
+    }
+    return FALSE;
+}
+
+// Searches for BODY or TEXT without a complete fts index read every mail in full, one after another, like the
+// indexing does. Their prefetched mails are decrypted as a whole on the prefetch threads as well.
+static struct mail_search_context *scrambler_search_init(
+    struct mailbox_transaction_context *transaction,
+    struct mail_search_args *args,
+    const enum mail_sort_type *sort_program,
+    enum mail_fetch_field wanted_fields,
+    struct mailbox_header_lookup_ctx *wanted_headers
+) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(transaction->box);
+
+    if (scrambler_search_args_read_body(args->args))
+        smailbox->body_searches++;
+    return smailbox->module_ctx.super.search_init(transaction, args, sort_program, wanted_fields, wanted_headers);
+}
+
+static int scrambler_search_deinit(struct mail_search_context *context) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(context->transaction->box);
+
+    if (scrambler_search_args_read_body(context->args->args)) {
+        i_assert(smailbox->body_searches > 0);
+        smailbox->body_searches--;
+    }
+    return smailbox->module_ctx.super.search_deinit(context);
+}
+
+// Mails of the alternate storage are told by the path of their file, e.g. <mail_alt_dir>/storage/m.1 for mdbox.
+static bool scrambler_mail_is_alt(struct mail *_mail, struct istream *input) {
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(_mail->box);
+    const char *name;
+
+    if (smailbox->alt_root == NULL)
+        return FALSE;
+
+    name = i_stream_get_name(input);
+    return name != NULL && strncmp(name, smailbox->alt_root, strlen(smailbox->alt_root)) == 0;
+}
+
+// The alternate storage is read rarely and then in bulk (e.g. exports, full fetches of old folders), so its prefetched
+// mails are decrypted as a whole like those of the indexing.
+static size_t scrambler_mail_prefetch_max_decrypt_size(struct mail *_mail, struct istream *input) {
+    struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(_mail->box->storage->user);
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(_mail->box);
+
+    if (suser->prefetch_max_decrypt_size == 0 &&
+        (smailbox->body_searches > 0 || scrambler_mail_is_alt(_mail, input)))
+        return PREFETCH_MAX_DECRYPT_SIZE;
+    return suser->prefetch_max_decrypt_size;
+}
+
+static int scrambler_mailbox_open(struct mailbox *box) {
+    struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(box->storage->user);
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
+
+    if (scrambler_user_unlock_failed(suser)) {
+        mail_storage_set_error(box->storage, MAIL_ERROR_PERM, SCRAMBLER_UNLOCK_FAILED_ERROR);
+        return -1;
+    }
+    return smailbox->module_ctx.super.open(box);
+}
+
+// Checked by imap after each command. An inconsistent mailbox disconnects the client.
+static bool scrambler_mailbox_is_inconsistent(struct mailbox *box) {
+    struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(box->storage->user);
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(box);
+
+    return scrambler_user_unlock_failed(suser) || smailbox->module_ctx.super.is_inconsistent(box);
+}
+
 static void scrambler_mailbox_allocated(struct mailbox *box) {
     struct mailbox_vfuncs *v = box->vlast;
-    union mailbox_module_context *mbox;
+    struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(box->storage->user);
+    struct scrambler_mailbox *smailbox;
     enum mail_storage_class_flags class_flags = box->storage->class_flags;
 
-    mbox = p_new(box->pool, union mailbox_module_context, 1);
-    mbox->super = *v;
-    box->vlast = &mbox->super;
+    smailbox = p_new(box->pool, struct scrambler_mailbox, 1);
+    smailbox->module_ctx.super = *v;
+    box->vlast = &smailbox->module_ctx.super;
 
-    MODULE_CONTEXT_SET_SELF(box, scrambler_storage_module, mbox);
+    MODULE_CONTEXT_SET(box, scrambler_storage_module, smailbox);
 
-    if ((class_flags & MAIL_STORAGE_CLASS_FLAG_OPEN_STREAMS) == 0)
+    if ((class_flags & MAIL_STORAGE_CLASS_FLAG_OPEN_STREAMS) == 0) {
         v->save_begin = scrambler_mail_save_begin;
+
+        if (suser->enabled && suser->save_precache) {
+            smailbox->save_precache = TRUE;
+            p_array_init(&smailbox->saved_mails, box->pool, 4);
+            v->save_finish = scrambler_mail_save_finish;
+            v->save_cancel = scrambler_mail_save_cancel;
+            v->transaction_commit = scrambler_transaction_commit;
+            v->transaction_rollback = scrambler_transaction_rollback;
+        }
+    }
+    if (suser->unlock != NULL || suser->unlock_failed) {
+        v->open = scrambler_mailbox_open;
+        v->is_inconsistent = scrambler_mailbox_is_inconsistent;
+    }
+    if (suser->prefetch) {
+        v->search_init = scrambler_search_init;
+        v->search_deinit = scrambler_search_deinit;
+    }
+
+    const char *alt_root;
+    if (suser->alt_read_ahead_size > 0 &&
+        mailbox_list_get_root_path(box->list, MAILBOX_LIST_PATH_TYPE_ALT_DIR, &alt_root))
+        smailbox->alt_root = p_strconcat(box->pool, alt_root, "/", NULL);
 }
 
 static int scrambler_istream_opened(struct mail *_mail, struct istream **stream) {
     struct mail_private *mail = (struct mail_private *)_mail;
     struct mail_user *user = _mail->box->storage->user;
     struct scrambler_user *suser = SCRAMBLER_USER_CONTEXT(user);
-    union mail_module_context *mmail = SCRAMBLER_MAIL_CONTEXT(mail);
+    struct scrambler_mail *smail = SCRAMBLER_MAIL_CONTEXT(mail);
+    struct scrambler_mailbox *smailbox = SCRAMBLER_CONTEXT(_mail->box);
     struct istream *input;
+    bool alt;
 
     input = *stream;
-    *stream = scrambler_istream_create(input, suser->private_key);
+    alt = scrambler_mail_is_alt(_mail, input);
+    *stream = scrambler_user_istream_create(suser, input);
     i_stream_unref(&input);
 
-		int result = mmail->super.istream_opened(_mail, stream);
+    scrambler_istream_set_spill(*stream, MAIL_MAX_MEMORY_BUFFER, mail_user_get_temp_prefix(user));
+    if (alt) {
+        scrambler_istream_set_read_ahead(*stream, suser->alt_read_ahead_size);
+        suser->stats.alt_reads++;
+    }
+
+    // before the other plugins see the stream, as zlib reads it right away to detect the compression
+    if (smailbox->precache_data != NULL) {
+        if (smail->prefetch != NULL)
+            scrambler_istream_prefetch_discard(&smail->prefetch);
+        scrambler_istream_set_decrypted(*stream, smailbox->precache_data->data, smailbox->precache_data->used);
+        smailbox->precache_data = NULL;
+    } else if (smail->prefetch != NULL)
+        scrambler_istream_attach_prefetch(*stream, &smail->prefetch);
+    else if (scrambler_prefetch_mail == _mail) {
+        // the read of zlib would wait for the worker right away. the stream is closed again by the prefetch, before
+        // the other plugins see it, and only the running prefetch is kept for the read
+        scrambler_istream_prefetch(*stream, scrambler_prefetch_workers,
+            scrambler_mail_prefetch_max_decrypt_size(_mail, *stream));
+        smail->prefetch_opened = TRUE;
+        return 0;
+    }
+
+    if (suser->trace != NULL) {
+        scrambler_istream_set_trace(*stream, suser->trace,
+            t_strdup_printf("%s uid %u (%s)", _mail->box->vname, _mail->uid, i_stream_get_name(*stream)));
+    }
+
+		int result = smail->module_ctx.super.istream_opened(_mail, stream);
 
     return result;
 }
 
+// Called by dovecot for the next mails of a search or fetch (mail_prefetch_count). Reads the headers of their stored
+// mails and lets the prefetch threads unwrap the content keys, while the current mail is processed. The decrypting
+// stream is only opened, once the mail is read, so the prefetches of all queued mails run at the same time.
+static bool scrambler_mail_prefetch(struct mail *_mail) {
+    struct mail_private *mail = (struct mail_private *)_mail;
+    struct scrambler_mail *smail = SCRAMBLER_MAIL_CONTEXT(mail);
+    struct istream *input;
+    bool result;
+
+    // like index_mail_prefetch(), only mails whose header or body is going to be read are opened. fetches served from
+    // the index or cache (e.g. FLAGS or ENVELOPE of cached mails) must not pay for the unwrapping
+    if ((((struct index_mail *)_mail)->data.access_part & (READ_HDR | READ_BODY | PARSE_HDR | PARSE_BODY)) == 0 ||
+        smail->prefetch != NULL)
+        return smail->module_ctx.super.prefetch(_mail);
+
+    scrambler_prefetch_mail = _mail;
+    result = smail->module_ctx.super.prefetch(_mail);
+    // single file storages open the stream in the prefetch already, the others are opened here
+    if (mail_get_stream(_mail, NULL, NULL, &input) == 0 && smail->prefetch_opened)
+        smail->prefetch = scrambler_istream_detach_prefetch(input);
+    scrambler_prefetch_mail = NULL;
+
+    if (smail->prefetch_opened) {
+        index_mail_close_streams((struct index_mail *)_mail);
+        smail->prefetch_opened = FALSE;
+    }
+    return result;
+}
+
+static void scrambler_mail_close(struct mail *_mail) {
+    struct mail_private *mail = (struct mail_private *)_mail;
+    struct scrambler_mail *smail = SCRAMBLER_MAIL_CONTEXT(mail);
+
+    // the mail is closed without being read or set to another one
+    if (smail->prefetch != NULL)
+        scrambler_istream_prefetch_discard(&smail->prefetch);
+    smail->module_ctx.super.close(_mail);
+}
+
 static void scrambler_mail_allocated(struct mail *_mail) {
 		struct mail_private *mail = (struct mail_private *)_mail;
 		struct mail_vfuncs *v = mail->vlast;
-		union mail_module_context *mmail;
+		struct scrambler_mail *smail;
 
-		mmail = p_new(mail->pool, union mail_module_context, 1);
-		mmail->super = *v;
-		mail->vlast = &mmail->super;
+		smail = p_new(mail->pool, struct scrambler_mail, 1);
+		smail->module_ctx.super = *v;
+		mail->vlast = &smail->module_ctx.super;
 
 		v->istream_opened = scrambler_istream_opened;
+		if (SCRAMBLER_USER_CONTEXT(_mail->box->storage->user)->prefetch) {
+				v->prefetch = scrambler_mail_prefetch;
+				v->close = scrambler_mail_close;
+		}
 
-		MODULE_CONTEXT_SET_SELF(mail, scrambler_mail_module, mmail);
+		MODULE_CONTEXT_SET(mail, scrambler_mail_module, smail);
 }
 
 static struct mail_storage_hooks scrambler_mail_storage_hooks = {
@@ -226,8 +829,26 @@ static struct mail_storage_hooks scrambler_mail_storage_hooks = {
 void scrambler_plugin_init(struct module *module) {
     scrambler_initialize();
 		mail_storage_hooks_add(module, &scrambler_mail_storage_hooks);
+    // lib-fs has no unregistration, the plugin stays loaded until the process exits
+    fs_class_register(&fs_class_scrambler);
 }
 
 void scrambler_plugin_deinit(void) {
+    // processes serving a single user have logged the same numbers already
+    if (scrambler_process_user_count > 1 && !scrambler_stats_is_empty(&scrambler_process_stats))
+        i_info("scrambler process stats: users=%u %s", scrambler_process_user_count,
+            scrambler_stats_format(&scrambler_process_stats));
+    if (scrambler_process_log_stats && scrambler_pool_is_used())
+        i_info("scrambler pool stats: %s", scrambler_pool_stats_format());
+    if (scrambler_prefetch_workers != NULL)
+        scrambler_workers_destroy(&scrambler_prefetch_workers);
+    if (scrambler_seal_workers != NULL) {
+        scrambler_header_pool_destroy_all();
+        scrambler_workers_destroy(&scrambler_seal_workers);
+    }
+    if (scrambler_unlock_workers != NULL)
+        scrambler_workers_destroy(&scrambler_unlock_workers);
+    scrambler_pool_deinit();
+
 		mail_storage_hooks_remove(&scrambler_mail_storage_hooks);
 }
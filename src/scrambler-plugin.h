@@ -21,8 +21,79 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef SCRAMBLER_PLUGIN_H
 #define SCRAMBLER_PLUGIN_H
 
+#include <dovecot/mail-user.h>
+#include <openssl/evp.h>
+
+#include "scrambler-header-pool.h"
+#include "scrambler-package.h"
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
+#include "scrambler-unlock.h"
+
+// Structs
+
+struct scrambler_user {
+    union mail_user_module_context module_ctx;
+    // listed while the user exists, so the attachment fs of its storages can look it up by the name
+    struct scrambler_user *prev, *next;
+    const char *username;
+
+    bool enabled;
+    EVP_PKEY *public_key;
+    // headers of new mails, sealed ahead of time, only set if scrambler_presealed_headers is configured. shared with
+    // the other users of the public key in the process
+    struct scrambler_header_pool *header_pool;
+    // mails that fit into a single chunk are written with the compact package of the key
+    bool compact;
+    // headers of the compact package, only set if both scrambler_compact_package and scrambler_presealed_headers are
+    // configured
+    struct scrambler_header_pool *compact_header_pool;
+    EVP_PKEY *private_key;
+    // private key of the previous key type, only set during a migration
+    EVP_PKEY *old_private_key;
+    // set while the keys are unlocked by the unlock threads, the keys above are NULL until it's finished
+    struct scrambler_unlock *unlock;
+    // the unlock threads failed to decrypt the keys, e.g. for a wrong password. the session is over then: its
+    // mailboxes report themselves inconsistent, which disconnects imap clients, and no mailbox can be opened anymore
+    bool unlock_failed;
+    // only set while doveadm scrambler rekey saves a mail again with a new header: the saved mail is written as this
+    // header and the stored chunks instead of being encrypted again, see scrambler_ostream_set_stored()
+    const unsigned char *rewrap_header;
+    size_t rewrap_header_size;
+    struct istream *rewrap_chunks;
+
+    bool log_stats;
+    bool mmap;
+    // content keys of the next mails are unwrapped by the prefetch threads
+    bool prefetch;
+    // prefetched mails up to this size are decrypted as a whole, only set for indexing processes
+    size_t prefetch_max_decrypt_size;
+    // deliveries precache the new mails from the plain text kept during the save
+    bool save_precache;
+    // read ahead for mails in the alternate storage (mail_alt_dir), 0 reads them like the other mails
+    size_t alt_read_ahead_size;
+    struct scrambler_stats stats;
+
+    // only set if scrambler_trace_threshold_msecs is configured
+    struct scrambler_trace *trace;
+};
+
 // Functions
 
+struct scrambler_user *scrambler_user_get(struct mail_user *user);
+
+// Returns the user with the name, which has been created and not deinitialized yet, or NULL.
+struct scrambler_user *scrambler_user_lookup(const char *username);
+
+// Wraps the input into a scrambler istream with the keys of the user.
+struct istream *scrambler_user_istream_create(struct scrambler_user *suser, struct istream *input);
+
+// Waits for the keys, if they are still unlocked in the background, and returns the private key or NULL.
+EVP_PKEY *scrambler_user_unlock(struct scrambler_user *suser);
+
+// Returns the private key that unwraps the content keys of the package or NULL, if the user doesn't have one.
+EVP_PKEY *scrambler_user_get_private_key(struct scrambler_user *suser, const struct scrambler_package *package);
+
 void scrambler_plugin_init(struct module *module);
 void scrambler_plugin_deinit(void);
 
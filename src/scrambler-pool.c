@@ -0,0 +1,206 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "scrambler-common.h"
+#include "scrambler-pool.h"
+
+// Structs
+
+struct scrambler_pool_list {
+    void *(*create)(void);
+    // wipes the object for the next user, returns -1 if it can't be reused
+    int (*reset)(void *object);
+    void (*destroy)(void *object);
+
+    void *free_objects[SCRAMBLER_POOL_MAXIMAL_FREE];
+    unsigned int free_count;
+
+    struct scrambler_pool_stats stats;
+};
+
+// Functions
+
+static void *scrambler_pool_cipher_context_create(void) {
+    return EVP_CIPHER_CTX_new();
+}
+
+static int scrambler_pool_cipher_context_reset(void *object) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // cleanup wipes the key schedule
+    if (EVP_CIPHER_CTX_cleanup(object) != 1)
+        return -1;
+    EVP_CIPHER_CTX_init(object);
+    return 0;
+#else
+    return EVP_CIPHER_CTX_reset(object) == 1 ? 0 : -1;
+#endif
+}
+
+static void scrambler_pool_cipher_context_destroy(void *object) {
+    EVP_CIPHER_CTX_free(object);
+}
+
+static void *scrambler_pool_mac_context_create(void) {
+    return scrambler_mac_context_new();
+}
+
+static int scrambler_pool_mac_context_reset(void *object) {
+    return scrambler_mac_context_reset(object);
+}
+
+static void scrambler_pool_mac_context_destroy(void *object) {
+    scrambler_mac_context_free(object);
+}
+
+static void *scrambler_pool_chunk_buffer_create(void) {
+    return malloc(CHUNK_SIZE);
+}
+
+static int scrambler_pool_chunk_buffer_reset(void *object) {
+    OPENSSL_cleanse(object, CHUNK_SIZE);
+    return 0;
+}
+
+static void scrambler_pool_chunk_buffer_destroy(void *object) {
+    OPENSSL_cleanse(object, CHUNK_SIZE);
+    free(object);
+}
+
+// Statics
+
+static pthread_mutex_t scrambler_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct scrambler_pool_list scrambler_pool_cipher_contexts = {
+    .create = scrambler_pool_cipher_context_create,
+    .reset = scrambler_pool_cipher_context_reset,
+    .destroy = scrambler_pool_cipher_context_destroy
+};
+
+static struct scrambler_pool_list scrambler_pool_mac_contexts = {
+    .create = scrambler_pool_mac_context_create,
+    .reset = scrambler_pool_mac_context_reset,
+    .destroy = scrambler_pool_mac_context_destroy
+};
+
+static struct scrambler_pool_list scrambler_pool_chunk_buffers = {
+    .create = scrambler_pool_chunk_buffer_create,
+    .reset = scrambler_pool_chunk_buffer_reset,
+    .destroy = scrambler_pool_chunk_buffer_destroy
+};
+
+// Functions
+
+static void *scrambler_pool_get(struct scrambler_pool_list *list) {
+    void *object = NULL;
+
+    pthread_mutex_lock(&scrambler_pool_mutex);
+    list->stats.gets++;
+    if (list->free_count > 0)
+        object = list->free_objects[--list->free_count];
+    else
+        list->stats.creates++;
+    pthread_mutex_unlock(&scrambler_pool_mutex);
+
+    // created outside the lock, objects on the free list have been reset already
+    return object != NULL ? object : list->create();
+}
+
+static void scrambler_pool_put(struct scrambler_pool_list *list, void *object) {
+    bool kept = FALSE;
+
+    if (object == NULL)
+        return;
+
+    if (list->reset(object) == 0) {
+        pthread_mutex_lock(&scrambler_pool_mutex);
+        if (list->free_count < SCRAMBLER_POOL_MAXIMAL_FREE) {
+            list->free_objects[list->free_count++] = object;
+            kept = TRUE;
+        } else {
+            list->stats.discards++;
+        }
+        pthread_mutex_unlock(&scrambler_pool_mutex);
+    }
+
+    if (!kept)
+        list->destroy(object);
+}
+
+static void scrambler_pool_list_deinit(struct scrambler_pool_list *list) {
+    pthread_mutex_lock(&scrambler_pool_mutex);
+    while (list->free_count > 0)
+        list->destroy(list->free_objects[--list->free_count]);
+    pthread_mutex_unlock(&scrambler_pool_mutex);
+}
+
+EVP_CIPHER_CTX *scrambler_pool_get_cipher_context(void) {
+    return scrambler_pool_get(&scrambler_pool_cipher_contexts);
+}
+
+void scrambler_pool_put_cipher_context(EVP_CIPHER_CTX *context) {
+    scrambler_pool_put(&scrambler_pool_cipher_contexts, context);
+}
+
+scrambler_mac_context_t *scrambler_pool_get_mac_context(void) {
+    return scrambler_pool_get(&scrambler_pool_mac_contexts);
+}
+
+void scrambler_pool_put_mac_context(scrambler_mac_context_t *context) {
+    scrambler_pool_put(&scrambler_pool_mac_contexts, context);
+}
+
+unsigned char *scrambler_pool_get_chunk_buffer(void) {
+    return scrambler_pool_get(&scrambler_pool_chunk_buffers);
+}
+
+void scrambler_pool_put_chunk_buffer(unsigned char *buffer) {
+    scrambler_pool_put(&scrambler_pool_chunk_buffers, buffer);
+}
+
+bool scrambler_pool_is_used(void) {
+    return scrambler_pool_cipher_contexts.stats.gets > 0 || scrambler_pool_mac_contexts.stats.gets > 0 ||
+        scrambler_pool_chunk_buffers.stats.gets > 0;
+}
+
+const char *scrambler_pool_stats_format(void) {
+    const struct scrambler_pool_stats *cipher = &scrambler_pool_cipher_contexts.stats;
+    const struct scrambler_pool_stats *mac = &scrambler_pool_mac_contexts.stats;
+    const struct scrambler_pool_stats *buffer = &scrambler_pool_chunk_buffers.stats;
+
+    return t_strdup_printf(
+        "cipher_gets=%u cipher_creates=%u cipher_discards=%u "
+        "mac_gets=%u mac_creates=%u mac_discards=%u "
+        "buffer_gets=%u buffer_creates=%u buffer_discards=%u",
+        cipher->gets, cipher->creates, cipher->discards,
+        mac->gets, mac->creates, mac->discards,
+        buffer->gets, buffer->creates, buffer->discards);
+}
+
+void scrambler_pool_deinit(void) {
+    scrambler_pool_list_deinit(&scrambler_pool_cipher_contexts);
+    scrambler_pool_list_deinit(&scrambler_pool_mac_contexts);
+    scrambler_pool_list_deinit(&scrambler_pool_chunk_buffers);
+}
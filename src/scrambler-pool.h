@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_POOL_H
+#define SCRAMBLER_POOL_H
+
+#include <openssl/evp.h>
+
+#include "scrambler-common.h"
+
+// Defines
+
+// objects kept on each free list, more are freed when they are put back
+#define SCRAMBLER_POOL_MAXIMAL_FREE (32)
+
+// Structs
+
+struct scrambler_pool_stats {
+    unsigned int gets;
+    // gets that found the free list empty
+    unsigned int creates;
+    // puts that found the free list full
+    unsigned int discards;
+};
+
+// Functions
+
+// Free lists of the objects every mail needs, kept for the lifetime of the process. Objects are wiped of key
+// material and plain text when they are put back. The lists are locked, so they can be used from worker threads.
+// The get functions return NULL if the allocation failed.
+
+EVP_CIPHER_CTX *scrambler_pool_get_cipher_context(void);
+void scrambler_pool_put_cipher_context(EVP_CIPHER_CTX *context);
+
+scrambler_mac_context_t *scrambler_pool_get_mac_context(void);
+void scrambler_pool_put_mac_context(scrambler_mac_context_t *context);
+
+// Buffers have a size of CHUNK_SIZE.
+unsigned char *scrambler_pool_get_chunk_buffer(void);
+void scrambler_pool_put_chunk_buffer(unsigned char *buffer);
+
+bool scrambler_pool_is_used(void);
+
+const char *scrambler_pool_stats_format(void);
+
+// Frees the objects on the free lists.
+void scrambler_pool_deinit(void);
+
+#endif
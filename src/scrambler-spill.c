@@ -0,0 +1,214 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <dovecot/str.h>
+#include <dovecot/safe-mkstemp.h>
+#include <dovecot/write-full.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <unistd.h>
+
+#include "scrambler-common.h"
+#include "scrambler-pool.h"
+#include "scrambler-spill.h"
+
+// Defines
+
+#define SPILL_KEY_SIZE (16)
+#define SPILL_BLOCK_SIZE (16)
+
+// Structs
+
+struct scrambler_spill {
+    size_t max_memory_size;
+    char *temp_path_prefix;
+
+    // allocated with max_memory_size up front, so no reallocation leaves plain data in freed memory. NULL once the
+    // data has been moved to the file.
+    unsigned char *memory;
+
+    int fd;
+    unsigned char key[SPILL_KEY_SIZE];
+    unsigned char iv[SPILL_BLOCK_SIZE];
+    // the file is written from the start, so the counter of the write context just follows
+    EVP_CIPHER_CTX *write_context;
+    EVP_CIPHER_CTX *read_context;
+
+    uoff_t size;
+};
+
+// Functions
+
+// Counter block of the block at the given index, the whole block is incremented as a big endian number like in CTR.
+static void scrambler_spill_counter(unsigned char *counter, const unsigned char *iv, uoff_t block_index) {
+    unsigned int carry = 0;
+
+    for (int index = SPILL_BLOCK_SIZE - 1; index >= 0; index--) {
+        unsigned int sum = iv[index] + (unsigned int)(block_index & 0xff) + carry;
+
+        counter[index] = sum & 0xff;
+        carry = sum >> 8;
+        block_index >>= 8;
+    }
+}
+
+static int scrambler_spill_write(struct scrambler_spill *spill, const unsigned char *data, size_t size) {
+    unsigned char encrypted[CHUNK_SIZE];
+    int encrypted_size;
+
+    while (size > 0) {
+        size_t block_size = MIN(size, sizeof(encrypted));
+
+        if (EVP_EncryptUpdate(spill->write_context, encrypted, &encrypted_size, data, block_size) != 1) {
+            i_error_openssl("scrambler_spill_write");
+            return -1;
+        }
+        if (write_full(spill->fd, encrypted, encrypted_size) < 0) {
+            i_error("scrambler_spill_write: write(%s) failed: %m", spill->temp_path_prefix);
+            return -1;
+        }
+
+        data += block_size;
+        size -= block_size;
+    }
+
+    OPENSSL_cleanse(encrypted, sizeof(encrypted));
+    return 0;
+}
+
+// Moves the data in memory to a new temporary file.
+static int scrambler_spill_to_file(struct scrambler_spill *spill) {
+    string_t *path = t_str_new(256);
+
+    str_append(path, spill->temp_path_prefix);
+    spill->fd = safe_mkstemp_hostpid(path, 0600, (uid_t)-1, (gid_t)-1);
+    if (spill->fd == -1) {
+        i_error("scrambler_spill_to_file: safe_mkstemp(%s) failed: %m", str_c(path));
+        return -1;
+    }
+    // only this process can read the data, even if it crashes
+    if (unlink(str_c(path)) < 0) {
+        i_error("scrambler_spill_to_file: unlink(%s) failed: %m", str_c(path));
+        return -1;
+    }
+
+    spill->write_context = scrambler_pool_get_cipher_context();
+    spill->read_context = scrambler_pool_get_cipher_context();
+    if (spill->write_context == NULL || spill->read_context == NULL ||
+        RAND_bytes(spill->key, sizeof(spill->key)) != 1 ||
+        RAND_bytes(spill->iv, sizeof(spill->iv)) != 1 ||
+        EVP_EncryptInit_ex(spill->write_context, scrambler_aes_128_ctr(), NULL, spill->key, spill->iv) != 1) {
+        i_error_openssl("scrambler_spill_to_file");
+        return -1;
+    }
+
+    if (scrambler_spill_write(spill, spill->memory, spill->size) < 0)
+        return -1;
+
+    safe_memset(spill->memory, 0, spill->size);
+    i_free(spill->memory);
+    return 0;
+}
+
+struct scrambler_spill *scrambler_spill_create(size_t max_memory_size, const char *temp_path_prefix) {
+    struct scrambler_spill *spill = i_new(struct scrambler_spill, 1);
+
+    spill->max_memory_size = max_memory_size;
+    spill->temp_path_prefix = i_strdup(temp_path_prefix);
+    spill->memory = i_malloc(max_memory_size);
+    spill->fd = -1;
+
+    return spill;
+}
+
+int scrambler_spill_append(struct scrambler_spill *spill, const unsigned char *data, size_t size) {
+    if (spill->memory != NULL && spill->size + size > spill->max_memory_size) {
+        if (scrambler_spill_to_file(spill) < 0)
+            return -1;
+    }
+
+    if (spill->memory != NULL) {
+        memcpy(spill->memory + spill->size, data, size);
+    } else if (scrambler_spill_write(spill, data, size) < 0) {
+        return -1;
+    }
+
+    spill->size += size;
+    return 0;
+}
+
+ssize_t scrambler_spill_read(struct scrambler_spill *spill, uoff_t offset, unsigned char *destination, size_t size) {
+    unsigned char counter[SPILL_BLOCK_SIZE], skipped[SPILL_BLOCK_SIZE];
+    unsigned int skipped_size = offset % SPILL_BLOCK_SIZE;
+    int decrypted_size;
+    ssize_t result;
+
+    i_assert(offset < spill->size);
+    size = MIN(size, spill->size - offset);
+
+    if (spill->memory != NULL) {
+        memcpy(destination, spill->memory + offset, size);
+        return size;
+    }
+
+    result = pread(spill->fd, destination, size, offset);
+    if (result <= 0) {
+        i_error("scrambler_spill_read: pread(%s) failed: %s", spill->temp_path_prefix,
+            result < 0 ? strerror(errno) : "unexpected end of file");
+        return -1;
+    }
+
+    // CTR allows to start at any block, the key stream before the offset within the block is skipped
+    scrambler_spill_counter(counter, spill->iv, offset / SPILL_BLOCK_SIZE);
+    memset(skipped, 0, sizeof(skipped));
+    if (EVP_DecryptInit_ex(spill->read_context, scrambler_aes_128_ctr(), NULL, spill->key, counter) != 1 ||
+        EVP_DecryptUpdate(spill->read_context, skipped, &decrypted_size, skipped, skipped_size) != 1 ||
+        EVP_DecryptUpdate(spill->read_context, destination, &decrypted_size, destination, result) != 1) {
+        i_error_openssl("scrambler_spill_read");
+        return -1;
+    }
+
+    return result;
+}
+
+uoff_t scrambler_spill_get_size(const struct scrambler_spill *spill) {
+    return spill->size;
+}
+
+void scrambler_spill_destroy(struct scrambler_spill **_spill) {
+    struct scrambler_spill *spill = *_spill;
+
+    *_spill = NULL;
+
+    if (spill->memory != NULL) {
+        safe_memset(spill->memory, 0, spill->size);
+        i_free(spill->memory);
+    }
+    if (spill->fd != -1 && close(spill->fd) < 0)
+        i_error("scrambler_spill_destroy: close(%s) failed: %m", spill->temp_path_prefix);
+
+    scrambler_pool_put_cipher_context(spill->write_context);
+    scrambler_pool_put_cipher_context(spill->read_context);
+    OPENSSL_cleanse(spill->key, sizeof(spill->key));
+
+    i_free(spill->temp_path_prefix);
+    i_free(spill);
+}
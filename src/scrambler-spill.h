@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_SPILL_H
+#define SCRAMBLER_SPILL_H
+
+// Structs
+
+// Cache of the decrypted data of a mail, which is appended to from the start. Data is kept in memory up to the
+// maximal memory size. Beyond that, all of it moves to an unlinked temporary file, encrypted with a random key that
+// only lives in the cache.
+struct scrambler_spill;
+
+// Functions
+
+struct scrambler_spill *scrambler_spill_create(size_t max_memory_size, const char *temp_path_prefix);
+
+int scrambler_spill_append(struct scrambler_spill *spill, const unsigned char *data, size_t size);
+
+// Reads up to size bytes at the offset, which has to be below the size of the cache. Returns the number of bytes read
+// or -1.
+ssize_t scrambler_spill_read(struct scrambler_spill *spill, uoff_t offset, unsigned char *destination, size_t size);
+
+uoff_t scrambler_spill_get_size(const struct scrambler_spill *spill);
+
+void scrambler_spill_destroy(struct scrambler_spill **spill);
+
+#endif
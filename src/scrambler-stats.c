@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <time.h>
+
+#include "scrambler-stats.h"
+
+// Functions
+
+unsigned long long scrambler_stats_now_usecs(void) {
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+        i_fatal("clock_gettime() failed: %m");
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void scrambler_stats_add(struct scrambler_stats *destination, const struct scrambler_stats *source) {
+    destination->key_operations += source->key_operations;
+    destination->prefetched_headers += source->prefetched_headers;
+    destination->presealed_headers += source->presealed_headers;
+    destination->kdf_usecs += source->kdf_usecs;
+    destination->key_load_usecs += source->key_load_usecs;
+
+    destination->encrypted_bytes += source->encrypted_bytes;
+    destination->decrypted_bytes += source->decrypted_bytes;
+    destination->chunks_encrypted += source->chunks_encrypted;
+    destination->chunks_verified += source->chunks_verified;
+    destination->seek_rewinds += source->seek_rewinds;
+    destination->chunk_seeks += source->chunk_seeks;
+    destination->alt_reads += source->alt_reads;
+
+    destination->header_usecs += source->header_usecs;
+    destination->cipher_usecs += source->cipher_usecs;
+    destination->mac_usecs += source->mac_usecs;
+}
+
+bool scrambler_stats_is_empty(const struct scrambler_stats *stats) {
+    static const struct scrambler_stats empty_stats;
+
+    return memcmp(stats, &empty_stats, sizeof(empty_stats)) == 0;
+}
+
+const char *scrambler_stats_format(const struct scrambler_stats *stats) {
+    return t_strdup_printf(
+        "key_ops=%u prefetched_headers=%u presealed_headers=%u kdf_msecs=%llu key_load_msecs=%llu "
+        "encrypted_bytes=%llu decrypted_bytes=%llu chunks_encrypted=%u chunks_verified=%u seek_rewinds=%u "
+        "chunk_seeks=%u alt_reads=%u header_msecs=%llu cipher_msecs=%llu mac_msecs=%llu",
+        stats->key_operations, stats->prefetched_headers, stats->presealed_headers, stats->kdf_usecs / 1000,
+        stats->key_load_usecs / 1000, stats->encrypted_bytes, stats->decrypted_bytes, stats->chunks_encrypted,
+        stats->chunks_verified, stats->seek_rewinds, stats->chunk_seeks, stats->alt_reads,
+        stats->header_usecs / 1000, stats->cipher_usecs / 1000, stats->mac_usecs / 1000);
+}
@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_STATS_H
+#define SCRAMBLER_STATS_H
+
+// Structs
+
+// Counters of the crypto work. The streams count into their own instance and add it to the one of the user when
+// they are closed. All times are in microseconds.
+struct scrambler_stats {
+    // wrapping or unwrapping of content keys with the public or private key
+    unsigned int key_operations;
+    // unwrapped by the prefetch threads ahead of the read, these are counted in key_operations as well
+    unsigned int prefetched_headers;
+    // sealed ahead of time by the header pool, counted in key_operations as well
+    unsigned int presealed_headers;
+    unsigned long long kdf_usecs;
+    unsigned long long key_load_usecs;
+
+    unsigned long long encrypted_bytes;
+    unsigned long long decrypted_bytes;
+    unsigned int chunks_encrypted;
+    unsigned int chunks_verified;
+    unsigned int seek_rewinds;
+    // seeks straight to the chunk of the offset
+    unsigned int chunk_seeks;
+    // mails opened from the alternate storage with its read ahead
+    unsigned int alt_reads;
+
+    unsigned long long header_usecs;
+    unsigned long long cipher_usecs;
+    unsigned long long mac_usecs;
+};
+
+// Functions
+
+unsigned long long scrambler_stats_now_usecs(void);
+
+void scrambler_stats_add(struct scrambler_stats *destination, const struct scrambler_stats *source);
+
+bool scrambler_stats_is_empty(const struct scrambler_stats *stats);
+
+const char *scrambler_stats_format(const struct scrambler_stats *stats);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <dovecot/str.h>
+
+#include "scrambler-common.h"
+#include "scrambler-stats.h"
+#include "scrambler-trace.h"
+
+// Functions
+
+static unsigned int scrambler_histogram_index(unsigned long long value) {
+    unsigned int exponent, sub_bucket;
+
+    if (value < HISTOGRAM_LINEAR_LIMIT)
+        return value;
+
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAXIMAL_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+
+    sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return HISTOGRAM_LINEAR_LIMIT + (exponent - HISTOGRAM_SUB_BUCKET_BITS - 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+// Returns the largest value, that falls into the bucket.
+static unsigned long long scrambler_histogram_value(unsigned int index) {
+    unsigned int exponent, sub_bucket;
+
+    if (index < HISTOGRAM_LINEAR_LIMIT)
+        return index;
+
+    exponent = (index - HISTOGRAM_LINEAR_LIMIT) / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS + 1;
+    sub_bucket = (index - HISTOGRAM_LINEAR_LIMIT) % HISTOGRAM_SUB_BUCKETS;
+    return ((unsigned long long)(HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - HISTOGRAM_SUB_BUCKET_BITS)) - 1;
+}
+
+void scrambler_histogram_add(struct scrambler_histogram *histogram, unsigned long long value) {
+    histogram->buckets[scrambler_histogram_index(value)]++;
+    histogram->count++;
+    histogram->maximum = MAX(histogram->maximum, value);
+}
+
+unsigned long long scrambler_histogram_percentile(const struct scrambler_histogram *histogram, double percentile) {
+    unsigned long long rank = (unsigned long long)(histogram->count * percentile / 100.0 + 0.5);
+    unsigned long long seen = 0;
+
+    if (histogram->count == 0)
+        return 0;
+
+    for (unsigned int index = 0; index < HISTOGRAM_BUCKETS; index++) {
+        seen += histogram->buckets[index];
+        if (seen >= MAX(rank, 1ULL))
+            return MIN(scrambler_histogram_value(index), histogram->maximum);
+    }
+    return histogram->maximum;
+}
+
+void scrambler_trace_read_finished(
+    struct scrambler_trace *trace,
+    const char *label,
+    unsigned long long elapsed_usecs,
+    const struct scrambler_stats *stats
+) {
+    scrambler_histogram_add(&trace->header, stats->header_usecs);
+    scrambler_histogram_add(&trace->read, elapsed_usecs);
+
+    if (elapsed_usecs >= (unsigned long long)trace->threshold_msecs * 1000) {
+        i_warning("scrambler slow read: %s: %llu ms, %llu bytes decrypted, %u chunks, %u rewinds, "
+            "header %llu ms, aes %llu ms, hmac %llu ms",
+            label, elapsed_usecs / 1000, stats->decrypted_bytes, stats->chunks_verified, stats->seek_rewinds,
+            stats->header_usecs / 1000, stats->cipher_usecs / 1000, stats->mac_usecs / 1000);
+    }
+}
+
+void scrambler_trace_write_finished(
+    struct scrambler_trace *trace,
+    const char *label,
+    unsigned long long elapsed_usecs,
+    unsigned int send_count,
+    const struct scrambler_stats *stats
+) {
+    scrambler_histogram_add(&trace->header, stats->header_usecs);
+    scrambler_histogram_add(&trace->write, elapsed_usecs);
+
+    if (elapsed_usecs >= (unsigned long long)trace->threshold_msecs * 1000) {
+        i_warning("scrambler slow write: %s: %llu ms, %llu bytes encrypted, %u chunks, %u sends, "
+            "header %llu ms, aes %llu ms, hmac %llu ms",
+            label, elapsed_usecs / 1000, stats->encrypted_bytes, stats->chunks_encrypted, send_count,
+            stats->header_usecs / 1000, stats->cipher_usecs / 1000, stats->mac_usecs / 1000);
+    }
+}
+
+static void scrambler_trace_format_histogram(
+    string_t *output,
+    const char *name,
+    const struct scrambler_histogram *histogram
+) {
+    str_printfa(output, " %s_count=%u %s_p50_usecs=%llu %s_p90_usecs=%llu %s_p99_usecs=%llu %s_max_usecs=%llu",
+        name, histogram->count,
+        name, scrambler_histogram_percentile(histogram, 50),
+        name, scrambler_histogram_percentile(histogram, 90),
+        name, scrambler_histogram_percentile(histogram, 99),
+        name, histogram->maximum);
+}
+
+const char *scrambler_trace_format(const struct scrambler_trace *trace) {
+    string_t *output = t_str_new(256);
+
+    scrambler_trace_format_histogram(output, "header", &trace->header);
+    scrambler_trace_format_histogram(output, "read", &trace->read);
+    scrambler_trace_format_histogram(output, "write", &trace->write);
+
+    return str_c(output) + 1;
+}
@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_TRACE_H
+#define SCRAMBLER_TRACE_H
+
+#include "scrambler-stats.h"
+
+// Defines
+
+// values below 16 get a bucket each, above that every power of two is split into 8 buckets (12.5% resolution)
+#define HISTOGRAM_SUB_BUCKET_BITS (3)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_LINEAR_LIMIT (2 * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_MAXIMAL_EXPONENT (40)
+#define HISTOGRAM_BUCKETS \
+    (HISTOGRAM_LINEAR_LIMIT + (HISTOGRAM_MAXIMAL_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+// Structs
+
+struct scrambler_histogram {
+    unsigned int buckets[HISTOGRAM_BUCKETS];
+    unsigned int count;
+    unsigned long long maximum;
+};
+
+// Latencies of one user in microseconds. Reads and writes that take longer than the threshold are logged.
+struct scrambler_trace {
+    unsigned int threshold_msecs;
+
+    struct scrambler_histogram header;
+    struct scrambler_histogram read;
+    struct scrambler_histogram write;
+};
+
+// Functions
+
+void scrambler_histogram_add(struct scrambler_histogram *histogram, unsigned long long value);
+
+unsigned long long scrambler_histogram_percentile(const struct scrambler_histogram *histogram, double percentile);
+
+void scrambler_trace_read_finished(
+    struct scrambler_trace *trace,
+    const char *label,
+    unsigned long long elapsed_usecs,
+    const struct scrambler_stats *stats);
+
+void scrambler_trace_write_finished(
+    struct scrambler_trace *trace,
+    const char *label,
+    unsigned long long elapsed_usecs,
+    unsigned int send_count,
+    const struct scrambler_stats *stats);
+
+const char *scrambler_trace_format(const struct scrambler_trace *trace);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <xcrypt.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-stats.h"
+#include "scrambler-workers.h"
+#include "scrambler-unlock.h"
+
+// Structs
+
+struct scrambler_unlock {
+    char *password;
+    char settings[HASH_SETTINGS_SIZE];
+    char *private_key_pem;
+    // NULL if the user has no old private key
+    char *old_private_key_pem;
+
+    // results, written by the worker thread before done is set
+    struct crypt_data crypt_data;
+    EVP_PKEY *private_key;
+    EVP_PKEY *old_private_key;
+    char error[256];
+    unsigned long long kdf_usecs;
+    unsigned long long key_load_usecs;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    bool done;
+};
+
+// Functions
+
+// Runs in the worker thread, so errors are only formatted into the unlock.
+static EVP_PKEY *scrambler_unlock_read_key(
+    struct scrambler_unlock *unlock,
+    const char *pem,
+    const char *password,
+    const char *name
+) {
+    BIO *bio = BIO_new_mem_buf((char *)pem, -1);
+    EVP_PKEY *key = bio == NULL ? NULL : PEM_read_bio_PrivateKey(bio, NULL, NULL, (void *)password);
+    char openssl_error[200];
+
+    BIO_free_all(bio);
+
+    if (key == NULL) {
+        ERR_error_string_n(ERR_get_error(), openssl_error, sizeof(openssl_error));
+        ERR_clear_error();
+        snprintf(unlock->error, sizeof(unlock->error), "failed to decrypt the %s: %s", name, openssl_error);
+        return NULL;
+    }
+
+    if (scrambler_package_for_key(key) == NULL) {
+        snprintf(unlock->error, sizeof(unlock->error), "unsupported key type %s of the %s",
+            OBJ_nid2sn(EVP_PKEY_base_id(key)), name);
+        EVP_PKEY_free(key);
+        return NULL;
+    }
+
+    return key;
+}
+
+static void scrambler_unlock_run(void *context) {
+    struct scrambler_unlock *unlock = context;
+    unsigned long long start_usecs = scrambler_stats_now_usecs();
+    const char *hashed_password;
+
+    hashed_password = crypt_r(unlock->password, unlock->settings, &unlock->crypt_data);
+    unlock->kdf_usecs = scrambler_stats_now_usecs() - start_usecs;
+
+    if (hashed_password == NULL || hashed_password[0] == '*') {
+        snprintf(unlock->error, sizeof(unlock->error), "failed to hash the password");
+    } else {
+        start_usecs = scrambler_stats_now_usecs();
+        unlock->private_key = scrambler_unlock_read_key(unlock, unlock->private_key_pem, hashed_password,
+            "private key");
+        if (unlock->private_key != NULL && unlock->old_private_key_pem != NULL) {
+            unlock->old_private_key = scrambler_unlock_read_key(unlock, unlock->old_private_key_pem,
+                hashed_password, "old private key");
+        }
+        unlock->key_load_usecs = scrambler_stats_now_usecs() - start_usecs;
+    }
+
+    OPENSSL_cleanse(&unlock->crypt_data, sizeof(unlock->crypt_data));
+
+    pthread_mutex_lock(&unlock->mutex);
+    unlock->done = TRUE;
+    pthread_cond_signal(&unlock->done_cond);
+    pthread_mutex_unlock(&unlock->mutex);
+}
+
+struct scrambler_unlock *scrambler_unlock_start(
+    struct scrambler_workers *workers,
+    const char *password,
+    const char *salt,
+    unsigned int iterations,
+    const char *private_key,
+    const char *old_private_key
+) {
+    struct scrambler_unlock *unlock = i_new(struct scrambler_unlock, 1);
+
+    if (scrambler_hash_settings(unlock->settings, salt, iterations) < 0) {
+        i_free(unlock);
+        return NULL;
+    }
+
+    unlock->password = i_strdup(password);
+    unlock->private_key_pem = i_strdup(private_key);
+    unlock->old_private_key_pem = i_strdup(old_private_key);
+    pthread_mutex_init(&unlock->mutex, NULL);
+    pthread_cond_init(&unlock->done_cond, NULL);
+
+    scrambler_workers_submit(workers, scrambler_unlock_run, NULL, unlock);
+    return unlock;
+}
+
+bool scrambler_unlock_is_done(struct scrambler_unlock *unlock) {
+    bool done;
+
+    pthread_mutex_lock(&unlock->mutex);
+    done = unlock->done;
+    pthread_mutex_unlock(&unlock->mutex);
+    return done;
+}
+
+int scrambler_unlock_finish(
+    struct scrambler_unlock **_unlock,
+    EVP_PKEY **private_key_r,
+    EVP_PKEY **old_private_key_r,
+    struct scrambler_stats *stats,
+    const char **error_r
+) {
+    struct scrambler_unlock *unlock = *_unlock;
+    int result = 0;
+
+    *_unlock = NULL;
+
+    pthread_mutex_lock(&unlock->mutex);
+    while (!unlock->done)
+        pthread_cond_wait(&unlock->done_cond, &unlock->mutex);
+    pthread_mutex_unlock(&unlock->mutex);
+
+    *private_key_r = unlock->private_key;
+    *old_private_key_r = unlock->old_private_key;
+    stats->kdf_usecs += unlock->kdf_usecs;
+    stats->key_load_usecs += unlock->key_load_usecs;
+
+    if (unlock->error[0] != '\0') {
+        *error_r = t_strdup(unlock->error);
+        result = -1;
+    }
+
+    safe_memset(unlock->password, 0, strlen(unlock->password));
+    i_free(unlock->password);
+    i_free(unlock->private_key_pem);
+    i_free(unlock->old_private_key_pem);
+    pthread_cond_destroy(&unlock->done_cond);
+    pthread_mutex_destroy(&unlock->mutex);
+    i_free(unlock);
+
+    return result;
+}
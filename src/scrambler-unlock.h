@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_UNLOCK_H
+#define SCRAMBLER_UNLOCK_H
+
+#include <openssl/evp.h>
+
+#include "scrambler-stats.h"
+#include "scrambler-workers.h"
+
+// Structs
+
+// Hashing of the password and decryption of the private keys of a user, which runs in a worker thread.
+struct scrambler_unlock;
+
+// Functions
+
+// Copies the strings and queues the unlock. Returns NULL, if salt or iterations are invalid.
+struct scrambler_unlock *scrambler_unlock_start(
+    struct scrambler_workers *workers,
+    const char *password,
+    const char *salt,
+    unsigned int iterations,
+    const char *private_key,
+    const char *old_private_key);
+
+// Returns TRUE, once the worker has finished the unlock, so scrambler_unlock_finish() doesn't wait.
+bool scrambler_unlock_is_done(struct scrambler_unlock *unlock);
+
+// Waits for the unlock, returns the keys and frees the unlock. The times are added to the stats. Returns -1, if one
+// of the keys couldn't be decrypted.
+int scrambler_unlock_finish(
+    struct scrambler_unlock **unlock,
+    EVP_PKEY **private_key_r,
+    EVP_PKEY **old_private_key_r,
+    struct scrambler_stats *stats,
+    const char **error_r);
+
+#endif
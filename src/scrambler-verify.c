@@ -0,0 +1,138 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-verify.h"
+
+// Functions
+
+// Returns NULL if all chunks are intact or the error text otherwise.
+static const char *scrambler_verify_chunks(
+    struct scrambler_package_context *context,
+    const unsigned char *source, const unsigned char *source_end,
+    unsigned int *chunk_index_r
+) {
+    scrambler_package_open_chunk_t *open_chunk = context->package->open_chunk;
+    const char *error;
+    bool final = FALSE;
+    ssize_t result;
+
+    while (source < source_end) {
+        *chunk_index_r = context->chunk_index;
+
+        if (final)
+            return "data after the final chunk";
+
+        // without a destination, only the tag is checked
+        result = open_chunk(context, source, source_end - source, NULL, NULL, &final, &error);
+        if (result < 0)
+            return result == SCRAMBLER_CHUNK_TAG_MISMATCH ? "chunk tag mismatch" : error;
+        source += result;
+    }
+
+    return final ? NULL : "final chunk missing";
+}
+
+// Opens the header with the given key and confirms the key with the tag of the first chunk.
+static int scrambler_verify_open(
+    struct scrambler_package_context *context,
+    const unsigned char *data, size_t size,
+    EVP_PKEY *private_key,
+    const char **error_r
+) {
+    size_t header_size = scrambler_package_header_size(context->package, private_key);
+    int result;
+
+    if (size < MAGIC_SIZE + header_size) {
+        *error_r = "truncated header";
+        return -1;
+    }
+
+    result = scrambler_package_open_confirmed_header(context, data + MAGIC_SIZE, private_key,
+        data + MAGIC_SIZE + header_size, size - MAGIC_SIZE - header_size, error_r);
+    if (result < 0) {
+        ERR_clear_error();
+        scrambler_package_context_deinit(context);
+    }
+    return result;
+}
+
+int scrambler_verify(
+    const unsigned char *data, size_t size,
+    EVP_PKEY *private_key, EVP_PKEY *old_private_key,
+    const char **error_r, unsigned int *chunk_index_r
+) {
+    const struct scrambler_package *package;
+    struct scrambler_package_context context;
+    int result;
+
+    *error_r = NULL;
+    *chunk_index_r = 0;
+
+    if (size < MAGIC_SIZE || memcmp(scrambler_header, data, sizeof(scrambler_header)) != 0) {
+        *error_r = "not encrypted";
+        return -1;
+    }
+
+    package = scrambler_package_get(data[sizeof(scrambler_header)]);
+    if (package == NULL) {
+        *error_r = "unknown encryption package";
+        return -1;
+    }
+
+    if (!scrambler_package_accepts_key(package, private_key) || old_private_key == private_key) {
+        private_key = old_private_key;
+        old_private_key = NULL;
+    }
+    if (!scrambler_package_accepts_key(package, private_key)) {
+        *error_r = "no private key for the encryption package";
+        return -1;
+    }
+
+    // a key of the same type may unwrap a header of the old key to garbage, the first chunk tag tells. If the old
+    // key doesn't open it either, the error of the current key is reported.
+    scrambler_package_context_init(&context, package, NULL);
+    result = scrambler_verify_open(&context, data, size, private_key, error_r);
+    if (result < 0 && scrambler_package_accepts_key(package, old_private_key)) {
+        const char *old_error;
+
+        scrambler_package_context_init(&context, package, NULL);
+        if (scrambler_verify_open(&context, data, size, old_private_key, &old_error) == 0) {
+            private_key = old_private_key;
+            result = 0;
+        }
+    }
+    if (result < 0) {
+        if (result == SCRAMBLER_CHUNK_TAG_MISMATCH)
+            *error_r = "chunk tag mismatch";
+        return -1;
+    }
+
+    *error_r = scrambler_verify_chunks(&context, data + MAGIC_SIZE + scrambler_package_header_size(package,
+        private_key), data + size, chunk_index_r);
+    scrambler_package_context_deinit(&context);
+
+    return *error_r == NULL ? 0 : -1;
+}
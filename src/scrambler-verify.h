@@ -0,0 +1,37 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_VERIFY_H
+#define SCRAMBLER_VERIFY_H
+
+#include <openssl/evp.h>
+
+// Functions
+
+// Checks the header, every chunk tag and the final chunk flag of an encrypted mail without decrypting the chunks.
+// Doesn't call into dovecot, so it can be run in worker threads. Returns 0 if the mail is intact, otherwise -1,
+// a static error text and the index of the failing chunk. Mails still wrapped for the old private key are checked
+// with that one, if given.
+int scrambler_verify(
+    const unsigned char *data, size_t size,
+    EVP_PKEY *private_key, EVP_PKEY *old_private_key,
+    const char **error_r, unsigned int *chunk_index_r);
+
+#endif
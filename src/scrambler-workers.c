@@ -0,0 +1,249 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "scrambler-common.h"
+#include "scrambler-workers.h"
+
+// Structs
+
+struct scrambler_job {
+    struct scrambler_job *next;
+
+    scrambler_job_run_t *run;
+    scrambler_job_finish_t *finish;
+    void *context;
+};
+
+struct scrambler_workers {
+    pthread_t *threads;
+    unsigned int thread_count;
+    unsigned int max_queued_jobs;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_cond;
+    pthread_cond_t done_cond;
+
+    // both queues are guarded by the mutex, jobs move from pending to done
+    struct scrambler_job *pending_head, *pending_tail;
+    struct scrambler_job *done_head, *done_tail;
+    unsigned int queued_count;
+
+    bool stopping;
+};
+
+// Functions
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1 is only thread safe with locking callbacks, which dovecot doesn't install. They are installed
+// once and kept for the lifetime of the process.
+static pthread_mutex_t *scrambler_workers_openssl_locks = NULL;
+
+static void scrambler_workers_openssl_lock(int mode, int index, const char *file ATTR_UNUSED, int line ATTR_UNUSED) {
+    if ((mode & CRYPTO_LOCK) != 0)
+        pthread_mutex_lock(&scrambler_workers_openssl_locks[index]);
+    else
+        pthread_mutex_unlock(&scrambler_workers_openssl_locks[index]);
+}
+
+static void scrambler_workers_openssl_thread_id(CRYPTO_THREADID *id) {
+    CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+
+static void scrambler_workers_openssl_init(void) {
+    if (CRYPTO_get_locking_callback() != NULL)
+        return;
+
+    scrambler_workers_openssl_locks = i_new(pthread_mutex_t, CRYPTO_num_locks());
+    for (int index = 0; index < CRYPTO_num_locks(); index++)
+        pthread_mutex_init(&scrambler_workers_openssl_locks[index], NULL);
+
+    CRYPTO_THREADID_set_callback(scrambler_workers_openssl_thread_id);
+    CRYPTO_set_locking_callback(scrambler_workers_openssl_lock);
+}
+#else
+static void scrambler_workers_openssl_init(void) {
+}
+#endif
+
+static void *scrambler_workers_thread(void *context) {
+    struct scrambler_workers *workers = context;
+    struct scrambler_job *job;
+
+    pthread_mutex_lock(&workers->mutex);
+    for (;;) {
+        while (workers->pending_head == NULL && !workers->stopping)
+            pthread_cond_wait(&workers->pending_cond, &workers->mutex);
+
+        if (workers->pending_head == NULL)
+            break;
+
+        job = workers->pending_head;
+        workers->pending_head = job->next;
+        if (workers->pending_head == NULL)
+            workers->pending_tail = NULL;
+        pthread_mutex_unlock(&workers->mutex);
+
+        job->run(job->context);
+
+        pthread_mutex_lock(&workers->mutex);
+        job->next = NULL;
+        if (workers->done_tail == NULL)
+            workers->done_head = job;
+        else
+            workers->done_tail->next = job;
+        workers->done_tail = job;
+        pthread_cond_signal(&workers->done_cond);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+
+    return NULL;
+}
+
+// Runs the finish callbacks of all done jobs. If wait is set, it blocks until at least one job is done. Must be
+// called with the mutex locked.
+static void scrambler_workers_finish_done(struct scrambler_workers *workers, bool wait) {
+    struct scrambler_job *job;
+
+    while (wait && workers->done_head == NULL)
+        pthread_cond_wait(&workers->done_cond, &workers->mutex);
+
+    job = workers->done_head;
+    workers->done_head = workers->done_tail = NULL;
+
+    while (job != NULL) {
+        struct scrambler_job *next = job->next;
+
+        workers->queued_count--;
+        pthread_mutex_unlock(&workers->mutex);
+        if (job->finish != NULL)
+            job->finish(job->context);
+        i_free(job);
+        pthread_mutex_lock(&workers->mutex);
+
+        job = next;
+    }
+}
+
+struct scrambler_workers *scrambler_workers_create(unsigned int thread_count, unsigned int max_queued_jobs) {
+    struct scrambler_workers *workers = i_new(struct scrambler_workers, 1);
+
+    scrambler_workers_openssl_init();
+
+    workers->max_queued_jobs = MAX(max_queued_jobs, thread_count);
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->pending_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+
+    workers->threads = i_new(pthread_t, thread_count);
+    for (unsigned int index = 0; index < thread_count; index++) {
+        int result = pthread_create(&workers->threads[index], NULL, scrambler_workers_thread, workers);
+        if (result != 0) {
+            i_error("scrambler_workers_create: pthread_create() failed: %s", strerror(result));
+            break;
+        }
+        workers->thread_count++;
+    }
+
+    return workers;
+}
+
+void scrambler_workers_submit(
+    struct scrambler_workers *workers,
+    scrambler_job_run_t *run,
+    scrambler_job_finish_t *finish,
+    void *context
+) {
+    struct scrambler_job *job;
+
+    // without threads, the job is run right away
+    if (workers->thread_count == 0) {
+        run(context);
+        if (finish != NULL)
+            finish(context);
+        return;
+    }
+
+    job = i_new(struct scrambler_job, 1);
+    job->run = run;
+    job->finish = finish;
+    job->context = context;
+
+    pthread_mutex_lock(&workers->mutex);
+    scrambler_workers_finish_done(workers, FALSE);
+    while (workers->queued_count >= workers->max_queued_jobs)
+        scrambler_workers_finish_done(workers, TRUE);
+
+    if (workers->pending_tail == NULL)
+        workers->pending_head = job;
+    else
+        workers->pending_tail->next = job;
+    workers->pending_tail = job;
+    workers->queued_count++;
+
+    pthread_cond_signal(&workers->pending_cond);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+void scrambler_workers_wait(struct scrambler_workers *workers) {
+    pthread_mutex_lock(&workers->mutex);
+    while (workers->queued_count > 0)
+        scrambler_workers_finish_done(workers, TRUE);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+void scrambler_workers_wait_any(struct scrambler_workers *workers) {
+    pthread_mutex_lock(&workers->mutex);
+    if (workers->queued_count > 0)
+        scrambler_workers_finish_done(workers, TRUE);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+void scrambler_workers_destroy(struct scrambler_workers **_workers) {
+    struct scrambler_workers *workers = *_workers;
+
+    *_workers = NULL;
+
+    scrambler_workers_wait(workers);
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->stopping = TRUE;
+    pthread_cond_broadcast(&workers->pending_cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    for (unsigned int index = 0; index < workers->thread_count; index++)
+        pthread_join(workers->threads[index], NULL);
+
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->pending_cond);
+    pthread_mutex_destroy(&workers->mutex);
+    i_free(workers->threads);
+    i_free(workers);
+}
+
+unsigned int scrambler_workers_default_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (unsigned int)count : 1;
+}
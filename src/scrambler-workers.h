@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCRAMBLER_WORKERS_H
+#define SCRAMBLER_WORKERS_H
+
+// Structs
+
+struct scrambler_workers;
+
+// Runs in a worker thread, so it must only work on its own buffers and must not call into dovecot (no data stack,
+// no pools, no logging). OpenSSL can be used.
+typedef void scrambler_job_run_t(void *context);
+
+// Runs in the thread that submitted the job, once the job has been run.
+typedef void scrambler_job_finish_t(void *context);
+
+// Functions
+
+struct scrambler_workers *scrambler_workers_create(unsigned int thread_count, unsigned int max_queued_jobs);
+
+void scrambler_workers_submit(
+    struct scrambler_workers *workers,
+    scrambler_job_run_t *run,
+    scrambler_job_finish_t *finish,
+    void *context);
+
+void scrambler_workers_wait(struct scrambler_workers *workers);
+
+// Blocks until at least one queued job is done and runs the finish callbacks of the done jobs. Returns right away
+// if no job is queued.
+void scrambler_workers_wait_any(struct scrambler_workers *workers);
+
+void scrambler_workers_destroy(struct scrambler_workers **workers);
+
+unsigned int scrambler_workers_default_count(void);
+
+#endif
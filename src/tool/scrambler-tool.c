@@ -0,0 +1,756 @@
+/*
+Copyright (c) 2014-2015 The scrambler-plugin authors. All rights reserved.
+
+On 30.4.2015 - or earlier on notice - the scrambler-plugin authors will make
+this source code available under the terms of the GNU Affero General Public
+License version 3.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <dovecot/lib.h>
+#include <dovecot/array.h>
+#include <dovecot/buffer.h>
+#include <dovecot/str.h>
+#include <dovecot/istream.h>
+#include <dovecot/ostream.h>
+#include <dovecot/mkdir-parents.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+
+#include "scrambler-common.h"
+#include "scrambler-package.h"
+#include "scrambler-istream.h"
+#include "scrambler-ostream.h"
+
+// Defines
+
+#define MDBOX_FILE_PREFIX "m."
+#define DBOX_MAGIC_PRE "\001\002"
+#define DBOX_MAGIC_POST "\001\003"
+#define DBOX_MESSAGE_TYPE_NORMAL 'N'
+#define DBOX_MESSAGE_HEADER_SIZE (30)
+#define DBOX_MESSAGE_SIZE_OFFSET (13)
+#define DBOX_MESSAGE_SIZE_LENGTH (16)
+
+// Structs
+
+struct scrambler_tool;
+
+struct scrambler_tool_command {
+    const char *name;
+    bool needs_public_key;
+    bool needs_private_key;
+    bool writes_output;
+    int (*run)(struct scrambler_tool *tool, struct istream *input, struct ostream *output, const char *name);
+};
+
+struct scrambler_tool_entry {
+    const char *path;
+    const char *relative_path;
+};
+
+struct scrambler_tool {
+    pool_t pool;
+    const struct scrambler_tool_command *command;
+
+    EVP_PKEY *public_key;
+    EVP_PKEY *private_key;
+
+    const char *output_path;
+    bool recursive;
+    bool mdbox;
+    bool batch;
+    unsigned int worker_count;
+
+    ARRAY(struct scrambler_tool_entry) entries;
+};
+
+struct scrambler_tool_container {
+    const struct scrambler_package *package;
+    unsigned int key_size;
+    unsigned int chunk_count;
+    uoff_t plain_size;
+};
+
+// Functions
+
+static void scrambler_tool_usage(void) ATTR_NORETURN;
+
+static void scrambler_tool_usage(void) {
+    fprintf(stderr,
+        "usage: scrambler-tool <command> [options] [<file>|<directory> ...]\n"
+        "\n"
+        "commands:\n"
+        "  encrypt   encrypt plain input with the public key (-k)\n"
+        "  decrypt   decrypt encrypted input with the private key (-K)\n"
+        "  verify    decrypt and verify every chunk tag without writing output (-K)\n"
+        "  info      print package and framing information, no key needed\n"
+        "\n"
+        "options:\n"
+        "  -k <file>  public key (pem)\n"
+        "  -K <file>  encrypted private key (pem)\n"
+        "  -s <salt>  salt of the hashed password that encrypts the private key\n"
+        "  -i <n>     iterations of the hashed password that encrypts the private key\n"
+        "  -p <fd>    read the plain password from the file descriptor <fd>\n"
+        "             (default: environment variable SCRAMBLER_PASSWORD)\n"
+        "  -o <path>  output file, or output directory in batch mode (default: stdout)\n"
+        "  -r         walk the given directories recursively\n"
+        "  -m         treat the input files as mdbox storage files (m.*)\n"
+        "  -j <n>     number of parallel workers in batch mode (default: 1)\n"
+        "\n"
+        "Without any <file>, the input is read from stdin.\n");
+    exit(EX_USAGE);
+}
+
+static const char *scrambler_tool_read_file(pool_t pool, const char *path) {
+    struct istream *input = i_stream_create_file(path, IO_BLOCK_SIZE);
+    string_t *content = str_new(pool, 4096);
+    const unsigned char *data;
+    size_t size;
+
+    while (i_stream_read_data(input, &data, &size, 0) > 0) {
+        buffer_append(content, data, size);
+        i_stream_skip(input, size);
+    }
+
+    if (input->stream_errno != 0)
+        i_fatal("read(%s) failed: %s", path, strerror(input->stream_errno));
+
+    i_stream_unref(&input);
+    return str_c(content);
+}
+
+static EVP_PKEY *scrambler_tool_load_public_key(struct scrambler_tool *tool, const char *path) {
+    char *pem = p_strdup(tool->pool, scrambler_tool_read_file(tool->pool, path));
+    scrambler_unescape_pem(pem);
+
+    EVP_PKEY *result = scrambler_pem_read_public_key(pem);
+    if (result == NULL)
+        i_fatal("failed to read public key from %s", path);
+    return result;
+}
+
+static EVP_PKEY *scrambler_tool_load_private_key(
+    struct scrambler_tool *tool,
+    const char *path,
+    const char *salt,
+    unsigned int iterations,
+    int password_fd
+) {
+    char *pem = p_strdup(tool->pool, scrambler_tool_read_file(tool->pool, path));
+    scrambler_unescape_pem(pem);
+
+    const char *password = getenv("SCRAMBLER_PASSWORD");
+    if (password_fd >= 0)
+        password = scrambler_read_line_fd(tool->pool, password_fd);
+
+    if (password != NULL && salt != NULL) {
+        password = scrambler_hash_password(password, salt, iterations);
+        if (password == NULL)
+            i_fatal("failed to hash the password");
+    }
+
+    EVP_PKEY *result = scrambler_pem_read_encrypted_private_key(pem, password);
+    if (result == NULL)
+        i_fatal("failed to load and decrypt the private key from %s. may caused by an invalid password.", path);
+    return result;
+}
+
+static int scrambler_tool_skip(struct istream *input, uoff_t count) {
+    const unsigned char *data;
+    size_t size;
+
+    while (count > 0) {
+        if (i_stream_read_data(input, &data, &size, 0) <= 0 && size == 0)
+            return -1;
+
+        size = MIN(size, count);
+        i_stream_skip(input, size);
+        count -= size;
+    }
+    return 0;
+}
+
+// Walks the chunk framing after the magic, given the size of the wrapped key in the package header.
+static int scrambler_tool_walk_chunks(
+    struct istream *input,
+    size_t wrapped_key_size,
+    struct scrambler_tool_container *container
+) {
+    const unsigned char *data;
+    size_t size;
+    unsigned short header;
+
+    container->chunk_count = 0;
+    container->plain_size = 0;
+
+    size_t encrypted_header_size = scrambler_package_wrapped_key_offset(container->package) - MAGIC_SIZE +
+        wrapped_key_size + container->package->encrypted_mac_key_size;
+    if (scrambler_tool_skip(input, encrypted_header_size) < 0)
+        return -1;
+
+    for (;;) {
+        if (i_stream_read_data(input, &data, &size, sizeof(unsigned short) - 1) <= 0 &&
+            size < sizeof(unsigned short))
+            return -1;
+
+        memcpy(&header, data, sizeof(unsigned short));
+        bool final = (header & 0x8000) != 0;
+        unsigned int encrypted_size = header & 0x7fff;
+
+        if (encrypted_size > CHUNK_SIZE || (!final && encrypted_size != CHUNK_SIZE))
+            return -1;
+
+        i_stream_skip(input, sizeof(unsigned short));
+        if (scrambler_tool_skip(input, encrypted_size + container->package->chunk_tag_size) < 0)
+            return -1;
+
+        container->chunk_count++;
+        container->plain_size += encrypted_size;
+
+        if (final) {
+            // the final chunk has to be the last data of the container
+            if (i_stream_read_data(input, &data, &size, 0) > 0 || size > 0)
+                return -1;
+            return 0;
+        }
+    }
+}
+
+static int scrambler_tool_detect(struct istream *input, enum packages *package_r) {
+    const unsigned char *data;
+    size_t size;
+
+    if (i_stream_read_data(input, &data, &size, MAGIC_SIZE - 1) <= 0 && size < MAGIC_SIZE)
+        return 0;
+
+    if (0 != memcmp(scrambler_header, data, sizeof(scrambler_header)))
+        return 0;
+
+    *package_r = data[sizeof(scrambler_header)];
+    return 1;
+}
+
+static int scrambler_tool_copy(struct istream *input, struct ostream *output) {
+    if (o_stream_send_istream(output, input) < 0 || input->stream_errno != 0 || output->stream_errno != 0)
+        return -1;
+
+    return o_stream_flush(output) < 0 ? -1 : 0;
+}
+
+static int scrambler_tool_encrypt(
+    struct scrambler_tool *tool,
+    struct istream *input,
+    struct ostream *output,
+    const char *name
+) {
+    struct ostream *encrypt_output = scrambler_ostream_create(output, tool->public_key, NULL);
+    int result;
+
+    if (encrypt_output == NULL) {
+        i_error("%s: failed to initialize encryption", name);
+        return -1;
+    }
+
+    result = scrambler_tool_copy(input, encrypt_output);
+    if (result < 0)
+        i_error("%s: encryption failed: %s", name,
+            strerror(input->stream_errno != 0 ? input->stream_errno : encrypt_output->stream_errno));
+
+    o_stream_unref(&encrypt_output);
+    return result;
+}
+
+static int scrambler_tool_decrypt(
+    struct scrambler_tool *tool,
+    struct istream *input,
+    struct ostream *output,
+    const char *name
+) {
+    struct istream *decrypt_input;
+    enum packages package;
+    int result;
+
+    if (scrambler_tool_detect(input, &package) == 0)
+        i_warning("%s: input is not encrypted, copying it unchanged", name);
+
+    decrypt_input = scrambler_istream_create(input, tool->private_key, NULL);
+    result = scrambler_tool_copy(decrypt_input, output);
+    if (result < 0)
+        i_error("%s: decryption failed: %s", name,
+            strerror(decrypt_input->stream_errno != 0 ? decrypt_input->stream_errno : output->stream_errno));
+
+    i_stream_unref(&decrypt_input);
+    return result;
+}
+
+static int scrambler_tool_verify(
+    struct scrambler_tool *tool,
+    struct istream *input,
+    struct ostream *output ATTR_UNUSED,
+    const char *name
+) {
+    struct istream *decrypt_input;
+    const unsigned char *data;
+    enum packages package;
+    uoff_t plain_size = 0;
+    size_t size;
+
+    if (scrambler_tool_detect(input, &package) == 0) {
+        printf("%s: plain\n", name);
+        return 0;
+    }
+
+    decrypt_input = scrambler_istream_create(input, tool->private_key, NULL);
+    while (i_stream_read_data(decrypt_input, &data, &size, 0) > 0) {
+        plain_size += size;
+        i_stream_skip(decrypt_input, size);
+    }
+
+    if (decrypt_input->stream_errno != 0) {
+        printf("%s: failed (%s)\n", name, strerror(decrypt_input->stream_errno));
+        i_stream_unref(&decrypt_input);
+        return -1;
+    }
+
+    printf("%s: ok (%llu bytes)\n", name, (unsigned long long)plain_size);
+    i_stream_unref(&decrypt_input);
+    return 0;
+}
+
+static int scrambler_tool_info(
+    struct scrambler_tool *tool,
+    struct istream *input,
+    struct ostream *output ATTR_UNUSED,
+    const char *name
+) {
+    static const unsigned int key_sizes[] = { 256, 128, 384, 512 };
+    struct scrambler_tool_container container;
+    uoff_t start_offset = input->v_offset;
+    enum packages package_id;
+    int result = -1;
+
+    if (scrambler_tool_detect(input, &package_id) == 0) {
+        printf("%s: plain\n", name);
+        return 0;
+    }
+
+    container.package = scrambler_package_get(package_id);
+    if (container.package == NULL) {
+        printf("%s: encrypted, unknown package %02x\n", name, package_id);
+        return -1;
+    }
+
+    if (container.package->key_type != EVP_PKEY_RSA) {
+        // the wrapped key has a fixed size
+        container.key_size = X25519_KEY_SIZE;
+        i_stream_skip(input, MAGIC_SIZE);
+        result = scrambler_tool_walk_chunks(input, container.package->wrapped_key_size(NULL), &container);
+    } else if (container.package->key_size_field_size > 0) {
+        // the size of the wrapped key is recorded in the header
+        const unsigned char *data;
+        size_t size, field_end = MAGIC_SIZE + container.package->key_size_field_size;
+
+        if (i_stream_read_data(input, &data, &size, field_end - 1) > 0 || size >= field_end) {
+            container.key_size = scrambler_package_recorded_key_size(container.package, data + MAGIC_SIZE);
+            i_stream_skip(input, MAGIC_SIZE);
+            result = scrambler_tool_walk_chunks(input, container.key_size, &container);
+        }
+    } else if (tool->public_key != NULL || tool->private_key != NULL) {
+        // with a key at hand, the size of the wrapped key is known
+        EVP_PKEY *key = tool->public_key != NULL ? tool->public_key : tool->private_key;
+        container.key_size = EVP_PKEY_size(key);
+        i_stream_skip(input, MAGIC_SIZE);
+        result = scrambler_tool_walk_chunks(input, container.key_size, &container);
+    } else {
+        // otherwise try the common key sizes until the framing matches up
+        for (unsigned int index = 0; index < N_ELEMENTS(key_sizes) && result < 0; index++) {
+            if (index > 0 && !input->seekable)
+                break;
+
+            container.key_size = key_sizes[index];
+            i_stream_seek(input, start_offset + MAGIC_SIZE);
+            result = scrambler_tool_walk_chunks(input, container.key_size, &container);
+        }
+    }
+
+    if (result < 0) {
+        printf("%s: encrypted, package %02x, invalid framing\n", name, package_id);
+        return -1;
+    }
+
+    printf("%s: encrypted, package %02x (%s), %u bit %s key, %u chunks, %llu bytes\n",
+        name, package_id, container.package->name, container.key_size * 8,
+        OBJ_nid2sn(container.package->key_type), container.chunk_count, (unsigned long long)container.plain_size);
+    return 0;
+}
+
+static const struct scrambler_tool_command scrambler_tool_commands[] = {
+    { "encrypt", TRUE, FALSE, TRUE, scrambler_tool_encrypt },
+    { "decrypt", FALSE, TRUE, TRUE, scrambler_tool_decrypt },
+    { "verify", FALSE, TRUE, FALSE, scrambler_tool_verify },
+    { "info", FALSE, FALSE, FALSE, scrambler_tool_info }
+};
+
+static struct ostream *scrambler_tool_open_output(struct scrambler_tool *tool, const char *relative_path) {
+    const char *path = tool->output_path;
+    int fd;
+
+    if (!tool->command->writes_output)
+        return NULL;
+
+    if (path == NULL)
+        return o_stream_create_fd(STDOUT_FILENO, 0, FALSE);
+
+    if (tool->batch) {
+        path = t_strdup_printf("%s/%s", path, relative_path);
+        const char *slash = strrchr(path, '/');
+        const char *directory = t_strdup_printf("%.*s", (int)(slash - path), path);
+        if (mkdir_parents(directory, 0700) < 0 && errno != EEXIST) {
+            i_error("mkdir(%s) failed: %s", directory, strerror(errno));
+            return NULL;
+        }
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        i_error("open(%s) failed: %s", path, strerror(errno));
+        return NULL;
+    }
+    return o_stream_create_fd_file(fd, 0, TRUE);
+}
+
+static int scrambler_tool_run(
+    struct scrambler_tool *tool,
+    struct istream *input,
+    const char *name,
+    const char *relative_path
+) {
+    struct ostream *output = NULL;
+    int result;
+
+    if (tool->command->writes_output) {
+        output = scrambler_tool_open_output(tool, relative_path);
+        if (output == NULL)
+            return -1;
+    }
+
+    result = tool->command->run(tool, input, output, name);
+
+    if (output != NULL)
+        o_stream_destroy(&output);
+    return result;
+}
+
+static int scrambler_tool_process_mdbox(struct scrambler_tool *tool, const struct scrambler_tool_entry *entry) {
+    struct istream *input = i_stream_create_file(entry->path, IO_BLOCK_SIZE);
+    const unsigned char *data;
+    const char *line;
+    unsigned int header_size = DBOX_MESSAGE_HEADER_SIZE;
+    size_t size;
+    int result = 0;
+
+    // file header, e.g. "2 M1e C55b0e8c4"
+    line = i_stream_read_next_line(input);
+    if (line == NULL || line[0] != '2') {
+        i_error("%s: not an mdbox storage file", entry->path);
+        i_stream_unref(&input);
+        return -1;
+    }
+    for (const char *const *fields = t_strsplit_spaces(line + 1, " "); *fields != NULL; fields++) {
+        if ((*fields)[0] == 'M')
+            header_size = strtoul(*fields + 1, NULL, 16);
+    }
+    if (header_size < DBOX_MESSAGE_HEADER_SIZE) {
+        i_error("%s: invalid message header size %u", entry->path, header_size);
+        i_stream_unref(&input);
+        return -1;
+    }
+
+    for (;;) {
+        uoff_t header_offset = input->v_offset;
+
+        if (i_stream_read_data(input, &data, &size, header_size - 1) <= 0 && size < header_size) {
+            if (size > 0 || input->stream_errno != 0) {
+                i_error("%s: truncated message header at offset %llu",
+                    entry->path, (unsigned long long)header_offset);
+                result = -1;
+            }
+            break;
+        }
+
+        if (0 != memcmp(data, DBOX_MAGIC_PRE, 2) || data[2] != DBOX_MESSAGE_TYPE_NORMAL) {
+            i_error("%s: invalid message header at offset %llu", entry->path, (unsigned long long)header_offset);
+            result = -1;
+            break;
+        }
+
+        const char *size_hex = t_strndup(data + DBOX_MESSAGE_SIZE_OFFSET, DBOX_MESSAGE_SIZE_LENGTH);
+        uoff_t message_size = strtoull(size_hex, NULL, 16);
+        i_stream_skip(input, header_size);
+
+        uoff_t message_offset = input->v_offset;
+        const char *name = t_strdup_printf("%s:%llu", entry->path, (unsigned long long)header_offset);
+        const char *relative_path = t_strdup_printf("%s.%llu", entry->relative_path, (unsigned long long)header_offset);
+
+        struct istream *message_input = i_stream_create_limit(input, message_size);
+        if (scrambler_tool_run(tool, message_input, name, relative_path) < 0)
+            result = -1;
+        i_stream_unref(&message_input);
+
+        i_stream_seek(input, message_offset + message_size);
+
+        // metadata block, terminated by an empty line
+        line = i_stream_read_next_line(input);
+        if (line == NULL || 0 != strcmp(line, DBOX_MAGIC_POST)) {
+            i_error("%s: invalid metadata at offset %llu", entry->path, (unsigned long long)input->v_offset);
+            result = -1;
+            break;
+        }
+        while ((line = i_stream_read_next_line(input)) != NULL && line[0] != '\0')
+            ;
+    }
+
+    i_stream_unref(&input);
+    return result;
+}
+
+static int scrambler_tool_process(struct scrambler_tool *tool, const struct scrambler_tool_entry *entry) {
+    struct istream *input;
+    int result;
+
+    if (tool->mdbox)
+        return scrambler_tool_process_mdbox(tool, entry);
+
+    if (entry->path == NULL)
+        input = i_stream_create_fd(STDIN_FILENO, IO_BLOCK_SIZE, FALSE);
+    else
+        input = i_stream_create_file(entry->path, IO_BLOCK_SIZE);
+
+    result = scrambler_tool_run(tool, input, entry->path == NULL ? "stdin" : entry->path, entry->relative_path);
+    if (input->stream_errno != 0) {
+        i_error("read(%s) failed: %s", i_stream_get_name(input), strerror(input->stream_errno));
+        result = -1;
+    }
+
+    i_stream_unref(&input);
+    return result;
+}
+
+static void scrambler_tool_add_entry(struct scrambler_tool *tool, const char *path, const char *relative_path) {
+    struct scrambler_tool_entry *entry = array_append_space(&tool->entries);
+    entry->path = p_strdup(tool->pool, path);
+    entry->relative_path = p_strdup(tool->pool, relative_path);
+}
+
+static void scrambler_tool_add_directory(struct scrambler_tool *tool, const char *path, const char *relative_path) {
+    DIR *directory = opendir(path);
+    struct dirent *dirent;
+    struct stat st;
+
+    if (directory == NULL)
+        i_fatal("opendir(%s) failed: %s", path, strerror(errno));
+
+    while ((dirent = readdir(directory)) != NULL) {
+        if (0 == strcmp(dirent->d_name, ".") || 0 == strcmp(dirent->d_name, ".."))
+            continue;
+
+        T_BEGIN {
+            const char *child_path = t_strdup_printf("%s/%s", path, dirent->d_name);
+            const char *child_relative_path = relative_path[0] == '\0' ? dirent->d_name :
+                t_strdup_printf("%s/%s", relative_path, dirent->d_name);
+
+            if (stat(child_path, &st) < 0)
+                i_error("stat(%s) failed: %s", child_path, strerror(errno));
+            else if (S_ISDIR(st.st_mode))
+                scrambler_tool_add_directory(tool, child_path, child_relative_path);
+            else if (S_ISREG(st.st_mode) &&
+                     (!tool->mdbox || 0 == strncmp(dirent->d_name, MDBOX_FILE_PREFIX, strlen(MDBOX_FILE_PREFIX))))
+                scrambler_tool_add_entry(tool, child_path, child_relative_path);
+        } T_END;
+    }
+
+    closedir(directory);
+}
+
+static void scrambler_tool_add_path(struct scrambler_tool *tool, const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+        i_fatal("stat(%s) failed: %s", path, strerror(errno));
+
+    if (S_ISDIR(st.st_mode)) {
+        if (!tool->recursive)
+            i_fatal("%s is a directory (use -r to walk it)", path);
+        scrambler_tool_add_directory(tool, path, "");
+    } else {
+        const char *slash = strrchr(path, '/');
+        scrambler_tool_add_entry(tool, path, slash == NULL ? path : slash + 1);
+    }
+}
+
+static int scrambler_tool_process_entries(struct scrambler_tool *tool, unsigned int worker_index) {
+    const struct scrambler_tool_entry *entries;
+    unsigned int count;
+    int result = 0;
+
+    entries = array_get(&tool->entries, &count);
+    for (unsigned int index = worker_index; index < count; index += tool->worker_count) {
+        T_BEGIN {
+            if (scrambler_tool_process(tool, &entries[index]) < 0)
+                result = -1;
+        } T_END;
+    }
+    return result;
+}
+
+static int scrambler_tool_process_parallel(struct scrambler_tool *tool) {
+    // libdovecot's data stack and streams are not thread-safe, so the
+    // entries are split up between forked worker processes.
+    unsigned int worker_index, running = 0;
+    int result = 0, status;
+    pid_t pid;
+
+    fflush(stdout);
+    for (worker_index = 0; worker_index < tool->worker_count; worker_index++) {
+        pid = fork();
+        if (pid < 0) {
+            i_error("fork() failed: %s", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (pid == 0) {
+            int worker_result = scrambler_tool_process_entries(tool, worker_index);
+            fflush(stdout);
+            _exit(worker_result < 0 ? EX_DATAERR : EX_OK);
+        }
+        running++;
+    }
+
+    while (running > 0) {
+        if (wait(&status) < 0) {
+            i_error("wait() failed: %s", strerror(errno));
+            return -1;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EX_OK)
+            result = -1;
+        running--;
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    struct scrambler_tool tool;
+    const char *public_key_path = NULL, *private_key_path = NULL, *salt = NULL;
+    unsigned int iterations = 0;
+    int password_fd = -1;
+    int option, result;
+
+    lib_init();
+    i_set_failure_prefix("scrambler-tool: ");
+    scrambler_initialize();
+
+    memset(&tool, 0, sizeof(tool));
+    tool.pool = pool_alloconly_create("scrambler tool", 4096);
+    tool.worker_count = 1;
+    p_array_init(&tool.entries, tool.pool, 64);
+
+    if (argc < 2)
+        scrambler_tool_usage();
+    for (unsigned int index = 0; index < N_ELEMENTS(scrambler_tool_commands); index++) {
+        if (0 == strcmp(argv[1], scrambler_tool_commands[index].name))
+            tool.command = &scrambler_tool_commands[index];
+    }
+    if (tool.command == NULL)
+        scrambler_tool_usage();
+
+    argc--;
+    argv++;
+    while ((option = getopt(argc, argv, "k:K:s:i:p:o:rmj:")) != -1) {
+        switch (option) {
+        case 'k':
+            public_key_path = optarg;
+            break;
+        case 'K':
+            private_key_path = optarg;
+            break;
+        case 's':
+            salt = optarg;
+            break;
+        case 'i':
+            if (str_to_uint(optarg, &iterations) < 0)
+                scrambler_tool_usage();
+            break;
+        case 'p':
+            password_fd = atoi(optarg);
+            break;
+        case 'o':
+            tool.output_path = optarg;
+            break;
+        case 'r':
+            tool.recursive = TRUE;
+            break;
+        case 'm':
+            tool.mdbox = TRUE;
+            break;
+        case 'j':
+            if (str_to_uint(optarg, &tool.worker_count) < 0 || tool.worker_count == 0)
+                scrambler_tool_usage();
+            break;
+        default:
+            scrambler_tool_usage();
+        }
+    }
+
+    if (tool.command->needs_public_key && public_key_path == NULL)
+        i_fatal("%s needs a public key (-k)", tool.command->name);
+    if (tool.command->needs_private_key && private_key_path == NULL)
+        i_fatal("%s needs a private key (-K)", tool.command->name);
+    if (tool.mdbox && 0 == strcmp(tool.command->name, "encrypt"))
+        i_fatal("mdbox storage files can't be encrypted as a whole, use doveadm instead");
+
+    if (public_key_path != NULL)
+        tool.public_key = scrambler_tool_load_public_key(&tool, public_key_path);
+    if (private_key_path != NULL)
+        tool.private_key = scrambler_tool_load_private_key(&tool, private_key_path, salt, iterations, password_fd);
+
+    if (optind == argc) {
+        if (tool.mdbox)
+            i_fatal("mdbox storage files have to be given by path");
+        scrambler_tool_add_entry(&tool, NULL, "stdin");
+    }
+    for (; optind < argc; optind++)
+        scrambler_tool_add_path(&tool, argv[optind]);
+
+    tool.batch = tool.recursive || tool.mdbox || array_count(&tool.entries) > 1;
+    if (tool.batch && tool.command->writes_output && tool.output_path == NULL)
+        i_fatal("%s of multiple inputs needs an output directory (-o)", tool.command->name);
+
+    if (tool.worker_count > 1 && array_count(&tool.entries) > 1)
+        result = scrambler_tool_process_parallel(&tool);
+    else
+        result = scrambler_tool_process_entries(&tool, 0);
+
+    if (tool.public_key != NULL)
+        EVP_PKEY_free(tool.public_key);
+    if (tool.private_key != NULL)
+        EVP_PKEY_free(tool.private_key);
+    pool_unref(&tool.pool);
+    lib_deinit();
+
+    return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}